@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include "crc32c.h"
 #include "utils.h"
 
@@ -30,24 +31,108 @@ void print_usage(int status)
 	printf("    brute force search for file names with the given crc\n");
 	printf("      -s seed    the random seed (default: random)\n");
 	printf("      -l length  the length of the file names (default: 10)\n");
+	printf("usage: btrfs-crc -b [-l length]\n");
+	printf("    benchmark the available crc32c implementations\n");
+	printf("      -l length  the buffer length in bytes (default: 4096)\n");
 	printf("usage: btrfs-crc -h\n");
 	printf("    print this message\n");
 	exit(status);
 }
 
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Checksum the same buffer with each implementation for about a second and
+ * print the throughput, the results must match the table implementation.
+ */
+static int benchmark(int length)
+{
+	const size_t total = 256 * 1024 * 1024;
+	unsigned char *buf;
+	u32 *batch;
+	u32 expected;
+	u32 crc;
+	struct timespec start;
+	double secs;
+	u64 loops;
+	u64 i;
+	int impl;
+	int ret = 0;
+
+	crc32c_optimization_init();
+	buf = malloc(total);
+	batch = malloc(total / length * sizeof(u32));
+	if (!buf || !batch) {
+		free(buf);
+		free(batch);
+		return 1;
+	}
+	for (i = 0; i < total; i++)
+		buf[i] = rand_u8();
+
+	loops = total / length;
+	expected = crc32c_impl(CRC32C_IMPL_TABLE, ~0U, buf, length);
+	for (impl = 0; impl < CRC32C_NR_IMPLS; impl++) {
+		if (!crc32c_impl_available(impl)) {
+			printf("%-20s not available\n", crc32c_impl_name(impl));
+			continue;
+		}
+		crc = crc32c_impl(impl, ~0U, buf, length);
+		if (crc != expected) {
+			printf("%-20s wrong result %08x, expected %08x\n",
+			       crc32c_impl_name(impl), crc, expected);
+			ret = 1;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < loops; i++)
+			crc32c_impl(impl, ~0U, buf + i * length, length);
+		secs = elapsed(&start);
+		printf("%-20s %10.1f MiB/s\n", crc32c_impl_name(impl),
+		       total / secs / (1024 * 1024));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	crc32c_le_batch(~0U, buf, length, loops, batch);
+	secs = elapsed(&start);
+	if (batch[0] != expected) {
+		printf("%-20s wrong result %08x, expected %08x\n", "batch",
+		       batch[0], expected);
+		ret = 1;
+	} else {
+		printf("%-20s %10.1f MiB/s\n", "batch",
+		       total / secs / (1024 * 1024));
+	}
+
+	free(buf);
+	free(batch);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int c;
 	unsigned long checksum = 0;
 	char *str;
 	char *buf;
-	int length = 10;
+	int length = 0;
 	u64 seed = 0;
 	int loop = 0;
+	int bench = 0;
 	int i;
 
-	while ((c = getopt(argc, argv, "l:c:s:h")) != -1) {
+	while ((c = getopt(argc, argv, "l:c:s:bh")) != -1) {
 		switch (c) {
+		case 'b':
+			bench = 1;
+			break;
 		case 'l':
 			length = atol(optarg);
 			break;
@@ -68,6 +153,18 @@ int main(int argc, char **argv)
 	set_argv0(argv);
 	str = argv[optind];
 
+	if (bench) {
+		if (check_argc_exact(argc - optind, 0))
+			print_usage(255);
+		if (!length)
+			length = 4096;
+		if (length < 0 || length > SZ_1M) {
+			error("invalid length %d", length);
+			return 1;
+		}
+		return benchmark(length);
+	}
+
 	if (!loop) {
 		if (check_argc_exact(argc - optind, 1))
 			print_usage(255);
@@ -78,6 +175,8 @@ int main(int argc, char **argv)
 	if (check_argc_exact(argc - optind, 0))
 		print_usage(255);
 
+	if (!length)
+		length = 10;
 	buf = malloc(length);
 	if (!buf)
 		return -ENOMEM;
@@ -26,6 +26,7 @@
 #include <getopt.h>
 #include <uuid/uuid.h>
 #include <time.h>
+#include <pthread.h>
 #include "ctree.h"
 #include "volumes.h"
 #include "repair.h"
@@ -60,6 +61,9 @@ LIST_HEAD(duplicate_extents);
 LIST_HEAD(delete_items);
 int no_holes = 0;
 static int is_free_space_tree = 0;
+static u64 memory_limit = 0;
+/* Set when the check stopped at the memory limit, not a corruption */
+static int memory_limit_exceeded = 0;
 int init_extent_tree = 0;
 int check_data_csum = 0;
 struct btrfs_fs_info *global_info;
@@ -1630,6 +1634,14 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 	return ret;
 }
 
+/* Shared blocks already seen from another root are not walked again */
+static int reada_skip_shared(struct btrfs_root *root, u64 bytenr, void *data)
+{
+	struct walk_control *wc = data;
+
+	return find_shared_node(&wc->shared, bytenr) != NULL;
+}
+
 static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			  struct walk_control *wc, int *level,
 			  struct node_refs *nrefs)
@@ -1714,7 +1726,8 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 		next = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
 		if (!next || !btrfs_buffer_uptodate(next, ptr_gen)) {
 			free_extent_buffer(next);
-			reada_walk_down(root, cur, path->slots[*level]);
+			reada_walk_down(root, cur, path->slots[*level],
+					reada_skip_shared, wc);
 			next = read_tree_block(root->fs_info, bytenr, ptr_gen);
 			if (!extent_buffer_uptodate(next)) {
 				struct btrfs_key node_key;
@@ -3391,6 +3404,37 @@ skip_walking:
 	return ret;
 }
 
+/*
+ * Enforce --memory-limit in original mode.
+ *
+ * The tree block cache is capped to a quarter of the limit when the
+ * filesystem is opened, the rest is for the extent, inode and backref
+ * records.  Those can't be dropped, so once the process grows past the limit
+ * the only option is to stop and let the user switch to lowmem mode, instead
+ * of getting killed by the OOM killer hours later.
+ */
+#define MEMORY_LIMIT_CHECK_INTERVAL	4096
+
+/* The RSS is read once per @interval calls */
+static int check_memory_limit(unsigned int interval)
+{
+	static unsigned int calls;
+	u64 rss;
+
+	if (!memory_limit || ++calls % interval)
+		return 0;
+
+	rss = process_rss();
+	if (rss <= memory_limit)
+		return 0;
+
+	error("memory limit exceeded, usage %llu limit %llu",
+	      (unsigned long long)rss, (unsigned long long)memory_limit);
+	error("try increasing --memory-limit or use --mode=lowmem");
+	memory_limit_exceeded = 1;
+	return -ENOMEM;
+}
+
 static int check_fs_roots(struct btrfs_fs_info *fs_info,
 			  struct cache_tree *root_cache)
 {
@@ -3459,6 +3503,13 @@ again:
 				err = 1;
 				goto next;
 			}
+			ret = check_memory_limit(1);
+			if (ret < 0) {
+				if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+					btrfs_free_fs_root(tmp_root);
+				err = ret;
+				goto out;
+			}
 			ret = check_fs_root(tmp_root, root_cache, &wc);
 			if (ret == -EAGAIN) {
 				free_root_recs_tree(root_cache);
@@ -3680,11 +3731,96 @@ out:
 	return err;
 }
 
+/*
+ * Extent backrefs are small, of fixed size and there's at least one for each
+ * extent.  Carve them out of large chunks instead of doing a malloc for each,
+ * that saves the allocator overhead and keeps them close in memory.  Freed
+ * backrefs are put on a free list and reused, the chunks are released once the
+ * extent check is finished.
+ */
+#define BACKREF_CHUNK_SIZE	(SZ_1M - 64)
+
+struct backref_chunk {
+	struct list_head list;
+	char data[] __attribute__((aligned(8)));
+};
+
+#define BACKREF_CHUNK_DATA	(BACKREF_CHUNK_SIZE - sizeof(struct backref_chunk))
+
+struct backref_slab {
+	size_t obj_size;
+	size_t used;
+	void *free_list;
+	struct list_head chunks;
+};
+
+static struct backref_slab tree_backref_slab = {
+	.obj_size = sizeof(struct tree_backref),
+	.chunks = LIST_HEAD_INIT(tree_backref_slab.chunks),
+};
+
+static struct backref_slab data_backref_slab = {
+	.obj_size = sizeof(struct data_backref),
+	.chunks = LIST_HEAD_INIT(data_backref_slab.chunks),
+};
+
+static void *backref_slab_alloc(struct backref_slab *slab)
+{
+	struct backref_chunk *chunk;
+	void *obj;
+
+	if (slab->free_list) {
+		obj = slab->free_list;
+		slab->free_list = *(void **)obj;
+		return obj;
+	}
+	if (list_empty(&slab->chunks) ||
+	    slab->used + slab->obj_size > BACKREF_CHUNK_DATA) {
+		chunk = malloc(BACKREF_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		list_add(&chunk->list, &slab->chunks);
+		slab->used = 0;
+	}
+	chunk = list_first_entry(&slab->chunks, struct backref_chunk, list);
+	obj = chunk->data + slab->used;
+	slab->used += slab->obj_size;
+	return obj;
+}
+
+static void backref_slab_free(struct backref_slab *slab, void *obj)
+{
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+}
+
+static void backref_slab_destroy(struct backref_slab *slab)
+{
+	struct backref_chunk *chunk;
+
+	while (!list_empty(&slab->chunks)) {
+		chunk = list_first_entry(&slab->chunks, struct backref_chunk,
+					 list);
+		list_del(&chunk->list);
+		free(chunk);
+	}
+	slab->used = 0;
+	slab->free_list = NULL;
+}
+
+static void free_extent_backref(struct extent_backref *back)
+{
+	if (back->is_data)
+		backref_slab_free(&data_backref_slab, to_data_backref(back));
+	else
+		backref_slab_free(&tree_backref_slab, to_tree_backref(back));
+}
+
 static void __free_one_backref(struct rb_node *node)
 {
 	struct extent_backref *back = rb_node_to_extent_backref(node);
 
-	free(back);
+	free_extent_backref(back);
 }
 
 static void free_all_extent_backrefs(struct extent_record *rec)
@@ -4165,40 +4301,10 @@ static int check_block(struct btrfs_root *root,
 	return ret;
 }
 
-#if 0
-static struct tree_backref *find_tree_backref(struct extent_record *rec,
-						u64 parent, u64 root)
-{
-	struct list_head *cur = rec->backrefs.next;
-	struct extent_backref *node;
-	struct tree_backref *back;
-
-	while (cur != &rec->backrefs) {
-		node = to_extent_backref(cur);
-		cur = cur->next;
-		if (node->is_data)
-			continue;
-		back = to_tree_backref(node);
-		if (parent > 0) {
-			if (!node->full_backref)
-				continue;
-			if (parent == back->parent)
-				return back;
-		} else {
-			if (node->full_backref)
-				continue;
-			if (back->root == root)
-				return back;
-		}
-	}
-	return NULL;
-}
-#endif
-
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
+	struct tree_backref *ref = backref_slab_alloc(&tree_backref_slab);
 
 	if (!ref)
 		return NULL;
@@ -4214,51 +4320,12 @@ static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 	return ref;
 }
 
-#if 0
-static struct data_backref *find_data_backref(struct extent_record *rec,
-						u64 parent, u64 root,
-						u64 owner, u64 offset,
-						int found_ref,
-						u64 disk_bytenr, u64 bytes)
-{
-	struct list_head *cur = rec->backrefs.next;
-	struct extent_backref *node;
-	struct data_backref *back;
-
-	while (cur != &rec->backrefs) {
-		node = to_extent_backref(cur);
-		cur = cur->next;
-		if (!node->is_data)
-			continue;
-		back = to_data_backref(node);
-		if (parent > 0) {
-			if (!node->full_backref)
-				continue;
-			if (parent == back->parent)
-				return back;
-		} else {
-			if (node->full_backref)
-				continue;
-			if (back->root == root && back->owner == owner &&
-			    back->offset == offset) {
-				if (found_ref && node->found_ref &&
-				    (back->bytes != bytes ||
-				    back->disk_bytenr != disk_bytenr))
-					continue;
-				return back;
-			}
-		}
-	}
-	return NULL;
-}
-#endif
-
 static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 parent, u64 root,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
+	struct data_backref *ref = backref_slab_alloc(&data_backref_slab);
 
 	if (!ref)
 		return NULL;
@@ -4364,7 +4431,6 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	rec->refs = tmpl->refs;
 	rec->extent_item_refs = tmpl->extent_item_refs;
 	rec->parent_generation = tmpl->parent_generation;
-	INIT_LIST_HEAD(&rec->backrefs);
 	INIT_LIST_HEAD(&rec->dups);
 	INIT_LIST_HEAD(&rec->list);
 	rec->backref_tree = RB_ROOT;
@@ -5458,83 +5524,328 @@ static int check_space_cache(struct btrfs_root *root)
 }
 
 /*
- * Check data checksum for [@bytenr, @bytenr + @num_bytes).
+ * Data checksum verification for --check-data-csum.
+ *
+ * check_csums() walks the csum tree and merges the csum items that cover
+ * contiguous data into jobs of up to CSUM_JOB_MAX_BYTES, with the expected
+ * csums copied out of the leaves.  Worker threads read each job with as few
+ * reads as the chunk mapping allows, checksum all its sectors in one batch and
+ * compare them to the expected csums in bulk.  The reads of one worker overlap
+ * with the checksumming of the others.  Sectors are only compared one by one
+ * to report a mismatch.
  *
- * Return <0 for fatal error (fails to read checksum/data or allocate memory).
+ * When the queue is full, the main thread verifies a job itself instead of
+ * waiting, so verification also works if no worker could be started.
+ */
+#define CSUM_JOB_MAX_BYTES	SZ_4M
+#define CSUM_VERIFY_THREADS	4
+#define CSUM_QUEUE_MAX		16
+
+struct csum_job {
+	struct list_head list;
+	u64 bytenr;
+	u64 len;
+	u8 csums[];
+};
+
+struct csum_verify_ctx {
+	struct btrfs_fs_info *fs_info;
+	struct list_head jobs;
+	int nr_jobs;
+	/* Job being filled by check_csums() */
+	struct csum_job *cur;
+	bool done;
+	/* First fatal error */
+	int ret;
+	/* Number of jobs with csum mismatch */
+	int errors;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nr_threads;
+	/* Buffers of the main thread */
+	char *data;
+	u8 *result;
+};
+
+static size_t csum_job_csums_size(struct btrfs_fs_info *fs_info)
+{
+	return CSUM_JOB_MAX_BYTES / fs_info->sectorsize *
+		btrfs_super_csum_size(fs_info->super_copy);
+}
+
+/*
+ * Check data checksum of all copies of @job.
+ *
+ * Return <0 for fatal error (fails to read data).
  * Return >0 for csum mismatch for any copy.
  * Return 0 if everything is OK.
  */
-static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb)
+static int verify_csum_job(struct btrfs_fs_info *fs_info, struct csum_job *job,
+			   char *data, u8 *result)
 {
-	struct btrfs_fs_info *fs_info = root->fs_info;
-	u64 offset = 0;
+	u32 sectorsize = fs_info->sectorsize;
 	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
-	char *data;
-	unsigned long csum_offset;
+	u64 offset = 0;
+	u64 read_len = 0;
+	u64 bytenr;
 	u32 csum;
 	u32 csum_expected;
-	u64 read_len;
-	u64 data_checked = 0;
-	u64 tmp;
-	int ret = 0;
+	u8 *expected;
+	u32 nr;
+	u32 i;
 	int mirror;
 	int num_copies;
+	int ret;
 	bool csum_mismatch = false;
 
-	if (num_bytes % fs_info->sectorsize)
-		return -EINVAL;
-
-	data = malloc(num_bytes);
-	if (!data)
-		return -ENOMEM;
-
-	num_copies = btrfs_num_copies(root->fs_info, bytenr, num_bytes);
-	while (offset < num_bytes) {
+	while (offset < job->len) {
+		bytenr = job->bytenr + offset;
+		num_copies = btrfs_num_copies(fs_info, bytenr,
+					      job->len - offset);
 		/*
 		 * Mirror 0 means 'read from any valid copy', so it's skipped.
 		 * The indexes 1-N represent the n-th copy for levels with
 		 * redundancy.
 		 */
 		for (mirror = 1; mirror <= num_copies; mirror++) {
-			read_len = num_bytes - offset;
+			read_len = job->len - offset;
 			/* read as much space once a time */
-			ret = read_extent_data(fs_info, data + offset,
-					bytenr + offset, &read_len, mirror);
+			ret = read_extent_data(fs_info, data + offset, bytenr,
+					       &read_len, mirror);
 			if (ret)
-				goto out;
+				return ret;
 
-			data_checked = 0;
-			/* verify every 4k data's checksum */
-			while (data_checked < read_len) {
-				csum = ~(u32)0;
-				tmp = offset + data_checked;
-
-				csum = btrfs_csum_data((char *)data + tmp,
-						csum, fs_info->sectorsize);
-				btrfs_csum_final(csum, (u8 *)&csum);
-
-				csum_offset = leaf_offset +
-					 tmp / fs_info->sectorsize * csum_size;
-				read_extent_buffer(eb, (char *)&csum_expected,
-						   csum_offset, csum_size);
-				if (csum != csum_expected) {
-					csum_mismatch = true;
-					fprintf(stderr,
+			nr = read_len / sectorsize;
+			expected = job->csums + offset / sectorsize * csum_size;
+			btrfs_csum_data_batch(data + offset, sectorsize, nr,
+					      result);
+			if (!memcmp(result, expected, nr * csum_size))
+				continue;
+
+			csum_mismatch = true;
+			for (i = 0; i < nr; i++) {
+				if (!memcmp(result + i * csum_size,
+					    expected + i * csum_size, csum_size))
+					continue;
+				memcpy(&csum, result + i * csum_size, csum_size);
+				memcpy(&csum_expected, expected + i * csum_size,
+				       csum_size);
+				fprintf(stderr,
 			"mirror %d bytenr %llu csum %u expected csum %u\n",
-						mirror, bytenr + tmp,
-						csum, csum_expected);
-				}
-				data_checked += fs_info->sectorsize;
+					mirror, bytenr + (u64)i * sectorsize,
+					csum, csum_expected);
 			}
 		}
 		offset += read_len;
 	}
-out:
+	return csum_mismatch;
+}
+
+/*
+ * Take one job from the queue and verify it, waiting for a job if @wait is
+ * set.  Return 0 when there is nothing more to do.
+ */
+static int csum_verify_run_one(struct csum_verify_ctx *vctx, char *data,
+			       u8 *result, bool wait)
+{
+	struct csum_job *job;
+	int ret;
+
+	pthread_mutex_lock(&vctx->lock);
+	while (wait && list_empty(&vctx->jobs) && !vctx->done && !vctx->ret)
+		pthread_cond_wait(&vctx->cond, &vctx->lock);
+	if (list_empty(&vctx->jobs) || vctx->ret) {
+		pthread_mutex_unlock(&vctx->lock);
+		return 0;
+	}
+	job = list_first_entry(&vctx->jobs, struct csum_job, list);
+	list_del(&job->list);
+	vctx->nr_jobs--;
+	pthread_mutex_unlock(&vctx->lock);
+
+	ret = verify_csum_job(vctx->fs_info, job, data, result);
+	free(job);
+
+	pthread_mutex_lock(&vctx->lock);
+	if (ret < 0 && !vctx->ret) {
+		vctx->ret = ret;
+		pthread_cond_broadcast(&vctx->cond);
+	} else if (ret > 0) {
+		vctx->errors++;
+	}
+	pthread_mutex_unlock(&vctx->lock);
+	return 1;
+}
+
+static void *csum_verify_worker(void *arg)
+{
+	struct csum_verify_ctx *vctx = arg;
+	char *data;
+	u8 *result;
+
+	data = malloc(CSUM_JOB_MAX_BYTES);
+	result = malloc(csum_job_csums_size(vctx->fs_info));
+	/* The main thread and the other workers will do the job */
+	if (data && result) {
+		while (csum_verify_run_one(vctx, data, result, true))
+			;
+	}
 	free(data);
-	if (!ret && csum_mismatch)
-		ret = 1;
+	free(result);
+	return NULL;
+}
+
+static int csum_verify_init(struct csum_verify_ctx *vctx,
+			    struct btrfs_fs_info *fs_info)
+{
+	int nr_threads;
+	int i;
+
+	memset(vctx, 0, sizeof(*vctx));
+	vctx->fs_info = fs_info;
+	INIT_LIST_HEAD(&vctx->jobs);
+	vctx->data = malloc(CSUM_JOB_MAX_BYTES);
+	vctx->result = malloc(csum_job_csums_size(fs_info));
+	if (!vctx->data || !vctx->result) {
+		free(vctx->data);
+		free(vctx->result);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&vctx->lock, NULL);
+	pthread_cond_init(&vctx->cond, NULL);
+
+	nr_threads = fs_info->read_threads ? fs_info->read_threads :
+		     CSUM_VERIFY_THREADS;
+	vctx->threads = malloc(nr_threads * sizeof(*vctx->threads));
+	if (!vctx->threads)
+		return 0;
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&vctx->threads[i], NULL, csum_verify_worker,
+				   vctx))
+			break;
+	}
+	vctx->nr_threads = i;
+	return 0;
+}
+
+static int csum_verify_submit(struct csum_verify_ctx *vctx)
+{
+	struct csum_job *job = vctx->cur;
+	bool full;
+	int ret;
+
+	vctx->cur = NULL;
+	pthread_mutex_lock(&vctx->lock);
+	ret = vctx->ret;
+	if (ret) {
+		pthread_mutex_unlock(&vctx->lock);
+		free(job);
+		return ret;
+	}
+	list_add_tail(&job->list, &vctx->jobs);
+	vctx->nr_jobs++;
+	full = vctx->nr_jobs > CSUM_QUEUE_MAX;
+	pthread_cond_signal(&vctx->cond);
+	pthread_mutex_unlock(&vctx->lock);
+
+	/* Help the workers rather than queueing up more data */
+	if (full)
+		csum_verify_run_one(vctx, vctx->data, vctx->result, false);
+
+	pthread_mutex_lock(&vctx->lock);
+	ret = vctx->ret;
+	pthread_mutex_unlock(&vctx->lock);
+	return ret;
+}
+
+/*
+ * Queue verification of the data csums of [@bytenr, @bytenr + @num_bytes)
+ * stored in @eb at @leaf_offset.
+ *
+ * Return <0 if verification of some previously queued data failed fatally.
+ */
+static int csum_verify_add(struct csum_verify_ctx *vctx, u64 bytenr,
+			   u64 num_bytes, unsigned long leaf_offset,
+			   struct extent_buffer *eb)
+{
+	struct btrfs_fs_info *fs_info = vctx->fs_info;
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	struct csum_job *job;
+	u64 len;
+	int ret;
+
+	if (num_bytes % fs_info->sectorsize)
+		return -EINVAL;
+
+	while (num_bytes) {
+		job = vctx->cur;
+		if (job && (job->bytenr + job->len != bytenr ||
+			    job->len == CSUM_JOB_MAX_BYTES)) {
+			ret = csum_verify_submit(vctx);
+			if (ret)
+				return ret;
+			job = NULL;
+		}
+		if (!job) {
+			job = malloc(sizeof(*job) + csum_job_csums_size(fs_info));
+			if (!job)
+				return -ENOMEM;
+			job->bytenr = bytenr;
+			job->len = 0;
+			vctx->cur = job;
+		}
+
+		len = min_t(u64, num_bytes, CSUM_JOB_MAX_BYTES - job->len);
+		read_extent_buffer(eb,
+			job->csums + job->len / fs_info->sectorsize * csum_size,
+			leaf_offset, len / fs_info->sectorsize * csum_size);
+		job->len += len;
+		bytenr += len;
+		num_bytes -= len;
+		leaf_offset += len / fs_info->sectorsize * csum_size;
+	}
+	return 0;
+}
+
+/*
+ * Verify all queued data and stop the workers.
+ *
+ * Return <0 for fatal error, otherwise the number of jobs with csum mismatch.
+ */
+static int csum_verify_finish(struct csum_verify_ctx *vctx)
+{
+	struct csum_job *job;
+	int ret = 0;
+	int i;
+
+	if (vctx->cur)
+		ret = csum_verify_submit(vctx);
+
+	pthread_mutex_lock(&vctx->lock);
+	vctx->done = true;
+	pthread_cond_broadcast(&vctx->cond);
+	pthread_mutex_unlock(&vctx->lock);
+
+	while (!ret && csum_verify_run_one(vctx, vctx->data, vctx->result, false))
+		;
+	for (i = 0; i < vctx->nr_threads; i++)
+		pthread_join(vctx->threads[i], NULL);
+
+	/* Left over after a fatal error */
+	while (!list_empty(&vctx->jobs)) {
+		job = list_first_entry(&vctx->jobs, struct csum_job, list);
+		list_del(&job->list);
+		free(job);
+	}
+	if (!ret)
+		ret = vctx->ret ? vctx->ret : vctx->errors;
+
+	free(vctx->threads);
+	free(vctx->data);
+	free(vctx->result);
+	pthread_cond_destroy(&vctx->cond);
+	pthread_mutex_destroy(&vctx->lock);
 	return ret;
 }
 
@@ -5689,6 +6000,7 @@ static int check_csums(struct btrfs_root *root)
 	int ret;
 	u64 data_len;
 	unsigned long leaf_offset;
+	struct csum_verify_ctx verify;
 	bool verify_csum = !!check_data_csum;
 
 	root = root->fs_info->csum_root;
@@ -5721,6 +6033,15 @@ static int check_csums(struct btrfs_root *root)
 		printf("skip data csum verification for metadata dump\n");
 		verify_csum = false;
 	}
+	if (verify_csum) {
+		ret = csum_verify_init(&verify, root->fs_info);
+		if (ret < 0) {
+			error("failed to start data csum verification: %s",
+			      strerror(-ret));
+			btrfs_release_path(&path);
+			return ret;
+		}
+	}
 
 	while (1) {
 		ctx.item_count++;
@@ -5747,16 +6068,14 @@ static int check_csums(struct btrfs_root *root)
 		if (!verify_csum)
 			goto skip_csum_check;
 		leaf_offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
+		ret = csum_verify_add(&verify, key.offset, data_len,
+				      leaf_offset, leaf);
 		/*
 		 * Only break for fatal errors, if mismatch is found, continue
 		 * checking until all extents are checked.
 		 */
 		if (ret < 0)
 			break;
-		if (ret > 0)
-			errors++;
 skip_csum_check:
 		if (!num_bytes) {
 			offset = key.offset;
@@ -5775,6 +6094,17 @@ skip_csum_check:
 		path.slots[0]++;
 	}
 
+	if (verify_csum) {
+		ret = csum_verify_finish(&verify);
+		if (ret < 0) {
+			error("failed to verify data csums: %s",
+			      strerror(-ret));
+			errors++;
+		} else {
+			errors += ret;
+		}
+	}
+
 	btrfs_release_path(&path);
 	return errors;
 }
@@ -5958,6 +6288,10 @@ static int run_next_block(struct btrfs_root *root,
 		return 1;
 
 	if (!reada_bits) {
+		u64 *reada_bytenrs;
+		int nr_reada = 0;
+
+		reada_bytenrs = malloc(nritems * sizeof(u64));
 		for (i = 0; i < nritems; i++) {
 			ret = add_cache_extent(reada, bits[i].start,
 					       bits[i].size);
@@ -5965,7 +6299,15 @@ static int run_next_block(struct btrfs_root *root,
 				continue;
 
 			/* fixme, get the parent transid */
-			readahead_tree_block(fs_info, bits[i].start, 0);
+			if (reada_bytenrs)
+				reada_bytenrs[nr_reada++] = bits[i].start;
+			else
+				readahead_tree_block(fs_info, bits[i].start, 0);
+		}
+		if (reada_bytenrs) {
+			read_tree_block_batch(fs_info, reada_bytenrs, NULL,
+					      nr_reada);
+			free(reada_bytenrs);
 		}
 	}
 	*last = bits[0].start;
@@ -6344,7 +6686,7 @@ static int free_extent_hook(struct btrfs_fs_info *fs_info,
 
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	} else {
 		struct tree_backref *back;
@@ -6364,7 +6706,7 @@ static int free_extent_hook(struct btrfs_fs_info *fs_info,
 		}
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -7007,7 +7349,6 @@ static int process_duplicates(struct cache_tree *extent_cache,
 
 	good = to_extent_record(rec->dups.next);
 	list_del_init(&good->list);
-	INIT_LIST_HEAD(&good->backrefs);
 	INIT_LIST_HEAD(&good->dups);
 	good->cache.start = good->start;
 	good->cache.size = good->nr;
@@ -7015,7 +7356,6 @@ static int process_duplicates(struct cache_tree *extent_cache,
 	good->owner_ref_checked = 0;
 	good->num_duplicates = 0;
 	good->refs = rec->refs;
-	list_splice_init(&rec->backrefs, &good->backrefs);
 	while (1) {
 		cache = lookup_cache_extent(extent_cache, good->start,
 					    good->nr);
@@ -7045,7 +7385,6 @@ static int process_duplicates(struct cache_tree *extent_cache,
 		 * just add it to this extent and carry on like we did above.
 		 */
 		good->refs += tmp->refs;
-		list_splice_init(&tmp->backrefs, &good->backrefs);
 		remove_cache_extent(extent_cache, &tmp->cache);
 		free(tmp);
 	}
@@ -8119,6 +8458,9 @@ static int deal_root_from_list(struct list_head *list,
 		 */
 		while (1) {
 			ctx.item_count++;
+			ret = check_memory_limit(MEMORY_LIMIT_CHECK_INTERVAL);
+			if (ret < 0)
+				break;
 			ret = run_next_block(root, bits, bits_nr, &last,
 					     pending, seen, reada, nodes,
 					     extent_cache, chunk_cache,
@@ -8134,6 +8476,9 @@ static int deal_root_from_list(struct list_head *list,
 			break;
 	}
 	while (ret >= 0) {
+		ret = check_memory_limit(MEMORY_LIMIT_CHECK_INTERVAL);
+		if (ret < 0)
+			break;
 		ret = run_next_block(root, bits, bits_nr, &last, pending, seen,
 				     reada, nodes, extent_cache, chunk_cache,
 				     dev_cache, block_group_cache,
@@ -8385,10 +8730,13 @@ static int do_check_chunks_and_extents(struct btrfs_fs_info *fs_info)
 {
 	int ret;
 
-	if (check_mode == CHECK_MODE_LOWMEM)
+	if (check_mode == CHECK_MODE_LOWMEM) {
 		ret = check_chunks_and_extents_lowmem(fs_info);
-	else
+	} else {
 		ret = check_chunks_and_extents(fs_info);
+		backref_slab_destroy(&tree_backref_slab);
+		backref_slab_destroy(&data_backref_slab);
+	}
 
 	/* Also repair device size related problems */
 	if (repair && !ret) {
@@ -9512,6 +9860,11 @@ const char * const cmd_check_usage[] = {
 	"       -E|--subvol-extents <subvolid>",
 	"                                   print subvolume extents and sharing state",
 	"       -p|--progress               indicate progress",
+	"       -v|--verbose                print tree block cache and prefetch",
+	"                                   statistics",
+	"       --read-threads <N>          number of threads reading tree blocks",
+	"       --memory-limit <SIZE>       limit memory usage, original mode stops",
+	"                                   when it can't continue within the limit",
 	NULL
 };
 
@@ -9536,6 +9889,8 @@ int cmd_check(int argc, char **argv)
 	int qgroup_report_ret;
 	unsigned ctree_flags = OPEN_CTREE_EXCLUSIVE;
 	int force = 0;
+	unsigned int read_threads = 0;
+	int verbose = 0;
 
 	while(1) {
 		int c;
@@ -9543,7 +9898,8 @@ int cmd_check(int argc, char **argv)
 			GETOPT_VAL_INIT_EXTENT, GETOPT_VAL_CHECK_CSUM,
 			GETOPT_VAL_READONLY, GETOPT_VAL_CHUNK_TREE,
 			GETOPT_VAL_MODE, GETOPT_VAL_CLEAR_SPACE_CACHE,
-			GETOPT_VAL_FORCE };
+			GETOPT_VAL_FORCE, GETOPT_VAL_READ_THREADS,
+			GETOPT_VAL_MEMORY_LIMIT };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, GETOPT_VAL_REPAIR },
@@ -9561,15 +9917,20 @@ int cmd_check(int argc, char **argv)
 			{ "chunk-root", required_argument, NULL,
 				GETOPT_VAL_CHUNK_TREE },
 			{ "progress", no_argument, NULL, 'p' },
+			{ "verbose", no_argument, NULL, 'v' },
 			{ "mode", required_argument, NULL,
 				GETOPT_VAL_MODE },
 			{ "clear-space-cache", required_argument, NULL,
 				GETOPT_VAL_CLEAR_SPACE_CACHE},
 			{ "force", no_argument, NULL, GETOPT_VAL_FORCE },
+			{ "read-threads", required_argument, NULL,
+				GETOPT_VAL_READ_THREADS },
+			{ "memory-limit", required_argument, NULL,
+				GETOPT_VAL_MEMORY_LIMIT },
 			{ NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long(argc, argv, "as:br:pEQ", long_options, NULL);
+		c = getopt_long(argc, argv, "as:br:pEQv", long_options, NULL);
 		if (c < 0)
 			break;
 		switch(c) {
@@ -9604,6 +9965,9 @@ int cmd_check(int argc, char **argv)
 			case 'p':
 				ctx.progress_enabled = true;
 				break;
+			case 'v':
+				verbose++;
+				break;
 			case '?':
 			case 'h':
 				usage(cmd_check_usage);
@@ -9653,6 +10017,18 @@ int cmd_check(int argc, char **argv)
 			case GETOPT_VAL_FORCE:
 				force = 1;
 				break;
+			case GETOPT_VAL_READ_THREADS:
+				num = arg_strtou64(optarg);
+				if (num == 0 || num > 256) {
+					error(
+				"number of read threads must be between 1 and 256");
+					exit(1);
+				}
+				read_threads = num;
+				break;
+			case GETOPT_VAL_MEMORY_LIMIT:
+				memory_limit = parse_size(optarg);
+				break;
 		}
 	}
 
@@ -9729,6 +10105,10 @@ int cmd_check(int argc, char **argv)
 	}
 
 	global_info = info;
+	info->read_threads = read_threads;
+	if (memory_limit)
+		info->extent_cache.max_cache_size = min(memory_limit / 4,
+					info->extent_cache.max_cache_size);
 	root = info->fs_root;
 	uuid_unparse(info->super_copy->fsid, uuidbuf);
 
@@ -9891,6 +10271,10 @@ int cmd_check(int argc, char **argv)
 	}
 	ret = do_check_chunks_and_extents(info);
 	task_stop(ctx.info);
+	if (memory_limit_exceeded) {
+		err = 1;
+		goto close_out;
+	}
 	err |= !!ret;
 	if (ret)
 		error(
@@ -9931,6 +10315,11 @@ int cmd_check(int argc, char **argv)
 
 	ret = do_check_fs_roots(info, &root_cache);
 	task_stop(ctx.info);
+	if (memory_limit_exceeded) {
+		err = 1;
+		free_root_recs_tree(&root_cache);
+		goto close_out;
+	}
 	err |= !!ret;
 	if (ret) {
 		error("errors found in fs roots");
@@ -10058,6 +10447,17 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	if (verbose && info->reada.queued)
+		printf("tree block prefetch: %llu queued, %llu read, %llu used, %llu evicted unused\n",
+		       (unsigned long long)info->reada.queued,
+		       (unsigned long long)info->reada.filled,
+		       (unsigned long long)info->reada.used,
+		       (unsigned long long)info->reada.wasted);
+	if (verbose)
+		printf("tree block cache: %llu hits, %llu misses, %llu evictions\n",
+		       (unsigned long long)info->extent_cache.cache_hits,
+		       (unsigned long long)info->extent_cache.cache_misses,
+		       (unsigned long long)info->extent_cache.cache_evictions);
 
 	free_qgroup_counts();
 	free_root_recs_tree(&root_cache);
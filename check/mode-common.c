@@ -508,25 +508,30 @@ void check_dev_size_alignment(u64 devid, u64 total_bytes, u32 sectorsize)
 	}
 }
 
+/*
+ * Queue the leaves after @slot of the level 1 @node for prefetch, the walker
+ * reads the one at @slot right away. The leaves are read in one batch when
+ * the walker gets to the first of them, leaves for which @skip returns
+ * nonzero are not visited by the walker and not queued.
+ */
 void reada_walk_down(struct btrfs_root *root, struct extent_buffer *node,
-		     int slot)
+		     int slot, reada_skip_fn skip, void *data)
 {
 	struct btrfs_fs_info *fs_info = root->fs_info;
 	u64 bytenr;
-	u64 ptr_gen;
 	u32 nritems;
 	int i;
-	int level;
 
-	level = btrfs_header_level(node);
-	if (level != 1)
+	if (btrfs_header_level(node) != 1)
 		return;
 
 	nritems = btrfs_header_nritems(node);
-	for (i = slot; i < nritems; i++) {
+	for (i = slot + 1; i < nritems; i++) {
 		bytenr = btrfs_node_blockptr(node, i);
-		ptr_gen = btrfs_node_ptr_generation(node, i);
-		readahead_tree_block(fs_info, bytenr, ptr_gen);
+		if (skip && skip(root, bytenr, data))
+			continue;
+		readahead_tree_block(fs_info, bytenr,
+				     btrfs_node_ptr_generation(node, i));
 	}
 }
 
@@ -113,8 +113,10 @@ int link_inode_to_lostfound(struct btrfs_trans_handle *trans,
 			    u64 ino, char *namebuf, u32 name_len,
 			    u8 filetype, u64 *ref_count);
 void check_dev_size_alignment(u64 devid, u64 total_bytes, u32 sectorsize);
+typedef int (*reada_skip_fn)(struct btrfs_root *root, u64 bytenr,
+			     void *data);
 void reada_walk_down(struct btrfs_root *root, struct extent_buffer *node,
-		     int slot);
+		     int slot, reada_skip_fn skip, void *data);
 int check_child_node(struct extent_buffer *parent, int slot,
 		     struct extent_buffer *child);
 void reset_cached_block_groups(struct btrfs_fs_info *fs_info);
@@ -4482,6 +4482,21 @@ out:
  * Returns <0  Fatal error, must exit the whole check
  * Returns 0   No errors found
  */
+/*
+ * A shared leaf is checked only from the root with the lowest id, don't
+ * prefetch it from the other roots. Finding that root is too expensive for
+ * a prefetch, so no shared leaf is queued.
+ */
+static int reada_skip_shared(struct btrfs_root *root, u64 bytenr, void *data)
+{
+	u64 refs = 0;
+	int ret;
+
+	ret = btrfs_lookup_extent_info(NULL, root->fs_info, bytenr, 0, 1,
+				       &refs, NULL);
+	return ret == 0 && refs > 1;
+}
+
 static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			  int *level, struct node_refs *nrefs, int check_all)
 {
@@ -4587,7 +4602,9 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 		next = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
 		if (!next || !btrfs_buffer_uptodate(next, ptr_gen)) {
 			free_extent_buffer(next);
-			reada_walk_down(root, cur, path->slots[*level]);
+			reada_walk_down(root, cur, path->slots[*level],
+					check_all ? NULL : reada_skip_shared,
+					NULL);
 			next = read_tree_block(fs_info, bytenr, ptr_gen);
 			if (!extent_buffer_uptodate(next)) {
 				struct btrfs_key node_key;
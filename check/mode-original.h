@@ -89,7 +89,6 @@ static inline struct tree_backref* to_tree_backref(struct extent_backref *back)
 enum { FLAG_UNSET = 2 };
 
 struct extent_record {
-	struct list_head backrefs;
 	struct list_head dups;
 	struct rb_root backref_tree;
 	struct list_head list;
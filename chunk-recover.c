@@ -27,7 +27,6 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
-#include <pthread.h>
 
 #include "list.h"
 #include "radix-tree.h"
@@ -40,6 +39,7 @@
 #include "utils.h"
 #include "btrfsck.h"
 #include "commands.h"
+#include "tree-scan.h"
 
 struct recover_control {
 	int verbose;
@@ -62,7 +62,6 @@ struct recover_control {
 	struct list_head bad_chunks;
 	struct list_head rebuild_chunks;
 	struct list_head unrepaired_chunks;
-	pthread_mutex_t rc_lock;
 };
 
 struct extent_record {
@@ -74,11 +73,15 @@ struct extent_record {
 	int nmirrors;
 };
 
-struct device_scan {
-	struct recover_control *rc;
-	struct btrfs_device *dev;
-	int fd;
-	u64 bytenr;
+/*
+ * Records found by one scan thread, merged into recover_control after the
+ * scan so that the threads don't contend on the shared trees
+ */
+struct scan_result {
+	struct cache_tree eb_cache;
+	struct cache_tree chunk;
+	struct block_group_tree bg;
+	struct device_extent_tree devext;
 };
 
 static struct extent_record *btrfs_new_extent_record(struct extent_buffer *eb)
@@ -99,16 +102,19 @@ static struct extent_record *btrfs_new_extent_record(struct extent_buffer *eb)
 	return rec;
 }
 
-static int process_extent_buffer(struct cache_tree *eb_cache,
-				 struct extent_buffer *eb,
-				 struct btrfs_device *device, u64 offset)
+/*
+ * Insert the record to eb_cache, unless there is a newer one, or add its
+ * mirrors to the record of the same block. The record is freed if it's not
+ * inserted.
+ */
+static int merge_extent_record(struct cache_tree *eb_cache,
+			       struct extent_record *rec)
 {
-	struct extent_record *rec;
 	struct extent_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
+	int i;
 
-	rec = btrfs_new_extent_record(eb);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -126,10 +132,15 @@ again:
 			    memcmp(exist->csum, rec->csum, BTRFS_CSUM_SIZE)) {
 				ret = -EEXIST;
 			} else {
-				BUG_ON(exist->nmirrors >= BTRFS_MAX_MIRRORS);
-				exist->devices[exist->nmirrors] = device;
-				exist->offsets[exist->nmirrors] = offset;
-				exist->nmirrors++;
+				for (i = 0; i < rec->nmirrors; i++) {
+					BUG_ON(exist->nmirrors >=
+					       BTRFS_MAX_MIRRORS);
+					exist->devices[exist->nmirrors] =
+						rec->devices[i];
+					exist->offsets[exist->nmirrors] =
+						rec->offsets[i];
+					exist->nmirrors++;
+				}
 			}
 			goto free_out;
 		}
@@ -138,9 +149,6 @@ again:
 		goto again;
 	}
 
-	rec->devices[0] = device;
-	rec->offsets[0] = offset;
-	rec->nmirrors++;
 	ret = insert_cache_extent(eb_cache, &rec->cache);
 	BUG_ON(ret);
 out:
@@ -150,6 +158,19 @@ free_out:
 	goto out;
 }
 
+static int process_extent_buffer(struct cache_tree *eb_cache,
+				 struct extent_buffer *eb,
+				 struct btrfs_device *device, u64 offset)
+{
+	struct extent_record *rec;
+
+	rec = btrfs_new_extent_record(eb);
+	rec->devices[0] = device;
+	rec->offsets[0] = offset;
+	rec->nmirrors++;
+	return merge_extent_record(eb_cache, rec);
+}
+
 static void free_extent_record(struct cache_extent *cache)
 {
 	struct extent_record *er;
@@ -208,7 +229,6 @@ static void init_recover_control(struct recover_control *rc, int verbose,
 
 	rc->verbose = verbose;
 	rc->yes = yes;
-	pthread_mutex_init(&rc->rc_lock, NULL);
 }
 
 static void free_recover_control(struct recover_control *rc)
@@ -217,19 +237,15 @@ static void free_recover_control(struct recover_control *rc)
 	free_chunk_cache_tree(&rc->chunk);
 	free_device_extent_tree(&rc->devext);
 	free_extent_record_tree(&rc->eb_cache);
-	pthread_mutex_destroy(&rc->rc_lock);
 }
 
-static int process_block_group_item(struct block_group_tree *bg_cache,
-				    struct extent_buffer *leaf,
-				    struct btrfs_key *key, int slot)
+static int merge_block_group_record(struct block_group_tree *bg_cache,
+				    struct block_group_record *rec)
 {
-	struct block_group_record *rec;
 	struct block_group_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
 
-	rec = btrfs_new_block_group_record(leaf, key, slot);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -276,16 +292,23 @@ free_out:
 	goto out;
 }
 
-static int process_chunk_item(struct cache_tree *chunk_cache,
-			      struct extent_buffer *leaf, struct btrfs_key *key,
-			      int slot)
+static int process_block_group_item(struct block_group_tree *bg_cache,
+				    struct extent_buffer *leaf,
+				    struct btrfs_key *key, int slot)
+{
+	struct block_group_record *rec;
+
+	rec = btrfs_new_block_group_record(leaf, key, slot);
+	return merge_block_group_record(bg_cache, rec);
+}
+
+static int merge_chunk_record(struct cache_tree *chunk_cache,
+			      struct chunk_record *rec)
 {
-	struct chunk_record *rec;
 	struct chunk_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
 
-	rec = btrfs_new_chunk_record(leaf, key, slot);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -320,16 +343,23 @@ free_out:
 	goto out;
 }
 
-static int process_device_extent_item(struct device_extent_tree *devext_cache,
-				      struct extent_buffer *leaf,
-				      struct btrfs_key *key, int slot)
+static int process_chunk_item(struct cache_tree *chunk_cache,
+			      struct extent_buffer *leaf, struct btrfs_key *key,
+			      int slot)
+{
+	struct chunk_record *rec;
+
+	rec = btrfs_new_chunk_record(leaf, key, slot);
+	return merge_chunk_record(chunk_cache, rec);
+}
+
+static int merge_device_extent_record(struct device_extent_tree *devext_cache,
+				      struct device_extent_record *rec)
 {
-	struct device_extent_record *rec;
 	struct device_extent_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
 
-	rec = btrfs_new_device_extent_record(leaf, key, slot);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -366,6 +396,16 @@ free_out:
 	goto out;
 }
 
+static int process_device_extent_item(struct device_extent_tree *devext_cache,
+				      struct extent_buffer *leaf,
+				      struct btrfs_key *key, int slot)
+{
+	struct device_extent_record *rec;
+
+	rec = btrfs_new_device_extent_record(leaf, key, slot);
+	return merge_device_extent_record(devext_cache, rec);
+}
+
 static void print_block_group_info(struct block_group_record *rec, char *prefix)
 {
 	if (prefix)
@@ -682,7 +722,7 @@ static int check_all_chunks_by_metadata(struct recover_control *rc,
 	return ret;
 }
 
-static int extract_metadata_record(struct recover_control *rc,
+static int extract_metadata_record(struct scan_result *result,
 				   struct extent_buffer *leaf)
 {
 	struct btrfs_key key;
@@ -695,20 +735,15 @@ static int extract_metadata_record(struct recover_control *rc,
 		btrfs_item_key_to_cpu(leaf, &key, i);
 		switch (key.type) {
 		case BTRFS_BLOCK_GROUP_ITEM_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
-			ret = process_block_group_item(&rc->bg, leaf, &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
+			ret = process_block_group_item(&result->bg, leaf,
+						       &key, i);
 			break;
 		case BTRFS_CHUNK_ITEM_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
-			ret = process_chunk_item(&rc->chunk, leaf, &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
+			ret = process_chunk_item(&result->chunk, leaf, &key, i);
 			break;
 		case BTRFS_DEV_EXTENT_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
-			ret = process_device_extent_item(&rc->devext, leaf,
+			ret = process_device_extent_item(&result->devext, leaf,
 							 &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
 			break;
 		}
 		if (ret)
@@ -717,202 +752,161 @@ static int extract_metadata_record(struct recover_control *rc,
 	return ret;
 }
 
-static inline int is_super_block_address(u64 offset)
+static void init_scan_result(struct scan_result *result)
 {
-	int i;
-
-	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
-		if (offset == btrfs_sb_offset(i))
-			return 1;
-	}
-	return 0;
+	cache_tree_init(&result->eb_cache);
+	cache_tree_init(&result->chunk);
+	block_group_tree_init(&result->bg);
+	device_extent_tree_init(&result->devext);
 }
 
-static int scan_one_device(void *dev_scan_struct)
+static void free_scan_result(struct scan_result *result)
 {
-	struct extent_buffer *buf;
-	u64 bytenr;
-	int ret = 0;
-	struct device_scan *dev_scan = (struct device_scan *)dev_scan_struct;
-	struct recover_control *rc = dev_scan->rc;
-	struct btrfs_device *device = dev_scan->dev;
-	int fd = dev_scan->fd;
-	int oldtype;
-
-	ret = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
-	if (ret)
-		return 1;
-
-	buf = malloc(sizeof(*buf) + rc->nodesize);
-	if (!buf)
-		return -ENOMEM;
-	buf->len = rc->nodesize;
+	free_extent_record_tree(&result->eb_cache);
+	free_chunk_cache_tree(&result->chunk);
+	free_block_group_tree(&result->bg);
+	free_device_extent_tree(&result->devext);
+}
 
-	bytenr = 0;
-	while (1) {
-		dev_scan->bytenr = bytenr;
+/* Move the records found by a scan thread to recover_control */
+static int merge_scan_result(struct recover_control *rc,
+			     struct scan_result *result)
+{
+	struct cache_extent *cache;
+	struct extent_record *er;
+	struct chunk_record *chunk;
+	struct block_group_record *bg;
+	struct device_extent_record *devext;
+	int ret;
 
-		if (is_super_block_address(bytenr))
-			bytenr += rc->sectorsize;
+	while ((cache = first_cache_extent(&result->eb_cache))) {
+		er = container_of(cache, struct extent_record, cache);
+		remove_cache_extent(&result->eb_cache, cache);
+		ret = merge_extent_record(&rc->eb_cache, er);
+		if (ret)
+			return ret;
+	}
+	while ((cache = first_cache_extent(&result->chunk))) {
+		chunk = container_of(cache, struct chunk_record, cache);
+		remove_cache_extent(&result->chunk, cache);
+		ret = merge_chunk_record(&rc->chunk, chunk);
+		if (ret)
+			return ret;
+	}
+	while ((cache = first_cache_extent(&result->bg.tree))) {
+		bg = container_of(cache, struct block_group_record, cache);
+		remove_cache_extent(&result->bg.tree, cache);
+		list_del_init(&bg->list);
+		ret = merge_block_group_record(&rc->bg, bg);
+		if (ret)
+			return ret;
+	}
+	while ((cache = first_cache_extent(&result->devext.tree))) {
+		devext = container_of(cache, struct device_extent_record,
+				      cache);
+		remove_cache_extent(&result->devext.tree, cache);
+		list_del_init(&devext->chunk_list);
+		list_del_init(&devext->device_list);
+		ret = merge_device_extent_record(&rc->devext, devext);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
 
-		if (pread64(fd, buf->data, rc->nodesize, bytenr) <
-		    rc->nodesize)
-			break;
+static void *scan_thread_init(struct tree_scan *scan)
+{
+	struct scan_result *result;
 
-		if (memcmp_extent_buffer(buf, rc->fs_devices->fsid,
-					 btrfs_header_fsid(),
-					 BTRFS_FSID_SIZE)) {
-			bytenr += rc->sectorsize;
-			continue;
-		}
+	result = malloc(sizeof(*result));
+	if (result)
+		init_scan_result(result);
+	return result;
+}
 
-		if (verify_tree_block_csum_silent(buf, rc->csum_size)) {
-			bytenr += rc->sectorsize;
-			continue;
-		}
+static int scan_block(struct tree_scan *scan, void *data,
+		      struct tree_scan_block *block)
+{
+	struct recover_control *rc = scan->priv;
+	struct scan_result *result = data;
+	int ret;
 
-		pthread_mutex_lock(&rc->rc_lock);
-		ret = process_extent_buffer(&rc->eb_cache, buf, device, bytenr);
-		pthread_mutex_unlock(&rc->rc_lock);
-		if (ret)
-			goto out;
+	ret = process_extent_buffer(&result->eb_cache, block->eb,
+				    block->dev->priv, block->physical);
+	if (ret)
+		return ret;
 
-		if (btrfs_header_level(buf) != 0)
-			goto next_node;
+	if (block->level != 0)
+		return 0;
 
-		switch (btrfs_header_owner(buf)) {
-		case BTRFS_EXTENT_TREE_OBJECTID:
-		case BTRFS_DEV_TREE_OBJECTID:
-			/* different tree use different generation */
-			if (btrfs_header_generation(buf) > rc->generation)
-				break;
-			ret = extract_metadata_record(rc, buf);
-			if (ret)
-				goto out;
+	switch (block->owner) {
+	case BTRFS_EXTENT_TREE_OBJECTID:
+	case BTRFS_DEV_TREE_OBJECTID:
+		/* different tree use different generation */
+		if (block->generation > rc->generation)
 			break;
-		case BTRFS_CHUNK_TREE_OBJECTID:
-			if (btrfs_header_generation(buf) >
-			    rc->chunk_root_generation)
-				break;
-			ret = extract_metadata_record(rc, buf);
-			if (ret)
-				goto out;
+		return extract_metadata_record(result, block->eb);
+	case BTRFS_CHUNK_TREE_OBJECTID:
+		if (block->generation > rc->chunk_root_generation)
 			break;
-		}
-next_node:
-		bytenr += rc->nodesize;
+		return extract_metadata_record(result, block->eb);
 	}
-out:
-	close(fd);
-	free(buf);
-	return ret;
+	return 0;
+}
+
+static int scan_thread_merge(struct tree_scan *scan, void *data)
+{
+	return merge_scan_result(scan->priv, data);
 }
 
+static void scan_thread_release(struct tree_scan *scan, void *data)
+{
+	free_scan_result(data);
+	free(data);
+}
+
+static const struct tree_scan_ops scan_ops = {
+	.thread_init = scan_thread_init,
+	.block = scan_block,
+	.thread_merge = scan_thread_merge,
+	.thread_release = scan_thread_release,
+};
+
+/*
+ * Scan all devices for tree blocks and the chunk, block group and device
+ * extent items in them
+ */
 static int scan_devices(struct recover_control *rc)
 {
-	int ret = 0;
-	int fd;
+	struct tree_scan scan = {
+		.nodesize = rc->nodesize,
+		.sectorsize = rc->sectorsize,
+		.csum_size = rc->csum_size,
+		.progress = 1,
+		.ops = &scan_ops,
+		.priv = rc,
+	};
+	struct tree_scan_device *devs;
 	struct btrfs_device *dev;
-	struct device_scan *dev_scans;
-	pthread_t *t_scans;
-	long *t_rets;
 	int devnr = 0;
-	int devidx = 0;
-	int i;
-	int all_done;
+	int ret;
 
 	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list)
 		devnr++;
-	dev_scans = (struct device_scan *)malloc(sizeof(struct device_scan)
-						 * devnr);
-	if (!dev_scans)
-		return -ENOMEM;
-	t_scans = (pthread_t *)malloc(sizeof(pthread_t) * devnr);
-	if (!t_scans) {
-		free(dev_scans);
+	devs = calloc(devnr, sizeof(*devs));
+	if (!devs)
 		return -ENOMEM;
-	}
-	t_rets = (long *)malloc(sizeof(long) * devnr);
-	if (!t_rets) {
-		free(dev_scans);
-		free(t_scans);
-		return -ENOMEM;
-	}
 
+	devnr = 0;
 	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list) {
-		fd = open(dev->name, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "Failed to open device %s\n",
-				dev->name);
-			ret = 1;
-			goto out2;
-		}
-		dev_scans[devidx].rc = rc;
-		dev_scans[devidx].dev = dev;
-		dev_scans[devidx].fd = fd;
-		dev_scans[devidx].bytenr = -1;
-		devidx++;
-	}
-
-	for (i = 0; i < devidx; i++) {
-		ret = pthread_create(&t_scans[i], NULL,
-				     (void *)scan_one_device,
-				     (void *)&dev_scans[i]);
-		if (ret)
-			goto out1;
-
-		dev_scans[i].bytenr = 0;
+		devs[devnr].name = dev->name;
+		devs[devnr].fsid = rc->fs_devices->fsid;
+		devs[devnr].priv = dev;
+		devnr++;
 	}
 
-	while (1) {
-		all_done = 1;
-		for (i = 0; i < devidx; i++) {
-			if (dev_scans[i].bytenr == -1)
-				continue;
-			ret = pthread_tryjoin_np(t_scans[i],
-						 (void **)&t_rets[i]);
-			if (ret == EBUSY) {
-				all_done = 0;
-				continue;
-			}
-			if (ret || t_rets[i]) {
-				ret = 1;
-				goto out1;
-			}
-			dev_scans[i].bytenr = -1;
-		}
-
-		printf("\rScanning: ");
-		for (i = 0; i < devidx; i++) {
-			if (dev_scans[i].bytenr == -1)
-				printf("%sDONE in dev%d",
-				       i ? ", " : "", i);
-			else
-				printf("%s%llu in dev%d",
-				       i ? ", " : "", dev_scans[i].bytenr, i);
-		}
-		/* clear chars if exist in tail */
-		printf("                ");
-		printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-		fflush(stdout);
-
-		if (all_done) {
-			printf("\n");
-			break;
-		}
-
-		sleep(1);
-	}
-out1:
-	for (i = 0; i < devidx; i++) {
-		if (dev_scans[i].bytenr == -1)
-			continue;
-		pthread_cancel(t_scans[i]);
-	}
-out2:
-	free(dev_scans);
-	free(t_scans);
-	free(t_rets);
+	ret = tree_scan_devices(&scan, devs, devnr);
+	free(devs);
 	return !!ret;
 }
 
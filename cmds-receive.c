@@ -24,6 +24,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <math.h>
 #include <ftw.h>
 #include <sys/wait.h>
@@ -45,22 +46,186 @@
 #include "utils.h"
 #include "list.h"
 #include "btrfs-list.h"
+#include "crc32c.h"
 
 #include "send.h"
 #include "send-stream.h"
 #include "send-utils.h"
 #include "send-dump.h"
+#include "send-compress.h"
+#include "send-index.h"
 #include "help.h"
 
 static int g_verbose = 0;
 
+/*
+ * Limit of data queued to the writer threads and not yet applied, the stream
+ * parser waits when it's exceeded
+ */
+#define RECEIVE_INFLIGHT_MAX	SZ_64M
+
+/*
+ * Size of the buffer to merge consecutive writes to one file, the stream
+ * carries at most BTRFS_SEND_READ_SIZE of data per write command
+ */
+#define RECEIVE_WRITE_BUFFER	SZ_4M
+
+/* Number of resolved clone source subvolumes and open clone sources kept */
+#define CLONE_CACHE_SIZE	16
+
+/*
+ * With --checkpoint, the filesystem is synced and the checkpoint file written
+ * after this much data or this many commands
+ */
+#define RECEIVE_CHECKPOINT_BYTES	SZ_1G
+#define RECEIVE_CHECKPOINT_CMDS		(1024 * 1024)
+
+#define RECEIVE_CHECKPOINT_MAGIC	"btrfs-receive-ck"
+#define RECEIVE_CHECKPOINT_VERSION	1
+
+/*
+ * Contents of the checkpoint file. Commands are counted from the start of the
+ * input, over all streams in it, the uuids are the received uuid of the
+ * subvolume in progress or zero between streams.
+ */
+struct receive_checkpoint {
+	char magic[sizeof(RECEIVE_CHECKPOINT_MAGIC)];
+	__le32 version;
+	char boot_id[40];
+	/* Commands applied and synced to disk */
+	__le64 synced_cmds;
+	u8 synced_uuid[BTRFS_UUID_SIZE];
+	/*
+	 * Commands applied by a receive running in boot_id, updated in place
+	 * without sync after each command that waits for all previous ones
+	 */
+	__le64 applied_cmds;
+	u8 applied_uuid[BTRFS_UUID_SIZE];
+} __attribute__ ((__packed__));
+
+struct clone_subvol_entry {
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 ctransid;
+	char *path;
+	u64 last_used;
+};
+
+struct clone_fd_entry {
+	char *path;
+	int fd;
+	u64 last_used;
+};
+
+struct btrfs_receive;
+
+/*
+ * State of one thread that applies file data and attribute commands, there's
+ * one in btrfs_receive for the synchronous case and one per writer thread
+ */
+struct receive_writer {
+	struct btrfs_receive *rctx;
+
+	int write_fd;
+	char write_path[PATH_MAX];
+
+	/*
+	 * Sequential writes to write_fd are collected here and written by one
+	 * pwrite at write_buf_offset, see do_write
+	 */
+	char *write_buf;
+	u64 write_buf_offset;
+	u64 write_buf_len;
+
+	/*
+	 * Buffer to store capabilities from security.capabilities xattr,
+	 * usually 20 bytes, but make same room for potentially larger
+	 * encodings. Must be set only once per file, denoted by length > 0.
+	 */
+	char cached_capabilities[64];
+	int cached_capabilities_len;
+
+	/* Clone sources opened relative to mnt_fd, by LRU */
+	struct clone_fd_entry clone_fds[CLONE_CACHE_SIZE];
+	u64 clone_fd_tick;
+	u64 clone_fd_lookups;
+	u64 clone_fd_hits;
+};
+
+/*
+ * A command queued for a writer thread. Path and name strings and the data
+ * are stored after the structure.
+ */
+struct receive_work {
+	struct list_head list;
+	int cmd;
+	size_t size;
+	char *path;
+	char *full_path;
+	union {
+		struct {
+			u64 offset;
+			u64 len;
+		} write;
+		struct {
+			u64 offset;
+			u64 len;
+			u64 clone_offset;
+			char *clone_path;
+		} clone;
+		struct {
+			char *name;
+			int len;
+		} xattr;
+		u64 size;
+		u64 mode;
+		struct {
+			u64 uid;
+			u64 gid;
+		} owner;
+		struct {
+			struct timespec at;
+			struct timespec mt;
+		} times;
+	} args;
+	char data[];
+};
+
+struct receive_shard {
+	struct receive_writer writer;
+	struct receive_pool *pool;
+	struct list_head queue;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int busy;
+};
+
+/*
+ * Commands that change only one inode (writes, clones, xattrs, truncate,
+ * chmod, chown, utimes) are hashed by path to a writer thread and applied in
+ * stream order by that thread. Everything else runs in the parser thread
+ * after waiting for the commands it depends on.
+ */
+struct receive_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t idle;
+	int waiting;
+	int stop;
+	/* First error of the writer threads and the failed commands */
+	int error;
+	u64 nr_errors;
+	u64 inflight;
+	int nr_shards;
+	struct receive_shard *shards;
+};
+
 struct btrfs_receive
 {
 	int mnt_fd;
 	int dest_dir_fd;
 
-	int write_fd;
-	char write_path[PATH_MAX];
+	struct receive_writer writer;
+	int nr_threads;
+	struct receive_pool *pool;
 
 	char *root_path;
 	char *dest_dir_path; /* relative to root_path */
@@ -77,17 +242,420 @@ struct btrfs_receive
 
 	struct subvol_uuid_search sus;
 
+	/*
+	 * Clone source subvolume paths by received uuid and ctransid, only
+	 * accessed by the stream parser
+	 */
+	struct clone_subvol_entry clone_subvols[CLONE_CACHE_SIZE];
+	u64 clone_subvol_tick;
+	u64 clone_subvol_lookups;
+	u64 clone_subvol_hits;
+
 	int honor_end_cmd;
 
+	/* State of --checkpoint and --resume */
+	int checkpoint_dir_fd;
+	int checkpoint_fd;
+	char checkpoint_name[PATH_MAX];
+	struct receive_checkpoint checkpoint;
+	u64 checkpoint_bytes;
+	u64 checkpoint_cmds;
+	u64 nr_cmds;
+	u64 resume_cmds;
+	u8 resume_uuid[BTRFS_UUID_SIZE];
 	/*
-	 * Buffer to store capabilities from security.capabilities xattr,
-	 * usually 20 bytes, but make same room for potentially larger
-	 * encodings. Must be set only once per file, denoted by length > 0.
+	 * Commands after the resumed checkpoint may have been applied by the
+	 * interrupted receive, until the next command that waits for all
+	 * previous ones or with replay_to_checkpoint until the next checkpoint
 	 */
-	char cached_capabilities[64];
-	int cached_capabilities_len;
+	int replaying;
+	int replay_to_checkpoint;
+	/* Subvolume of the current stream was received completely before */
+	int skip_stream;
 };
 
+static int receive_flush(struct btrfs_receive *rctx, u64 *nr_errors);
+
+/*
+ * Write the checkpoint to a temporary file and rename it over the previous
+ * one, the file stays open for update_progress
+ */
+static int save_checkpoint(struct btrfs_receive *rctx)
+{
+	char tmp[PATH_MAX];
+	int fd;
+	int ret;
+
+	ret = snprintf(tmp, sizeof(tmp), "%s.tmp", rctx->checkpoint_name);
+	if (ret >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	fd = openat(rctx->checkpoint_dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC,
+		    0600);
+	if (fd < 0) {
+		ret = -errno;
+		error("cannot create checkpoint %s: %m", tmp);
+		return ret;
+	}
+
+	ret = pwrite(fd, &rctx->checkpoint, sizeof(rctx->checkpoint), 0);
+	if (ret < 0 || fsync(fd) < 0) {
+		ret = -errno;
+		error("cannot write checkpoint %s: %m", tmp);
+		goto fail;
+	}
+	if (ret != sizeof(rctx->checkpoint)) {
+		ret = -EIO;
+		error("short write of checkpoint %s", tmp);
+		goto fail;
+	}
+
+	ret = renameat(rctx->checkpoint_dir_fd, tmp, rctx->checkpoint_dir_fd,
+		       rctx->checkpoint_name);
+	if (ret < 0) {
+		ret = -errno;
+		error("cannot rename checkpoint %s: %m", tmp);
+		goto fail;
+	}
+	fsync(rctx->checkpoint_dir_fd);
+
+	if (rctx->checkpoint_fd != -1)
+		close(rctx->checkpoint_fd);
+	rctx->checkpoint_fd = fd;
+
+	return 0;
+
+fail:
+	close(fd);
+	unlinkat(rctx->checkpoint_dir_fd, tmp, 0);
+	return ret;
+}
+
+static int pool_has_error(struct btrfs_receive *rctx)
+{
+	int ret;
+
+	if (!rctx->pool)
+		return 0;
+
+	pthread_mutex_lock(&rctx->pool->mutex);
+	ret = rctx->pool->error;
+	pthread_mutex_unlock(&rctx->pool->mutex);
+
+	return ret;
+}
+
+/*
+ * Capabilities are restored by the chown following the set_xattr, there must
+ * be no checkpoint in between. Call only after receive_sync.
+ */
+static int writers_hold_capabilities(struct btrfs_receive *rctx)
+{
+	int i;
+
+	if (rctx->writer.cached_capabilities_len)
+		return 1;
+	if (!rctx->pool)
+		return 0;
+	for (i = 0; i < rctx->pool->nr_shards; i++)
+		if (rctx->pool->shards[i].writer.cached_capabilities_len)
+			return 1;
+
+	return 0;
+}
+
+static void current_subvol_uuid(struct btrfs_receive *rctx, u8 *uuid)
+{
+	if (rctx->cur_subvol_path[0])
+		memcpy(uuid, rctx->cur_subvol.received_uuid, BTRFS_UUID_SIZE);
+	else
+		memset(uuid, 0, BTRFS_UUID_SIZE);
+}
+
+/*
+ * Apply all commands so far, sync the filesystem and record the number of
+ * commands in the checkpoint file. Postponed while capabilities are pending.
+ */
+static int write_checkpoint(struct btrfs_receive *rctx)
+{
+	struct receive_checkpoint *cp = &rctx->checkpoint;
+	int ret;
+
+	if (rctx->checkpoint_fd == -1)
+		return 0;
+
+	ret = receive_flush(rctx, NULL);
+	if (ret < 0)
+		return ret;
+	if (writers_hold_capabilities(rctx))
+		return 0;
+
+	ret = ioctl(rctx->mnt_fd, BTRFS_IOC_SYNC);
+	if (ret < 0) {
+		ret = -errno;
+		error("sync for checkpoint failed: %m");
+		return ret;
+	}
+
+	cp->synced_cmds = cpu_to_le64(rctx->nr_cmds);
+	current_subvol_uuid(rctx, cp->synced_uuid);
+	cp->applied_cmds = cp->synced_cmds;
+	memcpy(cp->applied_uuid, cp->synced_uuid, BTRFS_UUID_SIZE);
+	ret = save_checkpoint(rctx);
+	if (ret < 0)
+		return ret;
+
+	if (g_verbose >= 1)
+		fprintf(stderr, "checkpoint at command %llu\n", rctx->nr_cmds);
+	rctx->checkpoint_bytes = 0;
+	rctx->checkpoint_cmds = rctx->nr_cmds;
+	rctx->replaying = 0;
+
+	return 0;
+}
+
+/*
+ * Called by commands that waited for all previous commands, once they're
+ * applied. The number of applied commands is updated in the checkpoint file
+ * without sync, it's valid as long as the system keeps running.
+ */
+static int update_progress(struct btrfs_receive *rctx)
+{
+	struct receive_checkpoint *cp = &rctx->checkpoint;
+	off_t offset = offsetof(struct receive_checkpoint, applied_cmds);
+	int ret;
+
+	if (rctx->replaying && !rctx->replay_to_checkpoint)
+		rctx->replaying = 0;
+	if (rctx->checkpoint_fd == -1 || pool_has_error(rctx) ||
+	    writers_hold_capabilities(rctx))
+		return 0;
+
+	cp->applied_cmds = cpu_to_le64(rctx->nr_cmds);
+	current_subvol_uuid(rctx, cp->applied_uuid);
+	ret = pwrite(rctx->checkpoint_fd, (char *)cp + offset,
+		     sizeof(*cp) - offset, offset);
+	if (ret < 0) {
+		ret = -errno;
+		error("cannot update checkpoint: %m");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Start of every command. Returns 1 if the command has been applied before
+ * the checkpoint we resume from and must be skipped, <0 on error.
+ */
+static int begin_cmd(struct btrfs_receive *rctx)
+{
+	int ret;
+
+	if (rctx->checkpoint_fd != -1 && !rctx->skip_stream &&
+	    rctx->nr_cmds >= rctx->resume_cmds &&
+	    (rctx->checkpoint_bytes >= RECEIVE_CHECKPOINT_BYTES ||
+	     rctx->nr_cmds - rctx->checkpoint_cmds >= RECEIVE_CHECKPOINT_CMDS)) {
+		ret = write_checkpoint(rctx);
+		if (ret < 0)
+			return ret;
+	}
+
+	rctx->nr_cmds++;
+	if (rctx->skip_stream || rctx->nr_cmds <= rctx->resume_cmds)
+		return 1;
+
+	if (rctx->nr_cmds == rctx->resume_cmds + 1 &&
+	    rctx->cur_subvol_path[0] &&
+	    memcmp(rctx->cur_subvol.received_uuid, rctx->resume_uuid,
+		   BTRFS_UUID_SIZE)) {
+		error("the stream does not match the checkpoint");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * While replaying the commands after a resumed checkpoint, skip a command
+ * whose effect is already there, ie. @path relative to @dirfd exists or not
+ * as given by @exists. Commands on file data and attributes are skipped if
+ * the path is missing, it's been renamed or removed by the interrupted
+ * receive.
+ */
+static int replay_skip(struct btrfs_receive *rctx, int dirfd, const char *path,
+		       int exists)
+{
+	struct stat st;
+	int found;
+
+	if (!rctx->replaying)
+		return 0;
+
+	found = !fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW);
+	if (found != exists)
+		return 0;
+
+	if (g_verbose >= 2)
+		fprintf(stderr, "skip applied command on %s\n", path);
+	return 1;
+}
+
+/*
+ * The subvolume of a stream that has been started before the resumed
+ * checkpoint exists already, skip the whole stream if it's been finished
+ */
+static int resume_subvol(struct btrfs_receive *rctx)
+{
+	int fd;
+	int ret;
+	u64 flags;
+
+	fd = openat(rctx->mnt_fd, rctx->cur_subvol_path, O_RDONLY | O_NOATIME);
+	if (fd < 0) {
+		ret = -errno;
+		error("cannot open %s: %m", rctx->cur_subvol_path);
+		return ret;
+	}
+
+	ret = ioctl(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags);
+	if (ret < 0) {
+		ret = -errno;
+		error("ioctl BTRFS_IOC_SUBVOL_GETFLAGS failed: %m");
+		goto out;
+	}
+
+	if (flags & BTRFS_SUBVOL_RDONLY) {
+		fprintf(stderr, "Subvolume %s already received, skipping\n",
+			rctx->cur_subvol_path);
+		rctx->skip_stream = 1;
+	}
+
+out:
+	close(fd);
+	return ret;
+}
+
+static int read_boot_id(char *buf, size_t size)
+{
+	FILE *f;
+	char *nl;
+
+	buf[0] = 0;
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return -errno;
+	if (!fgets(buf, size, f))
+		buf[0] = 0;
+	fclose(f);
+
+	nl = strchr(buf, '\n');
+	if (nl)
+		*nl = 0;
+
+	return 0;
+}
+
+/*
+ * Set up the checkpoint file @path. With @resume, load the previous checkpoint
+ * and continue after the synced commands, or after the applied ones if the
+ * system has not been restarted since. Must be done before chroot.
+ */
+static int open_checkpoint(struct btrfs_receive *rctx, const char *path,
+			   int resume)
+{
+	struct receive_checkpoint *cp = &rctx->checkpoint;
+	struct receive_checkpoint old;
+	char dir[PATH_MAX];
+	char *slash;
+	int fd;
+	int ret;
+
+	strncpy_null(dir, path);
+	slash = strrchr(dir, '/');
+	if (!slash) {
+		strcpy(dir, ".");
+		strncpy_null(rctx->checkpoint_name, path);
+	} else {
+		strncpy_null(rctx->checkpoint_name, slash + 1);
+		if (slash == dir)
+			slash++;
+		*slash = 0;
+	}
+	if (!rctx->checkpoint_name[0]) {
+		error("invalid checkpoint file name: %s", path);
+		return -EINVAL;
+	}
+
+	rctx->checkpoint_dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (rctx->checkpoint_dir_fd < 0) {
+		ret = -errno;
+		error("cannot open %s: %m", dir);
+		return ret;
+	}
+
+	memset(cp, 0, sizeof(*cp));
+	memcpy(cp->magic, RECEIVE_CHECKPOINT_MAGIC, sizeof(cp->magic));
+	cp->version = cpu_to_le32(RECEIVE_CHECKPOINT_VERSION);
+	read_boot_id(cp->boot_id, sizeof(cp->boot_id));
+
+	if (!resume)
+		goto save;
+
+	fd = openat(rctx->checkpoint_dir_fd, rctx->checkpoint_name, O_RDONLY);
+	if (fd < 0 && errno == ENOENT) {
+		fprintf(stderr, "No checkpoint in %s, receiving from the start\n",
+			path);
+		goto save;
+	}
+	if (fd < 0) {
+		ret = -errno;
+		error("cannot open checkpoint %s: %m", path);
+		return ret;
+	}
+	ret = pread(fd, &old, sizeof(old), 0);
+	close(fd);
+	if (ret != sizeof(old) ||
+	    memcmp(old.magic, RECEIVE_CHECKPOINT_MAGIC, sizeof(old.magic)) ||
+	    le32_to_cpu(old.version) != RECEIVE_CHECKPOINT_VERSION) {
+		error("invalid checkpoint file %s", path);
+		return -EINVAL;
+	}
+
+	cp->synced_cmds = old.synced_cmds;
+	memcpy(cp->synced_uuid, old.synced_uuid, BTRFS_UUID_SIZE);
+	if (cp->boot_id[0] && !strncmp(cp->boot_id, old.boot_id,
+				       sizeof(cp->boot_id))) {
+		cp->applied_cmds = old.applied_cmds;
+		memcpy(cp->applied_uuid, old.applied_uuid, BTRFS_UUID_SIZE);
+	} else {
+		cp->applied_cmds = old.synced_cmds;
+		memcpy(cp->applied_uuid, old.synced_uuid, BTRFS_UUID_SIZE);
+		rctx->replay_to_checkpoint = 1;
+	}
+	rctx->resume_cmds = le64_to_cpu(cp->applied_cmds);
+	memcpy(rctx->resume_uuid, cp->applied_uuid, BTRFS_UUID_SIZE);
+	rctx->checkpoint_cmds = rctx->resume_cmds;
+	rctx->replaying = 1;
+	fprintf(stderr, "Resuming after command %llu\n", rctx->resume_cmds);
+
+save:
+	return save_checkpoint(rctx);
+}
+
+/* The receive finished, the checkpoint is not needed anymore */
+static void remove_checkpoint(struct btrfs_receive *rctx)
+{
+	if (rctx->checkpoint_fd == -1)
+		return;
+
+	close(rctx->checkpoint_fd);
+	rctx->checkpoint_fd = -1;
+	if (unlinkat(rctx->checkpoint_dir_fd, rctx->checkpoint_name, 0) < 0)
+		warning("cannot remove checkpoint %s: %m",
+			rctx->checkpoint_name);
+}
+
 static int finish_subvol(struct btrfs_receive *rctx)
 {
 	int ret;
@@ -159,6 +727,11 @@ static int process_subvol(const char *path, const u8 *uuid, u64 ctransid,
 	struct btrfs_receive *rctx = user;
 	struct btrfs_ioctl_vol_args args_v1;
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
+	int skip;
+
+	skip = begin_cmd(rctx);
+	if (skip < 0)
+		return skip;
 
 	ret = finish_subvol(rctx);
 	if (ret < 0)
@@ -206,6 +779,11 @@ static int process_subvol(const char *path, const u8 *uuid, u64 ctransid,
 				rctx->cur_subvol.stransid);
 	}
 
+	if (skip || replay_skip(rctx, AT_FDCWD, rctx->full_subvol_path, 1)) {
+		ret = resume_subvol(rctx);
+		goto out;
+	}
+
 	memset(&args_v1, 0, sizeof(args_v1));
 	strncpy_null(args_v1.name, path);
 	ret = ioctl(rctx->dest_dir_fd, BTRFS_IOC_SUBVOL_CREATE, &args_v1);
@@ -228,6 +806,11 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	struct btrfs_ioctl_vol_args_v2 args_v2;
 	struct subvol_info *parent_subvol = NULL;
+	int skip;
+
+	skip = begin_cmd(rctx);
+	if (skip < 0)
+		return skip;
 
 	ret = finish_subvol(rctx);
 	if (ret < 0)
@@ -278,6 +861,11 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 				uuid_str, parent_ctransid);
 	}
 
+	if (skip || replay_skip(rctx, AT_FDCWD, rctx->full_subvol_path, 1)) {
+		ret = resume_subvol(rctx);
+		goto out;
+	}
+
 	memset(&args_v2, 0, sizeof(args_v2));
 	strncpy_null(args_v2.name, path);
 
@@ -383,41 +971,370 @@ out:
 	return ret;
 }
 
-static int process_mkfile(const char *path, void *user)
+static int execute_work(struct receive_writer *w, struct receive_work *work);
+
+static void *receive_worker(void *arg)
 {
+	struct receive_shard *shard = arg;
+	struct receive_pool *pool = shard->pool;
+	struct receive_work *work;
 	int ret;
-	struct btrfs_receive *rctx = user;
-	char full_path[PATH_MAX];
 
-	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
-	if (ret < 0) {
-		error("mkfile: path invalid: %s", path);
-		goto out;
-	}
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (list_empty(&shard->queue) && !pool->stop)
+			pthread_cond_wait(&shard->cond, &pool->mutex);
+		if (list_empty(&shard->queue))
+			break;
+		work = list_first_entry(&shard->queue, struct receive_work,
+					list);
+		list_del(&work->list);
+		shard->busy = 1;
+		pthread_mutex_unlock(&pool->mutex);
 
-	if (g_verbose >= 2)
-		fprintf(stderr, "mkfile %s\n", path);
+		ret = execute_work(&shard->writer, work);
 
-	ret = creat(full_path, 0600);
-	if (ret < 0) {
-		ret = -errno;
-		error("mkfile %s failed: %m", path);
-		goto out;
+		pthread_mutex_lock(&pool->mutex);
+		if (ret < 0) {
+			if (!pool->nr_errors)
+				pool->error = ret;
+			pool->nr_errors++;
+		}
+		pool->inflight -= work->size;
+		shard->busy = 0;
+		if (pool->waiting)
+			pthread_cond_broadcast(&pool->idle);
+		free(work);
 	}
-	close(ret);
-	ret = 0;
+	pthread_mutex_unlock(&pool->mutex);
 
-out:
-	return ret;
+	return NULL;
 }
 
-static int process_mkdir(const char *path, void *user)
+static int shard_idle(struct receive_shard *shard)
 {
-	int ret;
-	struct btrfs_receive *rctx = user;
-	char full_path[PATH_MAX];
+	return !shard->busy && list_empty(&shard->queue);
+}
 
-	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
+/*
+ * Report one failed command of the writer threads, returns the first error
+ * until each failed command was reported once, so every failure is counted
+ * against --max-errors
+ */
+static int pool_take_error(struct receive_pool *pool)
+{
+	int ret = pool->error;
+
+	if (!pool->nr_errors)
+		return 0;
+	if (!--pool->nr_errors)
+		pool->error = 0;
+	return ret;
+}
+
+/*
+ * The writer thread of @full_path. Trailing slashes are ignored, the commands
+ * on the subvolume root come with one and must go to the same thread as the
+ * new entries in the root wait for.
+ */
+static struct receive_shard *shard_for_path(struct receive_pool *pool,
+					    const char *full_path)
+{
+	size_t len = strlen(full_path);
+	u32 hash;
+
+	while (len > 1 && full_path[len - 1] == '/')
+		len--;
+	hash = crc32c(~1, full_path, len);
+
+	return &pool->shards[hash % pool->nr_shards];
+}
+
+/*
+ * Wait until all commands queued for @shard, or for all writer threads if
+ * @shard is NULL, are applied
+ */
+static void pool_wait(struct receive_pool *pool, struct receive_shard *shard)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->waiting++;
+	if (shard) {
+		while (!shard_idle(shard))
+			pthread_cond_wait(&pool->idle, &pool->mutex);
+	} else {
+		for (i = 0; i < pool->nr_shards; i++) {
+			while (!shard_idle(&pool->shards[i]))
+				pthread_cond_wait(&pool->idle, &pool->mutex);
+		}
+	}
+	pool->waiting--;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static int sync_writer(struct receive_writer *w, int drop);
+static void release_writer(struct receive_writer *w);
+
+/*
+ * Wait for all queued commands and write out the buffered data. With @drop
+ * also close the open files, for commands that change the namespace and may
+ * invalidate any queued or cached path. Returns error of writing out the
+ * buffered data, errors of the queued commands are left for the next
+ * submit_work or receive_flush.
+ */
+static int receive_sync(struct btrfs_receive *rctx, int drop)
+{
+	int i;
+	int ret;
+	int err;
+
+	ret = sync_writer(&rctx->writer, drop);
+	if (!rctx->pool)
+		return ret;
+
+	pool_wait(rctx->pool, NULL);
+	for (i = 0; i < rctx->pool->nr_shards; i++) {
+		err = sync_writer(&rctx->pool->shards[i].writer, drop);
+		if (err < 0 && !ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/*
+ * Apply all queued commands at the end of a stream and return their first
+ * error, the number of failed commands is set in @nr_errors if not NULL
+ */
+static int receive_flush(struct btrfs_receive *rctx, u64 *nr_errors)
+{
+	u64 count = 0;
+	int ret;
+	int err;
+
+	ret = receive_sync(rctx, 1);
+	if (ret < 0)
+		count++;
+	if (rctx->pool) {
+		pthread_mutex_lock(&rctx->pool->mutex);
+		while ((err = pool_take_error(rctx->pool)) < 0) {
+			if (!ret)
+				ret = err;
+			count++;
+		}
+		pthread_mutex_unlock(&rctx->pool->mutex);
+	}
+	if (nr_errors)
+		*nr_errors = count;
+
+	return ret;
+}
+
+/*
+ * Wait for commands queued for the parent directory of @full_path before the
+ * directory is changed by a new entry, so the order of eg. utimes of the
+ * directory is kept
+ */
+static void wait_for_parent(struct btrfs_receive *rctx, const char *full_path)
+{
+	char parent[PATH_MAX];
+	char *slash;
+
+	if (!rctx->pool)
+		return;
+
+	strncpy_null(parent, full_path);
+	slash = parent + strlen(parent);
+	while (slash > parent + 1 && slash[-1] == '/')
+		*--slash = 0;
+	slash = strrchr(parent, '/');
+	if (!slash)
+		return;
+	*slash = 0;
+
+	pool_wait(rctx->pool, shard_for_path(rctx->pool, parent));
+}
+
+static struct receive_work *alloc_work(int cmd, const char *path,
+				       const char *full_path, size_t data_len,
+				       const char *extra)
+{
+	struct receive_work *work;
+	size_t path_len = strlen(path) + 1;
+	size_t full_len = strlen(full_path) + 1;
+	size_t extra_len = extra ? strlen(extra) + 1 : 0;
+	size_t size = sizeof(*work) + data_len + path_len + full_len + extra_len;
+
+	work = malloc(size);
+	if (!work)
+		return NULL;
+
+	work->cmd = cmd;
+	work->size = size;
+	work->path = work->data + data_len;
+	memcpy(work->path, path, path_len);
+	work->full_path = work->path + path_len;
+	memcpy(work->full_path, full_path, full_len);
+	if (extra)
+		memcpy(work->full_path + full_len, extra, extra_len);
+
+	return work;
+}
+
+/* The copy of the optional string passed to alloc_work */
+static char *work_extra(struct receive_work *work)
+{
+	return work->full_path + strlen(work->full_path) + 1;
+}
+
+/*
+ * Queue @work to the writer thread of its path. An error of a previously
+ * queued command is returned so it's accounted by the stream parser, the
+ * command is queued anyway.
+ */
+static int submit_work(struct btrfs_receive *rctx, struct receive_work *work)
+{
+	struct receive_pool *pool = rctx->pool;
+	struct receive_shard *shard = shard_for_path(pool, work->full_path);
+	int ret;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->waiting++;
+	while (pool->inflight && pool->inflight + work->size > RECEIVE_INFLIGHT_MAX)
+		pthread_cond_wait(&pool->idle, &pool->mutex);
+	pool->waiting--;
+	pool->inflight += work->size;
+	list_add_tail(&work->list, &shard->queue);
+	pthread_cond_signal(&shard->cond);
+	ret = pool_take_error(pool);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
+
+static void receive_pool_stop(struct btrfs_receive *rctx)
+{
+	struct receive_pool *pool = rctx->pool;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	for (i = 0; i < pool->nr_shards; i++)
+		pthread_cond_signal(&pool->shards[i].cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->nr_shards; i++) {
+		struct receive_shard *shard = &pool->shards[i];
+
+		pthread_join(shard->thread, NULL);
+		release_writer(&shard->writer);
+		pthread_cond_destroy(&shard->cond);
+	}
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->shards);
+	free(pool);
+	rctx->pool = NULL;
+}
+
+static int receive_pool_start(struct btrfs_receive *rctx)
+{
+	struct receive_pool *pool;
+	int i;
+	int ret = 0;
+
+	if (rctx->nr_threads < 1)
+		return -EINVAL;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+	pool->shards = calloc(rctx->nr_threads, sizeof(*pool->shards));
+	if (!pool->shards) {
+		free(pool);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	rctx->pool = pool;
+
+	for (i = 0; i < rctx->nr_threads; i++) {
+		struct receive_shard *shard = &pool->shards[i];
+
+		shard->pool = pool;
+		shard->writer.rctx = rctx;
+		shard->writer.write_fd = -1;
+		INIT_LIST_HEAD(&shard->queue);
+		pthread_cond_init(&shard->cond, NULL);
+		ret = pthread_create(&shard->thread, NULL, receive_worker,
+				     shard);
+		if (ret) {
+			pthread_cond_destroy(&shard->cond);
+			error("failed to start writer thread: %s",
+				strerror(ret));
+			break;
+		}
+		pool->nr_shards++;
+	}
+
+	if (pool->nr_shards < rctx->nr_threads) {
+		receive_pool_stop(rctx);
+		return -ret;
+	}
+
+	return 0;
+}
+
+static int process_mkfile(const char *path, void *user)
+{
+	int ret;
+	struct btrfs_receive *rctx = user;
+	char full_path[PATH_MAX];
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
+	if (ret < 0) {
+		error("mkfile: path invalid: %s", path);
+		goto out;
+	}
+
+	if (g_verbose >= 2)
+		fprintf(stderr, "mkfile %s\n", path);
+
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	wait_for_parent(rctx, full_path);
+	ret = creat(full_path, 0600);
+	if (ret < 0) {
+		ret = -errno;
+		error("mkfile %s failed: %m", path);
+		goto out;
+	}
+	close(ret);
+	ret = 0;
+
+out:
+	return ret;
+}
+
+static int process_mkdir(const char *path, void *user)
+{
+	int ret;
+	struct btrfs_receive *rctx = user;
+	char full_path[PATH_MAX];
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mkdir: path invalid: %s", path);
 		goto out;
@@ -426,6 +1343,10 @@ static int process_mkdir(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mkdir %s\n", path);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	wait_for_parent(rctx, full_path);
 	ret = mkdir(full_path, 0700);
 	if (ret < 0) {
 		ret = -errno;
@@ -442,6 +1363,10 @@ static int process_mknod(const char *path, u64 mode, u64 dev, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mknod: path invalid: %s", path);
@@ -452,6 +1377,10 @@ static int process_mknod(const char *path, u64 mode, u64 dev, void *user)
 		fprintf(stderr, "mknod %s mode=%llu, dev=%llu\n",
 				path, mode, dev);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	wait_for_parent(rctx, full_path);
 	ret = mknod(full_path, mode & S_IFMT, dev);
 	if (ret < 0) {
 		ret = -errno;
@@ -468,6 +1397,10 @@ static int process_mkfifo(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mkfifo: path invalid: %s", path);
@@ -477,6 +1410,10 @@ static int process_mkfifo(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mkfifo %s\n", path);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	wait_for_parent(rctx, full_path);
 	ret = mkfifo(full_path, 0600);
 	if (ret < 0) {
 		ret = -errno;
@@ -493,6 +1430,10 @@ static int process_mksock(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mksock: path invalid: %s", path);
@@ -502,6 +1443,10 @@ static int process_mksock(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "mksock %s\n", path);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	wait_for_parent(rctx, full_path);
 	ret = mknod(full_path, 0600 | S_IFSOCK, 0);
 	if (ret < 0) {
 		ret = -errno;
@@ -518,6 +1463,10 @@ static int process_symlink(const char *path, const char *lnk, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("symlink: path invalid: %s", path);
@@ -527,6 +1476,10 @@ static int process_symlink(const char *path, const char *lnk, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "symlink %s -> %s\n", path, lnk);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	wait_for_parent(rctx, full_path);
 	ret = symlink(lnk, full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -544,6 +1497,10 @@ static int process_rename(const char *from, const char *to, void *user)
 	char full_from[PATH_MAX];
 	char full_to[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_from, rctx->full_subvol_path, from);
 	if (ret < 0) {
 		error("rename: source path invalid: %s", from);
@@ -559,12 +1516,22 @@ static int process_rename(const char *from, const char *to, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
+	if (replay_skip(rctx, AT_FDCWD, full_from, 0))
+		goto out;
+
+	ret = receive_sync(rctx, 1);
+	if (ret < 0)
+		goto out;
+
 	ret = rename(full_from, full_to);
 	if (ret < 0) {
 		ret = -errno;
 		error("rename %s -> %s failed: %m", from, to);
+		goto out;
 	}
 
+	ret = update_progress(rctx);
+
 out:
 	return ret;
 }
@@ -576,6 +1543,10 @@ static int process_link(const char *path, const char *lnk, void *user)
 	char full_path[PATH_MAX];
 	char full_link_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("link: source path invalid: %s", full_path);
@@ -591,12 +1562,22 @@ static int process_link(const char *path, const char *lnk, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "link %s -> %s\n", path, lnk);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 1))
+		goto out;
+
+	ret = receive_sync(rctx, 1);
+	if (ret < 0)
+		goto out;
+
 	ret = link(full_link_path, full_path);
 	if (ret < 0) {
 		ret = -errno;
 		error("link %s -> %s failed: %m", path, lnk);
+		goto out;
 	}
 
+	ret = update_progress(rctx);
+
 out:
 	return ret;
 }
@@ -608,6 +1589,10 @@ static int process_unlink(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("unlink: path invalid: %s", path);
@@ -617,12 +1602,22 @@ static int process_unlink(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "unlink %s\n", path);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	ret = receive_sync(rctx, 1);
+	if (ret < 0)
+		goto out;
+
 	ret = unlink(full_path);
 	if (ret < 0) {
 		ret = -errno;
 		error("unlink %s failed: %m", path);
+		goto out;
 	}
 
+	ret = update_progress(rctx);
+
 out:
 	return ret;
 }
@@ -633,6 +1628,10 @@ static int process_rmdir(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("rmdir: path invalid: %s", path);
@@ -642,47 +1641,234 @@ static int process_rmdir(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "rmdir %s\n", path);
 
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	ret = receive_sync(rctx, 1);
+	if (ret < 0)
+		goto out;
+
 	ret = rmdir(full_path);
 	if (ret < 0) {
 		ret = -errno;
 		error("rmdir %s failed: %m", path);
+		goto out;
 	}
 
+	ret = update_progress(rctx);
+
 out:
 	return ret;
 }
 
-static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
+static int write_all(struct receive_writer *w, const char *path,
+		     const char *data, u64 offset, u64 len)
+{
+	u64 pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = pwrite(w->write_fd, data + pos, len - pos, offset + pos);
+		if (ret < 0) {
+			ret = -errno;
+			error("writing to %s failed: %m", path);
+			return ret;
+		}
+		pos += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out the data collected by do_write, must be done before anything
+ * else touches the file
+ */
+static int flush_write_buffer(struct receive_writer *w)
+{
+	int ret;
+
+	if (!w->write_buf_len)
+		return 0;
+
+	ret = write_all(w, w->write_path, w->write_buf, w->write_buf_offset,
+			w->write_buf_len);
+	w->write_buf_len = 0;
+
+	return ret;
+}
+
+static int close_inode_for_write(struct receive_writer *w)
+{
+	int ret;
+
+	if(w->write_fd == -1)
+		return 0;
+
+	ret = flush_write_buffer(w);
+	close(w->write_fd);
+	w->write_fd = -1;
+	w->write_path[0] = 0;
+
+	return ret;
+}
+
+static void drop_clone_fds(struct receive_writer *w)
+{
+	int i;
+
+	for (i = 0; i < CLONE_CACHE_SIZE; i++) {
+		struct clone_fd_entry *entry = &w->clone_fds[i];
+
+		if (!entry->path)
+			continue;
+		close(entry->fd);
+		free(entry->path);
+		entry->path = NULL;
+	}
+}
+
+/*
+ * Return a read-only fd of the clone source @path relative to mnt_fd. The fd
+ * stays open until the namespace changes, streams of deduplicated data
+ * clone from the same files over and over.
+ */
+static int get_clone_fd(struct receive_writer *w, const char *path)
+{
+	struct clone_fd_entry *entry;
+	struct clone_fd_entry *lru = &w->clone_fds[0];
+	int fd;
+	int i;
+
+	w->clone_fd_lookups++;
+	for (i = 0; i < CLONE_CACHE_SIZE; i++) {
+		entry = &w->clone_fds[i];
+		if (entry->path && strcmp(entry->path, path) == 0) {
+			w->clone_fd_hits++;
+			entry->last_used = ++w->clone_fd_tick;
+			return entry->fd;
+		}
+		if (!entry->path ||
+		    (lru->path && entry->last_used < lru->last_used))
+			lru = entry;
+	}
+
+	if (lru->path) {
+		close(lru->fd);
+		free(lru->path);
+		lru->path = NULL;
+	}
+
+	fd = openat(w->rctx->mnt_fd, path, O_RDONLY | O_NOATIME);
+	if (fd < 0) {
+		fd = -errno;
+		error("cannot open %s: %m", path);
+		return fd;
+	}
+	lru->path = strdup(path);
+	if (!lru->path) {
+		close(fd);
+		return -ENOMEM;
+	}
+	lru->fd = fd;
+	lru->last_used = ++w->clone_fd_tick;
+
+	return fd;
+}
+
+static int sync_writer(struct receive_writer *w, int drop)
+{
+	if (!drop)
+		return flush_write_buffer(w);
+
+	drop_clone_fds(w);
+	return close_inode_for_write(w);
+}
+
+static void release_writer(struct receive_writer *w)
+{
+	sync_writer(w, 1);
+	free(w->write_buf);
+	w->write_buf = NULL;
+}
+
+static int open_inode_for_write(struct receive_writer *w, const char *path)
 {
 	int ret = 0;
 
-	if (rctx->write_fd != -1) {
-		if (strcmp(rctx->write_path, path) == 0)
+	if (w->write_fd != -1) {
+		if (strcmp(w->write_path, path) == 0)
+			goto out;
+		ret = close_inode_for_write(w);
+		if (ret < 0)
 			goto out;
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
 	}
 
-	rctx->write_fd = open(path, O_RDWR);
-	if (rctx->write_fd < 0) {
+	w->write_fd = open(path, O_RDWR);
+	if (w->write_fd < 0) {
 		ret = -errno;
 		error("cannot open %s: %m", path);
 		goto out;
 	}
-	strncpy_null(rctx->write_path, path);
+	strncpy_null(w->write_path, path);
 
 out:
 	return ret;
 }
 
-static void close_inode_for_write(struct btrfs_receive *rctx)
+static void clear_cached_capabilities(struct receive_writer *w)
 {
-	if(rctx->write_fd == -1)
+	if (!w->cached_capabilities_len)
 		return;
 
-	close(rctx->write_fd);
-	rctx->write_fd = -1;
-	rctx->write_path[0] = 0;
+	if (g_verbose >= 3)
+		fprintf(stderr, "clear cached capabilities\n");
+	memset(w->cached_capabilities, 0, sizeof(w->cached_capabilities));
+	w->cached_capabilities_len = 0;
+}
+
+/*
+ * Writes that continue where the previous one ended are appended to the write
+ * buffer and written together, data of a sequentially sent file ends up in a
+ * few large writes instead of one write per BTRFS_SEND_READ_SIZE.
+ */
+static int do_write(struct receive_writer *w, const char *path,
+		    const char *full_path, const void *data, u64 offset,
+		    u64 len)
+{
+	int ret;
+
+	ret = open_inode_for_write(w, full_path);
+	if (ret < 0)
+		goto out;
+
+	if (w->write_buf_len &&
+	    (offset != w->write_buf_offset + w->write_buf_len ||
+	     w->write_buf_len + len > RECEIVE_WRITE_BUFFER)) {
+		ret = flush_write_buffer(w);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (len >= RECEIVE_WRITE_BUFFER) {
+		ret = write_all(w, path, data, offset, len);
+		goto out;
+	}
+
+	if (!w->write_buf) {
+		w->write_buf = malloc(RECEIVE_WRITE_BUFFER);
+		if (!w->write_buf) {
+			ret = write_all(w, path, data, offset, len);
+			goto out;
+		}
+	}
+	if (!w->write_buf_len)
+		w->write_buf_offset = offset;
+	memcpy(w->write_buf + w->write_buf_len, data, len);
+	w->write_buf_len += len;
+
+out:
+	return ret;
 }
 
 static int process_write(const char *path, const void *data, u64 offset,
@@ -690,9 +1876,12 @@ static int process_write(const char *path, const void *data, u64 offset,
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
 	char full_path[PATH_MAX];
-	u64 pos = 0;
-	int w;
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -700,25 +1889,129 @@ static int process_write(const char *path, const void *data, u64 offset,
 		goto out;
 	}
 
-	ret = open_inode_for_write(rctx, full_path);
+	rctx->checkpoint_bytes += len;
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_write(&rctx->writer, path, full_path, data, offset,
+			       len);
+		goto out;
+	}
+
+	work = alloc_work(BTRFS_SEND_C_WRITE, path, full_path, len, NULL);
+	if (!work) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(work->data, data, len);
+	work->args.write.offset = offset;
+	work->args.write.len = len;
+	ret = submit_work(rctx, work);
+
+out:
+	return ret;
+}
+
+static int do_clone(struct receive_writer *w, const char *path,
+		    const char *full_path, u64 offset, u64 len,
+		    const char *full_clone_path, u64 clone_offset)
+{
+	int ret;
+	struct btrfs_ioctl_clone_range_args clone_args;
+	int clone_fd;
+
+	ret = open_inode_for_write(w, full_path);
+	if (ret < 0)
+		goto out;
+	ret = flush_write_buffer(w);
 	if (ret < 0)
 		goto out;
 
-	while (pos < len) {
-		w = pwrite(rctx->write_fd, (char*)data + pos, len - pos,
-				offset + pos);
-		if (w < 0) {
-			ret = -errno;
-			error("writing to %s failed: %m", path);
-			goto out;
-		}
-		pos += w;
+	clone_fd = get_clone_fd(w, full_clone_path);
+	if (clone_fd < 0) {
+		ret = clone_fd;
+		goto out;
+	}
+
+	clone_args.src_fd = clone_fd;
+	clone_args.src_offset = clone_offset;
+	clone_args.src_length = len;
+	clone_args.dest_offset = offset;
+	ret = ioctl(w->write_fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
+	if (ret < 0) {
+		ret = -errno;
+		error("failed to clone extents to %s: %m", path);
+		goto out;
 	}
 
 out:
 	return ret;
 }
 
+/*
+ * Return a copy of the path of the clone source subvolume cached by a previous
+ * clone, resolving it may need a search in the uuid tree
+ */
+static char *find_clone_subvol(struct btrfs_receive *rctx, const u8 *uuid,
+			       u64 ctransid)
+{
+	struct clone_subvol_entry *entry;
+	int i;
+
+	rctx->clone_subvol_lookups++;
+	for (i = 0; i < CLONE_CACHE_SIZE; i++) {
+		entry = &rctx->clone_subvols[i];
+		if (entry->path && entry->ctransid == ctransid &&
+		    memcmp(entry->uuid, uuid, BTRFS_UUID_SIZE) == 0) {
+			rctx->clone_subvol_hits++;
+			entry->last_used = ++rctx->clone_subvol_tick;
+			return strdup(entry->path);
+		}
+	}
+
+	return NULL;
+}
+
+static void cache_clone_subvol(struct btrfs_receive *rctx, const u8 *uuid,
+			       u64 ctransid, const char *path)
+{
+	struct clone_subvol_entry *entry;
+	struct clone_subvol_entry *lru = &rctx->clone_subvols[0];
+	char *copy;
+	int i;
+
+	copy = strdup(path);
+	if (!copy)
+		return;
+
+	for (i = 0; i < CLONE_CACHE_SIZE; i++) {
+		entry = &rctx->clone_subvols[i];
+		if (!entry->path) {
+			lru = entry;
+			break;
+		}
+		if (entry->last_used < lru->last_used)
+			lru = entry;
+	}
+
+	free(lru->path);
+	memcpy(lru->uuid, uuid, BTRFS_UUID_SIZE);
+	lru->ctransid = ctransid;
+	lru->path = copy;
+	lru->last_used = ++rctx->clone_subvol_tick;
+}
+
+static void free_clone_subvols(struct btrfs_receive *rctx)
+{
+	int i;
+
+	for (i = 0; i < CLONE_CACHE_SIZE; i++) {
+		free(rctx->clone_subvols[i].path);
+		rctx->clone_subvols[i].path = NULL;
+	}
+}
+
 static int process_clone(const char *path, u64 offset, u64 len,
 			 const u8 *clone_uuid, u64 clone_ctransid,
 			 const char *clone_path, u64 clone_offset,
@@ -726,12 +2019,16 @@ static int process_clone(const char *path, u64 offset, u64 len,
 {
 	int ret;
 	struct btrfs_receive *rctx = user;
-	struct btrfs_ioctl_clone_range_args clone_args;
+	struct receive_work *work;
 	struct subvol_info *si = NULL;
 	char full_path[PATH_MAX];
 	char *subvol_path = NULL;
 	char full_clone_path[PATH_MAX];
-	int clone_fd = -1;
+	int self_clone = 0;
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -739,10 +2036,14 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		goto out;
 	}
 
-	ret = open_inode_for_write(rctx, full_path);
-	if (ret < 0)
+	rctx->checkpoint_bytes += len;
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
 		goto out;
 
+	subvol_path = find_clone_subvol(rctx, clone_uuid, clone_ctransid);
+	if (subvol_path)
+		goto found;
+
 	si = subvol_uuid_search(&rctx->sus, 0, clone_uuid, clone_ctransid,
 				NULL,
 				subvol_search_by_received_uuid);
@@ -751,6 +2052,7 @@ static int process_clone(const char *path, u64 offset, u64 len,
 				BTRFS_UUID_SIZE) == 0) {
 			/* TODO check generation of extent */
 			subvol_path = strdup(rctx->cur_subvol_path);
+			self_clone = 1;
 		} else {
 			if (!si)
 				ret = -ENOENT;
@@ -793,71 +2095,113 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		} else {
 			subvol_path = strdup(si->path);
 		}
+		if (subvol_path)
+			cache_clone_subvol(rctx, clone_uuid, clone_ctransid,
+					   subvol_path);
 	}
 
+found:
 	ret = path_cat_out(full_clone_path, subvol_path, clone_path);
 	if (ret < 0) {
 		error("clone: target path invalid: %s", clone_path);
 		goto out;
 	}
 
-	clone_fd = openat(rctx->mnt_fd, full_clone_path, O_RDONLY | O_NOATIME);
-	if (clone_fd < 0) {
-		ret = -errno;
-		error("cannot open %s: %m", full_clone_path);
+	if (replay_skip(rctx, rctx->mnt_fd, full_clone_path, 0))
 		goto out;
+
+	/*
+	 * The source in the subvolume being received may still have queued
+	 * or buffered writes, clone it after everything so far is applied.
+	 */
+	if (self_clone) {
+		ret = receive_sync(rctx, 0);
+		if (ret < 0)
+			goto out;
 	}
 
-	clone_args.src_fd = clone_fd;
-	clone_args.src_offset = clone_offset;
-	clone_args.src_length = len;
-	clone_args.dest_offset = offset;
-	ret = ioctl(rctx->write_fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
-	if (ret < 0) {
-		ret = -errno;
-		error("failed to clone extents to %s: %m", path);
+	if (!rctx->pool || self_clone) {
+		ret = do_clone(&rctx->writer, path, full_path, offset, len,
+			       full_clone_path, clone_offset);
 		goto out;
 	}
 
+	work = alloc_work(BTRFS_SEND_C_CLONE, path, full_path, 0,
+			  full_clone_path);
+	if (!work) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	work->args.clone.offset = offset;
+	work->args.clone.len = len;
+	work->args.clone.clone_path = work_extra(work);
+	work->args.clone.clone_offset = clone_offset;
+	ret = submit_work(rctx, work);
+
 out:
 	if (si) {
 		free(si->path);
 		free(si);
 	}
 	free(subvol_path);
-	if (clone_fd != -1)
-		close(clone_fd);
 	return ret;
 }
 
 
-static int process_set_xattr(const char *path, const char *name,
-			     const void *data, int len, void *user)
+static int do_set_xattr(struct receive_writer *w, const char *path,
+			const char *full_path, const char *name,
+			const void *data, int len)
 {
-	int ret = 0;
-	struct btrfs_receive *rctx = user;
-	char full_path[PATH_MAX];
+	int ret;
 
-	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
-	if (ret < 0) {
-		error("set_xattr: path invalid: %s", path);
+	ret = flush_write_buffer(w);
+	if (ret < 0)
 		goto out;
-	}
 
 	if (strcmp("security.capability", name) == 0) {
 		if (g_verbose >= 3)
 			fprintf(stderr, "set_xattr: cache capabilities\n");
-		if (rctx->cached_capabilities_len)
+		if (w->cached_capabilities_len)
 			warning("capabilities set multiple times per file: %s",
 				full_path);
-		if (len > sizeof(rctx->cached_capabilities)) {
+		if (len > sizeof(w->cached_capabilities)) {
 			error("capabilities encoded to %d bytes, buffer too small",
 				len);
 			ret = -E2BIG;
 			goto out;
 		}
-		rctx->cached_capabilities_len = len;
-		memcpy(rctx->cached_capabilities, data, len);
+		w->cached_capabilities_len = len;
+		memcpy(w->cached_capabilities, data, len);
+	}
+
+	ret = lsetxattr(full_path, name, data, len, 0);
+	if (ret < 0) {
+		ret = -errno;
+		error("lsetxattr %s %s=%.*s failed: %m",
+				path, name, len, (char*)data);
+		goto out;
+	}
+
+out:
+	return ret;
+}
+
+static int process_set_xattr(const char *path, const char *name,
+			     const void *data, int len, void *user)
+{
+	int ret = 0;
+	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
+	char full_path[PATH_MAX];
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
+	if (ret < 0) {
+		error("set_xattr: path invalid: %s", path);
+		goto out;
 	}
 
 	if (g_verbose >= 2) {
@@ -866,15 +2210,44 @@ static int process_set_xattr(const char *path, const char *name,
 				len, (char*)data);
 	}
 
-	ret = lsetxattr(full_path, name, data, len, 0);
-	if (ret < 0) {
-		ret = -errno;
-		error("lsetxattr %s %s=%.*s failed: %m",
-				path, name, len, (char*)data);
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_set_xattr(&rctx->writer, path, full_path, name, data,
+				   len);
+		goto out;
+	}
+
+	work = alloc_work(BTRFS_SEND_C_SET_XATTR, path, full_path, len, name);
+	if (!work) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	memcpy(work->data, data, len);
+	work->args.xattr.name = work_extra(work);
+	work->args.xattr.len = len;
+	ret = submit_work(rctx, work);
+
+out:
+	return ret;
+}
+
+static int do_remove_xattr(struct receive_writer *w, const char *path,
+			   const char *full_path, const char *name)
+{
+	int ret;
+
+	ret = flush_write_buffer(w);
+	if (ret < 0)
+		return ret;
+
+	ret = lremovexattr(full_path, name);
+	if (ret < 0) {
+		ret = -errno;
+		error("lremovexattr %s %s failed: %m", path, name);
+	}
 
-out:
 	return ret;
 }
 
@@ -882,8 +2255,13 @@ static int process_remove_xattr(const char *path, const char *name, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("remove_xattr: path invalid: %s", path);
@@ -895,23 +2273,55 @@ static int process_remove_xattr(const char *path, const char *name, void *user)
 				path, name);
 	}
 
-	ret = lremovexattr(full_path, name);
-	if (ret < 0) {
-		ret = -errno;
-		error("lremovexattr %s %s failed: %m", path, name);
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_remove_xattr(&rctx->writer, path, full_path, name);
 		goto out;
 	}
 
+	work = alloc_work(BTRFS_SEND_C_REMOVE_XATTR, path, full_path, 0, name);
+	if (!work) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	work->args.xattr.name = work_extra(work);
+	ret = submit_work(rctx, work);
+
 out:
 	return ret;
 }
 
+static int do_truncate(struct receive_writer *w, const char *path,
+		       const char *full_path, u64 size)
+{
+	int ret;
+
+	ret = flush_write_buffer(w);
+	if (ret < 0)
+		return ret;
+
+	ret = truncate(full_path, size);
+	if (ret < 0) {
+		ret = -errno;
+		error("truncate %s failed: %m", path);
+	}
+
+	return ret;
+}
+
 static int process_truncate(const char *path, u64 size, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("truncate: path invalid: %s", path);
@@ -921,23 +2331,55 @@ static int process_truncate(const char *path, u64 size, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "truncate %s size=%llu\n", path, size);
 
-	ret = truncate(full_path, size);
-	if (ret < 0) {
-		ret = -errno;
-		error("truncate %s failed: %m", path);
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_truncate(&rctx->writer, path, full_path, size);
+		goto out;
+	}
+
+	work = alloc_work(BTRFS_SEND_C_TRUNCATE, path, full_path, 0, NULL);
+	if (!work) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	work->args.size = size;
+	ret = submit_work(rctx, work);
 
 out:
 	return ret;
 }
 
+static int do_chmod(struct receive_writer *w, const char *path,
+		    const char *full_path, u64 mode)
+{
+	int ret;
+
+	ret = flush_write_buffer(w);
+	if (ret < 0)
+		return ret;
+
+	ret = chmod(full_path, mode);
+	if (ret < 0) {
+		ret = -errno;
+		error("chmod %s failed: %m", path);
+	}
+
+	return ret;
+}
+
 static int process_chmod(const char *path, u64 mode, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("chmod: path invalid: %s", path);
@@ -947,13 +2389,58 @@ static int process_chmod(const char *path, u64 mode, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
 
-	ret = chmod(full_path, mode);
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_chmod(&rctx->writer, path, full_path, mode);
+		goto out;
+	}
+
+	work = alloc_work(BTRFS_SEND_C_CHMOD, path, full_path, 0, NULL);
+	if (!work) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	work->args.mode = mode;
+	ret = submit_work(rctx, work);
+
+out:
+	return ret;
+}
+
+static int do_chown(struct receive_writer *w, const char *path,
+		    const char *full_path, u64 uid, u64 gid)
+{
+	int ret;
+
+	ret = flush_write_buffer(w);
+	if (ret < 0)
+		goto out;
+
+	ret = lchown(full_path, uid, gid);
 	if (ret < 0) {
 		ret = -errno;
-		error("chmod %s failed: %m", path);
+		error("chown %s failed: %m", path);
 		goto out;
 	}
 
+	if (w->cached_capabilities_len) {
+		if (g_verbose >= 2)
+			fprintf(stderr, "chown: restore capabilities\n");
+		ret = lsetxattr(full_path, "security.capability",
+				w->cached_capabilities,
+				w->cached_capabilities_len, 0);
+		memset(w->cached_capabilities, 0,
+				sizeof(w->cached_capabilities));
+		w->cached_capabilities_len = 0;
+		if (ret < 0) {
+			ret = -errno;
+			error("restoring capabilities %s: %m", path);
+			goto out;
+		}
+	}
+
 out:
 	return ret;
 }
@@ -962,8 +2449,13 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
 	char full_path[PATH_MAX];
 
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("chown: path invalid: %s", path);
@@ -974,41 +2466,61 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
 				uid, gid);
 
-	ret = lchown(full_path, uid, gid);
-	if (ret < 0) {
-		ret = -errno;
-		error("chown %s failed: %m", path);
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_chown(&rctx->writer, path, full_path, uid, gid);
 		goto out;
 	}
 
-	if (rctx->cached_capabilities_len) {
-		if (g_verbose >= 2)
-			fprintf(stderr, "chown: restore capabilities\n");
-		ret = lsetxattr(full_path, "security.capability",
-				rctx->cached_capabilities,
-				rctx->cached_capabilities_len, 0);
-		memset(rctx->cached_capabilities, 0,
-				sizeof(rctx->cached_capabilities));
-		rctx->cached_capabilities_len = 0;
-		if (ret < 0) {
-			ret = -errno;
-			error("restoring capabilities %s: %m", path);
-			goto out;
-		}
+	work = alloc_work(BTRFS_SEND_C_CHOWN, path, full_path, 0, NULL);
+	if (!work) {
+		ret = -ENOMEM;
+		goto out;
 	}
+	work->args.owner.uid = uid;
+	work->args.owner.gid = gid;
+	ret = submit_work(rctx, work);
 
 out:
 	return ret;
 }
 
+static int do_utimes(struct receive_writer *w, const char *path,
+		     const char *full_path, struct timespec *at,
+		     struct timespec *mt)
+{
+	int ret;
+	struct timespec tv[2];
+
+	ret = flush_write_buffer(w);
+	if (ret < 0)
+		return ret;
+
+	tv[0] = *at;
+	tv[1] = *mt;
+	ret = utimensat(AT_FDCWD, full_path, tv, AT_SYMLINK_NOFOLLOW);
+	if (ret < 0) {
+		ret = -errno;
+		error("utimes %s failed: %m", path);
+	}
+
+	return ret;
+}
+
 static int process_utimes(const char *path, struct timespec *at,
 			  struct timespec *mt, struct timespec *ct,
 			  void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_work *work;
 	char full_path[PATH_MAX];
-	struct timespec tv[2];
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -1019,14 +2531,22 @@ static int process_utimes(const char *path, struct timespec *at,
 	if (g_verbose >= 2)
 		fprintf(stderr, "utimes %s\n", path);
 
-	tv[0] = *at;
-	tv[1] = *mt;
-	ret = utimensat(AT_FDCWD, full_path, tv, AT_SYMLINK_NOFOLLOW);
-	if (ret < 0) {
-		ret = -errno;
-		error("utimes %s failed: %m", path);
+	if (replay_skip(rctx, AT_FDCWD, full_path, 0))
+		goto out;
+
+	if (!rctx->pool) {
+		ret = do_utimes(&rctx->writer, path, full_path, at, mt);
+		goto out;
+	}
+
+	work = alloc_work(BTRFS_SEND_C_UTIMES, path, full_path, 0, NULL);
+	if (!work) {
+		ret = -ENOMEM;
 		goto out;
 	}
+	work->args.times.at = *at;
+	work->args.times.mt = *mt;
+	ret = submit_work(rctx, work);
 
 out:
 	return ret;
@@ -1035,6 +2555,13 @@ out:
 static int process_update_extent(const char *path, u64 offset, u64 len,
 		void *user)
 {
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	ret = begin_cmd(rctx);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	if (g_verbose >= 2)
 		fprintf(stderr, "update_extent %s: offset=%llu, len=%llu\n",
 				path, (unsigned long long)offset,
@@ -1047,6 +2574,41 @@ static int process_update_extent(const char *path, u64 offset, u64 len,
 	return 0;
 }
 
+static int execute_work(struct receive_writer *w, struct receive_work *work)
+{
+	switch (work->cmd) {
+	case BTRFS_SEND_C_WRITE:
+		return do_write(w, work->path, work->full_path, work->data,
+				work->args.write.offset, work->args.write.len);
+	case BTRFS_SEND_C_CLONE:
+		return do_clone(w, work->path, work->full_path,
+				work->args.clone.offset, work->args.clone.len,
+				work->args.clone.clone_path,
+				work->args.clone.clone_offset);
+	case BTRFS_SEND_C_SET_XATTR:
+		return do_set_xattr(w, work->path, work->full_path,
+				    work->args.xattr.name, work->data,
+				    work->args.xattr.len);
+	case BTRFS_SEND_C_REMOVE_XATTR:
+		return do_remove_xattr(w, work->path, work->full_path,
+				       work->args.xattr.name);
+	case BTRFS_SEND_C_TRUNCATE:
+		return do_truncate(w, work->path, work->full_path,
+				   work->args.size);
+	case BTRFS_SEND_C_CHMOD:
+		return do_chmod(w, work->path, work->full_path,
+				work->args.mode);
+	case BTRFS_SEND_C_CHOWN:
+		return do_chown(w, work->path, work->full_path,
+				work->args.owner.uid, work->args.owner.gid);
+	case BTRFS_SEND_C_UTIMES:
+		return do_utimes(w, work->path, work->full_path,
+				 &work->args.times.at, &work->args.times.mt);
+	}
+
+	return -EINVAL;
+}
+
 static struct btrfs_send_ops send_ops = {
 	.subvol = process_subvol,
 	.snapshot = process_snapshot,
@@ -1071,6 +2633,29 @@ static struct btrfs_send_ops send_ops = {
 	.update_extent = process_update_extent,
 };
 
+static void print_clone_stats(struct btrfs_receive *rctx)
+{
+	u64 fd_lookups = rctx->writer.clone_fd_lookups;
+	u64 fd_hits = rctx->writer.clone_fd_hits;
+	int i;
+
+	if (!rctx->clone_subvol_lookups)
+		return;
+
+	if (rctx->pool) {
+		for (i = 0; i < rctx->pool->nr_shards; i++) {
+			fd_lookups += rctx->pool->shards[i].writer.clone_fd_lookups;
+			fd_hits += rctx->pool->shards[i].writer.clone_fd_hits;
+		}
+	}
+
+	fprintf(stderr,
+	"clone: %llu commands, source subvolume cache hits %llu%%, source file cache hits %llu%%\n",
+		rctx->clone_subvol_lookups,
+		rctx->clone_subvol_hits * 100 / rctx->clone_subvol_lookups,
+		fd_lookups ? fd_hits * 100 / fd_lookups : 0);
+}
+
 static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 		      char *realmnt, int r_fd, u64 max_errors)
 {
@@ -1080,6 +2665,9 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	char root_subvol_path[PATH_MAX];
 	int end = 0;
 	int iterations = 0;
+	int last_err = 0;
+	u64 flush_errors;
+	u64 errors;
 
 	dest_dir_full_path = realpath(tomnt, NULL);
 	if (!dest_dir_full_path) {
@@ -1173,19 +2761,26 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	if (ret < 0)
 		goto out;
 
+	if (rctx->nr_threads > 1) {
+		ret = receive_pool_start(rctx);
+		if (ret < 0)
+			goto out;
+	}
+
 	while (!end) {
-		if (rctx->cached_capabilities_len) {
-			if (g_verbose >= 3)
-				fprintf(stderr, "clear cached capabilities\n");
-			memset(rctx->cached_capabilities, 0,
-					sizeof(rctx->cached_capabilities));
-			rctx->cached_capabilities_len = 0;
+		clear_cached_capabilities(&rctx->writer);
+		if (rctx->pool) {
+			int i;
+
+			for (i = 0; i < rctx->pool->nr_shards; i++)
+				clear_cached_capabilities(
+						&rctx->pool->shards[i].writer);
 		}
 
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops,
-							 rctx,
-							 rctx->honor_end_cmd,
-							 max_errors);
+		errors = 0;
+		ret = btrfs_read_and_process_send_stream_errors(r_fd,
+					&send_ops, rctx, rctx->honor_end_cmd,
+					max_errors, &errors);
 		if (ret < 0) {
 			if (ret != -ENODATA)
 				goto out;
@@ -1202,20 +2797,58 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 		if (ret > 0)
 			end = 1;
 
-		close_inode_for_write(rctx);
-		ret = finish_subvol(rctx);
-		if (ret < 0)
-			goto out;
+		/*
+		 * Failed writes of the last commands count as errors of the
+		 * stream, like the writes that failed before. The subvolume
+		 * is incomplete then and must not be finished, the receive
+		 * continues with the next stream only with -e below the
+		 * --max-errors and fails at the end.
+		 */
+		ret = receive_flush(rctx, &flush_errors);
+		if (ret < 0) {
+			errors += flush_errors;
+			if ((max_errors > 0 && errors >= max_errors) ||
+			    !rctx->honor_end_cmd)
+				goto out;
+			last_err = ret;
+		}
+		if (rctx->skip_stream || ret < 0) {
+			rctx->cur_subvol_path[0] = 0;
+			rctx->skip_stream = 0;
+		} else {
+			ret = finish_subvol(rctx);
+			if (ret < 0)
+				goto out;
+		}
+		if (!end && !last_err && rctx->nr_cmds > rctx->resume_cmds) {
+			ret = write_checkpoint(rctx);
+			if (ret < 0)
+				goto out;
+		}
 
 		iterations++;
 	}
+
+	if (rctx->nr_cmds < rctx->resume_cmds) {
+		error("stream ended before the checkpoint at command %llu",
+			rctx->resume_cmds);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (last_err) {
+		ret = last_err;
+		goto out;
+	}
+	remove_checkpoint(rctx);
 	ret = 0;
 
+	if (g_verbose >= 1)
+		print_clone_stats(rctx);
+
 out:
-	if (rctx->write_fd != -1) {
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
-	}
+	receive_pool_stop(rctx);
+	release_writer(&rctx->writer);
+	free_clone_subvols(rctx);
 
 	if (rctx->root_path != realmnt)
 		free(rctx->root_path);
@@ -1235,33 +2868,171 @@ out:
 	return ret;
 }
 
+struct receive_decompress {
+	int in_fd;
+	/* Start of the stream already read from a pipe by the detection */
+	struct send_compress_header head;
+	size_t head_len;
+	int pipefd[2];
+	pthread_t thread;
+	int ret;
+};
+
+static void *decompress_worker(void *arg)
+{
+	struct receive_decompress *dc = arg;
+	sigset_t sigs;
+
+	/* Parser may stop before the end, eg. with -e, get EPIPE instead */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	dc->ret = send_decompress_stream(dc->in_fd, dc->pipefd[1], &dc->head,
+					 dc->head_len);
+	close(dc->pipefd[1]);
+	dc->pipefd[1] = -1;
+
+	return NULL;
+}
+
+/*
+ * Decompress the stream from @dc->in_fd in a separate thread, ahead of the
+ * stream parser that reads the returned fd. @dc->head and @dc->head_len are
+ * set by send_compress_detect().
+ */
+static int start_decompress(struct receive_decompress *dc, int in_fd)
+{
+	int ret;
+
+	dc->in_fd = in_fd;
+	ret = pipe(dc->pipefd);
+	if (ret < 0) {
+		ret = -errno;
+		error("pipe failed: %m");
+		return ret;
+	}
+
+	ret = pthread_create(&dc->thread, NULL, decompress_worker, dc);
+	if (ret) {
+		errno = ret;
+		error("thread setup failed: %m");
+		close(dc->pipefd[0]);
+		close(dc->pipefd[1]);
+		return -ret;
+	}
+
+	return dc->pipefd[0];
+}
+
+static int finish_decompress(struct receive_decompress *dc)
+{
+	close(dc->pipefd[0]);
+	pthread_join(dc->thread, NULL);
+	if (dc->ret == -EPIPE)
+		return 0;
+
+	return dc->ret;
+}
+
+/*
+ * Answer --path and --stats from the index of the stream, loaded from
+ * @index_file if it matches the stream or built and saved there
+ */
+static int dump_index(int fd, const char *index_file, const char *path,
+		      int stats)
+{
+	struct send_index idx;
+	int ret = -ENOENT;
+
+	if (index_file) {
+		ret = send_index_read(&idx, index_file);
+		if (ret == 0 && !send_index_match(&idx, fd)) {
+			warning("index %s does not match the stream, rebuilding",
+				index_file);
+			send_index_free(&idx);
+			ret = -ESTALE;
+		} else if (ret < 0 && ret != -ENOENT) {
+			warning("invalid index %s, rebuilding", index_file);
+		}
+	}
+
+	if (ret < 0) {
+		ret = send_index_build(&idx, fd);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot index the stream: %m");
+			return ret;
+		}
+		if (index_file) {
+			ret = send_index_write(&idx, index_file);
+			if (ret < 0)
+				goto out;
+		}
+	}
+
+	if (stats)
+		send_index_print_stats(&idx);
+	if (path) {
+		if (stats)
+			putchar('\n');
+		ret = send_index_dump_path(&idx, fd, path);
+	}
+
+out:
+	send_index_free(&idx);
+	return ret;
+}
+
 int cmd_receive(int argc, char **argv)
 {
 	char *tomnt = NULL;
 	char fromfile[PATH_MAX];
 	char realmnt[PATH_MAX];
 	struct btrfs_receive rctx;
+	struct receive_decompress decompress;
 	int receive_fd = fileno(stdin);
+	int stream_fd;
+	int compressed;
 	u64 max_errors = 1;
+	u64 num;
+	char *checkpoint = NULL;
+	int resume = 0;
+	char *index_file = NULL;
+	char *dump_path = NULL;
+	int stats = 0;
 	int dump = 0;
 	int ret = 0;
 
 	memset(&rctx, 0, sizeof(rctx));
 	rctx.mnt_fd = -1;
-	rctx.write_fd = -1;
+	rctx.writer.rctx = &rctx;
+	rctx.writer.write_fd = -1;
+	rctx.nr_threads = 1;
 	rctx.dest_dir_fd = -1;
 	rctx.dest_dir_chroot = 0;
+	rctx.checkpoint_dir_fd = -1;
+	rctx.checkpoint_fd = -1;
 	realmnt[0] = 0;
 	fromfile[0] = 0;
 
 	optind = 0;
 	while (1) {
 		int c;
-		enum { GETOPT_VAL_DUMP = 257 };
+		enum { GETOPT_VAL_DUMP = 257, GETOPT_VAL_THREADS,
+		       GETOPT_VAL_CHECKPOINT, GETOPT_VAL_RESUME,
+		       GETOPT_VAL_INDEX, GETOPT_VAL_PATH, GETOPT_VAL_STATS };
 		static const struct option long_opts[] = {
 			{ "max-errors", required_argument, NULL, 'E' },
 			{ "chroot", no_argument, NULL, 'C' },
 			{ "dump", no_argument, NULL, GETOPT_VAL_DUMP },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "checkpoint", required_argument, NULL,
+				GETOPT_VAL_CHECKPOINT },
+			{ "resume", no_argument, NULL, GETOPT_VAL_RESUME },
+			{ "index", required_argument, NULL, GETOPT_VAL_INDEX },
+			{ "path", required_argument, NULL, GETOPT_VAL_PATH },
+			{ "stats", no_argument, NULL, GETOPT_VAL_STATS },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -1301,6 +3072,30 @@ int cmd_receive(int argc, char **argv)
 		case GETOPT_VAL_DUMP:
 			dump = 1;
 			break;
+		case GETOPT_VAL_THREADS:
+			num = arg_strtou64(optarg);
+			if (num == 0 || num > 256) {
+				error("number of threads must be between 1 and 256");
+				ret = 1;
+				goto out;
+			}
+			rctx.nr_threads = num;
+			break;
+		case GETOPT_VAL_CHECKPOINT:
+			checkpoint = optarg;
+			break;
+		case GETOPT_VAL_RESUME:
+			resume = 1;
+			break;
+		case GETOPT_VAL_INDEX:
+			index_file = optarg;
+			break;
+		case GETOPT_VAL_PATH:
+			dump_path = optarg;
+			break;
+		case GETOPT_VAL_STATS:
+			stats = 1;
+			break;
 		case '?':
 		default:
 			error("receive args invalid");
@@ -1315,6 +3110,27 @@ int cmd_receive(int argc, char **argv)
 
 	tomnt = argv[optind];
 
+	if (resume && !checkpoint) {
+		error("--resume requires --checkpoint");
+		ret = 1;
+		goto out;
+	}
+	if (dump && checkpoint) {
+		error("--checkpoint cannot be used with --dump");
+		ret = 1;
+		goto out;
+	}
+	if (!dump && (index_file || dump_path || stats)) {
+		error("--index, --path and --stats require --dump");
+		ret = 1;
+		goto out;
+	}
+	if (index_file && !dump_path && !stats) {
+		error("--index requires --path or --stats");
+		ret = 1;
+		goto out;
+	}
+
 	if (fromfile[0]) {
 		receive_fd = open(fromfile, O_RDONLY | O_NOATIME);
 		if (receive_fd < 0) {
@@ -1323,25 +3139,73 @@ int cmd_receive(int argc, char **argv)
 		}
 	}
 
-	if (dump) {
+	compressed = send_compress_detect(receive_fd, &decompress.head,
+					  &decompress.head_len);
+	if (compressed < 0) {
+		errno = -compressed;
+		error("cannot read the stream: %m");
+		ret = 1;
+		goto out_close;
+	}
+	/* The start of a stream from a pipe has been read, pass it on */
+	if (decompress.head_len)
+		compressed = 1;
+	stream_fd = receive_fd;
+	if (compressed) {
+		stream_fd = start_decompress(&decompress, receive_fd);
+		if (stream_fd < 0) {
+			ret = 1;
+			goto out_close;
+		}
+	}
+
+	if (dump_path) {
+		struct stat st;
+
+		if (compressed || fstat(stream_fd, &st) < 0 ||
+		    !S_ISREG(st.st_mode)) {
+			error("--path requires an uncompressed stream file");
+			ret = 1;
+			goto out_decompress;
+		}
+	}
+
+	if (dump && (index_file || dump_path || stats)) {
+		ret = dump_index(stream_fd, index_file, dump_path, stats);
+	} else if (dump) {
 		struct btrfs_dump_send_args dump_args;
 
 		dump_args.root_path[0] = '.';
 		dump_args.root_path[1] = '\0';
 		dump_args.full_subvol_path[0] = '.';
 		dump_args.full_subvol_path[1] = '\0';
-		ret = btrfs_read_and_process_send_stream(receive_fd,
+		ret = btrfs_read_and_process_send_stream(stream_fd,
 				&btrfs_print_send_ops, &dump_args, 0, 0);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to dump the send stream: %m");
 		}
 	} else {
-		ret = do_receive(&rctx, tomnt, realmnt, receive_fd, max_errors);
+		if (checkpoint) {
+			ret = open_checkpoint(&rctx, checkpoint, resume);
+			if (ret < 0)
+				goto out_decompress;
+		}
+		ret = do_receive(&rctx, tomnt, realmnt, stream_fd, max_errors);
 	}
 
+out_decompress:
+
+	if (compressed && finish_decompress(&decompress) < 0)
+		ret = 1;
+
+out_close:
 	if (receive_fd != fileno(stdin))
 		close(receive_fd);
+	if (rctx.checkpoint_fd != -1)
+		close(rctx.checkpoint_fd);
+	if (rctx.checkpoint_dir_fd != -1)
+		close(rctx.checkpoint_dir_fd);
 out:
 
 	return !!ret;
@@ -1373,7 +3237,19 @@ const char * const cmd_receive_usage[] = {
 	"-m ROOTMOUNT     the root mount point of the destination filesystem.",
 	"                 If /proc is not accessible, use this to tell us where",
 	"                 this file system is mounted.",
+	"--threads NUM    apply file data and attributes in NUM threads,",
+	"                 default is 1, do everything in one thread",
+	"--checkpoint FILE",
+	"                 periodically sync the filesystem and record the",
+	"                 progress in FILE, removed after a successful receive",
+	"--resume         skip the commands applied according to the",
+	"                 checkpoint, the same stream must be received again",
 	"--dump           dump stream metadata, one line per operation,",
 	"                 does not require the MOUNT parameter",
+	"--index FILE     with --dump and --path or --stats, use the index of",
+	"                 the stream in FILE, create or update it if it does",
+	"                 not match the stream",
+	"--path PATH      with --dump, print only the commands of PATH",
+	"--stats          with --dump, print statistics of the stream",
 	NULL
 };
@@ -26,6 +26,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
 #include <poll.h>
 #include <sys/file.h>
 #include <uuid/uuid.h>
@@ -36,12 +37,14 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <getopt.h>
 
 #include "ctree.h"
 #include "ioctl.h"
 #include "utils.h"
 #include "volumes.h"
 #include "disk-io.h"
+#include "scrub-offline.h"
 
 #include "commands.h"
 #include "help.h"
@@ -53,6 +56,7 @@ static const char * const scrub_cmd_group_usage[] = {
 
 #define SCRUB_DATA_FILE "/var/lib/btrfs/scrub.status"
 #define SCRUB_PROGRESS_SOCKET_PATH "/var/lib/btrfs/scrub.progress"
+#define SCRUB_PROGRESS_MAP_PATH "/var/lib/btrfs/scrub.mmap"
 #define SCRUB_FILE_VERSION_PREFIX "scrub status"
 #define SCRUB_FILE_VERSION "1"
 
@@ -62,6 +66,8 @@ struct scrub_stats {
 	u64 duration;
 	u64 finished;
 	u64 canceled;
+	/* Stopped at the end of the --window, implies canceled */
+	u64 paused;
 	int in_progress;
 };
 
@@ -74,6 +80,18 @@ struct scrub_stats {
 #define IOPRIO_CLASS_IDLE 3
 #endif
 
+/*
+ * Bytes per second assumed for the first range of a scheduled scrub with a
+ * deadline, low enough for a slow disk
+ */
+#define SCRUB_SCHED_RATE	SZ_64M
+
+/* Device extent, scrubbed by one ioctl when the scrub is scheduled */
+struct scrub_range {
+	u64 start;
+	u64 end;
+};
+
 struct scrub_progress {
 	struct btrfs_ioctl_scrub_args scrub_args;
 	int fd;
@@ -85,6 +103,18 @@ struct scrub_progress {
 	pthread_mutex_t progress_mutex;
 	int ioprio_class;
 	int ioprio_classdata;
+
+	/*
+	 * Scheduled scrub: the ranges are scrubbed in order, throttled to
+	 * limit bytes per second and not started after the deadline. The
+	 * progress of the finished ranges is summed in done, under
+	 * progress_mutex.
+	 */
+	struct scrub_range *ranges;
+	int nr_ranges;
+	u64 limit;
+	time_t deadline;
+	struct btrfs_scrub_progress done;
 };
 
 struct scrub_file_record {
@@ -102,6 +132,7 @@ struct scrub_progress_cycle {
 	struct scrub_progress *progress;
 	struct scrub_progress *shared_progress;
 	pthread_mutex_t *write_mutex;
+	struct scrub_map *map;
 };
 
 struct scrub_fs_stat {
@@ -110,6 +141,49 @@ struct scrub_fs_stat {
 	int i;
 };
 
+/*
+ * Progress of a running scrub in SCRUB_PROGRESS_MAP_PATH.UUID, mapped shared
+ * by the scrub process and any reader:
+ *
+ *   struct scrub_map_header
+ *   struct scrub_map_record for each device
+ *
+ * The scrub process updates each record once a second. The sequence counter
+ * of the record is odd while the record is being updated, a reader copies
+ * the record and retries if the counter was odd or changed meanwhile. The
+ * values are in host byte order, the file is removed when the scrub ends.
+ */
+#define SCRUB_MAP_MAGIC "btrfs-scrub-map"
+#define SCRUB_MAP_VERSION 1
+
+struct scrub_map_header {
+	char magic[sizeof(SCRUB_MAP_MAGIC)];
+	u32 version;
+	u32 record_size;
+	u32 num_devices;
+	/* The scrub process */
+	u32 pid;
+	u8 fsid[BTRFS_FSID_SIZE];
+};
+
+struct scrub_map_record {
+	u64 seq;
+	u64 devid;
+	struct btrfs_scrub_progress p;
+	u64 t_start;
+	u64 t_resumed;
+	u64 duration;
+	u64 canceled;
+	u64 finished;
+	u64 paused;
+};
+
+struct scrub_map {
+	struct scrub_map_header *header;
+	struct scrub_map_record *records;
+	size_t size;
+};
+
 static void print_scrub_full(struct btrfs_scrub_progress *sp)
 {
 	printf("\tdata_extents_scrubbed: %lld\n", sp->data_extents_scrubbed);
@@ -214,6 +288,7 @@ static void add_to_fs_stat(struct btrfs_scrub_progress *p,
 	_SCRUB_FS_STAT_ZMIN(ss, t_resumed, fs_stat);
 	_SCRUB_FS_STAT_ZMAX(ss, duration, fs_stat);
 	_SCRUB_FS_STAT_ZMAX(ss, canceled, fs_stat);
+	_SCRUB_FS_STAT_ZMAX(ss, paused, fs_stat);
 	_SCRUB_FS_STAT_MIN(ss, finished, fs_stat);
 }
 
@@ -252,6 +327,9 @@ static void _print_scrub_ss(struct scrub_stats *ss)
 	strftime(t, sizeof(t), "%M:%S", &tm);
 	if (ss->in_progress)
 		printf(", running for %02u:%s\n", hours, t);
+	else if (ss->paused)
+		printf(" and was paused at the end of its window after %02u:%s\n",
+		       hours, t);
 	else if (ss->canceled)
 		printf(" and was aborted after %02u:%s\n", hours, t);
 	else if (ss->finished)
@@ -303,12 +381,16 @@ static void free_history(struct scrub_file_record **last_scrubs)
  * progress status before exiting.
  */
 static int cancel_fd = -1;
+/* Stops a scheduled scrub that is between two ranges */
+static volatile sig_atomic_t scrub_canceled;
 static void scrub_sigint_record_progress(int signal)
 {
 	int ret;
 
+	scrub_canceled = 1;
 	ret = ioctl(cancel_fd, BTRFS_IOC_SCRUB_CANCEL, NULL);
-	if (ret < 0)
+	/* a scheduled scrub can be between two ranges */
+	if (ret < 0 && errno != ENOTCONN)
 		perror("Scrub cancel failed");
 }
 
@@ -627,6 +709,8 @@ again:
 					(u64 *)&p[curr]->stats);
 			_SCRUB_KVREAD(ret, &i, canceled, avail, l,
 					&p[curr]->stats);
+			_SCRUB_KVREAD(ret, &i, paused, avail, l,
+					&p[curr]->stats);
 			if (ret != 1)
 				_SCRUB_INVALID;
 			++state;
@@ -703,8 +787,12 @@ static struct scrub_progress *scrub_resumed_stats(struct scrub_progress *data,
 	_SCRUB_SUM(dest, data, malloc_errors);
 	_SCRUB_SUM(dest, data, uncorrectable_errors);
 	_SCRUB_SUM(dest, data, corrected_errors);
-	_SCRUB_SUM(dest, data, last_physical);
+	/* last_physical is a device offset, not a counter */
+	dest->scrub_args.progress.last_physical =
+		max(data->resumed->p.last_physical,
+		    data->scrub_args.progress.last_physical);
 	dest->stats.canceled = data->stats.canceled;
+	dest->stats.paused = data->stats.paused;
 	dest->stats.finished = data->stats.finished;
 	dest->stats.t_resumed = data->stats.t_start;
 	dest->stats.t_start = data->resumed->stats.t_start;
@@ -773,6 +861,8 @@ static int scrub_write_file(int fd, const char *fsid,
 		    _SCRUB_KVWRITE_STATS(fd, buf, duration, use) ||
 		    _SCRUB_KVWRITE_STATS(fd, buf, canceled, use) ||
 		    _SCRUB_KVWRITE_STATS(fd, buf, finished, use) ||
+		    (use->stats.paused &&
+		     _SCRUB_KVWRITE_STATS(fd, buf, paused, use)) ||
 		    scrub_write_buf(fd, "\n", 1)) {
 			return -EOVERFLOW;
 		}
@@ -833,13 +923,453 @@ out3:
 	return err;
 }
 
+/*
+ * Read the device extents of devid, each is scrubbed by one ioctl when the
+ * scrub is scheduled
+ */
+static int scrub_load_ranges(int fd, u64 devid, struct scrub_range **ranges,
+			     int *nr_ranges)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct scrub_range *tmp;
+	int alloc = 0;
+	int ret;
+
+	*ranges = NULL;
+	*nr_ranges = 0;
+
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = BTRFS_DEV_TREE_OBJECTID;
+	sk->min_objectid = devid;
+	sk->max_objectid = devid;
+	sk->max_type = BTRFS_DEV_EXTENT_KEY;
+	sk->min_type = BTRFS_DEV_EXTENT_KEY;
+	sk->min_offset = 0;
+	sk->max_offset = (u64)-1;
+	sk->min_transid = 0;
+	sk->max_transid = (u64)-1;
+	sk->nr_items = 4096;
+
+	while (1) {
+		int i;
+		struct btrfs_ioctl_search_header *sh;
+		unsigned long off = 0;
+
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+		if (ret < 0) {
+			ret = -errno;
+			goto fail;
+		}
+
+		if (sk->nr_items == 0)
+			break;
+
+		for (i = 0; i < sk->nr_items; i++) {
+			struct btrfs_dev_extent *extent;
+
+			sh = (struct btrfs_ioctl_search_header *)(args.buf +
+								  off);
+			off += sizeof(*sh);
+			extent = (struct btrfs_dev_extent *)(args.buf + off);
+			off += btrfs_search_header_len(sh);
+
+			sk->min_objectid = btrfs_search_header_objectid(sh);
+			sk->min_type = btrfs_search_header_type(sh);
+			sk->min_offset = btrfs_search_header_offset(sh) + 1;
+
+			if (btrfs_search_header_objectid(sh) != devid ||
+			    btrfs_search_header_type(sh) != BTRFS_DEV_EXTENT_KEY)
+				continue;
+
+			if (*nr_ranges == alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				tmp = realloc(*ranges, alloc * sizeof(*tmp));
+				if (!tmp) {
+					ret = -ENOMEM;
+					goto fail;
+				}
+				*ranges = tmp;
+			}
+			tmp = &(*ranges)[(*nr_ranges)++];
+			tmp->start = btrfs_search_header_offset(sh);
+			tmp->end = tmp->start +
+				   btrfs_stack_dev_extent_length(extent);
+		}
+
+		if (sk->min_type != BTRFS_DEV_EXTENT_KEY ||
+		    sk->min_objectid != devid)
+			break;
+	}
+
+	return 0;
+
+fail:
+	free(*ranges);
+	*ranges = NULL;
+	*nr_ranges = 0;
+	return ret;
+}
+
+static void scrub_add_progress(struct btrfs_scrub_progress *dest,
+			       struct btrfs_scrub_progress *p)
+{
+	dest->data_extents_scrubbed += p->data_extents_scrubbed;
+	dest->tree_extents_scrubbed += p->tree_extents_scrubbed;
+	dest->data_bytes_scrubbed += p->data_bytes_scrubbed;
+	dest->tree_bytes_scrubbed += p->tree_bytes_scrubbed;
+	dest->read_errors += p->read_errors;
+	dest->csum_errors += p->csum_errors;
+	dest->verify_errors += p->verify_errors;
+	dest->no_csum += p->no_csum;
+	dest->csum_discards += p->csum_discards;
+	/* the superblocks are scrubbed by each ioctl */
+	dest->super_errors = max(dest->super_errors, p->super_errors);
+	dest->malloc_errors += p->malloc_errors;
+	dest->uncorrectable_errors += p->uncorrectable_errors;
+	dest->unverified_errors += p->unverified_errors;
+	dest->corrected_errors += p->corrected_errors;
+	dest->last_physical = max(dest->last_physical, p->last_physical);
+}
+
+/* Sleep until the given time, returns 1 if canceled meanwhile */
+static int scrub_sched_sleep(struct timeval *until)
+{
+	struct timeval tv;
+	u64 usec;
+
+	while (!scrub_canceled) {
+		gettimeofday(&tv, NULL);
+		if (timercmp(&tv, until, >=))
+			return 0;
+		usec = (until->tv_sec - tv.tv_sec) * 1000000ULL +
+		       until->tv_usec - tv.tv_usec;
+		usleep(min_t(u64, usec, 1000000));
+	}
+	return 1;
+}
+
+/*
+ * Scrub the ranges of the device one by one, starting at scrub_args.start.
+ * Sleep after each range so the scrubbed bytes stay under the limit and
+ * don't start a range that is not expected to finish before the deadline,
+ * the time per range is estimated from the ranges scrubbed so far. Nothing
+ * is known before the first range, it is expected to run at
+ * SCRUB_SCHED_RATE or the limit if that is lower.
+ *
+ * Returns the ioctl result, sets paused if the deadline was reached.
+ */
+static int scrub_sched_dev(struct scrub_progress *sp, int *paused)
+{
+	struct btrfs_ioctl_scrub_args args = sp->scrub_args;
+	struct timeval t_start;
+	struct timeval tv;
+	u64 pos = sp->scrub_args.start;
+	u64 scrubbed = 0;
+	u64 covered = 0;
+	u64 elapsed;
+	u64 len;
+	int ret = 0;
+	int i;
+
+	gettimeofday(&t_start, NULL);
+	for (i = 0; i < sp->nr_ranges; i++) {
+		struct scrub_range *r = &sp->ranges[i];
+
+		if (r->end <= pos)
+			continue;
+		if (scrub_canceled) {
+			errno = ECANCELED;
+			ret = -1;
+			break;
+		}
+
+		args.start = max(r->start, pos);
+		args.end = r->end - 1;
+		len = r->end - args.start;
+
+		gettimeofday(&tv, NULL);
+		if (sp->deadline) {
+			u64 estimate;
+
+			elapsed = (tv.tv_sec - t_start.tv_sec) * 1000000ULL +
+				  tv.tv_usec - t_start.tv_usec;
+			if (covered)
+				estimate = (double)elapsed / covered * len /
+					   1000000;
+			else if (sp->limit && sp->limit < SCRUB_SCHED_RATE)
+				estimate = len / sp->limit;
+			else
+				estimate = len / SCRUB_SCHED_RATE;
+			if (tv.tv_sec + estimate >= sp->deadline) {
+				if (!covered)
+					warning(
+"devid %llu: the window is too short for the chunk at %llu, not started",
+						args.devid, args.start);
+				*paused = 1;
+				break;
+			}
+		}
+
+		memset(&args.progress, 0, sizeof(args.progress));
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &args);
+		if (pthread_mutex_lock(&sp->progress_mutex) == 0) {
+			scrub_add_progress(&sp->done, &args.progress);
+			if (!ret)
+				sp->done.last_physical = r->end;
+			pthread_mutex_unlock(&sp->progress_mutex);
+		}
+		if (ret)
+			break;
+
+		pos = r->end;
+		covered += len;
+		scrubbed += args.progress.data_bytes_scrubbed +
+			    args.progress.tree_bytes_scrubbed;
+
+		if (sp->limit) {
+			elapsed = scrubbed * 1000000 / sp->limit;
+			tv.tv_sec = t_start.tv_sec + elapsed / 1000000;
+			tv.tv_usec = t_start.tv_usec + elapsed % 1000000;
+			if (tv.tv_usec >= 1000000) {
+				tv.tv_sec++;
+				tv.tv_usec -= 1000000;
+			}
+			if (sp->deadline && tv.tv_sec > sp->deadline)
+				tv.tv_sec = sp->deadline;
+			scrub_sched_sleep(&tv);
+		}
+	}
+
+	sp->scrub_args.progress = sp->done;
+	return ret;
+}
+
+static size_t scrub_map_size(u32 num_devices)
+{
+	return sizeof(struct scrub_map_header) +
+	       num_devices * sizeof(struct scrub_map_record);
+}
+
+/*
+ * Create the progress map of the scrub in this process, the map is complete
+ * before it appears under its name
+ */
+static int scrub_map_create(struct scrub_map *map, const char *fsid,
+			    u8 *fsid_bin, struct scrub_progress *data, int n)
+{
+	char path[PATH_MAX];
+	void *addr;
+	int fd;
+	int ret;
+	int i;
+
+	map->header = NULL;
+	map->size = scrub_map_size(n);
+	ret = scrub_datafile(SCRUB_PROGRESS_MAP_PATH, fsid, "tmp", path,
+			     sizeof(path));
+	if (ret < 0)
+		return ret;
+	unlink(path);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+	if (fd < 0)
+		return -errno;
+	ret = ftruncate(fd, map->size);
+	if (ret < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	addr = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ret = -errno;
+		goto fail;
+	}
+	close(fd);
+
+	map->header = addr;
+	map->records = addr + sizeof(*map->header);
+	memcpy(map->header->magic, SCRUB_MAP_MAGIC, sizeof(SCRUB_MAP_MAGIC));
+	map->header->version = SCRUB_MAP_VERSION;
+	map->header->record_size = sizeof(*map->records);
+	map->header->num_devices = n;
+	map->header->pid = getpid();
+	memcpy(map->header->fsid, fsid_bin, BTRFS_FSID_SIZE);
+	for (i = 0; i < n; i++)
+		map->records[i].devid = data[i].scrub_args.devid;
+
+	ret = scrub_rename_file(SCRUB_PROGRESS_MAP_PATH, fsid, "tmp");
+	if (ret < 0) {
+		munmap(map->header, map->size);
+		map->header = NULL;
+		unlink(path);
+	}
+	return ret;
+
+fail:
+	close(fd);
+	unlink(path);
+	return ret;
+}
+
+static void scrub_map_remove(struct scrub_map *map, const char *fsid)
+{
+	char path[PATH_MAX];
+
+	if (!map->header)
+		return;
+	if (scrub_datafile(SCRUB_PROGRESS_MAP_PATH, fsid, NULL, path,
+			   sizeof(path)) == 0)
+		unlink(path);
+	munmap(map->header, map->size);
+	map->header = NULL;
+}
+
+static void scrub_map_update(struct scrub_map *map,
+			     struct scrub_progress *data, int n)
+{
+	struct scrub_map_record *rec;
+	struct scrub_progress local;
+	struct scrub_progress *use;
+	u64 seq;
+	int i;
+
+	if (!map->header)
+		return;
+
+	for (i = 0; i < n; i++) {
+		rec = &map->records[i];
+		use = scrub_resumed_stats(&data[i], &local);
+
+		seq = rec->seq;
+		__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		rec->p = use->scrub_args.progress;
+		rec->t_start = use->stats.t_start;
+		rec->t_resumed = use->stats.t_resumed;
+		rec->duration = use->stats.duration;
+		rec->canceled = use->stats.canceled;
+		rec->finished = use->stats.finished;
+		rec->paused = use->stats.paused;
+		__atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Read the progress map of a running scrub in the format of the status file,
+ * returns NULL if there is no map or the scrub process is gone
+ */
+static struct scrub_file_record **scrub_read_map(const char *fsid)
+{
+	struct scrub_file_record **p = NULL;
+	struct scrub_map_header *header;
+	struct scrub_map_record *records;
+	struct scrub_map_record rec;
+	char path[PATH_MAX];
+	struct stat st;
+	void *addr = MAP_FAILED;
+	u64 seq;
+	u32 i;
+	int retries;
+	int fd;
+
+	if (scrub_datafile(SCRUB_PROGRESS_MAP_PATH, fsid, NULL, path,
+			   sizeof(path)) < 0)
+		return NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header))
+		goto out;
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto out;
+
+	header = addr;
+	records = addr + sizeof(*header);
+	if (memcmp(header->magic, SCRUB_MAP_MAGIC, sizeof(SCRUB_MAP_MAGIC)) ||
+	    header->version != SCRUB_MAP_VERSION ||
+	    header->record_size != sizeof(rec) ||
+	    st.st_size < scrub_map_size(header->num_devices))
+		goto out;
+	if (kill(header->pid, 0) < 0 && errno == ESRCH)
+		goto out;
+
+	p = calloc(header->num_devices + 1, sizeof(*p));
+	if (!p)
+		goto out;
+	for (i = 0; i < header->num_devices; i++) {
+		/* the writer could have died in the middle of an update */
+		retries = 1000;
+		do {
+			if (!retries--) {
+				free_history(p);
+				p = NULL;
+				goto out;
+			}
+			seq = __atomic_load_n(&records[i].seq,
+					      __ATOMIC_ACQUIRE);
+			memcpy(&rec, &records[i], sizeof(rec));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) ||
+			 seq != __atomic_load_n(&records[i].seq,
+						__ATOMIC_RELAXED));
+
+		p[i] = calloc(1, sizeof(**p));
+		if (!p[i]) {
+			free_history(p);
+			p = NULL;
+			goto out;
+		}
+		memcpy(p[i]->fsid, header->fsid, BTRFS_FSID_SIZE);
+		p[i]->devid = rec.devid;
+		p[i]->p = rec.p;
+		p[i]->stats.t_start = rec.t_start;
+		p[i]->stats.t_resumed = rec.t_resumed;
+		p[i]->stats.duration = rec.duration;
+		p[i]->stats.canceled = rec.canceled;
+		p[i]->stats.finished = rec.finished;
+		p[i]->stats.paused = rec.paused;
+	}
+
+out:
+	if (addr != MAP_FAILED)
+		munmap(addr, st.st_size);
+	close(fd);
+	return p;
+}
+
+/* Return the pid of the scrub process that has a progress map, 0 if none */
+static pid_t scrub_map_pid(const char *fsid)
+{
+	struct scrub_map_header header;
+	char path[PATH_MAX];
+	pid_t pid = 0;
+	int fd;
+
+	if (scrub_datafile(SCRUB_PROGRESS_MAP_PATH, fsid, NULL, path,
+			   sizeof(path)) < 0)
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+	    !memcmp(header.magic, SCRUB_MAP_MAGIC, sizeof(SCRUB_MAP_MAGIC)) &&
+	    header.version == SCRUB_MAP_VERSION && header.pid &&
+	    kill(header.pid, 0) == 0)
+		pid = header.pid;
+	close(fd);
+	return pid;
+}
+
 static void *scrub_one_dev(void *ctx)
 {
 	struct scrub_progress *sp = ctx;
 	int ret;
+	int paused = 0;
 	struct timeval tv;
 
 	sp->stats.canceled = 0;
+	sp->stats.paused = 0;
 	sp->stats.duration = 0;
 	sp->stats.finished = 0;
 
@@ -849,12 +1379,16 @@ static void *scrub_one_dev(void *ctx)
 	if (ret)
 		warning("setting ioprio failed: %m (ignored)");
 
-	ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
+	if (sp->ranges)
+		ret = scrub_sched_dev(sp, &paused);
+	else
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
+	sp->ioctl_errno = errno;
 	gettimeofday(&tv, NULL);
 	sp->ret = ret;
 	sp->stats.duration = tv.tv_sec - sp->stats.t_start;
-	sp->stats.canceled = !!ret;
-	sp->ioctl_errno = errno;
+	sp->stats.canceled = !!ret || paused;
+	sp->stats.paused = paused;
 	ret = pthread_mutex_lock(&sp->progress_mutex);
 	if (ret)
 		return ERR_PTR(-ret);
@@ -876,6 +1410,31 @@ static void *progress_one_dev(void *ctx)
 	return NULL;
 }
 
+/*
+ * The kernel reports the progress of the range that is being scrubbed, add
+ * the ranges finished before. Between two ranges no scrub is running, report
+ * just the finished ranges then.
+ */
+static int progress_sched_dev(struct scrub_progress *sp,
+			      struct scrub_progress *sp_shared)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&sp_shared->progress_mutex);
+	if (ret)
+		return ret;
+	if (sp->ret && sp->ioctl_errno == ENOTCONN &&
+	    !sp_shared->stats.finished) {
+		memset(&sp->scrub_args.progress, 0,
+		       sizeof(sp->scrub_args.progress));
+		sp->ret = 0;
+	}
+	if (!sp->ret)
+		scrub_add_progress(&sp->scrub_args.progress,
+				   &sp_shared->done);
+	return pthread_mutex_unlock(&sp_shared->progress_mutex);
+}
+
 /* nb: returns a negative errno via ERR_PTR */
 static void *scrub_progress_cycle(void *ctx)
 {
@@ -892,6 +1451,7 @@ static void *scrub_progress_cycle(void *ctx)
 	int ndev = spc->fi->num_devices;
 	int this = 1;
 	int last = 0;
+	int cycle = 0;
 	int peer_fd = -1;
 	struct pollfd accept_poll_fd = {
 		.fd = spc->prg_fd,
@@ -927,7 +1487,7 @@ static void *scrub_progress_cycle(void *ctx)
 	}
 
 	while (1) {
-		ret = poll(&accept_poll_fd, 1, 5 * 1000);
+		ret = poll(&accept_poll_fd, 1, 1000);
 		if (ret == -1) {
 			ret = -errno;
 			goto out;
@@ -946,6 +1506,19 @@ static void *scrub_progress_cycle(void *ctx)
 				continue;
 			progress_one_dev(sp);
 			sp->stats.duration = tv.tv_sec - sp->stats.t_start;
+			if (sp_shared->ranges) {
+				perr = pthread_setcancelstate(
+						PTHREAD_CANCEL_DISABLE, &old);
+				if (perr)
+					goto out;
+				perr = progress_sched_dev(sp, sp_shared);
+				if (perr)
+					goto out;
+				perr = pthread_setcancelstate(
+						PTHREAD_CANCEL_ENABLE, &old);
+				if (perr)
+					goto out;
+			}
 			if (!sp->ret)
 				continue;
 			if (sp->ioctl_errno != ENOTCONN &&
@@ -1005,7 +1578,15 @@ static void *scrub_progress_cycle(void *ctx)
 			close(peer_fd);
 			peer_fd = -1;
 		}
-		if (!spc->do_record)
+		perr = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+		if (perr)
+			goto out;
+		scrub_map_update(spc->map, &spc->progress[this * ndev], ndev);
+		perr = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+		if (perr)
+			goto out;
+		/* the status file is written every 5 seconds */
+		if (!spc->do_record || ++cycle % 5)
 			continue;
 		ret = scrub_write_progress(spc->write_mutex, fsid,
 					   &spc->progress[this * ndev], ndev);
@@ -1092,6 +1673,136 @@ static int is_scrub_running_in_kernel(int fd,
 	return 0;
 }
 
+/*
+ * Scrub the unmounted filesystem on device @path and print the result like
+ * 'scrub start -B' does.
+ */
+static int scrub_start_offline(const char *path, int readonly,
+			       int do_stats_per_dev, int print_raw,
+			       int do_quiet)
+{
+	struct btrfs_fs_info *fs_info;
+	struct scrub_offline_dev *devs = NULL;
+	struct btrfs_scrub_progress *p;
+	struct scrub_fs_stat fs_stat;
+	struct scrub_stats ss;
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	unsigned ctree_flags = OPEN_CTREE_EXCLUSIVE;
+	int e_uncorrectable = 0;
+	int e_correctable = 0;
+	int nr_devs = 0;
+	int ret;
+	int i;
+
+	ret = check_mounted(path);
+	if (ret < 0) {
+		errno = -ret;
+		error_on(!do_quiet, "could not check mount status: %m");
+		return 1;
+	} else if (ret) {
+		error_on(!do_quiet,
+			 "%s is mounted, scrub the mount point without --offline",
+			 path);
+		return 1;
+	}
+
+	if (!readonly)
+		ctree_flags |= OPEN_CTREE_WRITES;
+	fs_info = open_ctree_fs_info(path, 0, 0, 0, ctree_flags);
+	if (!fs_info) {
+		error_on(!do_quiet, "cannot open the filesystem on %s", path);
+		return 1;
+	}
+	uuid_unparse(fs_info->fs_devices->fsid, fsid);
+
+	memset(&ss, 0, sizeof(ss));
+	ss.t_start = time(NULL);
+	ret = scrub_offline(fs_info, readonly, do_quiet, &devs, &nr_devs);
+	ss.duration = time(NULL) - ss.t_start;
+	close_ctree_fs_info(fs_info);
+	if (ret) {
+		errno = -ret;
+		error_on(!do_quiet, "scrub failed: %m");
+		return 1;
+	}
+	ss.finished = 1;
+
+	if (!do_stats_per_dev)
+		init_fs_stat(&fs_stat);
+	for (i = 0; i < nr_devs; i++) {
+		p = &devs[i].progress;
+		if (p->uncorrectable_errors > 0)
+			e_uncorrectable++;
+		if (p->corrected_errors > 0 || p->unverified_errors > 0)
+			e_correctable++;
+		if (do_quiet)
+			continue;
+		if (devs[i].missing) {
+			warning("device %llu is missing and was not scrubbed",
+				devs[i].info.devid);
+			if (do_stats_per_dev)
+				print_scrub_dev(&devs[i].info, NULL, print_raw,
+						"missing", NULL);
+		} else if (do_stats_per_dev) {
+			print_scrub_dev(&devs[i].info, p, print_raw, "done",
+					&ss);
+		} else {
+			add_to_fs_stat(p, &ss, &fs_stat);
+		}
+	}
+	if (!do_quiet && !do_stats_per_dev) {
+		printf("scrub done for %s\n", fsid);
+		print_fs_stat(&fs_stat, print_raw);
+	}
+	free(devs);
+
+	if (e_uncorrectable) {
+		error_on(!do_quiet, "there are uncorrectable errors");
+		return 3;
+	}
+	if (e_correctable)
+		warning_on(!do_quiet,
+			"errors detected during scrubbing, corrected");
+	return 0;
+}
+
+/* Parse a time like 90, 30m, 2h or 1d, in seconds */
+static u64 parse_window(const char *s)
+{
+	char *end;
+	u64 ret;
+
+	ret = strtoull(s, &end, 10);
+	if (end == s || s[0] == '-')
+		goto invalid;
+	switch (*end) {
+	case 'd':
+		ret *= 24;
+		/* fall through */
+	case 'h':
+		ret *= 60;
+		/* fall through */
+	case 'm':
+		ret *= 60;
+		/* fall through */
+	case 's':
+		end++;
+		/* fall through */
+	case 0:
+		break;
+	default:
+		goto invalid;
+	}
+	if (*end || !ret)
+		goto invalid;
+	return ret;
+
+invalid:
+	error("invalid window '%s', use seconds or a number with s, m, h or d",
+	      s);
+	exit(1);
+}
+
 static const char * const cmd_scrub_start_usage[];
 static const char * const cmd_scrub_resume_usage[];
 
@@ -1137,14 +1848,36 @@ static int scrub_start(int argc, char **argv, int resume)
 	char fsid[BTRFS_UUID_UNPARSED_SIZE];
 	char sock_path[PATH_MAX] = "";
 	struct scrub_progress_cycle spc;
+	struct scrub_map map = { NULL };
 	pthread_mutex_t spc_write_mutex = PTHREAD_MUTEX_INITIALIZER;
 	void *terr;
 	u64 devid;
 	DIR *dirstream = NULL;
 	int force = 0;
 	int nothing_to_resume = 0;
+	int offline = 0;
+	int do_continue = 0;
+	int n_paused = 0;
+	u64 limit = 0;
+	u64 window = 0;
+
+	while (1) {
+		enum {
+			GETOPT_VAL_OFFLINE = 256,
+			GETOPT_VAL_LIMIT,
+			GETOPT_VAL_WINDOW,
+		};
+		static const struct option long_options[] = {
+			{ "offline", no_argument, NULL, GETOPT_VAL_OFFLINE },
+			{ "limit", required_argument, NULL, GETOPT_VAL_LIMIT },
+			{ "window", required_argument, NULL, GETOPT_VAL_WINDOW },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "BdqrRc:n:f", long_options, NULL);
+		if (c < 0)
+			break;
 
-	while ((c = getopt(argc, argv, "BdqrRc:n:f")) != -1) {
 		switch (c) {
 		case 'B':
 			do_background = 0;
@@ -1172,6 +1905,18 @@ static int scrub_start(int argc, char **argv, int resume)
 		case 'f':
 			force = 1;
 			break;
+		case GETOPT_VAL_LIMIT:
+			limit = parse_size(optarg);
+			break;
+		case GETOPT_VAL_WINDOW:
+			window = parse_window(optarg);
+			break;
+		case GETOPT_VAL_OFFLINE:
+			if (!resume) {
+				offline = 1;
+				break;
+			}
+			/* fall through */
 		case '?':
 		default:
 			usage(resume ? cmd_scrub_resume_usage :
@@ -1186,6 +1931,19 @@ static int scrub_start(int argc, char **argv, int resume)
 					cmd_scrub_start_usage);
 	}
 
+	if (offline && (limit || window)) {
+		error("--limit and --window cannot be used with --offline");
+		free(datafile);
+		return 1;
+	}
+
+	if (offline) {
+		free(datafile);
+		return scrub_start_offline(argv[optind], readonly,
+					   do_stats_per_dev, print_raw,
+					   do_quiet);
+	}
+
 	spc.progress = NULL;
 	if (do_quiet && do_print)
 		do_print = 0;
@@ -1270,6 +2028,19 @@ static int scrub_start(int argc, char **argv, int resume)
 		goto out;
 	}
 
+	/*
+	 * A new scrub with a window continues the last one if that stopped at
+	 * the end of its window, like resume
+	 */
+	if (window && !resume && !IS_ERR_OR_NULL(past_scrubs)) {
+		for (i = 0; i < fi_args.num_devices; ++i) {
+			last_scrub = last_dev_scrub(past_scrubs,
+						    di_args[i].devid);
+			if (last_scrub && last_scrub->stats.paused)
+				do_continue = 1;
+		}
+	}
+
 	for (i = 0; i < fi_args.num_devices; ++i) {
 		devid = di_args[i].devid;
 		ret = pthread_mutex_init(&sp[i].progress_mutex, NULL);
@@ -1282,12 +2053,13 @@ static int scrub_start(int argc, char **argv, int resume)
 		last_scrub = last_dev_scrub(past_scrubs, devid);
 		sp[i].scrub_args.devid = devid;
 		sp[i].fd = fdmnt;
-		if (resume && last_scrub && (last_scrub->stats.canceled ||
-					     !last_scrub->stats.finished)) {
+		if ((resume || do_continue) && last_scrub &&
+		    (last_scrub->stats.canceled ||
+		     !last_scrub->stats.finished)) {
 			++n_resume;
 			sp[i].scrub_args.start = last_scrub->p.last_physical;
 			sp[i].resumed = last_scrub;
-		} else if (resume) {
+		} else if (resume || do_continue) {
 			++n_skip;
 			sp[i].skip = 1;
 			sp[i].resumed = last_scrub;
@@ -1302,6 +2074,19 @@ static int scrub_start(int argc, char **argv, int resume)
 		sp[i].scrub_args.flags = readonly ? BTRFS_SCRUB_READONLY : 0;
 		sp[i].ioprio_class = ioprio_class;
 		sp[i].ioprio_classdata = ioprio_classdata;
+		if (!limit && !window)
+			continue;
+		ret = scrub_load_ranges(fdmnt, devid, &sp[i].ranges,
+					&sp[i].nr_ranges);
+		if (ret) {
+			errno = -ret;
+			error_on(!do_quiet,
+				"cannot read device extents of devid %llu: %m",
+				devid);
+			err = 1;
+			goto out;
+		}
+		sp[i].limit = limit;
 	}
 
 	if (!n_start && !n_resume) {
@@ -1405,6 +2190,12 @@ static int scrub_start(int argc, char **argv, int resume)
 
 	scrub_handle_sigint_child(fdmnt);
 
+	if (window) {
+		gettimeofday(&tv, NULL);
+		for (i = 0; i < fi_args.num_devices; ++i)
+			sp[i].deadline = tv.tv_sec + window;
+	}
+
 	for (i = 0; i < fi_args.num_devices; ++i) {
 		if (sp[i].skip) {
 			sp[i].scrub_args.progress = sp[i].resumed->p;
@@ -1430,6 +2221,15 @@ static int scrub_start(int argc, char **argv, int resume)
 		}
 	}
 
+	ret = scrub_map_create(&map, fsid, fi_args.fsid, sp,
+			       fi_args.num_devices);
+	if (ret) {
+		errno = -ret;
+		warning_on(do_print,
+	"failed to create the progress map: %m. Progress is served by the socket only");
+	}
+
+	spc.map = &map;
 	spc.fdmnt = fdmnt;
 	spc.prg_fd = prg_fd;
 	spc.do_record = do_record;
@@ -1484,6 +2284,8 @@ static int scrub_start(int argc, char **argv, int resume)
 				continue;
 			}
 		}
+		if (sp[i].stats.paused)
+			n_paused++;
 		if (sp[i].scrub_args.progress.uncorrectable_errors > 0)
 			e_uncorrectable++;
 		if (sp[i].scrub_args.progress.corrected_errors > 0
@@ -1500,11 +2302,16 @@ static int scrub_start(int argc, char **argv, int resume)
 				print_scrub_dev(&di_args[i],
 						&sp[i].scrub_args.progress,
 						print_raw,
-						sp[i].ret ? "canceled" : "done",
+						sp[i].ret ? "canceled" :
+						sp[i].stats.paused ? "paused" :
+						"done",
 						&sp[i].stats);
 			} else {
 				if (sp[i].ret)
 					append = "canceled";
+				else if (sp[i].stats.paused &&
+					 strcmp(append, "canceled"))
+					append = "paused";
 				add_to_fs_stat(&sp[i].scrub_args.progress,
 						&sp[i].stats, &fs_stat);
 			}
@@ -1546,6 +2353,11 @@ out:
 	free_history(past_scrubs);
 	free(di_args);
 	free(t_devs);
+	scrub_map_remove(&map, fsid);
+	if (sp) {
+		for (i = 0; i < fi_args.num_devices; ++i)
+			free(sp[i].ranges);
+	}
 	free(sp);
 	free(spc.progress);
 	if (prg_fd > -1) {
@@ -1566,12 +2378,17 @@ out:
 	if (e_correctable)
 		warning_on(!do_quiet,
 			"errors detected during scrubbing, corrected");
+	if (n_paused && do_print)
+		printf(
+	"scrub paused at the end of the window, run it again to continue\n");
 
 	return 0;
 }
 
 static const char * const cmd_scrub_start_usage[] = {
-	"btrfs scrub start [-BdqrRf] [-c ioprio_class -n ioprio_classdata] <path>|<device>",
+	"btrfs scrub start [-BdqrRf] [-c ioprio_class -n ioprio_classdata]\n"
+	"                  [--limit <bytes>] [--window <time>] <path>|<device>\n"
+	"btrfs scrub start --offline [-dqrR] <device>",
 	"Start a new scrub. If a scrub is already running, the new one fails.",
 	"",
 	"-B     do not background",
@@ -1583,6 +2400,13 @@ static const char * const cmd_scrub_start_usage[] = {
 	"-n     set ioprio classdata (see ionice(1) manpage)",
 	"-f     force starting new scrub even if a scrub is already running",
 	"       this is useful when scrub stats record file is damaged",
+	"--limit <bytes>",
+	"       scrub each device chunk by chunk, at most <bytes> per second",
+	"--window <time>",
+	"       scrub each device chunk by chunk and pause when <time> (like 90m",
+	"       or 2h) is over, the next start with --window continues",
+	"--offline",
+	"       scrub the unmounted filesystem on <device> in the foreground",
 	NULL
 };
 
@@ -1599,8 +2423,12 @@ static const char * const cmd_scrub_cancel_usage[] = {
 
 static int cmd_scrub_cancel(int argc, char **argv)
 {
+	struct btrfs_ioctl_fs_info_args fi_args;
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
 	char *path;
+	pid_t pid;
 	int ret;
+	int i;
 	int fdmnt = -1;
 	DIR *dirstream = NULL;
 
@@ -1619,6 +2447,24 @@ static int cmd_scrub_cancel(int argc, char **argv)
 
 	ret = ioctl(fdmnt, BTRFS_IOC_SCRUB_CANCEL, NULL);
 
+	/*
+	 * A scheduled scrub is not running in the kernel between two ranges,
+	 * interrupt the scrub process then, like ctrl-c, and give it some
+	 * time to record its status
+	 */
+	if (ret < 0 && errno == ENOTCONN &&
+	    ioctl(fdmnt, BTRFS_IOC_FS_INFO, &fi_args) == 0) {
+		uuid_unparse(fi_args.fsid, fsid);
+		pid = scrub_map_pid(fsid);
+		if (pid && kill(pid, SIGINT) == 0) {
+			for (i = 0; i < 100 && kill(pid, 0) == 0; i++)
+				usleep(100000);
+			ret = 0;
+		} else {
+			errno = ENOTCONN;
+		}
+	}
+
 	if (ret < 0) {
 		error("scrub cancel failed on %s: %s", path,
 			errno == ENOTCONN ? "not running" : strerror(errno));
@@ -1638,7 +2484,8 @@ out:
 }
 
 static const char * const cmd_scrub_resume_usage[] = {
-	"btrfs scrub resume [-BdqrR] [-c ioprio_class -n ioprio_classdata] <path>|<device>",
+	"btrfs scrub resume [-BdqrR] [-c ioprio_class -n ioprio_classdata]\n"
+	"                   [--limit <bytes>] [--window <time>] <path>|<device>",
 	"Resume previously canceled or interrupted scrub",
 	"",
 	"-B     do not background",
@@ -1648,6 +2495,10 @@ static const char * const cmd_scrub_resume_usage[] = {
 	"-R     raw print mode, print full data instead of summary",
 	"-c     set ioprio class (see ionice(1) manpage)",
 	"-n     set ioprio classdata (see ionice(1) manpage)",
+	"--limit <bytes>",
+	"       scrub each device chunk by chunk, at most <bytes> per second",
+	"--window <time>",
+	"       scrub each device chunk by chunk and pause when <time> is over",
 	NULL
 };
 
@@ -1726,6 +2577,11 @@ static int cmd_scrub_status(int argc, char **argv)
 
 	uuid_unparse(fi_args.fsid, fsid);
 
+	/* a running scrub publishes its progress in the map, no need to ask */
+	past_scrubs = scrub_read_map(fsid);
+	if (past_scrubs)
+		goto print;
+
 	fdres = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fdres == -1) {
 		error("failed to create socket to receive progress information: %m");
@@ -1755,6 +2611,7 @@ static int cmd_scrub_status(int argc, char **argv)
 			warning("failed to read status: %m");
 		}
 	}
+print:
 	in_progress = is_scrub_running_in_kernel(fdmnt, di_args, fi_args.num_devices);
 
 	printf("scrub status for %s\n", fsid);
@@ -43,6 +43,7 @@
 
 #include "send.h"
 #include "send-utils.h"
+#include "send-compress.h"
 #include "help.h"
 
 #define SEND_BUFFER_SIZE	SZ_64K
@@ -63,6 +64,9 @@ struct btrfs_send {
 
 	char *root_path;
 	struct subvol_uuid_search sus;
+
+	int compress_method;
+	int compress_threads;
 };
 
 static int get_root_id(struct btrfs_send *sctx, const char *path, u64 *root_id)
@@ -297,6 +301,23 @@ out:
 	return ERR_PTR(ret);
 }
 
+static void *read_sent_data_compressed(void *arg)
+{
+	int ret;
+	struct btrfs_send *sctx = (struct btrfs_send*)arg;
+
+	ret = send_compress_stream(sctx->send_fd, sctx->dump_fd,
+				   sctx->compress_method,
+				   sctx->compress_threads);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to compress stream: %m");
+		exit(-ret);
+	}
+
+	return ERR_PTR(ret);
+}
+
 static int do_send(struct btrfs_send *send, u64 parent_root_id,
 		   int is_first_subvol, int is_last_subvol, const char *subvol,
 		   u64 flags)
@@ -327,7 +348,10 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 	send->send_fd = pipefd[0];
 
 	if (!ret)
-		ret = pthread_create(&t_read, NULL, read_sent_data, send);
+		ret = pthread_create(&t_read, NULL,
+				     send->compress_method ?
+				     read_sent_data_compressed : read_sent_data,
+				     send);
 	if (ret) {
 		ret = -ret;
 		errno = -ret;
@@ -489,6 +513,165 @@ static void free_send_info(struct btrfs_send *sctx)
 	subvol_uuid_search_finit(&sctx->sus);
 }
 
+/* Return the name of the stream file of @subvol in the output directory */
+static const char *stream_name(const char *subvol)
+{
+	const char *name = strrchr(subvol, '/');
+
+	return name ? name + 1 : subvol;
+}
+
+static int open_output(const char *path)
+{
+	int fd;
+
+	/*
+	 * Try to use an existing file first. Even if send runs as root, it
+	 * might not have permissions to create file (eg. on a NFS) but it
+	 * should still be able to use a pre-created file.
+	 */
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 && errno == ENOENT)
+		fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (fd < 0) {
+		fd = -errno;
+		error("cannot create '%s': %m", path);
+	}
+
+	return fd;
+}
+
+/*
+ * Send @subvol as a complete stream to its own file in @output_dir, using
+ * @sctx only for reading
+ */
+static int send_to_dir(struct btrfs_send *sctx, const char *output_dir,
+		       u64 parent_root_id, const char *subvol, u64 flags)
+{
+	struct btrfs_send job;
+	char path[PATH_MAX];
+	int ret;
+
+	ret = path_cat_out(path, output_dir, stream_name(subvol));
+	if (ret < 0) {
+		error("output file path too long for %s", subvol);
+		return ret;
+	}
+
+	/*
+	 * Each stream needs its own pipe and output, the rest is shared by
+	 * the parallel jobs and not changed by do_send.
+	 */
+	job = *sctx;
+	job.dump_fd = open_output(path);
+	if (job.dump_fd < 0)
+		return job.dump_fd;
+
+	ret = do_send(&job, parent_root_id, 1, 1, subvol, flags);
+	close(job.dump_fd);
+
+	return ret;
+}
+
+struct send_jobs {
+	struct btrfs_send *sctx;
+	const char *output_dir;
+	u64 parent_root_id;
+	u64 flags;
+
+	char **subvols;
+	int nr_subvols;
+
+	pthread_mutex_t mutex;
+	int next;
+	int error;
+};
+
+static void *send_jobs_worker(void *arg)
+{
+	struct send_jobs *jobs = arg;
+	char *subvol;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&jobs->mutex);
+		if (jobs->error || jobs->next == jobs->nr_subvols) {
+			pthread_mutex_unlock(&jobs->mutex);
+			break;
+		}
+		subvol = jobs->subvols[jobs->next++];
+		pthread_mutex_unlock(&jobs->mutex);
+
+		if (g_verbose > 0)
+			fprintf(stderr, "At subvol %s\n", subvol);
+
+		ret = send_to_dir(jobs->sctx, jobs->output_dir,
+				  jobs->parent_root_id, subvol, jobs->flags);
+		if (ret < 0) {
+			pthread_mutex_lock(&jobs->mutex);
+			if (!jobs->error)
+				jobs->error = ret;
+			pthread_mutex_unlock(&jobs->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Send subvolumes that don't depend on each other, ie. have the same parent
+ * and clone sources, with up to @nr_jobs send ioctls running at a time
+ */
+static int send_parallel(struct btrfs_send *sctx, const char *output_dir,
+			 u64 parent_root_id, char **subvols, int nr_subvols,
+			 u64 flags, int nr_jobs)
+{
+	struct send_jobs jobs;
+	pthread_t *threads;
+	int nr_threads = 0;
+	int ret = 0;
+	int i;
+
+	threads = calloc(nr_jobs, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	memset(&jobs, 0, sizeof(jobs));
+	jobs.sctx = sctx;
+	jobs.output_dir = output_dir;
+	jobs.parent_root_id = parent_root_id;
+	jobs.flags = flags;
+	jobs.subvols = subvols;
+	jobs.nr_subvols = nr_subvols;
+	pthread_mutex_init(&jobs.mutex, NULL);
+
+	for (i = 0; i < min(nr_jobs, nr_subvols); i++) {
+		ret = pthread_create(&threads[i], NULL, send_jobs_worker,
+				     &jobs);
+		if (ret) {
+			ret = -ret;
+			errno = -ret;
+			error("thread setup failed: %m");
+			break;
+		}
+		nr_threads++;
+	}
+
+	if (ret < 0) {
+		pthread_mutex_lock(&jobs.mutex);
+		jobs.error = ret;
+		pthread_mutex_unlock(&jobs.mutex);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&jobs.mutex);
+	free(threads);
+
+	return jobs.error;
+}
+
 int cmd_send(int argc, char **argv)
 {
 	char *subvol = NULL;
@@ -503,6 +686,9 @@ int cmd_send(int argc, char **argv)
 	int full_send = 1;
 	int new_end_cmd_semantic = 0;
 	u64 send_flags = 0;
+	char *output_dir = NULL;
+	char **subvols = NULL;
+	u64 nr_jobs = 1;
 
 	memset(&send, 0, sizeof(send));
 	send.dump_fd = fileno(stdout);
@@ -510,13 +696,20 @@ int cmd_send(int argc, char **argv)
 
 	optind = 0;
 	while (1) {
-		enum { GETOPT_VAL_SEND_NO_DATA = 256 };
+		enum { GETOPT_VAL_SEND_NO_DATA = 256, GETOPT_VAL_OUTPUT_DIR,
+		       GETOPT_VAL_COMPRESS };
 		static const struct option long_options[] = {
 			{ "verbose", no_argument, NULL, 'v' },
 			{ "quiet", no_argument, NULL, 'q' },
-			{ "no-data", no_argument, NULL, GETOPT_VAL_SEND_NO_DATA }
+			{ "no-data", no_argument, NULL, GETOPT_VAL_SEND_NO_DATA },
+			{ "jobs", required_argument, NULL, 'j' },
+			{ "output-dir", required_argument, NULL,
+				GETOPT_VAL_OUTPUT_DIR },
+			{ "compress", required_argument, NULL,
+				GETOPT_VAL_COMPRESS },
+			{ NULL, 0, NULL, 0 }
 		};
-		int c = getopt_long(argc, argv, "vqec:f:i:p:", long_options, NULL);
+		int c = getopt_long(argc, argv, "vqec:f:i:p:j:", long_options, NULL);
 
 		if (c < 0)
 			break;
@@ -602,6 +795,40 @@ int cmd_send(int argc, char **argv)
 		case GETOPT_VAL_SEND_NO_DATA:
 			send_flags |= BTRFS_SEND_FLAG_NO_FILE_DATA;
 			break;
+		case 'j':
+			nr_jobs = arg_strtou64(optarg);
+			if (nr_jobs == 0 || nr_jobs > 256) {
+				error("number of jobs must be between 1 and 256");
+				ret = 1;
+				goto out;
+			}
+			break;
+		case GETOPT_VAL_COMPRESS:
+			ret = send_compress_parse_method(optarg);
+			if (ret < 0) {
+				if (ret == -EOPNOTSUPP)
+					error("compression method %s not compiled in",
+					      optarg);
+				else
+					error("unknown compression method %s",
+					      optarg);
+				ret = 1;
+				goto out;
+			}
+			send.compress_method = ret;
+			send.compress_threads = min_t(long,
+					max_t(long, sysconf(_SC_NPROCESSORS_ONLN), 1),
+					16);
+			break;
+		case GETOPT_VAL_OUTPUT_DIR:
+			free(output_dir);
+			output_dir = strdup(optarg);
+			if (!output_dir) {
+				ret = -ENOMEM;
+				error("not enough memory");
+				goto out;
+			}
+			break;
 		case '?':
 		default:
 			error("send arguments invalid");
@@ -613,29 +840,32 @@ int cmd_send(int argc, char **argv)
 	if (check_argc_min(argc - optind, 1))
 		usage(cmd_send_usage);
 
+	if (output_dir && outname[0]) {
+		error("options -f and --output-dir cannot be used together");
+		ret = 1;
+		goto out;
+	}
+	if (nr_jobs > 1 && !output_dir) {
+		error("option --jobs needs --output-dir");
+		ret = 1;
+		goto out;
+	}
+	if (nr_jobs > 1 && !full_send && !snapshot_parent) {
+		error(
+	"option --jobs cannot be used when the parent is chosen from clone sources");
+		ret = 1;
+		goto out;
+	}
+
 	if (outname[0]) {
-		int tmpfd;
-
-		/*
-		 * Try to use an existing file first. Even if send runs as
-		 * root, it might not have permissions to create file (eg. on a
-		 * NFS) but it should still be able to use a pre-created file.
-		 */
-		tmpfd = open(outname, O_WRONLY | O_TRUNC);
-		if (tmpfd < 0) {
-			if (errno == ENOENT)
-				tmpfd = open(outname,
-					O_CREAT | O_WRONLY | O_TRUNC, 0600);
-		}
-		send.dump_fd = tmpfd;
-		if (send.dump_fd == -1) {
-			ret = -errno;
-			error("cannot create '%s': %m", outname);
+		send.dump_fd = open_output(outname);
+		if (send.dump_fd < 0) {
+			ret = send.dump_fd;
 			goto out;
 		}
 	}
 
-	if (isatty(send.dump_fd)) {
+	if (!output_dir && isatty(send.dump_fd)) {
 		error(
 	    "not dumping send stream into a terminal, redirect it into a file");
 		ret = 1;
@@ -671,6 +901,16 @@ int cmd_send(int argc, char **argv)
 		}
 	}
 
+	/* The resolved paths name the stream files in the output directory */
+	if (output_dir) {
+		subvols = calloc(argc - optind, sizeof(*subvols));
+		if (!subvols) {
+			ret = -ENOMEM;
+			error("not enough memory");
+			goto out;
+		}
+	}
+
 	for (i = optind; i < argc; i++) {
 		free(subvol);
 		subvol = realpath(argv[i], NULL);
@@ -707,12 +947,35 @@ int cmd_send(int argc, char **argv)
 			error("subvolume %s is not read-only", subvol);
 			goto out;
 		}
+
+		if (output_dir) {
+			int j;
+
+			for (j = 0; j < i - optind; j++) {
+				if (strcmp(stream_name(subvol),
+					   stream_name(subvols[j])) == 0) {
+					ret = -EEXIST;
+					error(
+				"subvolumes %s and %s would be sent to the same file",
+						argv[optind + j], argv[i]);
+					goto out;
+				}
+			}
+			subvols[i - optind] = subvol;
+			subvol = NULL;
+		}
 	}
 
 	if ((send_flags & BTRFS_SEND_FLAG_NO_FILE_DATA) && g_verbose > 1)
 		if (g_verbose > 1)
 			fprintf(stderr, "Mode NO_FILE_DATA enabled\n");
 
+	if (nr_jobs > 1) {
+		ret = send_parallel(&send, output_dir, parent_root_id, subvols,
+				    argc - optind, send_flags, nr_jobs);
+		goto out;
+	}
+
 	for (i = optind; i < argc; i++) {
 		int is_first_subvol;
 		int is_last_subvol;
@@ -743,19 +1006,26 @@ int cmd_send(int argc, char **argv)
 			}
 		}
 
-		if (new_end_cmd_semantic) {
-			/* require new kernel */
-			is_first_subvol = (i == optind);
-			is_last_subvol = (i == argc - 1);
+		if (output_dir) {
+			ret = send_to_dir(&send, output_dir, parent_root_id,
+					  subvol, send_flags);
+			if (ret < 0)
+				goto out;
 		} else {
-			/* be compatible to old and new kernel */
-			is_first_subvol = 1;
-			is_last_subvol = 1;
+			if (new_end_cmd_semantic) {
+				/* require new kernel */
+				is_first_subvol = (i == optind);
+				is_last_subvol = (i == argc - 1);
+			} else {
+				/* be compatible to old and new kernel */
+				is_first_subvol = 1;
+				is_last_subvol = 1;
+			}
+			ret = do_send(&send, parent_root_id, is_first_subvol,
+				      is_last_subvol, subvol, send_flags);
+			if (ret < 0)
+				goto out;
 		}
-		ret = do_send(&send, parent_root_id, is_first_subvol,
-			      is_last_subvol, subvol, send_flags);
-		if (ret < 0)
-			goto out;
 
 		if (!full_send && !snapshot_parent) {
 			/* done with this subvol, so add it to the clone sources */
@@ -772,6 +1042,12 @@ int cmd_send(int argc, char **argv)
 	ret = 0;
 
 out:
+	if (subvols) {
+		for (i = 0; i < argc - optind; i++)
+			free(subvols[i]);
+		free(subvols);
+	}
+	free(output_dir);
 	free(subvol);
 	free(snapshot_parent);
 	free(send.clone_sources);
@@ -780,7 +1056,7 @@ out:
 }
 
 const char * const cmd_send_usage[] = {
-	"btrfs send [-ve] [-p <parent>] [-c <clone-src>] [-f <outfile>] <subvol> [<subvol>...]",
+	"btrfs send [-ve] [-p <parent>] [-c <clone-src>] [-f <outfile>|--output-dir <dir> [-j <N>]] <subvol> [<subvol>...]",
 	"Send the subvolume(s) to stdout.",
 	"Sends the subvolume(s) specified by <subvol> to stdout.",
 	"<subvol> should be read-only here.",
@@ -803,6 +1079,15 @@ const char * const cmd_send_usage[] = {
 	"-f <outfile>     Output is normally written to stdout. To write to",
 	"                 a file, use this option. An alternative would be to",
 	"                 use pipes.",
+	"--output-dir <dir>",
+	"                 Write the stream of each subvolume to its own file",
+	"                 in <dir>, named after the last component of <subvol>.",
+	"--compress <method>",
+	"                 Compress the stream with zlib or zstd in parallel,",
+	"                 btrfs receive detects it when reading from a file.",
+	"-j|--jobs <N>    Run up to N sends at the same time, needs --output-dir.",
+	"                 The subvolumes must not depend on each other, ie.",
+	"                 either a full send or -p must be used.",
 	"--no-data        send in NO_FILE_DATA mode, Note: the output stream",
 	"                 does not contain any file data and thus cannot be used",
 	"                 to transfer changes. This mode is faster and useful to",
@@ -999,7 +999,10 @@ static int noinline push_nodes_for_insert(struct btrfs_trans_handle *trans,
 }
 
 /*
- * readahead one full node of leaves
+ * readahead the siblings of the child at @slot, up to one full node
+ *
+ * The blocks are queued by readahead_tree_block() and read as one batch when
+ * the search reaches the first of them.
  */
 void reada_for_search(struct btrfs_fs_info *fs_info, struct btrfs_path *path,
 		      int level, int slot, u64 objectid)
@@ -1016,7 +1019,7 @@ void reada_for_search(struct btrfs_fs_info *fs_info, struct btrfs_path *path,
 	u32 nr;
 	u32 nscan = 0;
 
-	if (level != 1)
+	if (level == 0)
 		return;
 
 	if (!path->nodes[level])
@@ -1061,7 +1064,7 @@ void reada_for_search(struct btrfs_fs_info *fs_info, struct btrfs_path *path,
 		nscan++;
 		if (path->reada < 2 && (nread > SZ_256K || nscan > 32))
 			break;
-		if(nread > SZ_1M || nscan > 128)
+		if (nread > SZ_4M || nscan >= BTRFS_READA_QUEUE_SIZE)
 			break;
 
 		if (search < lowest_read)
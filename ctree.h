@@ -1086,6 +1086,24 @@ struct btrfs_block_group_cache {
 
 };
 
+/*
+ * Tree blocks queued by readahead_tree_block(), read in one batch when
+ * read_tree_block() misses the cache for one of them
+ */
+#define BTRFS_READA_QUEUE_SIZE	256
+
+struct btrfs_reada_queue {
+	u64 bytenr[BTRFS_READA_QUEUE_SIZE];
+	u64 gen[BTRFS_READA_QUEUE_SIZE];
+	int nr;
+
+	/* Statistics */
+	u64 queued;
+	u64 filled;
+	u64 used;
+	u64 wasted;
+};
+
 struct btrfs_device;
 struct btrfs_fs_devices;
 struct btrfs_fs_info {
@@ -1162,6 +1180,10 @@ struct btrfs_fs_info {
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
 
+	struct btrfs_reada_queue reada;
+	/* Number of threads for batched tree block reads, 0 for default */
+	unsigned int read_threads;
+
 	/* Cached block sizes */
 	u32 nodesize;
 	u32 sectorsize;
@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
@@ -33,6 +34,7 @@
 #include "utils.h"
 #include "print-tree.h"
 #include "rbtree-utils.h"
+#include "internal.h"
 
 /* specified errno for check_tree_block */
 #define BTRFS_BAD_BYTENR		(-1)
@@ -132,6 +134,30 @@ void btrfs_csum_final(u32 crc, u8 *result)
 	put_unaligned_le32(~crc, result);
 }
 
+/*
+ * Checksum @nr consecutive blocks of @blocksize bytes and store the final
+ * crc32c of each block at @result, packed like in a csum item.
+ */
+void btrfs_csum_data_batch(char *data, u32 blocksize, unsigned int nr,
+			   u8 *result)
+{
+	u32 crcs[64];
+	unsigned int batch;
+	unsigned int i;
+
+	while (nr) {
+		batch = min_t(unsigned int, nr, ARRAY_SIZE(crcs));
+		crc32c_le_batch(~(u32)0, (unsigned char const *)data,
+				blocksize, batch, crcs);
+		for (i = 0; i < batch; i++) {
+			btrfs_csum_final(crcs[i], result);
+			result += sizeof(u32);
+		}
+		data += (size_t)batch * blocksize;
+		nr -= batch;
+	}
+}
+
 static int __csum_tree_block_size(struct extent_buffer *buf, u16 csum_size,
 				  int verify, int silent)
 {
@@ -178,11 +204,20 @@ int csum_tree_block(struct btrfs_fs_info *fs_info,
 	return csum_tree_block_size(buf, csum_size, verify);
 }
 
+/*
+ * Look up a cached tree block, a block that is up to date counts as a cache
+ * hit. Otherwise the caller reads it by read_tree_block(), which counts the
+ * miss.
+ */
 struct extent_buffer *btrfs_find_tree_block(struct btrfs_fs_info *fs_info,
 					    u64 bytenr, u32 blocksize)
 {
-	return find_extent_buffer(&fs_info->extent_cache,
-				  bytenr, blocksize);
+	struct extent_buffer *eb;
+
+	eb = find_extent_buffer(&fs_info->extent_cache, bytenr, blocksize);
+	if (eb && extent_buffer_uptodate(eb))
+		fs_info->extent_cache.cache_hits++;
+	return eb;
 }
 
 struct extent_buffer* btrfs_find_create_tree_block(
@@ -191,28 +226,55 @@ struct extent_buffer* btrfs_find_create_tree_block(
 	return alloc_extent_buffer(fs_info, bytenr, fs_info->nodesize);
 }
 
+/*
+ * Queue a tree block for prefetch.
+ *
+ * The block is only hinted to the kernel here, the queue is read into the
+ * extent buffer cache as one batch by the first read_tree_block() of a queued
+ * block, or when the queue is full.
+ */
 void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 		u64 parent_transid)
 {
+	struct btrfs_reada_queue *reada = &fs_info->reada;
 	struct extent_buffer *eb;
 	u64 length;
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
 
-	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
+	eb = find_extent_buffer(&fs_info->extent_cache, bytenr,
+				fs_info->nodesize);
 	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid)) &&
 	    !btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 0,
 			     NULL)) {
 		device = multi->stripes[0].dev;
-		device->total_ios++;
 		readahead(device->fd, multi->stripes[0].physical,
 				fs_info->nodesize);
+
+		if (reada->nr == BTRFS_READA_QUEUE_SIZE)
+			flush_readahead_tree_blocks(fs_info, 0, 0);
+		reada->bytenr[reada->nr] = bytenr;
+		reada->gen[reada->nr] = parent_transid;
+		reada->nr++;
+		reada->queued++;
 	}
 
 	free_extent_buffer(eb);
 	kfree(multi);
 }
 
+static int readahead_queued(struct btrfs_fs_info *fs_info, u64 bytenr)
+{
+	struct btrfs_reada_queue *reada = &fs_info->reada;
+	int i;
+
+	for (i = 0; i < reada->nr; i++) {
+		if (reada->bytenr[i] == bytenr)
+			return 1;
+	}
+	return 0;
+}
+
 static int verify_parent_transid(struct extent_io_tree *io_tree,
 				 struct extent_buffer *eb, u64 parent_transid,
 				 int ignore)
@@ -330,9 +392,27 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	eb = btrfs_find_create_tree_block(fs_info, bytenr);
 	if (!eb)
 		return ERR_PTR(-ENOMEM);
+	if (extent_buffer_uptodate(eb))
+		fs_info->extent_cache.cache_hits++;
+	else
+		fs_info->extent_cache.cache_misses++;
+
+	if (!extent_buffer_uptodate(eb) && readahead_queued(fs_info, bytenr)) {
+		flush_readahead_tree_blocks(fs_info, bytenr, parent_transid);
+		/* The block we're waiting for doesn't count as prefetched */
+		if (eb->flags & EXTENT_BUFFER_READA) {
+			eb->flags &= ~EXTENT_BUFFER_READA;
+			fs_info->reada.filled--;
+		}
+	}
 
-	if (btrfs_buffer_uptodate(eb, parent_transid))
+	if (btrfs_buffer_uptodate(eb, parent_transid)) {
+		if (eb->flags & EXTENT_BUFFER_READA) {
+			eb->flags &= ~EXTENT_BUFFER_READA;
+			fs_info->reada.used++;
+		}
 		return eb;
+	}
 
 	while (1) {
 		ret = read_whole_eb(fs_info, eb, mirror_num);
@@ -381,6 +461,235 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	return ERR_PTR(ret);
 }
 
+/*
+ * Batched tree block reads.
+ *
+ * read_tree_block() does one synchronous pread per block, so the device only
+ * ever sees a queue depth of one.  read_tree_block_batch() maps a set of
+ * blocks up front and lets a small pool of threads read and checksum them
+ * concurrently.  The extent buffer cache is only touched by the caller
+ * thread, the workers operate on the private data of buffers that are not
+ * uptodate yet.
+ *
+ * Blocks that can't be read, mapped or verified are left !uptodate, a later
+ * read_tree_block() will retry them with the usual mirror handling and
+ * error reporting.
+ */
+#define BTRFS_READ_BATCH_THREADS	8
+#define BTRFS_READ_BATCH_MAX_THREADS	256
+
+struct read_batch_req {
+	struct extent_buffer *eb;
+	u64 parent_transid;
+	int ret;
+};
+
+struct read_batch_ctx {
+	struct btrfs_fs_info *fs_info;
+	struct read_batch_req *reqs;
+	int nr;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static int map_tree_block_read(struct btrfs_fs_info *fs_info,
+			       struct extent_buffer *eb)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 read_len = eb->len;
+	int ret;
+
+	ret = btrfs_map_block(fs_info, READ, eb->start, &read_len, &multi, 0,
+			      NULL);
+	if (ret)
+		return -EIO;
+	device = multi->stripes[0].dev;
+	/* Blocks crossing a stripe boundary go through read_whole_eb() */
+	if (read_len < eb->len || device->fd <= 0) {
+		kfree(multi);
+		return -EIO;
+	}
+	eb->fd = device->fd;
+	eb->dev_bytenr = multi->stripes[0].physical;
+	device->total_ios++;
+	kfree(multi);
+	return 0;
+}
+
+static void *read_batch_worker(void *arg)
+{
+	struct read_batch_ctx *ctx = arg;
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+	struct read_batch_req *req;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		i = ctx->next++;
+		pthread_mutex_unlock(&ctx->lock);
+		if (i >= ctx->nr)
+			break;
+
+		req = &ctx->reqs[i];
+		req->ret = read_extent_from_disk(req->eb, 0, req->eb->len);
+		if (req->ret)
+			continue;
+		if (verify_tree_block_csum_silent(req->eb, csum_size) ||
+		    check_tree_block(fs_info, req->eb))
+			req->ret = -EIO;
+	}
+	return NULL;
+}
+
+static int cmp_read_batch_req(const void *a, const void *b)
+{
+	const struct read_batch_req *ra = a;
+	const struct read_batch_req *rb = b;
+
+	if (ra->eb->fd != rb->eb->fd)
+		return ra->eb->fd < rb->eb->fd ? -1 : 1;
+	if (ra->eb->dev_bytenr != rb->eb->dev_bytenr)
+		return ra->eb->dev_bytenr < rb->eb->dev_bytenr ? -1 : 1;
+	return 0;
+}
+
+static int __read_tree_block_batch(struct btrfs_fs_info *fs_info,
+				   const u64 *bytenrs,
+				   const u64 *parent_transids, int nr,
+				   u32 eb_flags)
+{
+	struct read_batch_ctx ctx;
+	struct read_batch_req *reqs;
+	struct extent_buffer *eb;
+	pthread_t *threads;
+	int nr_threads;
+	int nr_reqs = 0;
+	int uptodate = 0;
+	int i, j;
+
+	if (nr <= 0 || fs_info->on_restoring)
+		return 0;
+
+	reqs = calloc(nr, sizeof(*reqs));
+	if (!reqs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (bytenrs[i] < fs_info->sectorsize ||
+		    !IS_ALIGNED(bytenrs[i], fs_info->sectorsize))
+			continue;
+		eb = btrfs_find_create_tree_block(fs_info, bytenrs[i]);
+		if (!eb)
+			continue;
+		if (extent_buffer_uptodate(eb)) {
+			uptodate++;
+			free_extent_buffer(eb);
+			continue;
+		}
+		if (eb->flags & EXTENT_DIRTY ||
+		    map_tree_block_read(fs_info, eb)) {
+			free_extent_buffer(eb);
+			continue;
+		}
+		reqs[nr_reqs].eb = eb;
+		reqs[nr_reqs].parent_transid =
+			parent_transids ? parent_transids[i] : 0;
+		nr_reqs++;
+	}
+
+	/* Sort by device offset and drop duplicate blocks */
+	qsort(reqs, nr_reqs, sizeof(*reqs), cmp_read_batch_req);
+	for (i = 0, j = 0; i < nr_reqs; i++) {
+		if (j > 0 && reqs[j - 1].eb == reqs[i].eb) {
+			free_extent_buffer(reqs[i].eb);
+			continue;
+		}
+		reqs[j++] = reqs[i];
+	}
+	nr_reqs = j;
+
+	ctx.fs_info = fs_info;
+	ctx.reqs = reqs;
+	ctx.nr = nr_reqs;
+	ctx.next = 0;
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	/* The caller thread takes part in the reads as well */
+	nr_threads = fs_info->read_threads ? fs_info->read_threads :
+		     BTRFS_READ_BATCH_THREADS;
+	nr_threads = min_t(int, nr_threads, BTRFS_READ_BATCH_MAX_THREADS);
+	nr_threads = min_t(int, nr_reqs, nr_threads) - 1;
+	threads = NULL;
+	if (nr_threads > 0)
+		threads = malloc(nr_threads * sizeof(*threads));
+	if (!threads)
+		nr_threads = 0;
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, read_batch_worker, &ctx))
+			break;
+	}
+	nr_threads = i;
+	read_batch_worker(&ctx);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&ctx.lock);
+
+	for (i = 0; i < nr_reqs; i++) {
+		eb = reqs[i].eb;
+		if (!reqs[i].ret && (!reqs[i].parent_transid ||
+		     btrfs_header_generation(eb) == reqs[i].parent_transid)) {
+			eb->flags |= eb_flags;
+			btrfs_set_buffer_uptodate(eb);
+			uptodate++;
+		}
+		free_extent_buffer(eb);
+	}
+	free(reqs);
+	return uptodate;
+}
+
+/*
+ * Read @nr tree blocks at @bytenrs into the extent buffer cache.
+ *
+ * @parent_transids can be NULL if the generations are not known.
+ *
+ * Return the number of blocks that are uptodate in the cache after the call,
+ * or <0 if the batch could not be set up at all.
+ */
+int read_tree_block_batch(struct btrfs_fs_info *fs_info, const u64 *bytenrs,
+			  const u64 *parent_transids, int nr)
+{
+	return __read_tree_block_batch(fs_info, bytenrs, parent_transids, nr, 0);
+}
+
+/*
+ * Read all blocks queued by readahead_tree_block(), plus @bytenr if it's not
+ * 0, which is the block the caller is going to wait for anyway.
+ */
+void flush_readahead_tree_blocks(struct btrfs_fs_info *fs_info, u64 bytenr,
+				 u64 parent_transid)
+{
+	struct btrfs_reada_queue *reada = &fs_info->reada;
+	int nr = reada->nr;
+	int ret;
+
+	if (!nr)
+		return;
+	if (bytenr && nr < BTRFS_READA_QUEUE_SIZE) {
+		reada->bytenr[nr] = bytenr;
+		reada->gen[nr] = parent_transid;
+		nr++;
+	}
+	reada->nr = 0;
+	ret = __read_tree_block_batch(fs_info, reada->bytenr, reada->gen, nr,
+				      EXTENT_BUFFER_READA);
+	if (ret > 0)
+		reada->filled += ret;
+}
+
 int read_extent_data(struct btrfs_fs_info *fs_info, char *data, u64 logical,
 		     u64 *len, int mirror)
 {
@@ -1284,7 +1593,7 @@ struct btrfs_root *open_ctree_fd(int fp, const char *path, u64 sb_bytenr,
  * - number of devices   - something sane
  * - sys array size      - maximum
  */
-static int check_super(struct btrfs_super_block *sb, unsigned sbflags)
+int btrfs_check_super(struct btrfs_super_block *sb, unsigned sbflags)
 {
 	u8 result[BTRFS_CSUM_SIZE];
 	u32 crc;
@@ -1476,7 +1785,7 @@ int btrfs_read_dev_super(int fd, struct btrfs_super_block *sb, u64 sb_bytenr,
 		if (btrfs_super_bytenr(buf) != sb_bytenr)
 			return -EIO;
 
-		ret = check_super(buf, sbflags);
+		ret = btrfs_check_super(buf, sbflags);
 		if (ret < 0)
 			return ret;
 		memcpy(sb, buf, BTRFS_SUPER_INFO_SIZE);
@@ -1501,7 +1810,7 @@ int btrfs_read_dev_super(int fd, struct btrfs_super_block *sb, u64 sb_bytenr,
 		/* if magic is NULL, the device was removed */
 		if (btrfs_super_magic(buf) == 0 && i == 0)
 			break;
-		if (check_super(buf, sbflags))
+		if (btrfs_check_super(buf, sbflags))
 			continue;
 
 		if (!fsid_is_initialized) {
@@ -36,8 +36,16 @@ void extent_io_tree_init(struct extent_io_tree *tree)
 	cache_tree_init(&tree->state);
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
+	INIT_LIST_HEAD(&tree->lru_hot);
+	tree->hash = NULL;
+	tree->hash_bits = 0;
+	tree->nr_cached = 0;
 	tree->cache_size = 0;
+	tree->hot_size = 0;
 	tree->max_cache_size = (u64)total_memory() / 4;
+	tree->cache_hits = 0;
+	tree->cache_misses = 0;
+	tree->cache_evictions = 0;
 }
 
 void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
@@ -78,12 +86,12 @@ static void free_extent_state_func(struct cache_extent *cache)
 }
 
 static void free_extent_buffer_final(struct extent_buffer *eb);
-void extent_io_tree_cleanup(struct extent_io_tree *tree)
+static void cleanup_extent_buffer_lru(struct list_head *lru)
 {
 	struct extent_buffer *eb;
 
-	while(!list_empty(&tree->lru)) {
-		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
+	while(!list_empty(lru)) {
+		eb = list_entry(lru->next, struct extent_buffer, lru);
 		if (eb->refs) {
 			fprintf(stderr,
 				"extent buffer leak: start %llu len %u\n",
@@ -93,6 +101,15 @@ void extent_io_tree_cleanup(struct extent_io_tree *tree)
 			free_extent_buffer_final(eb);
 		}
 	}
+}
+
+void extent_io_tree_cleanup(struct extent_io_tree *tree)
+{
+	cleanup_extent_buffer_lru(&tree->lru);
+	cleanup_extent_buffer_lru(&tree->lru_hot);
+	free(tree->hash);
+	tree->hash = NULL;
+	tree->hash_bits = 0;
 
 	cache_tree_free_extents(&tree->state, free_extent_state_func);
 }
@@ -642,6 +659,135 @@ struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 	return new;
 }
 
+#define EB_HASH_MIN_BITS	10
+
+static inline u32 eb_hash(struct extent_io_tree *tree, u64 bytenr)
+{
+	return (u32)((bytenr * 0x9E3779B97F4A7C15ULL) >>
+		     (64 - tree->hash_bits));
+}
+
+static int eb_hash_resize(struct extent_io_tree *tree, u32 bits)
+{
+	struct extent_buffer **old_hash = tree->hash;
+	struct extent_buffer **new_hash;
+	struct extent_buffer *eb;
+	u32 old_bits = tree->hash_bits;
+	u32 i;
+
+	new_hash = calloc(1UL << bits, sizeof(*new_hash));
+	if (!new_hash)
+		return -ENOMEM;
+
+	tree->hash = new_hash;
+	tree->hash_bits = bits;
+	if (!old_hash)
+		return 0;
+
+	for (i = 0; i < (1U << old_bits); i++) {
+		while (old_hash[i]) {
+			u32 h;
+
+			eb = old_hash[i];
+			old_hash[i] = eb->hash_next;
+			h = eb_hash(tree, eb->start);
+			eb->hash_next = new_hash[h];
+			new_hash[h] = eb;
+		}
+	}
+	free(old_hash);
+	return 0;
+}
+
+static int eb_hash_insert(struct extent_io_tree *tree,
+			  struct extent_buffer *eb)
+{
+	u32 h;
+
+	if (!tree->hash) {
+		if (eb_hash_resize(tree, EB_HASH_MIN_BITS))
+			return -ENOMEM;
+	} else if (tree->nr_cached >= (2ULL << tree->hash_bits)) {
+		/* A failed resize only means longer chains */
+		eb_hash_resize(tree, tree->hash_bits + 1);
+	}
+
+	h = eb_hash(tree, eb->start);
+	eb->hash_next = tree->hash[h];
+	tree->hash[h] = eb;
+	tree->nr_cached++;
+	return 0;
+}
+
+static void eb_hash_remove(struct extent_io_tree *tree,
+			   struct extent_buffer *eb)
+{
+	struct extent_buffer **p;
+
+	if (!tree->hash)
+		return;
+	for (p = &tree->hash[eb_hash(tree, eb->start)]; *p;
+	     p = &(*p)->hash_next) {
+		if (*p == eb) {
+			*p = eb->hash_next;
+			eb->hash_next = NULL;
+			tree->nr_cached--;
+			return;
+		}
+	}
+}
+
+static struct extent_buffer *eb_hash_lookup(struct extent_io_tree *tree,
+					    u64 bytenr, u32 blocksize)
+{
+	struct extent_buffer *eb;
+
+	if (!tree->hash)
+		return NULL;
+	for (eb = tree->hash[eb_hash(tree, bytenr)]; eb; eb = eb->hash_next) {
+		if (eb->start == bytenr && eb->len == blocksize)
+			return eb;
+	}
+	return NULL;
+}
+
+/*
+ * Update the position of a cached extent buffer on lookup.
+ *
+ * A buffer is promoted to the hot list when it's looked up again after it
+ * has been used (uptodate) and released by everybody.
+ */
+static void touch_extent_buffer(struct extent_io_tree *tree,
+				struct extent_buffer *eb)
+{
+	struct extent_buffer *cold;
+
+	if (eb->flags & EXTENT_BUFFER_HOT) {
+		list_move_tail(&eb->lru, &tree->lru_hot);
+		return;
+	}
+	if (eb->refs || !extent_buffer_uptodate(eb) ||
+	    !(eb->flags & EXTENT_BUFFER_REFERENCED)) {
+		if (extent_buffer_uptodate(eb))
+			eb->flags |= EXTENT_BUFFER_REFERENCED;
+		list_move_tail(&eb->lru, &tree->lru);
+		return;
+	}
+
+	eb->flags |= EXTENT_BUFFER_HOT;
+	list_move_tail(&eb->lru, &tree->lru_hot);
+	tree->hot_size += eb->len;
+
+	/* Keep at least a quarter of the cache for the cold list */
+	while (tree->hot_size > (tree->max_cache_size / 4) * 3) {
+		cold = list_first_entry(&tree->lru_hot, struct extent_buffer,
+					lru);
+		cold->flags &= ~(EXTENT_BUFFER_HOT | EXTENT_BUFFER_REFERENCED);
+		list_move_tail(&cold->lru, &tree->lru);
+		tree->hot_size -= cold->len;
+	}
+}
+
 static void free_extent_buffer_final(struct extent_buffer *eb)
 {
 	struct extent_io_tree *tree = eb->tree;
@@ -649,9 +795,15 @@ static void free_extent_buffer_final(struct extent_buffer *eb)
 	BUG_ON(eb->refs);
 	BUG_ON(tree && tree->cache_size < eb->len);
 	list_del_init(&eb->lru);
+	/* Prefetched but evicted before anybody read it */
+	if (eb->flags & EXTENT_BUFFER_READA && eb->fs_info)
+		eb->fs_info->reada.wasted++;
 	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
 		remove_cache_extent(&tree->cache, &eb->cache_node);
+		eb_hash_remove(tree, eb);
 		tree->cache_size -= eb->len;
+		if (eb->flags & EXTENT_BUFFER_HOT)
+			tree->hot_size -= eb->len;
 	}
 	free(eb);
 }
@@ -688,14 +840,11 @@ void free_extent_buffer_nocache(struct extent_buffer *eb)
 struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
 					 u64 bytenr, u32 blocksize)
 {
-	struct extent_buffer *eb = NULL;
-	struct cache_extent *cache;
+	struct extent_buffer *eb;
 
-	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
+	eb = eb_hash_lookup(tree, bytenr, blocksize);
+	if (eb) {
+		touch_extent_buffer(tree, eb);
 		eb->refs++;
 	}
 	return eb;
@@ -710,24 +859,36 @@ struct extent_buffer *find_first_extent_buffer(struct extent_io_tree *tree,
 	cache = search_cache_extent(&tree->cache, start);
 	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
+		touch_extent_buffer(tree, eb);
 		eb->refs++;
 	}
 	return eb;
 }
 
-static void trim_extent_buffer_cache(struct extent_io_tree *tree)
+static void trim_extent_buffer_lru(struct extent_io_tree *tree,
+				   struct list_head *lru, u64 target)
 {
 	struct extent_buffer *eb, *tmp;
 
-	list_for_each_entry_safe(eb, tmp, &tree->lru, lru) {
-		if (eb->refs == 0)
-			free_extent_buffer_final(eb);
-		if (tree->cache_size <= ((tree->max_cache_size * 9) / 10))
+	list_for_each_entry_safe(eb, tmp, lru, lru) {
+		if (tree->cache_size <= target)
 			break;
+		if (eb->refs == 0) {
+			free_extent_buffer_final(eb);
+			tree->cache_evictions++;
+		}
 	}
 }
 
+static void trim_extent_buffer_cache(struct extent_io_tree *tree)
+{
+	u64 target = (tree->max_cache_size * 9) / 10;
+
+	trim_extent_buffer_lru(tree, &tree->lru, target);
+	if (tree->cache_size > target)
+		trim_extent_buffer_lru(tree, &tree->lru_hot, target);
+}
+
 struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 					  u64 bytenr, u32 blocksize)
 {
@@ -735,15 +896,14 @@ struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 	struct extent_io_tree *tree = &fs_info->extent_cache;
 	struct cache_extent *cache;
 
-	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
+	eb = eb_hash_lookup(tree, bytenr, blocksize);
+	if (eb) {
+		touch_extent_buffer(tree, eb);
 		eb->refs++;
 	} else {
 		int ret;
 
+		cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
 		if (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
@@ -757,6 +917,12 @@ struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 			free(eb);
 			return NULL;
 		}
+		ret = eb_hash_insert(tree, eb);
+		if (ret) {
+			remove_cache_extent(&tree->cache, &eb->cache_node);
+			free(eb);
+			return NULL;
+		}
 		list_add_tail(&eb->lru, &tree->lru);
 		tree->cache_size += blocksize;
 		if (tree->cache_size >= tree->max_cache_size)
@@ -41,6 +41,9 @@
 #define EXTENT_CSUM		(1U << 9)
 #define EXTENT_BAD_TRANSID	(1U << 10)
 #define EXTENT_BUFFER_DUMMY	(1U << 11)
+#define EXTENT_BUFFER_READA	(1U << 12)
+#define EXTENT_BUFFER_REFERENCED	(1U << 13)
+#define EXTENT_BUFFER_HOT	(1U << 14)
 #define EXTENT_IOBITS (EXTENT_LOCKED | EXTENT_WRITEBACK)
 
 #define BLOCK_GROUP_DATA	(1U << 1)
@@ -70,12 +73,36 @@ static inline int le_test_bit(int nr, const u8 *addr)
 
 struct btrfs_fs_info;
 
+struct extent_buffer;
+
+/*
+ * Cached extent buffers are indexed by the cache tree for range lookups and
+ * by a hash table for exact lookups by start.
+ *
+ * Eviction uses two LRU lists (2Q): new buffers go to @lru and are only
+ * promoted to @lru_hot once they are looked up again after they have been
+ * used and released.  Trimming evicts from @lru first, so one pass over a
+ * large tree doesn't push out the hot root and upper level nodes.
+ */
 struct extent_io_tree {
 	struct cache_tree state;
 	struct cache_tree cache;
 	struct list_head lru;
+	struct list_head lru_hot;
+	struct extent_buffer **hash;
+	u32 hash_bits;
+	u64 nr_cached;
 	u64 cache_size;
+	u64 hot_size;
 	u64 max_cache_size;
+
+	/*
+	 * Statistics, each lookup of a tree block for its content is counted
+	 * once, by btrfs_find_tree_block() or read_tree_block()
+	 */
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 cache_evictions;
 };
 
 struct extent_state {
@@ -92,6 +119,7 @@ struct extent_buffer {
 	u64 start;
 	u64 dev_bytenr;
 	struct extent_io_tree *tree;
+	struct extent_buffer *hash_next;
 	struct list_head lru;
 	struct list_head recow;
 	u32 len;
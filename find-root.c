@@ -20,12 +20,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "ctree.h"
 #include "utils.h"
 #include "find-root.h"
 #include "volumes.h"
 #include "disk-io.h"
 #include "extent-cache.h"
+#include "tree-scan.h"
 
 /* Return value is the same as btrfs_find_root_search(). */
 static int add_eb_to_result(struct extent_buffer *eb,
@@ -96,54 +98,169 @@ static int add_eb_to_result(struct extent_buffer *eb,
 	return ret;
 }
 
+struct find_root_scan {
+	struct btrfs_find_root_filter *filter;
+	struct cache_tree *result;
+	struct cache_extent **match;
+	u32 nodesize;
+	pthread_mutex_t lock;
+	/* Keep *match valid until the other threads stopped */
+	int found;
+};
+
+/* Called from the scan threads */
+static int find_root_scan_block(struct tree_scan *scan, void *data,
+				struct tree_scan_block *block)
+{
+	struct find_root_scan *frs = scan->priv;
+	struct cache_extent *chunk = block->range->priv;
+	int ret;
+
+	/*
+	 * Only take the blocks of this chunk at nodesize offsets, like reading
+	 * the chunk by logical address would return them
+	 */
+	if (block->bytenr < chunk->start ||
+	    block->bytenr + frs->nodesize > chunk->start + chunk->size ||
+	    (block->bytenr - chunk->start) % frs->nodesize)
+		return 0;
+	if (block->owner != frs->filter->objectid)
+		return 0;
+
+	pthread_mutex_lock(&frs->lock);
+	if (frs->found)
+		ret = 1;
+	else
+		ret = add_eb_to_result(block->eb, frs->result, frs->nodesize,
+				       frs->filter, frs->match);
+	if (ret > 0)
+		frs->found = 1;
+	pthread_mutex_unlock(&frs->lock);
+	return ret;
+}
+
+static const struct tree_scan_ops find_root_scan_ops = {
+	.block = find_root_scan_block,
+};
+
+static int cmp_scan_range(const void *a, const void *b)
+{
+	const struct tree_scan_range *ra = a;
+	const struct tree_scan_range *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	if (ra->start > rb->start)
+		return 1;
+	return 0;
+}
+
+/* Add the stripes of the chunks of the given type on the device */
+static int add_chunk_ranges(struct btrfs_fs_info *fs_info, u64 type,
+			    struct btrfs_device *device,
+			    struct tree_scan_device *dev)
+{
+	struct cache_extent *ce;
+	struct map_lookup *map;
+	struct tree_scan_range *range;
+	u64 stripe_len;
+	int i;
+
+	for (ce = first_cache_extent(&fs_info->mapping_tree.cache_tree); ce;
+	     ce = next_cache_extent(ce)) {
+		map = container_of(ce, struct map_lookup, ce);
+		if (!(map->type & type))
+			continue;
+		stripe_len = calc_stripe_length(map->type, ce->size,
+						map->num_stripes);
+		for (i = 0; i < map->num_stripes; i++) {
+			if (map->stripes[i].dev != device)
+				continue;
+			range = realloc(dev->ranges,
+					(dev->nr_ranges + 1) * sizeof(*range));
+			if (!range)
+				return -ENOMEM;
+			dev->ranges = range;
+			range += dev->nr_ranges++;
+			range->start = map->stripes[i].physical;
+			range->end = range->start + stripe_len;
+			range->priv = ce;
+		}
+	}
+	qsort(dev->ranges, dev->nr_ranges, sizeof(*dev->ranges),
+	      cmp_scan_range);
+	return 0;
+}
+
 /*
  * Return 0 if iterating all the metadata extents.
  * Return 1 if found root with given gen/level and set *match to it.
  * Return <0 if error happens
+ *
+ * The stripes of the metadata (or system) chunks are read from all devices
+ * in parallel, so with search_all or without a match the blocks are found
+ * in no particular order.
  */
 int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
 			   struct btrfs_find_root_filter *filter,
 			   struct cache_tree *result,
 			   struct cache_extent **match)
 {
-	struct extent_buffer *eb;
-	u64 chunk_offset = 0;
-	u64 chunk_size = 0;
-	u64 offset = 0;
-	u32 nodesize = btrfs_super_nodesize(fs_info->super_copy);
-	int suppress_errors = 0;
+	struct find_root_scan frs = {
+		.filter = filter,
+		.result = result,
+		.match = match,
+		.nodesize = btrfs_super_nodesize(fs_info->super_copy),
+	};
+	struct tree_scan scan = {
+		.nodesize = frs.nodesize,
+		.sectorsize = btrfs_super_sectorsize(fs_info->super_copy),
+		.csum_size = btrfs_super_csum_size(fs_info->super_copy),
+		.ops = &find_root_scan_ops,
+		.priv = &frs,
+	};
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	struct tree_scan_device *devs = NULL;
+	struct tree_scan_device *dev;
+	u64 type = BTRFS_BLOCK_GROUP_METADATA;
+	int nr_devs = 0;
 	int ret = 0;
+	int i;
 
-	suppress_errors = fs_info->suppress_check_block_errors;
-	fs_info->suppress_check_block_errors = 1;
-	while (1) {
-		if (filter->objectid != BTRFS_CHUNK_TREE_OBJECTID)
-			ret = btrfs_next_bg_metadata(fs_info,
-						  &chunk_offset,
-						  &chunk_size);
-		else
-			ret = btrfs_next_bg_system(fs_info,
-						&chunk_offset,
-						&chunk_size);
-		if (ret) {
-			if (ret == -ENOENT)
-				ret = 0;
-			break;
-		}
-		for (offset = chunk_offset;
-		     offset < chunk_offset + chunk_size;
-		     offset += nodesize) {
-			eb = read_tree_block(fs_info, offset, 0);
-			if (!eb || IS_ERR(eb))
+	if (filter->objectid == BTRFS_CHUNK_TREE_OBJECTID)
+		type = BTRFS_BLOCK_GROUP_SYSTEM;
+
+	for (fs_devices = fs_info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed) {
+		list_for_each_entry(device, &fs_devices->devices, dev_list) {
+			if (device->fd < 0 || !device->name)
 				continue;
-			ret = add_eb_to_result(eb, result, nodesize, filter,
-					       match);
-			free_extent_buffer(eb);
-			if (ret)
+			dev = realloc(devs, (nr_devs + 1) * sizeof(*dev));
+			if (!dev) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			devs = dev;
+			dev += nr_devs++;
+			memset(dev, 0, sizeof(*dev));
+			dev->name = device->name;
+			dev->fsid = fs_devices->fsid;
+			ret = add_chunk_ranges(fs_info, type, device, dev);
+			if (ret < 0)
 				goto out;
+			/* Nothing to read, don't scan the whole device */
+			if (!dev->nr_ranges)
+				nr_devs--;
 		}
 	}
+
+	pthread_mutex_init(&frs.lock, NULL);
+	ret = tree_scan_devices(&scan, devs, nr_devs);
+	pthread_mutex_destroy(&frs.lock);
 out:
-	fs_info->suppress_check_block_errors = suppress_errors;
+	for (i = 0; i < nr_devs; i++)
+		free(devs[i].ranges);
+	free(devs);
 	return ret;
 }
@@ -25,6 +25,9 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <zlib.h>
+#if BTRFSIMAGE_ZSTD
+#include <zstd.h>
+#endif
 #include <getopt.h>
 
 #include "kerncompat.h"
@@ -36,12 +39,21 @@
 #include "volumes.h"
 #include "extent_io.h"
 #include "help.h"
+#include "internal.h"
 #include "image/metadump.h"
 #include "image/sanitize.h"
+#include "kernel-lib/bitops.h"
 
 #define MAX_WORKER_THREADS	(32)
 
+/*
+ * Number of metadata blocks that are read together with
+ * read_tree_block_batch() before they are copied to the dump
+ */
+#define METADUMP_READ_BATCH	(1024)
+
 struct async_work {
+	/* Link in metadump_struct::unread, then in the worker queue */
 	struct list_head list;
 	struct list_head ordered;
 	u64 start;
@@ -71,9 +83,24 @@ struct metadump_struct {
 	size_t num_items;
 	size_t num_ready;
 
+	/*
+	 * Metadata items queued in order but not read yet, and the number of
+	 * tree blocks they cover.  Only used by the main thread.
+	 */
+	struct list_head unread;
+	size_t num_unread;
+
 	u64 pending_start;
 	u64 pending_size;
 
+	/* Items written so far and the end of the last cluster, for --index */
+	struct meta_index_item *index;
+	u64 index_nr;
+	u64 index_alloc;
+	u64 out_bytes;
+	int write_index;
+
+	int compress_method;
 	int compress_level;
 	int done;
 	int data;
@@ -103,6 +130,12 @@ struct mdrestore_struct {
 	u8 uuid[BTRFS_UUID_SIZE];
 	u8 fsid[BTRFS_FSID_SIZE];
 
+	/* Index of the image if it has one, sorted by bytenr */
+	struct meta_index_item *index;
+	u64 index_nr;
+	/* End of the clusters, (u64)-1 if the image has no index */
+	u64 index_offset;
+
 	int compress_method;
 	int done;
 	int error;
@@ -337,12 +370,160 @@ static void copy_buffer(struct metadump_struct *md, u8 *dst,
 	csum_block(dst, src->len);
 }
 
+/*
+ * Compression state of one thread.  The zstd contexts are allocated on first
+ * use and reused for all items the thread processes.
+ */
+struct compress_ctx {
+#if BTRFSIMAGE_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+#endif
+};
+
+static void compress_ctx_release(struct compress_ctx *ctx)
+{
+#if BTRFSIMAGE_ZSTD
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+	ctx->cctx = NULL;
+	ctx->dctx = NULL;
+#endif
+}
+
+static const char *compress_method_name(int method)
+{
+	switch (method) {
+	case COMPRESS_NONE:
+		return "none";
+	case COMPRESS_ZLIB:
+		return "zlib";
+	case COMPRESS_ZSTD:
+		return "zstd";
+	}
+	return "unknown";
+}
+
+static int compress_method_supported(int method)
+{
+	switch (method) {
+	case COMPRESS_NONE:
+	case COMPRESS_ZLIB:
+		return 1;
+#if BTRFSIMAGE_ZSTD
+	case COMPRESS_ZSTD:
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+static size_t compress_bound(int method, size_t size)
+{
+#if BTRFSIMAGE_ZSTD
+	if (method == COMPRESS_ZSTD)
+		return ZSTD_compressBound(size);
+#endif
+	return compressBound(size);
+}
+
+/*
+ * Compress @in_size bytes from @in to @out, which has room for @out_size
+ * bytes.  On success @out_size is set to the compressed size.
+ */
+static int compress_buffer(struct compress_ctx *ctx, int method, int level,
+			   u8 *out, size_t *out_size, const u8 *in,
+			   size_t in_size)
+{
+	uLongf zsize = *out_size;
+	int ret;
+
+#if BTRFSIMAGE_ZSTD
+	if (method == COMPRESS_ZSTD) {
+		size_t zret;
+
+		if (!ctx->cctx) {
+			ctx->cctx = ZSTD_createCCtx();
+			if (!ctx->cctx)
+				return -ENOMEM;
+		}
+		zret = ZSTD_compressCCtx(ctx->cctx, out, *out_size, in, in_size,
+					 level);
+		if (ZSTD_isError(zret)) {
+			error("zstd compression failed: %s",
+			      ZSTD_getErrorName(zret));
+			return -EIO;
+		}
+		*out_size = zret;
+		return 0;
+	}
+#endif
+	ret = compress2(out, &zsize, in, in_size, level);
+	if (ret != Z_OK) {
+		error("compression failed with %d", ret);
+		return -EIO;
+	}
+	*out_size = zsize;
+	return 0;
+}
+
+/*
+ * Decompress @in_size bytes from @in to @out, which has room for @out_size
+ * bytes.  On success @out_size is set to the decompressed size.  @ctx may be
+ * NULL for one-off use.
+ */
+static int decompress_buffer(struct compress_ctx *ctx, int method, u8 *out,
+			     size_t *out_size, const u8 *in, size_t in_size)
+{
+	uLongf zsize = *out_size;
+	int ret;
+
+#if BTRFSIMAGE_ZSTD
+	if (method == COMPRESS_ZSTD) {
+		size_t zret;
+
+		if (ctx && !ctx->dctx) {
+			ctx->dctx = ZSTD_createDCtx();
+			if (!ctx->dctx)
+				return -ENOMEM;
+		}
+		if (ctx)
+			zret = ZSTD_decompressDCtx(ctx->dctx, out, *out_size,
+						   in, in_size);
+		else
+			zret = ZSTD_decompress(out, *out_size, in, in_size);
+		if (ZSTD_isError(zret)) {
+			error("zstd decompression failed: %s",
+			      ZSTD_getErrorName(zret));
+			return -EIO;
+		}
+		*out_size = zret;
+		return 0;
+	}
+#endif
+	if (method != COMPRESS_ZLIB) {
+		error("unsupported compression method %s",
+		      compress_method_name(method));
+		return -EOPNOTSUPP;
+	}
+	ret = uncompress(out, &zsize, in, in_size);
+	if (ret != Z_OK) {
+		error("decompression failed with %d", ret);
+		return -EIO;
+	}
+	*out_size = zsize;
+	return 0;
+}
+
 static void *dump_worker(void *data)
 {
 	struct metadump_struct *md = (struct metadump_struct *)data;
+	struct compress_ctx cctx;
 	struct async_work *async;
 	int ret;
 
+	memset(&cctx, 0, sizeof(cctx));
+
 	while (1) {
 		pthread_mutex_lock(&md->mutex);
 		while (list_empty(&md->list)) {
@@ -359,7 +540,8 @@ static void *dump_worker(void *data)
 		if (md->compress_level > 0) {
 			u8 *orig = async->buffer;
 
-			async->bufsize = compressBound(async->size);
+			async->bufsize = compress_bound(md->compress_method,
+							async->size);
 			async->buffer = malloc(async->bufsize);
 			if (!async->buffer) {
 				error("not enough memory for async buffer");
@@ -367,14 +549,15 @@ static void *dump_worker(void *data)
 				if (!md->error)
 					md->error = -ENOMEM;
 				pthread_mutex_unlock(&md->mutex);
+				compress_ctx_release(&cctx);
 				pthread_exit(NULL);
 			}
 
-			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
-
-			if (ret != Z_OK)
+			ret = compress_buffer(&cctx, md->compress_method,
+					      md->compress_level,
+					      async->buffer, &async->bufsize,
+					      orig, async->size);
+			if (ret)
 				async->error = 1;
 
 			free(orig);
@@ -385,6 +568,7 @@ static void *dump_worker(void *data)
 		pthread_mutex_unlock(&md->mutex);
 	}
 out:
+	compress_ctx_release(&cctx);
 	pthread_exit(NULL);
 }
 
@@ -399,7 +583,7 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 	header->bytenr = cpu_to_le64(start);
 	header->nritems = cpu_to_le32(0);
 	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+			   md->compress_method : COMPRESS_NONE;
 }
 
 static void metadump_destroy(struct metadump_struct *md, int num_threads)
@@ -427,20 +611,23 @@ static void metadump_destroy(struct metadump_struct *md, int num_threads)
 		free(name->sub);
 		free(name);
 	}
+	free(md->index);
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
-			 enum sanitize_mode sanitize_names)
+			 FILE *out, int num_threads, int compress_method,
+			 int compress_level, enum sanitize_mode sanitize_names)
 {
 	int i, ret = 0;
 
 	memset(md, 0, sizeof(*md));
 	INIT_LIST_HEAD(&md->list);
 	INIT_LIST_HEAD(&md->ordered);
+	INIT_LIST_HEAD(&md->unread);
 	md->root = root;
 	md->out = out;
 	md->pending_start = (u64)-1;
+	md->compress_method = compress_method;
 	md->compress_level = compress_level;
 	md->sanitize_names = sanitize_names;
 	if (sanitize_names == SANITIZE_COLLISIONS)
@@ -473,6 +660,81 @@ static int write_zero(FILE *out, size_t size)
 	return fwrite(zero, size, 1, out);
 }
 
+static int add_index_item(struct metadump_struct *md,
+			  struct async_work *async, u64 offset)
+{
+	struct meta_index_item *item;
+
+	if (md->index_nr == md->index_alloc) {
+		u64 nr = max_t(u64, md->index_alloc * 2, 1024);
+
+		item = realloc(md->index, nr * sizeof(*item));
+		if (!item) {
+			error("not enough memory for image index");
+			return -ENOMEM;
+		}
+		md->index = item;
+		md->index_alloc = nr;
+	}
+	item = &md->index[md->index_nr++];
+	item->bytenr = cpu_to_le64(async->start);
+	item->offset = cpu_to_le64(offset);
+	item->len = cpu_to_le32(async->size);
+	item->size = cpu_to_le32(async->bufsize);
+	return 0;
+}
+
+static int cmp_index_item(const void *a, const void *b)
+{
+	const struct meta_index_item *ia = a;
+	const struct meta_index_item *ib = b;
+	u64 bytenr_a = le64_to_cpu(ia->bytenr);
+	u64 bytenr_b = le64_to_cpu(ib->bytenr);
+
+	if (bytenr_a != bytenr_b)
+		return bytenr_a < bytenr_b ? -1 : 1;
+	return 0;
+}
+
+/* Append the index of all written items and the footer to the image */
+static int write_image_index(struct metadump_struct *md)
+{
+	struct meta_footer *footer;
+	char block[BLOCK_SIZE];
+	size_t size = md->index_nr * sizeof(*md->index);
+	u32 crc;
+
+	qsort(md->index, md->index_nr, sizeof(*md->index), cmp_index_item);
+	crc = crc32c(~(u32)0, (u8 *)md->index, size);
+
+	if (size && fwrite(md->index, size, 1, md->out) != 1) {
+		error("unable to write image index: %m");
+		return -errno;
+	}
+	memset(block, 0, sizeof(block));
+	if ((md->out_bytes + size) & BLOCK_MASK) {
+		size_t pad = BLOCK_SIZE - ((md->out_bytes + size) & BLOCK_MASK);
+
+		if (fwrite(block, pad, 1, md->out) != 1) {
+			error("unable to write image index: %m");
+			return -errno;
+		}
+	}
+
+	footer = (struct meta_footer *)block;
+	footer->magic = cpu_to_le64(FOOTER_MAGIC);
+	footer->index_offset = cpu_to_le64(md->out_bytes);
+	footer->nritems = cpu_to_le64(md->index_nr);
+	footer->csum = cpu_to_le32(crc);
+	footer->compress = md->compress_level > 0 ?
+			   md->compress_method : COMPRESS_NONE;
+	if (fwrite(block, BLOCK_SIZE, 1, md->out) != 1) {
+		error("unable to write image footer: %m");
+		return -errno;
+	}
+	return 0;
+}
+
 static int write_buffers(struct metadump_struct *md, u64 *next)
 {
 	struct meta_cluster_header *header = &md->cluster.header;
@@ -504,6 +766,15 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 		goto out;
 	}
 
+	list_for_each_entry(async, &md->ordered, ordered) {
+		if (async->error) {
+			error("unable to compress buffer at %llu",
+			      (unsigned long long)async->start);
+			err = -EIO;
+			goto out;
+		}
+	}
+
 	/* setup and write index block */
 	list_for_each_entry(async, &md->ordered, ordered) {
 		item = &md->cluster.items[nritems];
@@ -526,6 +797,8 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 				   ordered);
 		list_del_init(&async->ordered);
 
+		if (!err && md->write_index)
+			err = add_index_item(md, async, bytenr);
 		bytenr += async->bufsize;
 		if (!err)
 			ret = fwrite(async->buffer, async->bufsize, 1,
@@ -551,6 +824,8 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 			err = -errno;
 		}
 	}
+	if (!err)
+		md->out_bytes = bytenr;
 out:
 	*next = bytenr;
 	return err;
@@ -599,13 +874,87 @@ static int get_dev_fd(struct btrfs_root *root)
 	return dev->fd;
 }
 
+/* Pass a filled item to the compression workers, called with md->mutex held */
+static void queue_async_work(struct metadump_struct *md,
+			     struct async_work *async)
+{
+	if (md->compress_level > 0) {
+		list_add_tail(&async->list, &md->list);
+		pthread_cond_signal(&md->cond);
+	} else {
+		md->num_ready++;
+	}
+}
+
+/*
+ * Read the tree blocks of all unread items at once, so the reads are spread
+ * over the reader threads of read_tree_block_batch() instead of being done one
+ * by one.  The blocks are then copied to the item buffers, and the items passed
+ * on to the workers, in the order they were added.
+ */
+static int read_unread_items(struct metadump_struct *md)
+{
+	struct btrfs_fs_info *fs_info = md->root->fs_info;
+	struct async_work *async;
+	struct extent_buffer *eb;
+	u64 *bytenrs;
+	u64 start;
+	u64 offset;
+	int nr = 0;
+	int ret = 0;
+
+	if (list_empty(&md->unread))
+		return 0;
+
+	/* If this fails, read_tree_block() below reads the blocks one by one */
+	bytenrs = malloc(md->num_unread * sizeof(*bytenrs));
+	if (bytenrs) {
+		list_for_each_entry(async, &md->unread, list) {
+			for (offset = 0; offset < async->size;
+			     offset += fs_info->nodesize)
+				bytenrs[nr++] = async->start + offset;
+		}
+		read_tree_block_batch(fs_info, bytenrs, NULL, nr);
+		free(bytenrs);
+	}
+
+	while (!ret && !list_empty(&md->unread)) {
+		async = list_entry(md->unread.next, struct async_work, list);
+		list_del_init(&async->list);
+
+		for (offset = 0; offset < async->size;
+		     offset += fs_info->nodesize) {
+			start = async->start + offset;
+			eb = read_tree_block(fs_info, start, 0);
+			if (!extent_buffer_uptodate(eb)) {
+				error("unable to read metadata block %llu",
+					(unsigned long long)start);
+				ret = -EIO;
+				break;
+			}
+			copy_buffer(md, async->buffer + offset, eb);
+			free_extent_buffer(eb);
+		}
+
+		pthread_mutex_lock(&md->mutex);
+		if (ret) {
+			async->error = 1;
+			if (!md->error)
+				md->error = ret;
+		}
+		queue_async_work(md, async);
+		pthread_mutex_unlock(&md->mutex);
+	}
+	md->num_unread = 0;
+	return ret;
+}
+
 static int flush_pending(struct metadump_struct *md, int done)
 {
 	struct async_work *async = NULL;
-	struct extent_buffer *eb;
 	u64 start = 0;
 	u64 size;
-	size_t offset;
+	int unread = 0;
 	int ret = 0;
 
 	if (md->pending_size) {
@@ -621,7 +970,6 @@ static int flush_pending(struct metadump_struct *md, int done)
 			free(async);
 			return -ENOMEM;
 		}
-		offset = 0;
 		start = async->start;
 		size = async->size;
 
@@ -653,24 +1001,8 @@ static int flush_pending(struct metadump_struct *md, int done)
 			ret = 0;
 		}
 
-		while (!md->data && size > 0) {
-			u64 this_read = min((u64)md->root->fs_info->nodesize,
-					size);
-
-			eb = read_tree_block(md->root->fs_info, start, 0);
-			if (!extent_buffer_uptodate(eb)) {
-				free(async->buffer);
-				free(async);
-				error("unable to read metadata block %llu",
-					(unsigned long long)start);
-				return -EIO;
-			}
-			copy_buffer(md, async->buffer + offset, eb);
-			free_extent_buffer(eb);
-			start += this_read;
-			offset += this_read;
-			size -= this_read;
-		}
+		/* Tree blocks are read in batches by read_unread_items() */
+		unread = !md->data && size > 0;
 
 		md->pending_start = (u64)-1;
 		md->pending_size = 0;
@@ -678,17 +1010,28 @@ static int flush_pending(struct metadump_struct *md, int done)
 		return 0;
 	}
 
-	pthread_mutex_lock(&md->mutex);
 	if (async) {
+		pthread_mutex_lock(&md->mutex);
 		list_add_tail(&async->ordered, &md->ordered);
 		md->num_items++;
-		if (md->compress_level > 0) {
-			list_add_tail(&async->list, &md->list);
-			pthread_cond_signal(&md->cond);
+		if (unread) {
+			list_add_tail(&async->list, &md->unread);
+			md->num_unread += DIV_ROUND_UP(async->size,
+						md->root->fs_info->nodesize);
 		} else {
-			md->num_ready++;
+			queue_async_work(md, async);
 		}
+		pthread_mutex_unlock(&md->mutex);
+	}
+
+	if (md->num_unread >= METADUMP_READ_BATCH ||
+	    md->num_items >= ITEMS_PER_CLUSTER || done) {
+		ret = read_unread_items(md);
+		if (ret)
+			return ret;
 	}
+
+	pthread_mutex_lock(&md->mutex);
 	if (md->num_items >= ITEMS_PER_CLUSTER || done) {
 		ret = write_buffers(md, &start);
 		if (ret) {
@@ -714,7 +1057,6 @@ static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 			return ret;
 		md->pending_start = start;
 	}
-	readahead_tree_block(md->root->fs_info, start, 0);
 	md->pending_size += size;
 	md->data = data;
 	return 0;
@@ -757,6 +1099,28 @@ static int is_tree_block(struct btrfs_root *extent_root,
 }
 #endif
 
+/* Read all children of the node @eb in one batch */
+static void read_child_blocks(struct btrfs_fs_info *fs_info,
+			      struct extent_buffer *eb)
+{
+	u32 nritems = btrfs_header_nritems(eb);
+	u64 *bytenrs;
+	u64 *gens;
+	u32 i;
+
+	bytenrs = malloc(nritems * sizeof(*bytenrs));
+	gens = malloc(nritems * sizeof(*gens));
+	if (bytenrs && gens) {
+		for (i = 0; i < nritems; i++) {
+			bytenrs[i] = btrfs_node_blockptr(eb, i);
+			gens[i] = btrfs_node_ptr_generation(eb, i);
+		}
+		read_tree_block_batch(fs_info, bytenrs, gens, nritems);
+	}
+	free(bytenrs);
+	free(gens);
+}
+
 static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 			    struct metadump_struct *metadump, int root_tree)
 {
@@ -783,6 +1147,8 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 
 	level = btrfs_header_level(eb);
 	nritems = btrfs_header_nritems(eb);
+	if (level > 0)
+		read_child_blocks(fs_info, eb);
 	for (i = 0; i < nritems; i++) {
 		if (level == 0) {
 			btrfs_item_key_to_cpu(eb, &key, i);
@@ -1008,8 +1374,9 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 }
 
 static int create_metadump(const char *input, FILE *out, int num_threads,
-			   int compress_level, enum sanitize_mode sanitize,
-			   int walk_trees)
+			   int compress_method, int compress_level,
+			   enum sanitize_mode sanitize, int walk_trees,
+			   int write_index)
 {
 	struct btrfs_root *root;
 	struct btrfs_path path;
@@ -1024,12 +1391,13 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 	}
 
 	ret = metadump_init(&metadump, root, out, num_threads,
-			    compress_level, sanitize);
+			    compress_method, compress_level, sanitize);
 	if (ret) {
 		error("failed to initialize metadump: %d", ret);
 		close_ctree(root);
 		return ret;
 	}
+	metadump.write_index = write_index;
 
 	ret = add_extent(BTRFS_SUPER_INFO_OFFSET, BTRFS_SUPER_INFO_SIZE,
 			&metadump, 0);
@@ -1077,6 +1445,11 @@ out:
 			err = ret;
 		error("failed to flush pending data: %d", ret);
 	}
+	if (!err && write_index) {
+		ret = write_image_index(&metadump);
+		if (ret)
+			err = ret;
+	}
 
 	metadump_destroy(&metadump, num_threads);
 
@@ -1368,6 +1741,7 @@ static void write_backup_supers(int fd, u8 *buf)
 static void *restore_worker(void *data)
 {
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
+	struct compress_ctx dctx;
 	struct async_work *async;
 	size_t size;
 	u8 *buffer;
@@ -1376,6 +1750,8 @@ static void *restore_worker(void *data)
 	int ret;
 	int compress_size = MAX_PENDING_SIZE * 4;
 
+	memset(&dctx, 0, sizeof(dctx));
+
 	outfd = fileno(mdres->out);
 	buffer = malloc(compress_size);
 	if (!buffer) {
@@ -1390,6 +1766,7 @@ static void *restore_worker(void *data)
 	while (1) {
 		u64 bytenr, physical_dup;
 		off_t offset = 0;
+		int method;
 		int err = 0;
 
 		pthread_mutex_lock(&mdres->mutex);
@@ -1402,16 +1779,22 @@ static void *restore_worker(void *data)
 		}
 		async = list_entry(mdres->list.next, struct async_work, list);
 		list_del_init(&async->list);
+		method = mdres->compress_method;
+		pthread_mutex_unlock(&mdres->mutex);
 
-		if (mdres->compress_method == COMPRESS_ZLIB) {
-			size = compress_size; 
-			pthread_mutex_unlock(&mdres->mutex);
-			ret = uncompress(buffer, (unsigned long *)&size,
-					 async->buffer, async->bufsize);
-			pthread_mutex_lock(&mdres->mutex);
-			if (ret != Z_OK) {
-				error("decompression failed with %d", ret);
-				err = -EIO;
+		/*
+		 * The restore state used below (chunk mapping, nodesize, fsid,
+		 * ...) is set up before the first item is queued and read-only
+		 * afterwards, so the items are processed and written in
+		 * parallel without holding the lock.
+		 */
+		if (method != COMPRESS_NONE) {
+			size = compress_size;
+			ret = decompress_buffer(&dctx, method, buffer, &size,
+						async->buffer, async->bufsize);
+			if (ret) {
+				err = ret;
+				goto next;
 			}
 			outbuf = buffer;
 		} else {
@@ -1471,6 +1854,7 @@ error:
 					error("short write");
 					err = -EIO;
 				}
+				break;
 			}
 		} else if (async->start != BTRFS_SUPER_INFO_OFFSET) {
 			ret = write_data_to_disk(mdres->info, outbuf, async->start, size, 0);
@@ -1485,6 +1869,8 @@ error:
 		if (!mdres->multi_devices && async->start == BTRFS_SUPER_INFO_OFFSET)
 			write_backup_supers(outfd, outbuf);
 
+next:
+		pthread_mutex_lock(&mdres->mutex);
 		if (err && !mdres->error)
 			mdres->error = err;
 		mdres->num_items--;
@@ -1494,6 +1880,7 @@ error:
 		free(async);
 	}
 out:
+	compress_ctx_release(&dctx);
 	free(buffer);
 	pthread_exit(NULL);
 }
@@ -1521,6 +1908,106 @@ static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 
 	pthread_cond_destroy(&mdres->cond);
 	pthread_mutex_destroy(&mdres->mutex);
+	free(mdres->index);
+}
+
+/*
+ * Load the index of an image created with --index.  Images without an index,
+ * or read from stdin, are restored by scanning the clusters.  The footer
+ * isn't checksummed, its values are bounded by the size of the image.  The
+ * clusters end at mdres->index_offset once the footer looks sane, even if the
+ * index items turn out to be unusable and only they are ignored.
+ */
+static int load_image_index(struct mdrestore_struct *mdres)
+{
+	struct meta_footer *footer;
+	char block[BLOCK_SIZE];
+	off_t footer_offset;
+	u64 index_offset;
+	u64 nritems;
+	size_t size;
+	u32 crc;
+	int ret = 0;
+
+	mdres->index_offset = (u64)-1;
+	if (mdres->in == stdin)
+		return 0;
+
+	if (fseeko(mdres->in, -BLOCK_SIZE, SEEK_END) ||
+	    (footer_offset = ftello(mdres->in)) < 0 ||
+	    fread(block, BLOCK_SIZE, 1, mdres->in) != 1)
+		goto out;
+	footer = (struct meta_footer *)block;
+	if (le64_to_cpu(footer->magic) != FOOTER_MAGIC)
+		goto out;
+
+	index_offset = le64_to_cpu(footer->index_offset);
+	nritems = le64_to_cpu(footer->nritems);
+	if (index_offset & BLOCK_MASK || index_offset > footer_offset ||
+	    nritems > (footer_offset - index_offset) / sizeof(*mdres->index)) {
+		warning("image index is corrupted, ignoring it");
+		goto out;
+	}
+	mdres->index_offset = index_offset;
+	if (!compress_method_supported(footer->compress)) {
+		warning("image index with unsupported compression %s, ignoring it",
+			compress_method_name(footer->compress));
+		goto out;
+	}
+
+	size = nritems * sizeof(*mdres->index);
+	mdres->index = malloc(size ? size : 1);
+	if (!mdres->index) {
+		error("not enough memory for image index");
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (fseeko(mdres->in, index_offset, SEEK_SET) ||
+	    (size && fread(mdres->index, size, 1, mdres->in) != 1)) {
+		warning("unable to read image index, ignoring it");
+		goto out_free;
+	}
+	crc = crc32c(~(u32)0, (u8 *)mdres->index, size);
+	if (crc != le32_to_cpu(footer->csum)) {
+		warning("image index is corrupted, ignoring it");
+		goto out_free;
+	}
+	mdres->index_nr = nritems;
+	goto out;
+
+out_free:
+	free(mdres->index);
+	mdres->index = NULL;
+out:
+	if (fseeko(mdres->in, 0, SEEK_SET)) {
+		error("seek failed: %m");
+		ret = -EIO;
+	}
+	return ret;
+}
+
+/* Find the index item that covers @bytenr */
+static struct meta_index_item *find_index_item(struct mdrestore_struct *mdres,
+					       u64 bytenr)
+{
+	struct meta_index_item *item;
+	u64 lo = 0;
+	u64 hi = mdres->index_nr;
+	u64 mid;
+	u64 start;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		item = &mdres->index[mid];
+		start = le64_to_cpu(item->bytenr);
+		if (bytenr < start)
+			hi = mid;
+		else if (bytenr >= start + le32_to_cpu(item->len))
+			lo = mid + 1;
+		else
+			return item;
+	}
+	return NULL;
 }
 
 static int mdrestore_init(struct mdrestore_struct *mdres,
@@ -1545,6 +2032,7 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 	mdres->clear_space_cache = 0;
 	mdres->last_physical_offset = 0;
 	mdres->alloced_chunks = 0;
+	mdres->index_offset = (u64)-1;
 
 	if (!num_threads)
 		return 0;
@@ -1576,18 +2064,17 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	if (mdres->nodesize)
 		return 0;
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 
 		buffer = malloc(MAX_PENDING_SIZE * 2);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			error("decompression failed with %d", ret);
+		ret = decompress_buffer(NULL, mdres->compress_method, buffer,
+					&size, async->buffer, async->bufsize);
+		if (ret) {
 			free(buffer);
-			return -EIO;
+			return ret;
 		}
 		outbuf = buffer;
 	} else {
@@ -1614,6 +2101,11 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
+	if (!compress_method_supported(header->compress)) {
+		error("unsupported compression method %s in metadump image",
+		      compress_method_name(header->compress));
+		return -EOPNOTSUPP;
+	}
 	pthread_mutex_lock(&mdres->mutex);
 	mdres->compress_method = header->compress;
 	pthread_mutex_unlock(&mdres->mutex);
@@ -1805,6 +2297,69 @@ out:
 	return ret;
 }
 
+/* Read the chunk tree block at @search using the image index */
+static int search_index_for_chunk_block(struct mdrestore_struct *mdres,
+					u64 search)
+{
+	struct meta_index_item *item;
+	u32 max_size = MAX_PENDING_SIZE * 2;
+	u8 *buffer;
+	u8 *tmp = NULL;
+	size_t size;
+	u32 bufsize;
+	int ret;
+
+	item = find_index_item(mdres, search);
+	if (!item) {
+		error("chunk tree block %llu not found in image index",
+		      (unsigned long long)search);
+		return -EIO;
+	}
+	bufsize = le32_to_cpu(item->size);
+	size = le32_to_cpu(item->len);
+	if (bufsize > max_size || size > max_size) {
+		error("index item at %llu too big: %u > %u",
+		      (unsigned long long)le64_to_cpu(item->bytenr),
+		      max(bufsize, (u32)size), max_size);
+		return -EIO;
+	}
+
+	buffer = malloc(bufsize);
+	if (!buffer) {
+		error("not enough memory for buffer");
+		return -ENOMEM;
+	}
+	if (fseeko(mdres->in, le64_to_cpu(item->offset), SEEK_SET) ||
+	    fread(buffer, bufsize, 1, mdres->in) != 1) {
+		error("unable to read image at %llu: %m",
+		      (unsigned long long)le64_to_cpu(item->offset));
+		ret = -EIO;
+		goto out;
+	}
+
+	if (mdres->compress_method != COMPRESS_NONE) {
+		tmp = buffer;
+		buffer = malloc(max_size);
+		if (!buffer) {
+			error("not enough memory for buffer");
+			ret = -ENOMEM;
+			goto out;
+		}
+		size = max_size;
+		ret = decompress_buffer(NULL, mdres->compress_method, buffer,
+					&size, tmp, bufsize);
+		if (ret)
+			goto out;
+	}
+
+	ret = read_chunk_block(mdres, buffer, search,
+			       le64_to_cpu(item->bytenr), size, 0);
+out:
+	free(tmp);
+	free(buffer);
+	return ret;
+}
+
 /* If you have to ask you aren't worthy */
 static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				   u64 search, u64 cluster_bytenr)
@@ -1819,6 +2374,9 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 	u8 *buffer, *tmp = NULL;
 	int ret = 0;
 
+	if (mdres->index)
+		return search_index_for_chunk_block(mdres, search);
+
 	cluster = malloc(BLOCK_SIZE);
 	if (!cluster) {
 		error("not enough memory for cluster");
@@ -1832,7 +2390,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 		return -ENOMEM;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		tmp = malloc(max_size);
 		if (!tmp) {
 			error("not enough memory for buffer");
@@ -1850,7 +2408,11 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 			break;
 		}
 
-		ret = fread(cluster, BLOCK_SIZE, 1, mdres->in);
+		/* Stop at the index as if it was the end of the image */
+		if (current_cluster < mdres->index_offset)
+			ret = fread(cluster, BLOCK_SIZE, 1, mdres->in);
+		else
+			ret = 0;
 		if (ret == 0) {
 			if (cluster_bytenr != 0) {
 				cluster_bytenr = 0;
@@ -1894,7 +2456,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				break;
 			}
 
-			if (mdres->compress_method == COMPRESS_ZLIB) {
+			if (mdres->compress_method != COMPRESS_NONE) {
 				ret = fread(tmp, bufsize, 1, mdres->in);
 				if (ret != 1) {
 					error("read error: %m");
@@ -1903,15 +2465,11 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				}
 
 				size = max_size;
-				ret = uncompress(buffer,
-						 (unsigned long *)&size, tmp,
-						 bufsize);
-				if (ret != Z_OK) {
-					error("decompression failed with %d",
-							ret);
-					ret = -EIO;
+				ret = decompress_buffer(NULL,
+						mdres->compress_method, buffer,
+						&size, tmp, bufsize);
+				if (ret)
 					break;
-				}
 			} else {
 				ret = fread(buffer, bufsize, 1, mdres->in);
 				if (ret != 1) {
@@ -1981,6 +2539,11 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	}
 
 	bytenr += BLOCK_SIZE;
+	if (!compress_method_supported(header->compress)) {
+		error("unsupported compression method %s in metadump image",
+		      compress_method_name(header->compress));
+		return -EOPNOTSUPP;
+	}
 	mdres->compress_method = header->compress;
 	nritems = le32_to_cpu(header->nritems);
 	for (i = 0; i < nritems; i++) {
@@ -2014,7 +2577,7 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		return -EIO;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 		u8 *tmp;
 
@@ -2023,13 +2586,12 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 			free(buffer);
 			return -ENOMEM;
 		}
-		ret = uncompress(tmp, (unsigned long *)&size,
-				 buffer, le32_to_cpu(item->size));
-		if (ret != Z_OK) {
-			error("decompression failed with %d", ret);
+		ret = decompress_buffer(NULL, mdres->compress_method, tmp,
+					&size, buffer, le32_to_cpu(item->size));
+		if (ret) {
 			free(buffer);
 			free(tmp);
-			return -EIO;
+			return ret;
 		}
 		free(buffer);
 		buffer = tmp;
@@ -2227,6 +2789,10 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 		goto failed_cluster;
 	}
 
+	ret = load_image_index(&mdrestore);
+	if (ret)
+		goto out;
+
 	if (!multi_devices && !old_restore) {
 		ret = build_chunk_tree(&mdrestore, cluster);
 		if (ret)
@@ -2241,6 +2807,8 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 	}
 
 	while (!mdrestore.error) {
+		if (bytenr >= mdrestore.index_offset)
+			break;
 		ret = fread(cluster, BLOCK_SIZE, 1, in);
 		if (!ret)
 			break;
@@ -2402,7 +2970,10 @@ static void print_usage(int ret)
 {
 	printf("usage: btrfs-image [options] source target\n");
 	printf("\t-r      \trestore metadump image\n");
-	printf("\t-c value\tcompression level (0 ~ 9)\n");
+	printf("\t-c value\tcompression level (0 ~ 9 for zlib, 0 ~ 19 for zstd)\n");
+	printf("\t--compress method\n");
+	printf("\t        \tcompression method: zlib (default) or zstd\n");
+	printf("\t--index \tappend an index of the blocks to the image\n");
 	printf("\t-t value\tnumber of threads (1 ~ 32)\n");
 	printf("\t-o      \tdon't mess with the chunk tree when restoring\n");
 	printf("\t-s      \tsanitize file names, use once to just use garbage, use twice if you want crc collisions\n");
@@ -2420,6 +2991,9 @@ int main(int argc, char *argv[])
 	char *target;
 	u64 num_threads = 0;
 	u64 compress_level = 0;
+	int compress_method = COMPRESS_NONE;
+	bool compress_level_set = false;
+	int write_index = 0;
 	int create = 1;
 	int old_restore = 0;
 	int walk_trees = 0;
@@ -2431,7 +3005,11 @@ int main(int argc, char *argv[])
 	FILE *out;
 
 	while (1) {
+		enum { GETOPT_VAL_COMPRESS = 256, GETOPT_VAL_INDEX };
 		static const struct option long_options[] = {
+			{ "compress", required_argument, NULL,
+				GETOPT_VAL_COMPRESS },
+			{ "index", no_argument, NULL, GETOPT_VAL_INDEX },
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
 			{ NULL, 0, NULL, 0 }
 		};
@@ -2453,12 +3031,26 @@ int main(int argc, char *argv[])
 			break;
 		case 'c':
 			compress_level = arg_strtou64(optarg);
-			if (compress_level > 9) {
-				error("compression level out of range: %llu",
-					(unsigned long long)compress_level);
+			compress_level_set = true;
+			break;
+		case GETOPT_VAL_COMPRESS:
+			if (!strcmp(optarg, "zlib")) {
+				compress_method = COMPRESS_ZLIB;
+			} else if (!strcmp(optarg, "zstd")) {
+				compress_method = COMPRESS_ZSTD;
+			} else {
+				error("unknown compression method: %s", optarg);
+				return 1;
+			}
+			if (!compress_method_supported(compress_method)) {
+				error("%s compression support not built in",
+				      optarg);
 				return 1;
 			}
 			break;
+		case GETOPT_VAL_INDEX:
+			write_index = 1;
+			break;
 		case 'o':
 			old_restore = 1;
 			break;
@@ -2485,6 +3077,18 @@ int main(int argc, char *argv[])
 	if (check_argc_min(argc - optind, 2))
 		print_usage(1);
 
+	if (compress_method == COMPRESS_NONE) {
+		compress_method = COMPRESS_ZLIB;
+	} else if (!compress_level_set) {
+		/* --compress without -c uses the library default level */
+		compress_level = compress_method == COMPRESS_ZSTD ? 3 : 6;
+	}
+	if (compress_level > (compress_method == COMPRESS_ZSTD ? 19 : 9)) {
+		error("compression level out of range: %llu",
+			(unsigned long long)compress_level);
+		return 1;
+	}
+
 	dev_cnt = argc - optind - 1;
 
 	if (create) {
@@ -2494,9 +3098,10 @@ int main(int argc, char *argv[])
 			usage_error++;
 		}
 	} else {
-		if (walk_trees || sanitize != SANITIZE_NONE || compress_level) {
+		if (walk_trees || sanitize != SANITIZE_NONE || compress_level ||
+		    compress_method != COMPRESS_ZLIB || write_index) {
 			error(
-			"using -w, -s, -c options for restore makes no sense");
+	"using -w, -s, -c, --compress, --index options for restore makes no sense");
 			usage_error++;
 		}
 		if (multi_devices && dev_cnt < 2) {
@@ -2548,7 +3153,8 @@ int main(int argc, char *argv[])
 		}
 
 		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees);
+				      compress_method, compress_level, sanitize,
+				      walk_trees, write_index);
 	} else {
 		ret = restore_metadump(source, out, old_restore, num_threads,
 				       0, target, multi_devices);
@@ -32,6 +32,7 @@
 
 #define COMPRESS_NONE		0
 #define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
 
 struct meta_cluster_item {
 	__le64 bytenr;
@@ -51,6 +52,33 @@ struct meta_cluster {
 	struct meta_cluster_item items[];
 } __attribute__ ((__packed__));
 
+/*
+ * Optional index at the end of the image (btrfs-image --index).  After the
+ * last cluster there is an array of meta_index_item sorted by bytenr, then one
+ * block that starts with meta_footer.  The footer is found at BLOCK_SIZE
+ * before the end of the image.
+ */
+#define FOOTER_MAGIC		0x7a5e45c2d1f0b6a9ULL
+
+struct meta_index_item {
+	__le64 bytenr;
+	/* Position of the item data in the image */
+	__le64 offset;
+	/* Bytes covered in the filesystem, and stored in the image */
+	__le32 len;
+	__le32 size;
+} __attribute__ ((__packed__));
+
+struct meta_footer {
+	__le64 magic;
+	/* Position of the first index item, also the end of the clusters */
+	__le64 index_offset;
+	__le64 nritems;
+	/* crc32c of the index items */
+	__le32 csum;
+	u8 compress;
+} __attribute__ ((__packed__));
+
 struct fs_chunk {
 	u64 logical;
 	u64 physical;
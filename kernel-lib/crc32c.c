@@ -16,6 +16,9 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length);
 static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) = __crc32c_le;
@@ -42,6 +45,7 @@ static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) =
 
 static int crc32c_probed = 0;
 static int crc32c_intel_available = 0;
+static int crc32c_pclmul_available = 0;
 
 static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 					unsigned long length)
@@ -109,15 +113,185 @@ static void crc32c_intel_probe(void)
 
 		do_cpuid(&eax, &ebx, &ecx, &edx);
 		crc32c_intel_available = (ecx & (1 << 20)) != 0;
+		crc32c_pclmul_available = (ecx & (1 << 1)) != 0;
 		crc32c_probed = 1;
 	}
 }
 
+/*
+ * Three way interleaved CRC32C for long buffers
+ *
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one per
+ * cycle, so a single dependency chain leaves the unit idle most of the time.
+ * The buffer is split into three blocks that are checksummed in parallel and
+ * the partial crcs are combined by shifting them by the length of the blocks
+ * that follow:
+ *
+ *   crc(A|B|C) = shift(crc(A), |B| + |C|) ^ shift(crc(B), |C|) ^ crc(C)
+ *
+ * where crc(B) and crc(C) start from 0.  The shift is a multiplication by
+ * x^(8 * len) modulo the polynomial, done with one carry-less multiplication
+ * (PCLMULQDQ) by a precomputed constant and one crc32 instruction for the
+ * reduction.
+ */
+#define CRC32C_POLY		0x82F63B78
+
+/*
+ * Bytes per stream, the largest that fits is used first.  The sizes are chosen
+ * so that 4K sectors and 16K tree blocks leave only a few bytes behind.
+ */
+static const unsigned int crc32c_3way_blocks[] = { 5448, 1360, 256, 64 };
+static u64 crc32c_3way_shift1[ARRAY_SIZE(crc32c_3way_blocks)];
+static u64 crc32c_3way_shift2[ARRAY_SIZE(crc32c_3way_blocks)];
+
+/* Multiply a and b modulo the polynomial, bit 31 is the coefficient of x^0 */
+static u32 crc32c_multmodp(u32 a, u32 b)
+{
+	u32 m = 1U << 31;
+	u32 p = 0;
+
+	if (!a)
+		return 0;
+	while (1) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^n modulo the polynomial */
+static u32 crc32c_xpow(u64 n)
+{
+	u32 p = 1U << 31;
+	u32 sq = 1U << 30;
+
+	while (n) {
+		if (n & 1)
+			p = crc32c_multmodp(sq, p);
+		sq = crc32c_multmodp(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+static void crc32c_3way_init(void)
+{
+	int i;
+
+	/*
+	 * The carry-less product of two reflected values is one bit short and
+	 * the crc32 reduction of a 64bit value multiplies by x^32, so the
+	 * constant for a shift by n bits is x^(n - 33).
+	 */
+	for (i = 0; i < ARRAY_SIZE(crc32c_3way_blocks); i++) {
+		crc32c_3way_shift1[i] =
+			crc32c_xpow(8ULL * crc32c_3way_blocks[i] - 33);
+		crc32c_3way_shift2[i] =
+			crc32c_xpow(16ULL * crc32c_3way_blocks[i] - 33);
+	}
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline u32 crc32c_shift_clmul(u32 crc, u64 constant)
+{
+	__m128i product;
+
+	product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				       _mm_cvtsi64_si128(constant), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2")))
+static u32 crc32c_intel_tail(u32 crc, unsigned char const *data,
+			     unsigned long length)
+{
+	u64 crc64 = crc;
+
+	while (length >= 8) {
+		crc64 = _mm_crc32_u64(crc64, *(const u64 *)data);
+		data += 8;
+		length -= 8;
+	}
+	crc = crc64;
+	while (length--)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_intel_3way(u32 crc, unsigned char const *data,
+			     unsigned long length)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(crc32c_3way_blocks); i++) {
+		const unsigned int block = crc32c_3way_blocks[i];
+
+		while (length >= 3 * block) {
+			const u64 *p0 = (const u64 *)data;
+			const u64 *p1 = (const u64 *)(data + block);
+			const u64 *p2 = (const u64 *)(data + 2 * block);
+			u64 crc0 = crc;
+			u64 crc1 = 0;
+			u64 crc2 = 0;
+			int j;
+
+			for (j = 0; j < block / 8; j++) {
+				crc0 = _mm_crc32_u64(crc0, p0[j]);
+				crc1 = _mm_crc32_u64(crc1, p1[j]);
+				crc2 = _mm_crc32_u64(crc2, p2[j]);
+			}
+			crc = crc32c_shift_clmul(crc0, crc32c_3way_shift2[i]) ^
+			      crc32c_shift_clmul(crc1, crc32c_3way_shift1[i]) ^
+			      crc2;
+			data += 3 * block;
+			length -= 3 * block;
+		}
+	}
+	return crc32c_intel_tail(crc, data, length);
+}
+
+/* Checksum three independent blocks in parallel */
+__attribute__((target("sse4.2")))
+static void crc32c_intel_batch3(u32 seed, unsigned char const *data,
+				size_t blocksize, u32 *results)
+{
+	const u64 *p0 = (const u64 *)data;
+	const u64 *p1 = (const u64 *)(data + blocksize);
+	const u64 *p2 = (const u64 *)(data + 2 * blocksize);
+	u64 crc0 = seed;
+	u64 crc1 = seed;
+	u64 crc2 = seed;
+	size_t tail = blocksize % 8;
+	size_t j;
+
+	for (j = 0; j < blocksize / 8; j++) {
+		crc0 = _mm_crc32_u64(crc0, p0[j]);
+		crc1 = _mm_crc32_u64(crc1, p1[j]);
+		crc2 = _mm_crc32_u64(crc2, p2[j]);
+	}
+	results[0] = crc32c_intel_tail(crc0, (unsigned char const *)(p0 + j),
+				       tail);
+	results[1] = crc32c_intel_tail(crc1, (unsigned char const *)(p1 + j),
+				       tail);
+	results[2] = crc32c_intel_tail(crc2, (unsigned char const *)(p2 + j),
+				       tail);
+}
+
 void crc32c_optimization_init(void)
 {
 	crc32c_intel_probe();
 	if (crc32c_intel_available)
 		crc_function = crc32c_intel;
+	if (crc32c_intel_available && crc32c_pclmul_available) {
+		crc32c_3way_init();
+		crc_function = crc32c_intel_3way;
+	}
 }
 #else
 
@@ -224,3 +398,82 @@ u32 crc32c_le(u32 crc, unsigned char const *data, size_t length)
 
 	return crc_function(crc, data, length);
 }
+
+/*
+ * Checksum @nr consecutive blocks of @blocksize bytes starting at @data, each
+ * of them started from @seed, and store the results to @results.
+ */
+void crc32c_le_batch(u32 seed, unsigned char const *data, size_t blocksize,
+		     unsigned int nr, u32 *results)
+{
+	unsigned int i = 0;
+
+#ifdef __x86_64__
+	if (crc_function != __crc32c_le &&
+	    !((unsigned long)data % sizeof(unsigned long)) &&
+	    !(blocksize % sizeof(unsigned long))) {
+		for (; i + 3 <= nr; i += 3)
+			crc32c_intel_batch3(seed, data + i * blocksize,
+					    blocksize, results + i);
+	}
+#endif
+	for (; i < nr; i++)
+		results[i] = crc32c_le(seed, data + i * blocksize, blocksize);
+}
+
+/*
+ * Direct access to the implementations for testing and benchmarking, the
+ * regular users should go through crc32c_le()
+ */
+static const char * const crc32c_impl_names[CRC32C_NR_IMPLS] = {
+	[CRC32C_IMPL_TABLE]		= "table",
+	[CRC32C_IMPL_INTEL]		= "sse4.2",
+	[CRC32C_IMPL_INTEL_3WAY]	= "sse4.2-pclmul-3way",
+};
+
+const char *crc32c_impl_name(int impl)
+{
+	if (impl < 0 || impl >= CRC32C_NR_IMPLS)
+		return NULL;
+	return crc32c_impl_names[impl];
+}
+
+int crc32c_impl_available(int impl)
+{
+	switch (impl) {
+	case CRC32C_IMPL_TABLE:
+		return 1;
+#ifdef __x86_64__
+	case CRC32C_IMPL_INTEL:
+		crc32c_intel_probe();
+		return crc32c_intel_available;
+	case CRC32C_IMPL_INTEL_3WAY:
+		crc32c_intel_probe();
+		return crc32c_intel_available && crc32c_pclmul_available;
+#endif
+	default:
+		return 0;
+	}
+}
+
+u32 crc32c_impl(int impl, u32 crc, unsigned char const *data, size_t length)
+{
+	switch (impl) {
+#ifdef __x86_64__
+	case CRC32C_IMPL_INTEL:
+		if (!((unsigned long)data % sizeof(unsigned long)))
+			return crc32c_intel(crc, data, length);
+		break;
+	case CRC32C_IMPL_INTEL_3WAY:
+		if (!((unsigned long)data % sizeof(unsigned long))) {
+			if (!crc32c_3way_shift1[0])
+				crc32c_3way_init();
+			return crc32c_intel_3way(crc, data, length);
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+	return __crc32c_le(crc, data, length);
+}
@@ -26,8 +26,21 @@
 #endif /* BTRFS_FLAT_INCLUDES */
 
 u32 crc32c_le(u32 seed, unsigned char const *data, size_t length);
+void crc32c_le_batch(u32 seed, unsigned char const *data, size_t blocksize,
+		     unsigned int nr, u32 *results);
 void crc32c_optimization_init(void);
 
+enum {
+	CRC32C_IMPL_TABLE,
+	CRC32C_IMPL_INTEL,
+	CRC32C_IMPL_INTEL_3WAY,
+	CRC32C_NR_IMPLS
+};
+
+const char *crc32c_impl_name(int impl);
+int crc32c_impl_available(int impl);
+u32 crc32c_impl(int impl, u32 crc, unsigned char const *data, size_t length);
+
 #define crc32c(seed, data, length) crc32c_le(seed, (unsigned char const *)data, length)
 #define btrfs_crc32c crc32c
 #endif
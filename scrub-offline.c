@@ -0,0 +1,1090 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+/*
+ * Scrub of an unmounted filesystem.
+ *
+ * The main thread walks the chunks in logical order.  For each chunk it
+ * records which sectors belong to a tree block or a data extent, the
+ * generation of the tree blocks from the extent tree and the data csums from
+ * the csum tree, then hands the chunk over to the reader thread of each device
+ * with a stripe of the chunk.  Up to SCRUB_MAX_CHUNKS chunks are prepared
+ * ahead, so the trees are read while the devices are busy.
+ *
+ * Each device has one reader thread.  It reads the used part of its stripes
+ * in sequential reads of up to SCRUB_READ_BYTES and verifies the data sectors
+ * of a read in one batch.  A bad block is read from another copy of a
+ * DUP/RAID1/RAID10 chunk or rebuilt from the other stripes of a RAID5/6 chunk
+ * and written back, unless scrub is read-only.  The readers only use the
+ * device fds, the trees are read by the main thread alone.
+ *
+ * The errors are counted per device like the scrub ioctl does.
+ */
+
+#include "kerncompat.h"
+
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctree.h"
+#include "disk-io.h"
+#include "volumes.h"
+#include "scrub-offline.h"
+#include "kernel-lib/raid56.h"
+#include "messages.h"
+#include "utils.h"
+
+/* Maximum size of one read, a multiple of BTRFS_STRIPE_LEN */
+#define SCRUB_READ_BYTES	SZ_4M
+/* Number of chunks prepared but not yet scrubbed by all devices */
+#define SCRUB_MAX_CHUNKS	4
+
+/* Flags of each sector of a chunk */
+#define SCRUB_SECTOR_DATA	(1U << 0)
+#define SCRUB_SECTOR_TREE	(1U << 1)
+/* First sector of an extent */
+#define SCRUB_SECTOR_START	(1U << 2)
+/* The data sector has a csum */
+#define SCRUB_SECTOR_CSUM	(1U << 3)
+
+#define SCRUB_RAID56	(BTRFS_BLOCK_GROUP_RAID5 | BTRFS_BLOCK_GROUP_RAID6)
+#define SCRUB_STRIPED	(BTRFS_BLOCK_GROUP_RAID0 | BTRFS_BLOCK_GROUP_RAID10 | \
+			 SCRUB_RAID56)
+#define SCRUB_MIRRORED	(BTRFS_BLOCK_GROUP_DUP | BTRFS_BLOCK_GROUP_RAID1 | \
+			 BTRFS_BLOCK_GROUP_RAID10)
+
+enum scrub_error {
+	SCRUB_OK,
+	SCRUB_ERR_READ,
+	SCRUB_ERR_CSUM,
+	SCRUB_ERR_VERIFY,
+};
+
+static const char * const scrub_error_names[] = {
+	[SCRUB_ERR_READ]	= "read",
+	[SCRUB_ERR_CSUM]	= "checksum",
+	[SCRUB_ERR_VERIFY]	= "header",
+};
+
+struct scrub_chunk {
+	struct map_lookup *map;
+	u64 start;
+	u64 len;
+	/* Length of the stripe on each device */
+	u64 stripe_size;
+	/* Number of data stripes in a RAID5/6 row */
+	int nr_data;
+	/* SCRUB_SECTOR_* for each sector */
+	u8 *sectors;
+	/* Data csum of each sector, only for data chunks */
+	u8 *csums;
+	/* Generation of the tree blocks by first sector, only for metadata */
+	u64 *gens;
+	/* Number of devices that did not scrub the chunk yet */
+	int refs;
+};
+
+struct scrub_work {
+	struct list_head list;
+	struct scrub_chunk *chunk;
+};
+
+struct scrub_ctx;
+
+struct scrub_dev {
+	struct scrub_ctx *sctx;
+	struct btrfs_device *device;
+	struct btrfs_scrub_progress *progress;
+	/* Chunks to scrub, struct scrub_work */
+	struct list_head queue;
+	pthread_t thread;
+	int started;
+	/* Buffer of SCRUB_READ_BYTES */
+	char *buf;
+	/* Data csums of buf */
+	u8 *result;
+	/* A single tree block or sector read separately */
+	char *block;
+	/* The good copy of a bad block */
+	char *repair;
+};
+
+struct scrub_ctx {
+	struct btrfs_fs_info *fs_info;
+	int readonly;
+	int quiet;
+	u32 sectorsize;
+	u32 nodesize;
+	u16 csum_size;
+	struct scrub_dev *devs;
+	int nr_devs;
+	/* Protects the queues and nr_chunks */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nr_chunks;
+	int done;
+};
+
+static void scrub_free_chunk(struct scrub_chunk *chunk)
+{
+	free(chunk->sectors);
+	free(chunk->csums);
+	free(chunk->gens);
+	free(chunk);
+}
+
+static void scrub_mark_extent(struct scrub_ctx *sctx,
+			      struct scrub_chunk *chunk, u64 bytenr, u64 len,
+			      u8 type, u64 generation)
+{
+	u64 end = min(bytenr + len, chunk->start + chunk->len);
+	u64 idx;
+
+	if (bytenr < chunk->start || bytenr >= end)
+		return;
+	idx = (bytenr - chunk->start) / sctx->sectorsize;
+	chunk->sectors[idx] |= SCRUB_SECTOR_START;
+	if (type == SCRUB_SECTOR_TREE && chunk->gens)
+		chunk->gens[idx] = generation;
+	for (; bytenr < end; bytenr += sctx->sectorsize, idx++)
+		chunk->sectors[idx] |= type;
+}
+
+/* Record the tree blocks and data extents of @chunk from the extent tree */
+static int scrub_load_extents(struct scrub_ctx *sctx,
+			      struct scrub_chunk *chunk)
+{
+	struct btrfs_root *extent_root = sctx->fs_info->extent_root;
+	struct btrfs_extent_item *ei;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 flags;
+	u64 len;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = chunk->start;
+	key.type = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(extent_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid >= chunk->start + chunk->len)
+			break;
+		if ((key.type != BTRFS_EXTENT_ITEM_KEY &&
+		     key.type != BTRFS_METADATA_ITEM_KEY) ||
+		    btrfs_item_size_nr(leaf, path.slots[0]) < sizeof(*ei)) {
+			path.slots[0]++;
+			continue;
+		}
+
+		ei = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_extent_item);
+		flags = btrfs_extent_flags(leaf, ei);
+		if (key.type == BTRFS_METADATA_ITEM_KEY)
+			len = sctx->nodesize;
+		else
+			len = key.offset;
+		if (flags & BTRFS_EXTENT_FLAG_TREE_BLOCK)
+			scrub_mark_extent(sctx, chunk, key.objectid, len,
+					  SCRUB_SECTOR_TREE,
+					  btrfs_extent_generation(leaf, ei));
+		else
+			scrub_mark_extent(sctx, chunk, key.objectid, len,
+					  SCRUB_SECTOR_DATA, 0);
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/* Copy the data csums of @chunk from the csum tree */
+static int scrub_load_csums(struct scrub_ctx *sctx, struct scrub_chunk *chunk)
+{
+	struct btrfs_root *csum_root = sctx->fs_info->csum_root;
+	u32 sectorsize = sctx->sectorsize;
+	u16 csum_size = sctx->csum_size;
+	u64 chunk_end = chunk->start + chunk->len;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 start;
+	u64 end;
+	u64 bytenr;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = chunk->start;
+	ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	/* The previous item can cover the start of the chunk */
+	if (ret > 0 && path.slots[0] > 0)
+		path.slots[0]--;
+
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(csum_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY) {
+			if (key.objectid > BTRFS_EXTENT_CSUM_OBJECTID)
+				break;
+			path.slots[0]++;
+			continue;
+		}
+		if (key.offset >= chunk_end)
+			break;
+
+		start = max(key.offset, chunk->start);
+		end = key.offset + btrfs_item_size_nr(leaf, path.slots[0]) /
+		      csum_size * sectorsize;
+		end = min(end, chunk_end);
+		if (start < end) {
+			read_extent_buffer(leaf, chunk->csums +
+				(start - chunk->start) / sectorsize * csum_size,
+				btrfs_item_ptr_offset(leaf, path.slots[0]) +
+				(start - key.offset) / sectorsize * csum_size,
+				(end - start) / sectorsize * csum_size);
+			for (bytenr = start; bytenr < end; bytenr += sectorsize)
+				chunk->sectors[(bytenr - chunk->start) /
+					sectorsize] |= SCRUB_SECTOR_CSUM;
+		}
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static struct scrub_chunk *scrub_prepare_chunk(struct scrub_ctx *sctx,
+					       struct cache_extent *ce)
+{
+	struct map_lookup *map = container_of(ce, struct map_lookup, ce);
+	struct scrub_chunk *chunk;
+	u64 nr_sectors = ce->size / sctx->sectorsize;
+	int ret = -ENOMEM;
+
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return ERR_PTR(-ENOMEM);
+	chunk->map = map;
+	chunk->start = ce->start;
+	chunk->len = ce->size;
+	chunk->stripe_size = calc_stripe_length(map->type, ce->size,
+						map->num_stripes);
+	chunk->nr_data = map->num_stripes;
+	if (map->type & BTRFS_BLOCK_GROUP_RAID5)
+		chunk->nr_data -= 1;
+	else if (map->type & BTRFS_BLOCK_GROUP_RAID6)
+		chunk->nr_data -= 2;
+
+	chunk->sectors = calloc(nr_sectors, 1);
+	if (!chunk->sectors)
+		goto fail;
+	if (map->type & BTRFS_BLOCK_GROUP_DATA) {
+		chunk->csums = malloc(nr_sectors * sctx->csum_size);
+		if (!chunk->csums)
+			goto fail;
+	}
+	if (map->type & (BTRFS_BLOCK_GROUP_METADATA |
+			 BTRFS_BLOCK_GROUP_SYSTEM)) {
+		chunk->gens = calloc(nr_sectors, sizeof(u64));
+		if (!chunk->gens)
+			goto fail;
+	}
+
+	ret = scrub_load_extents(sctx, chunk);
+	if (ret < 0)
+		goto fail;
+	if (chunk->csums) {
+		ret = scrub_load_csums(sctx, chunk);
+		if (ret < 0)
+			goto fail;
+	}
+	return chunk;
+
+fail:
+	scrub_free_chunk(chunk);
+	return ERR_PTR(ret);
+}
+
+/*
+ * Map offset @soff in stripe @stripe of @chunk to the logical address.
+ *
+ * Return 1 if @soff is in RAID5/6 parity.
+ */
+static int scrub_stripe_to_logical(struct scrub_chunk *chunk, int stripe,
+				   u64 soff, u64 *logical)
+{
+	struct map_lookup *map = chunk->map;
+	u64 row = soff / map->stripe_len;
+	u64 nr;
+	int idx;
+
+	if (map->type & BTRFS_BLOCK_GROUP_RAID0) {
+		nr = row * map->num_stripes + stripe;
+	} else if (map->type & BTRFS_BLOCK_GROUP_RAID10) {
+		nr = row * (map->num_stripes / map->sub_stripes) +
+		     stripe / map->sub_stripes;
+	} else if (map->type & SCRUB_RAID56) {
+		/* The parity rotates by one stripe each row */
+		idx = (stripe + map->num_stripes - row % map->num_stripes) %
+		      map->num_stripes;
+		if (idx >= chunk->nr_data)
+			return 1;
+		nr = row * chunk->nr_data + idx;
+	} else {
+		*logical = chunk->start + soff;
+		return 0;
+	}
+	*logical = chunk->start + nr * map->stripe_len + soff % map->stripe_len;
+	return *logical >= chunk->start + chunk->len;
+}
+
+/* End of the logically contiguous range of the stripe at @soff */
+static u64 scrub_piece_end(struct scrub_chunk *chunk, u64 soff)
+{
+	struct map_lookup *map = chunk->map;
+
+	if (!(map->type & SCRUB_STRIPED))
+		return chunk->stripe_size;
+	return round_down(soff, map->stripe_len) + map->stripe_len;
+}
+
+static int scrub_sector_used(struct scrub_ctx *sctx, struct scrub_chunk *chunk,
+			     int stripe, u64 soff)
+{
+	u64 logical;
+
+	if (scrub_stripe_to_logical(chunk, stripe, soff, &logical))
+		return 0;
+	return chunk->sectors[(logical - chunk->start) / sctx->sectorsize] &
+		(SCRUB_SECTOR_DATA | SCRUB_SECTOR_TREE);
+}
+
+static int scrub_verify_tree_block(struct scrub_ctx *sctx,
+				   struct scrub_chunk *chunk, u64 logical,
+				   char *buf)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_header *header = (struct btrfs_header *)buf;
+	struct btrfs_fs_devices *fs_devices;
+	u8 result[BTRFS_CSUM_SIZE];
+	u64 idx = (logical - chunk->start) / sctx->sectorsize;
+	u32 crc;
+
+	if (btrfs_stack_header_bytenr(header) != logical)
+		return SCRUB_ERR_VERIFY;
+	if (chunk->gens &&
+	    btrfs_stack_header_generation(header) != chunk->gens[idx])
+		return SCRUB_ERR_VERIFY;
+	if (memcmp(header->chunk_tree_uuid, fs_info->chunk_tree_uuid,
+		   BTRFS_UUID_SIZE))
+		return SCRUB_ERR_VERIFY;
+	/* Blocks written before a seed device was sprouted have its fsid */
+	for (fs_devices = fs_info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed) {
+		if (!memcmp(header->fsid, fs_devices->fsid, BTRFS_FSID_SIZE))
+			break;
+	}
+	if (!fs_devices)
+		return SCRUB_ERR_VERIFY;
+
+	crc = btrfs_csum_data(buf + BTRFS_CSUM_SIZE, ~(u32)0,
+			      sctx->nodesize - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(crc, result);
+	if (memcmp(result, header->csum, sctx->csum_size))
+		return SCRUB_ERR_CSUM;
+	return SCRUB_OK;
+}
+
+static int scrub_verify_sector(struct scrub_ctx *sctx,
+			       struct scrub_chunk *chunk, u64 logical,
+			       char *buf)
+{
+	u64 idx = (logical - chunk->start) / sctx->sectorsize;
+	u8 result[BTRFS_CSUM_SIZE];
+	u32 crc;
+
+	crc = btrfs_csum_data(buf, ~(u32)0, sctx->sectorsize);
+	btrfs_csum_final(crc, result);
+	if (memcmp(result, chunk->csums + idx * sctx->csum_size,
+		   sctx->csum_size))
+		return SCRUB_ERR_CSUM;
+	return SCRUB_OK;
+}
+
+/* Verify a tree block or a data sector at @logical */
+static int scrub_verify(struct scrub_ctx *sctx, struct scrub_chunk *chunk,
+			u64 logical, char *buf)
+{
+	u64 idx = (logical - chunk->start) / sctx->sectorsize;
+
+	if (chunk->sectors[idx] & SCRUB_SECTOR_TREE)
+		return scrub_verify_tree_block(sctx, chunk, logical, buf);
+	return scrub_verify_sector(sctx, chunk, logical, buf);
+}
+
+/* Find a good copy of a block in the other stripes of a mirrored chunk */
+static int scrub_read_mirror(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+			     int stripe, u64 soff, u64 logical, u32 len,
+			     char *buf)
+{
+	struct map_lookup *map = chunk->map;
+	struct btrfs_device *device;
+	int i;
+
+	if (!(map->type & SCRUB_MIRRORED))
+		return -EIO;
+
+	for (i = 0; i < map->num_stripes; i++) {
+		if (i == stripe)
+			continue;
+		if ((map->type & BTRFS_BLOCK_GROUP_RAID10) &&
+		    i / map->sub_stripes != stripe / map->sub_stripes)
+			continue;
+		device = map->stripes[i].dev;
+		if (device->fd < 0)
+			continue;
+		if (pread(device->fd, buf, len,
+			  map->stripes[i].physical + soff) != len)
+			continue;
+		if (!scrub_verify(sdev->sctx, chunk, logical, buf))
+			return 0;
+	}
+	return -EIO;
+}
+
+/*
+ * Rebuild a block of a RAID5/6 chunk from the other stripes of its row.
+ *
+ * The block is rebuilt from P first.  For RAID6 it's also rebuilt from Q in
+ * case P is bad too, and together with each other data stripe in case that
+ * one is bad as well.
+ */
+static int scrub_rebuild_raid56(struct scrub_dev *sdev,
+				struct scrub_chunk *chunk, int stripe,
+				u64 soff, u64 logical, u32 len, char *buf)
+{
+	struct map_lookup *map = chunk->map;
+	int nr = map->num_stripes;
+	u32 stripe_len = map->stripe_len;
+	u64 row = soff / stripe_len;
+	u64 element = row * stripe_len;
+	int rot = row % nr;
+	int dest = (stripe + nr - rot) % nr;
+	struct btrfs_bio_stripe *bio_stripe;
+	char *orig;
+	char *work;
+	void **ptrs;
+	int tries;
+	int other;
+	int ret = -ENOMEM;
+	int i;
+
+	orig = malloc((size_t)nr * stripe_len);
+	work = malloc((size_t)nr * stripe_len);
+	ptrs = malloc(nr * sizeof(*ptrs));
+	if (!orig || !work || !ptrs)
+		goto out;
+
+	/* Data stripes in order, then P and Q, like raid56_recov() expects */
+	for (i = 0; i < nr; i++) {
+		bio_stripe = &map->stripes[(i + rot) % nr];
+		if (i == dest || bio_stripe->dev->fd < 0 ||
+		    pread(bio_stripe->dev->fd, orig + (size_t)i * stripe_len,
+			  stripe_len, bio_stripe->physical + element) !=
+		    stripe_len)
+			memset(orig + (size_t)i * stripe_len, 0, stripe_len);
+	}
+
+	ret = -EIO;
+	tries = (map->type & BTRFS_BLOCK_GROUP_RAID6) ? nr - 1 : 1;
+	for (i = 0; i < tries; i++) {
+		int err;
+
+		memcpy(work, orig, (size_t)nr * stripe_len);
+		for (other = 0; other < nr; other++)
+			ptrs[other] = work + (size_t)other * stripe_len;
+
+		if (i == 0) {
+			err = raid56_recov(nr, stripe_len, map->type, dest, -1,
+					   ptrs);
+		} else if (i == 1) {
+			err = raid6_recov_datap(nr, stripe_len, dest, ptrs);
+		} else {
+			other = i - 2;
+			if (other >= dest)
+				other++;
+			err = raid56_recov(nr, stripe_len, map->type, dest,
+					   other, ptrs);
+		}
+		if (err)
+			continue;
+		if (!scrub_verify(sdev->sctx, chunk, logical,
+				  ptrs[dest] + (soff - element))) {
+			memcpy(buf, ptrs[dest] + (soff - element), len);
+			ret = 0;
+			break;
+		}
+	}
+out:
+	free(orig);
+	free(work);
+	free(ptrs);
+	return ret;
+}
+
+static int scrub_repair(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+			int stripe, u64 soff, u64 logical, u32 len)
+{
+	struct map_lookup *map = chunk->map;
+	int ret;
+
+	if (map->type & SCRUB_RAID56)
+		ret = scrub_rebuild_raid56(sdev, chunk, stripe, soff, logical,
+					   len, sdev->repair);
+	else
+		ret = scrub_read_mirror(sdev, chunk, stripe, soff, logical,
+					len, sdev->repair);
+	if (ret)
+		return ret;
+
+	if (pwrite(sdev->device->fd, sdev->repair, len,
+		   map->stripes[stripe].physical + soff) != len)
+		return -EIO;
+	return 0;
+}
+
+static void scrub_bad_block(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+			    int stripe, u64 soff, u64 logical, u32 len,
+			    int err)
+{
+	struct scrub_ctx *sctx = sdev->sctx;
+	struct btrfs_scrub_progress *progress = sdev->progress;
+	u64 physical = chunk->map->stripes[stripe].physical + soff;
+	const char *result = "";
+
+	if (err == SCRUB_ERR_READ)
+		progress->read_errors++;
+	else if (err == SCRUB_ERR_CSUM)
+		progress->csum_errors++;
+	else
+		progress->verify_errors++;
+
+	if (!sctx->readonly) {
+		if (scrub_repair(sdev, chunk, stripe, soff, logical, len)) {
+			progress->uncorrectable_errors++;
+			result = ", unrepairable";
+		} else {
+			progress->corrected_errors++;
+			result = ", repaired";
+		}
+	}
+	error_on(!sctx->quiet,
+		 "%s error at logical %llu on dev %s, physical %llu%s",
+		 scrub_error_names[err], logical, sdev->device->name,
+		 physical, result);
+}
+
+/*
+ * Verify the tree block at @logical.  @buf is NULL if the block was not read
+ * with the rest of the stripe.
+ */
+static void scrub_tree_block(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+			     int stripe, u64 soff, u64 logical, char *buf)
+{
+	struct scrub_ctx *sctx = sdev->sctx;
+	u64 physical = chunk->map->stripes[stripe].physical + soff;
+	int err;
+
+	sdev->progress->tree_extents_scrubbed++;
+	sdev->progress->tree_bytes_scrubbed += sctx->nodesize;
+
+	if (!buf) {
+		buf = sdev->block;
+		if (pread(sdev->device->fd, buf, sctx->nodesize, physical) !=
+		    sctx->nodesize) {
+			scrub_bad_block(sdev, chunk, stripe, soff, logical,
+					sctx->nodesize, SCRUB_ERR_READ);
+			return;
+		}
+	}
+	err = scrub_verify_tree_block(sctx, chunk, logical, buf);
+	if (err)
+		scrub_bad_block(sdev, chunk, stripe, soff, logical,
+				sctx->nodesize, err);
+}
+
+/*
+ * Verify @nr data sectors with csums at @logical.  @buf is NULL if the read
+ * of the stripe failed and each sector has to be read separately.
+ */
+static void scrub_data(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+		       int stripe, u64 soff, u64 logical, u32 nr, char *buf)
+{
+	struct scrub_ctx *sctx = sdev->sctx;
+	u32 sectorsize = sctx->sectorsize;
+	u16 csum_size = sctx->csum_size;
+	u64 physical = chunk->map->stripes[stripe].physical + soff;
+	u8 *expected;
+	u32 i;
+	int err;
+
+	expected = chunk->csums + (logical - chunk->start) / sectorsize *
+		   csum_size;
+	if (buf) {
+		btrfs_csum_data_batch(buf, sectorsize, nr, sdev->result);
+		if (!memcmp(sdev->result, expected, nr * csum_size))
+			return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (buf) {
+			if (!memcmp(sdev->result + i * csum_size,
+				    expected + i * csum_size, csum_size))
+				continue;
+			err = SCRUB_ERR_CSUM;
+		} else if (pread(sdev->device->fd, sdev->block, sectorsize,
+				 physical + (u64)i * sectorsize) !=
+			   sectorsize) {
+			err = SCRUB_ERR_READ;
+		} else {
+			err = scrub_verify_sector(sctx, chunk,
+					logical + (u64)i * sectorsize,
+					sdev->block);
+			if (!err)
+				continue;
+		}
+		scrub_bad_block(sdev, chunk, stripe,
+				soff + (u64)i * sectorsize,
+				logical + (u64)i * sectorsize, sectorsize, err);
+	}
+}
+
+/*
+ * Verify [@soff, @end) of @stripe, which maps to contiguous logical addresses
+ * starting at @logical.
+ */
+static void scrub_piece(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+			int stripe, u64 soff, u64 end, u64 logical, char *buf)
+{
+	struct scrub_ctx *sctx = sdev->sctx;
+	struct btrfs_scrub_progress *progress = sdev->progress;
+	u32 sectorsize = sctx->sectorsize;
+	u64 len = end - soff;
+	u64 idx;
+	u64 pos = 0;
+	u32 nr;
+	u8 flags;
+	u8 next;
+
+	while (pos < len) {
+		idx = (logical + pos - chunk->start) / sectorsize;
+		flags = chunk->sectors[idx];
+
+		if (flags & SCRUB_SECTOR_TREE) {
+			/* The rest of a tree block is verified with its start */
+			if (!(flags & SCRUB_SECTOR_START)) {
+				pos += sectorsize;
+				continue;
+			}
+			scrub_tree_block(sdev, chunk, stripe, soff + pos,
+					 logical + pos,
+					 buf && pos + sctx->nodesize <= len ?
+					 buf + pos : NULL);
+			pos += sctx->nodesize;
+			continue;
+		}
+		if (!(flags & SCRUB_SECTOR_DATA)) {
+			pos += sectorsize;
+			continue;
+		}
+
+		/* Sectors of the same kind are verified in one batch */
+		for (nr = 0; pos + (u64)nr * sectorsize < len; nr++) {
+			next = chunk->sectors[idx + nr];
+			if ((next & (SCRUB_SECTOR_DATA | SCRUB_SECTOR_TREE)) !=
+			    SCRUB_SECTOR_DATA ||
+			    (next & SCRUB_SECTOR_CSUM) !=
+			    (flags & SCRUB_SECTOR_CSUM))
+				break;
+			if (next & SCRUB_SECTOR_START)
+				progress->data_extents_scrubbed++;
+		}
+		progress->data_bytes_scrubbed += (u64)nr * sectorsize;
+		if (flags & SCRUB_SECTOR_CSUM)
+			scrub_data(sdev, chunk, stripe, soff + pos,
+				   logical + pos, nr, buf ? buf + pos : NULL);
+		else
+			progress->no_csum += nr;
+		pos += (u64)nr * sectorsize;
+	}
+}
+
+static void scrub_stripe(struct scrub_dev *sdev, struct scrub_chunk *chunk,
+			 int stripe)
+{
+	struct scrub_ctx *sctx = sdev->sctx;
+	u32 sectorsize = sctx->sectorsize;
+	u64 physical = chunk->map->stripes[stripe].physical;
+	u64 logical;
+	u64 off;
+	u64 pos;
+	u64 start;
+	u64 end;
+	u64 piece_end;
+	int read_ok;
+
+	for (off = 0; off < chunk->stripe_size; off += SCRUB_READ_BYTES) {
+		start = off;
+		end = min_t(u64, off + SCRUB_READ_BYTES, chunk->stripe_size);
+
+		/* Read only from the first to the last used sector */
+		while (start < end &&
+		       !scrub_sector_used(sctx, chunk, stripe, start))
+			start += sectorsize;
+		while (end > start &&
+		       !scrub_sector_used(sctx, chunk, stripe, end - sectorsize))
+			end -= sectorsize;
+		if (start == end)
+			continue;
+
+		read_ok = pread(sdev->device->fd, sdev->buf, end - start,
+				physical + start) == end - start;
+
+		for (pos = start; pos < end; pos = piece_end) {
+			piece_end = min(end, scrub_piece_end(chunk, pos));
+			if (scrub_stripe_to_logical(chunk, stripe, pos,
+						    &logical))
+				continue;
+			scrub_piece(sdev, chunk, stripe, pos, piece_end,
+				    logical,
+				    read_ok ? sdev->buf + (pos - start) : NULL);
+		}
+		sdev->progress->last_physical = physical + end;
+	}
+}
+
+/* Verify the superblock copies of the device */
+static void scrub_supers(struct scrub_dev *sdev)
+{
+	struct scrub_ctx *sctx = sdev->sctx;
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_device *device = sdev->device;
+	char buf[BTRFS_SUPER_INFO_SIZE];
+	struct btrfs_super_block *sb = (struct btrfs_super_block *)buf;
+	u8 result[BTRFS_CSUM_SIZE];
+	u64 bytenr;
+	u32 crc;
+	int i;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		bytenr = btrfs_sb_offset(i);
+		if (bytenr + BTRFS_SUPER_INFO_SIZE > device->total_bytes)
+			break;
+
+		if (pread(device->fd, buf, BTRFS_SUPER_INFO_SIZE, bytenr) !=
+		    BTRFS_SUPER_INFO_SIZE)
+			goto bad;
+		if (btrfs_super_bytenr(sb) != bytenr ||
+		    btrfs_super_magic(sb) != BTRFS_MAGIC ||
+		    btrfs_super_generation(sb) !=
+		    btrfs_super_generation(fs_info->super_copy) ||
+		    memcmp(sb->fsid, fs_info->fs_devices->fsid,
+			   BTRFS_FSID_SIZE))
+			goto bad;
+		crc = btrfs_csum_data(buf + BTRFS_CSUM_SIZE, ~(u32)0,
+				      BTRFS_SUPER_INFO_SIZE - BTRFS_CSUM_SIZE);
+		btrfs_csum_final(crc, result);
+		if (!memcmp(result, sb->csum, sctx->csum_size))
+			continue;
+bad:
+		sdev->progress->super_errors++;
+		error_on(!sctx->quiet, "super block %d on dev %s is bad", i,
+			 device->name);
+	}
+}
+
+static void scrub_put_chunk(struct scrub_ctx *sctx, struct scrub_chunk *chunk)
+{
+	int refs;
+
+	pthread_mutex_lock(&sctx->lock);
+	refs = --chunk->refs;
+	if (!refs) {
+		sctx->nr_chunks--;
+		pthread_cond_broadcast(&sctx->cond);
+	}
+	pthread_mutex_unlock(&sctx->lock);
+	if (!refs)
+		scrub_free_chunk(chunk);
+}
+
+static void *scrub_dev_thread(void *arg)
+{
+	struct scrub_dev *sdev = arg;
+	struct scrub_ctx *sctx = sdev->sctx;
+	struct scrub_work *work;
+	struct scrub_chunk *chunk;
+	int i;
+
+	scrub_supers(sdev);
+
+	while (1) {
+		pthread_mutex_lock(&sctx->lock);
+		while (list_empty(&sdev->queue) && !sctx->done)
+			pthread_cond_wait(&sctx->cond, &sctx->lock);
+		if (list_empty(&sdev->queue)) {
+			pthread_mutex_unlock(&sctx->lock);
+			break;
+		}
+		work = list_first_entry(&sdev->queue, struct scrub_work, list);
+		list_del(&work->list);
+		pthread_mutex_unlock(&sctx->lock);
+
+		chunk = work->chunk;
+		free(work);
+		/* DUP has both stripes on the same device */
+		for (i = 0; i < chunk->map->num_stripes; i++) {
+			if (chunk->map->stripes[i].dev == sdev->device)
+				scrub_stripe(sdev, chunk, i);
+		}
+		scrub_put_chunk(sctx, chunk);
+	}
+	return NULL;
+}
+
+static struct scrub_dev *scrub_find_dev(struct scrub_ctx *sctx,
+					struct btrfs_device *device)
+{
+	int i;
+
+	for (i = 0; i < sctx->nr_devs; i++) {
+		if (sctx->devs[i].started && sctx->devs[i].device == device)
+			return &sctx->devs[i];
+	}
+	return NULL;
+}
+
+static int scrub_chunk_has_dev(struct scrub_ctx *sctx, struct cache_extent *ce)
+{
+	struct map_lookup *map = container_of(ce, struct map_lookup, ce);
+	int i;
+
+	for (i = 0; i < map->num_stripes; i++) {
+		if (scrub_find_dev(sctx, map->stripes[i].dev))
+			return 1;
+	}
+	return 0;
+}
+
+/* Queue @chunk to the device of each of its stripes */
+static int scrub_queue_chunk(struct scrub_ctx *sctx, struct scrub_chunk *chunk)
+{
+	struct map_lookup *map = chunk->map;
+	struct scrub_dev *sdev;
+	struct scrub_work *work;
+	int queued;
+	int ret = 0;
+	int i;
+	int j;
+
+	pthread_mutex_lock(&sctx->lock);
+	while (sctx->nr_chunks >= SCRUB_MAX_CHUNKS)
+		pthread_cond_wait(&sctx->cond, &sctx->lock);
+
+	for (i = 0; i < map->num_stripes; i++) {
+		sdev = scrub_find_dev(sctx, map->stripes[i].dev);
+		if (!sdev)
+			continue;
+		for (j = 0; j < i; j++) {
+			if (map->stripes[j].dev == sdev->device)
+				break;
+		}
+		if (j < i)
+			continue;
+		work = malloc(sizeof(*work));
+		if (!work) {
+			ret = -ENOMEM;
+			break;
+		}
+		work->chunk = chunk;
+		list_add_tail(&work->list, &sdev->queue);
+		chunk->refs++;
+	}
+	queued = chunk->refs;
+	if (queued) {
+		sctx->nr_chunks++;
+		pthread_cond_broadcast(&sctx->cond);
+	}
+	pthread_mutex_unlock(&sctx->lock);
+
+	if (!queued)
+		scrub_free_chunk(chunk);
+	return ret;
+}
+
+static int scrub_init_dev(struct scrub_ctx *sctx, struct scrub_dev *sdev)
+{
+	sdev->buf = malloc(SCRUB_READ_BYTES);
+	sdev->result = malloc(SCRUB_READ_BYTES / sctx->sectorsize *
+			      sctx->csum_size);
+	sdev->block = malloc(sctx->nodesize);
+	sdev->repair = malloc(sctx->nodesize);
+	if (!sdev->buf || !sdev->result || !sdev->block || !sdev->repair)
+		return -ENOMEM;
+	return -pthread_create(&sdev->thread, NULL, scrub_dev_thread, sdev);
+}
+
+/*
+ * Scrub all devices of the unmounted filesystem @fs_info.  Blocks with errors
+ * are repaired if a good copy is found, unless @readonly is set.
+ *
+ * On success the results of each device are returned in @devs_ret, which
+ * must be freed by the caller.
+ */
+int scrub_offline(struct btrfs_fs_info *fs_info, int readonly, int quiet,
+		  struct scrub_offline_dev **devs_ret, int *nr_devs_ret)
+{
+	struct btrfs_fs_devices *fs_devices = fs_info->fs_devices;
+	struct scrub_ctx sctx = {
+		.fs_info = fs_info,
+		.readonly = readonly,
+		.quiet = quiet,
+		.sectorsize = fs_info->sectorsize,
+		.nodesize = fs_info->nodesize,
+		.csum_size = btrfs_super_csum_size(fs_info->super_copy),
+	};
+	struct scrub_offline_dev *devs = NULL;
+	struct scrub_dev *sdev;
+	struct btrfs_device *device;
+	struct cache_extent *ce;
+	struct scrub_chunk *chunk;
+	int nr_devs = 0;
+	int ret = 0;
+	int i;
+
+	list_for_each_entry(device, &fs_devices->devices, dev_list)
+		nr_devs++;
+	devs = calloc(nr_devs, sizeof(*devs));
+	sctx.devs = calloc(nr_devs, sizeof(*sctx.devs));
+	if (!devs || !sctx.devs) {
+		free(devs);
+		free(sctx.devs);
+		return -ENOMEM;
+	}
+	sctx.nr_devs = nr_devs;
+	pthread_mutex_init(&sctx.lock, NULL);
+	pthread_cond_init(&sctx.cond, NULL);
+
+	i = 0;
+	list_for_each_entry(device, &fs_devices->devices, dev_list) {
+		sdev = &sctx.devs[i];
+		devs[i].info.devid = device->devid;
+		memcpy(devs[i].info.uuid, device->uuid, BTRFS_UUID_SIZE);
+		devs[i].info.total_bytes = device->total_bytes;
+		devs[i].info.bytes_used = device->bytes_used;
+		if (device->name)
+			__strncpy_null((char *)devs[i].info.path, device->name,
+				       sizeof(devs[i].info.path));
+		sdev->sctx = &sctx;
+		sdev->device = device;
+		sdev->progress = &devs[i].progress;
+		INIT_LIST_HEAD(&sdev->queue);
+		i++;
+
+		if (device->fd < 0) {
+			devs[i - 1].missing = 1;
+			continue;
+		}
+		ret = scrub_init_dev(&sctx, sdev);
+		if (ret)
+			goto out;
+		sdev->started = 1;
+	}
+
+	for (ce = first_cache_extent(&fs_info->mapping_tree.cache_tree); ce;
+	     ce = next_cache_extent(ce)) {
+		/* Chunks on seed devices only */
+		if (!scrub_chunk_has_dev(&sctx, ce))
+			continue;
+		chunk = scrub_prepare_chunk(&sctx, ce);
+		if (IS_ERR(chunk)) {
+			ret = PTR_ERR(chunk);
+			errno = -ret;
+			error("cannot read extents of chunk %llu: %m",
+			      ce->start);
+			break;
+		}
+		ret = scrub_queue_chunk(&sctx, chunk);
+		if (ret)
+			break;
+	}
+
+out:
+	pthread_mutex_lock(&sctx.lock);
+	sctx.done = 1;
+	pthread_cond_broadcast(&sctx.cond);
+	pthread_mutex_unlock(&sctx.lock);
+
+	for (i = 0; i < nr_devs; i++) {
+		sdev = &sctx.devs[i];
+		if (sdev->started)
+			pthread_join(sdev->thread, NULL);
+		free(sdev->buf);
+		free(sdev->result);
+		free(sdev->block);
+		free(sdev->repair);
+	}
+	free(sctx.devs);
+	pthread_mutex_destroy(&sctx.lock);
+	pthread_cond_destroy(&sctx.cond);
+
+	if (ret) {
+		free(devs);
+		return ret;
+	}
+	*devs_ret = devs;
+	*nr_devs_ret = nr_devs;
+	return 0;
+}
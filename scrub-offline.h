@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#ifndef __BTRFS_SCRUB_OFFLINE_H__
+#define __BTRFS_SCRUB_OFFLINE_H__
+
+#include "kerncompat.h"
+#include "ctree.h"
+#include "ioctl.h"
+
+/* Result of the offline scrub of one device */
+struct scrub_offline_dev {
+	struct btrfs_ioctl_dev_info_args info;
+	struct btrfs_scrub_progress progress;
+	/* The device could not be opened and was not scrubbed */
+	int missing;
+};
+
+int scrub_offline(struct btrfs_fs_info *fs_info, int readonly, int quiet,
+		  struct scrub_offline_dev **devs_ret, int *nr_devs_ret);
+
+#endif
@@ -0,0 +1,633 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#include "kerncompat.h"
+
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+#if BTRFSSEND_ZSTD
+#include <zstd.h>
+#endif
+
+#include "internal.h"
+#include "messages.h"
+#include "send-compress.h"
+
+#define SEND_COMPRESS_ZLIB_LEVEL	6
+#define SEND_COMPRESS_ZSTD_LEVEL	3
+
+/* Number of frames in flight per compression thread */
+#define SEND_COMPRESS_SLOTS_PER_THREAD	2
+
+struct compress_ctx {
+#if BTRFSSEND_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+#else
+	int unused;
+#endif
+};
+
+static void compress_ctx_release(struct compress_ctx *ctx)
+{
+#if BTRFSSEND_ZSTD
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+	ctx->cctx = NULL;
+	ctx->dctx = NULL;
+#endif
+}
+
+static int method_supported(int method)
+{
+	if (method == SEND_COMPRESS_ZLIB)
+		return 1;
+#if BTRFSSEND_ZSTD
+	if (method == SEND_COMPRESS_ZSTD)
+		return 1;
+#endif
+	return 0;
+}
+
+/* Parse name of a compression method, return -EINVAL if not supported */
+int send_compress_parse_method(const char *str)
+{
+	int method;
+
+	if (strcmp(str, "zlib") == 0)
+		method = SEND_COMPRESS_ZLIB;
+	else if (strcmp(str, "zstd") == 0)
+		method = SEND_COMPRESS_ZSTD;
+	else
+		return -EINVAL;
+
+	if (!method_supported(method))
+		return -EOPNOTSUPP;
+
+	return method;
+}
+
+static size_t compress_bound(int method, size_t len)
+{
+#if BTRFSSEND_ZSTD
+	if (method == SEND_COMPRESS_ZSTD)
+		return ZSTD_compressBound(len);
+#endif
+	return compressBound(len);
+}
+
+static int compress_buffer(struct compress_ctx *ctx, int method, void *out,
+			   size_t *out_len, const void *in, size_t in_len)
+{
+	uLongf zlen = *out_len;
+	int ret;
+
+#if BTRFSSEND_ZSTD
+	if (method == SEND_COMPRESS_ZSTD) {
+		size_t zret;
+
+		if (!ctx->cctx) {
+			ctx->cctx = ZSTD_createCCtx();
+			if (!ctx->cctx)
+				return -ENOMEM;
+		}
+		zret = ZSTD_compressCCtx(ctx->cctx, out, *out_len, in, in_len,
+					 SEND_COMPRESS_ZSTD_LEVEL);
+		if (ZSTD_isError(zret)) {
+			error("zstd compression failed: %s",
+			      ZSTD_getErrorName(zret));
+			return -EIO;
+		}
+		*out_len = zret;
+		return 0;
+	}
+#endif
+	ret = compress2(out, &zlen, in, in_len, SEND_COMPRESS_ZLIB_LEVEL);
+	if (ret != Z_OK) {
+		error("compression failed with %d", ret);
+		return -EIO;
+	}
+	*out_len = zlen;
+	return 0;
+}
+
+static int decompress_buffer(struct compress_ctx *ctx, int method, void *out,
+			     size_t out_len, const void *in, size_t in_len)
+{
+	uLongf zlen = out_len;
+	int ret;
+
+#if BTRFSSEND_ZSTD
+	if (method == SEND_COMPRESS_ZSTD) {
+		size_t zret;
+
+		if (!ctx->dctx) {
+			ctx->dctx = ZSTD_createDCtx();
+			if (!ctx->dctx)
+				return -ENOMEM;
+		}
+		zret = ZSTD_decompressDCtx(ctx->dctx, out, out_len, in, in_len);
+		if (ZSTD_isError(zret)) {
+			error("zstd decompression failed: %s",
+			      ZSTD_getErrorName(zret));
+			return -EIO;
+		}
+		if (zret != out_len)
+			goto corrupted;
+		return 0;
+	}
+#endif
+	ret = uncompress(out, &zlen, in, in_len);
+	if (ret != Z_OK) {
+		error("decompression failed with %d", ret);
+		return -EIO;
+	}
+	if (zlen != out_len)
+		goto corrupted;
+	return 0;
+
+corrupted:
+	error("compressed stream corrupted, frame size mismatch");
+	return -EIO;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = write(fd, (const char *)buf + pos, len - pos);
+		if (ret < 0) {
+			ret = -errno;
+			/* The reader went away, reported by the caller */
+			if (ret != -EPIPE)
+				error("failed to write stream: %m");
+			return ret;
+		}
+		pos += ret;
+	}
+
+	return 0;
+}
+
+/* Read up to @len bytes, less only at the end of the input */
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = read(fd, (char *)buf + pos, len - pos);
+		if (ret < 0) {
+			ret = -errno;
+			error("failed to read stream: %m");
+			return ret;
+		}
+		if (ret == 0)
+			break;
+		pos += ret;
+	}
+
+	return pos;
+}
+
+enum {
+	SLOT_FREE,
+	SLOT_FILLED,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+struct compress_slot {
+	char *raw;
+	size_t raw_len;
+	/* Frame header followed by the compressed data */
+	char *frame;
+	size_t frame_len;
+	int state;
+	int ret;
+};
+
+/*
+ * Frames are filled, compressed and written in the order of the sequence
+ * numbers, slot of frame N is slots[N % nr_slots]
+ */
+struct compress_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t filled;
+	pthread_cond_t done;
+	int method;
+	int stop;
+	int nr_slots;
+	struct compress_slot *slots;
+	u64 next_fill;
+	u64 next_compress;
+	u64 next_write;
+};
+
+static void compress_frame(struct compress_ctx *ctx, int method,
+			   struct compress_slot *slot)
+{
+	struct send_compress_frame *frame;
+	size_t len = compress_bound(method, slot->raw_len);
+
+	frame = (struct send_compress_frame *)slot->frame;
+	slot->ret = compress_buffer(ctx, method, frame + 1, &len, slot->raw,
+				    slot->raw_len);
+	if (slot->ret < 0)
+		return;
+
+	/* Store incompressible data as is, denoted by len == raw_len */
+	if (len >= slot->raw_len) {
+		len = slot->raw_len;
+		memcpy(frame + 1, slot->raw, len);
+	}
+	frame->len = cpu_to_le32(len);
+	frame->raw_len = cpu_to_le32(slot->raw_len);
+	slot->frame_len = sizeof(*frame) + len;
+}
+
+static void *compress_worker(void *arg)
+{
+	struct compress_pool *pool = arg;
+	struct compress_ctx ctx;
+	struct compress_slot *slot;
+
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (pool->next_compress == pool->next_fill && !pool->stop)
+			pthread_cond_wait(&pool->filled, &pool->mutex);
+		if (pool->next_compress == pool->next_fill)
+			break;
+		slot = &pool->slots[pool->next_compress++ % pool->nr_slots];
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&pool->mutex);
+
+		compress_frame(&ctx, pool->method, slot);
+
+		pthread_mutex_lock(&pool->mutex);
+		slot->state = SLOT_DONE;
+		pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	compress_ctx_release(&ctx);
+
+	return NULL;
+}
+
+static int compress_pool_run(struct compress_pool *pool, int in_fd, int out_fd)
+{
+	struct compress_slot *slot;
+	ssize_t len;
+	int eof = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		/* Write out compressed frames in order */
+		slot = &pool->slots[pool->next_write % pool->nr_slots];
+		if (pool->next_write < pool->next_fill &&
+		    slot->state == SLOT_DONE) {
+			pthread_mutex_unlock(&pool->mutex);
+			ret = slot->ret;
+			if (!ret)
+				ret = write_all(out_fd, slot->frame,
+						slot->frame_len);
+			pthread_mutex_lock(&pool->mutex);
+			if (ret < 0)
+				break;
+			slot->state = SLOT_FREE;
+			pool->next_write++;
+			continue;
+		}
+
+		if (eof && pool->next_write == pool->next_fill)
+			break;
+
+		/* Read the next frame if there's a free slot */
+		if (!eof && pool->next_fill - pool->next_write < pool->nr_slots) {
+			slot = &pool->slots[pool->next_fill % pool->nr_slots];
+			pthread_mutex_unlock(&pool->mutex);
+			len = read_full(in_fd, slot->raw,
+					SEND_COMPRESS_FRAME_SIZE);
+			pthread_mutex_lock(&pool->mutex);
+			if (len < 0) {
+				ret = len;
+				break;
+			}
+			if (len == 0) {
+				eof = 1;
+				continue;
+			}
+			slot->raw_len = len;
+			slot->state = SLOT_FILLED;
+			pool->next_fill++;
+			pthread_cond_signal(&pool->filled);
+			if (len < SEND_COMPRESS_FRAME_SIZE)
+				eof = 1;
+			continue;
+		}
+
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return ret;
+}
+
+/*
+ * Read a raw send stream from @in_fd until end of file and write it to
+ * @out_fd compressed by @method, using @nr_threads threads to compress
+ */
+int send_compress_stream(int in_fd, int out_fd, int method, int nr_threads)
+{
+	struct compress_pool pool;
+	struct send_compress_header header;
+	pthread_t *threads;
+	size_t frame_size;
+	int nr_started = 0;
+	int ret;
+	int i;
+
+	if (!method_supported(method))
+		return -EOPNOTSUPP;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.method = method;
+	pool.nr_slots = nr_threads * SEND_COMPRESS_SLOTS_PER_THREAD;
+	pool.slots = calloc(pool.nr_slots, sizeof(*pool.slots));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!pool.slots || !threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	frame_size = sizeof(struct send_compress_frame) +
+		     max(compress_bound(method, SEND_COMPRESS_FRAME_SIZE),
+			 (size_t)SEND_COMPRESS_FRAME_SIZE);
+	for (i = 0; i < pool.nr_slots; i++) {
+		pool.slots[i].raw = malloc(SEND_COMPRESS_FRAME_SIZE);
+		pool.slots[i].frame = malloc(frame_size);
+		if (!pool.slots[i].raw || !pool.slots[i].frame) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.filled, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, SEND_COMPRESS_MAGIC);
+	header.version = cpu_to_le32(SEND_COMPRESS_VERSION);
+	header.method = cpu_to_le32(method);
+	ret = write_all(out_fd, &header, sizeof(header));
+	if (ret < 0)
+		goto out_destroy;
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&threads[i], NULL, compress_worker, &pool);
+		if (ret) {
+			ret = -ret;
+			errno = -ret;
+			error("thread setup failed: %m");
+			break;
+		}
+		nr_started++;
+	}
+
+	if (nr_started)
+		ret = compress_pool_run(&pool, in_fd, out_fd);
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.filled);
+	pthread_mutex_unlock(&pool.mutex);
+	for (i = 0; i < nr_started; i++)
+		pthread_join(threads[i], NULL);
+
+out_destroy:
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.filled);
+	pthread_mutex_destroy(&pool.mutex);
+out:
+	if (pool.slots) {
+		for (i = 0; i < pool.nr_slots; i++) {
+			free(pool.slots[i].raw);
+			free(pool.slots[i].frame);
+		}
+	}
+	free(pool.slots);
+	free(threads);
+
+	return ret;
+}
+
+/*
+ * Check if the stream read from @fd is compressed. The file offset of a
+ * seekable @fd is not changed. A pipe can't be peeked at, the start of the
+ * stream is read to @head then and its length set in @head_len, the stream
+ * must be read through send_decompress_stream() even if it's not compressed.
+ */
+int send_compress_detect(int fd, struct send_compress_header *head,
+			 size_t *head_len)
+{
+	off_t pos;
+	ssize_t ret;
+
+	*head_len = 0;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == (off_t)-1) {
+		ret = read_full(fd, head, sizeof(*head));
+		if (ret < 0)
+			return ret;
+		*head_len = ret;
+	} else {
+		ret = pread(fd, head, sizeof(*head), pos);
+		if (ret < 0)
+			return -errno;
+	}
+	if (ret < sizeof(*head))
+		return 0;
+
+	return memcmp(head->magic, SEND_COMPRESS_MAGIC,
+		      sizeof(head->magic)) == 0;
+}
+
+/* Write @len bytes of @head and then the rest of @in_fd unchanged */
+static int copy_stream(int in_fd, int out_fd, const void *head, size_t len,
+		       char *buf, size_t size)
+{
+	ssize_t ret;
+
+	ret = write_all(out_fd, head, len);
+	while (ret >= 0) {
+		ret = read(in_fd, buf, size);
+		if (ret < 0) {
+			ret = -errno;
+			error("failed to read stream: %m");
+			break;
+		}
+		if (ret == 0)
+			break;
+		ret = write_all(out_fd, buf, ret);
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Read the rest of the stream header of which @len bytes are already in
+ * @header and return the compression method
+ */
+static int read_header(int fd, struct send_compress_header *header, size_t len)
+{
+	ssize_t ret;
+	int method;
+
+	ret = read_full(fd, (char *)header + len, sizeof(*header) - len);
+	if (ret < 0)
+		return ret;
+	if (ret < sizeof(*header) - len ||
+	    memcmp(header->magic, SEND_COMPRESS_MAGIC,
+		   sizeof(header->magic)) != 0) {
+		error("compressed stream header corrupted");
+		return -EINVAL;
+	}
+	if (le32_to_cpu(header->version) != SEND_COMPRESS_VERSION) {
+		error("unsupported compressed stream version %u",
+		      le32_to_cpu(header->version));
+		return -EINVAL;
+	}
+	method = le32_to_cpu(header->method);
+	if (!method_supported(method)) {
+		error("compression method %d of the stream not supported",
+		      method);
+		return -EOPNOTSUPP;
+	}
+
+	return method;
+}
+
+/*
+ * Read compressed stream from @in_fd and write the raw send stream to @out_fd
+ * until the end of the input. The first @head_len bytes of the input were
+ * already read by send_compress_detect() to @head, a stream that turned out
+ * not to be compressed is copied unchanged.
+ */
+int send_decompress_stream(int in_fd, int out_fd,
+			   const struct send_compress_header *head,
+			   size_t head_len)
+{
+	struct send_compress_header header;
+	struct send_compress_frame *frame;
+	struct compress_ctx ctx;
+	char *in = NULL;
+	char *out = NULL;
+	size_t in_size;
+	size_t len;
+	size_t raw_len;
+	int method;
+	ssize_t ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	in_size = max(compress_bound(SEND_COMPRESS_ZLIB,
+				     SEND_COMPRESS_FRAME_SIZE),
+		      (size_t)SEND_COMPRESS_FRAME_SIZE);
+#if BTRFSSEND_ZSTD
+	in_size = max(in_size, compress_bound(SEND_COMPRESS_ZSTD,
+					      SEND_COMPRESS_FRAME_SIZE));
+#endif
+	in = malloc(in_size);
+	out = malloc(SEND_COMPRESS_FRAME_SIZE);
+	if (!in || !out) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (head_len)
+		memcpy(&header, head, head_len);
+	if (head_len && (head_len < sizeof(header) ||
+			 memcmp(header.magic, SEND_COMPRESS_MAGIC,
+				sizeof(header.magic)) != 0)) {
+		ret = copy_stream(in_fd, out_fd, head, head_len, in, in_size);
+		goto out;
+	}
+	method = read_header(in_fd, &header, head_len);
+	if (method < 0) {
+		ret = method;
+		goto out;
+	}
+
+	frame = (struct send_compress_frame *)&header;
+	while (1) {
+		ret = read_full(in_fd, frame, sizeof(*frame));
+		if (ret <= 0)
+			break;
+		if (ret < sizeof(*frame)) {
+			error("compressed stream truncated");
+			ret = -EIO;
+			break;
+		}
+
+		/* Stream of the next subvolume */
+		if (memcmp(frame, SEND_COMPRESS_MAGIC, sizeof(*frame)) == 0) {
+			method = read_header(in_fd, &header, sizeof(*frame));
+			if (method < 0) {
+				ret = method;
+				break;
+			}
+			continue;
+		}
+
+		len = le32_to_cpu(frame->len);
+		raw_len = le32_to_cpu(frame->raw_len);
+		if (raw_len > SEND_COMPRESS_FRAME_SIZE || len > in_size) {
+			error("compressed stream corrupted, invalid frame size");
+			ret = -EIO;
+			break;
+		}
+
+		ret = read_full(in_fd, in, len);
+		if (ret < 0)
+			break;
+		if (ret < len) {
+			error("compressed stream truncated");
+			ret = -EIO;
+			break;
+		}
+
+		if (len == raw_len) {
+			ret = write_all(out_fd, in, len);
+		} else {
+			ret = decompress_buffer(&ctx, method, out, raw_len, in,
+						len);
+			if (!ret)
+				ret = write_all(out_fd, out, raw_len);
+		}
+		if (ret < 0)
+			break;
+	}
+
+out:
+	compress_ctx_release(&ctx);
+	free(in);
+	free(out);
+
+	return ret < 0 ? ret : 0;
+}
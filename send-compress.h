@@ -0,0 +1,65 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#ifndef __BTRFS_SEND_COMPRESS_H__
+#define __BTRFS_SEND_COMPRESS_H__
+
+#include "kerncompat.h"
+#include "sizes.h"
+
+/*
+ * Compressed send stream as written by 'btrfs send --compress'. The stream is
+ * cut to frames of up to SEND_COMPRESS_FRAME_SIZE bytes that are compressed
+ * independently, so they can be compressed and decompressed in parallel:
+ *
+ *   struct send_compress_header
+ *   struct send_compress_frame, compressed data
+ *   struct send_compress_frame, compressed data
+ *   ...
+ *
+ * Streams of several subvolumes written to one output may follow each other,
+ * another header may start where a frame is expected.
+ */
+#define SEND_COMPRESS_MAGIC		"btrfs-zstream"
+#define SEND_COMPRESS_VERSION		1
+#define SEND_COMPRESS_FRAME_SIZE	SZ_1M
+
+enum {
+	SEND_COMPRESS_NONE,
+	SEND_COMPRESS_ZLIB,
+	SEND_COMPRESS_ZSTD,
+};
+
+struct send_compress_header {
+	char magic[sizeof(SEND_COMPRESS_MAGIC)];
+	__le32 version;
+	__le32 method;
+} __attribute__ ((__packed__));
+
+struct send_compress_frame {
+	/* Length of the compressed data following the frame header */
+	__le32 len;
+	/* Length of the data after decompression */
+	__le32 raw_len;
+} __attribute__ ((__packed__));
+
+int send_compress_parse_method(const char *str);
+int send_compress_stream(int in_fd, int out_fd, int method, int nr_threads);
+int send_compress_detect(int fd, struct send_compress_header *head,
+			 size_t *head_len);
+int send_decompress_stream(int in_fd, int out_fd,
+			   const struct send_compress_header *head,
+			   size_t head_len);
+
+#endif
@@ -0,0 +1,887 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#include "kerncompat.h"
+
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "send.h"
+#include "send-stream.h"
+#include "send-dump.h"
+#include "send-index.h"
+#include "messages.h"
+#include "utils.h"
+
+/* Size of the buffer for the sequential read of the stream */
+#define SEND_INDEX_READ_SIZE	SZ_1M
+
+static const char * const cmd_names[BTRFS_SEND_C_MAX + 1] = {
+	[BTRFS_SEND_C_SUBVOL]		= "subvol",
+	[BTRFS_SEND_C_SNAPSHOT]		= "snapshot",
+	[BTRFS_SEND_C_MKFILE]		= "mkfile",
+	[BTRFS_SEND_C_MKDIR]		= "mkdir",
+	[BTRFS_SEND_C_MKNOD]		= "mknod",
+	[BTRFS_SEND_C_MKFIFO]		= "mkfifo",
+	[BTRFS_SEND_C_MKSOCK]		= "mksock",
+	[BTRFS_SEND_C_SYMLINK]		= "symlink",
+	[BTRFS_SEND_C_RENAME]		= "rename",
+	[BTRFS_SEND_C_LINK]		= "link",
+	[BTRFS_SEND_C_UNLINK]		= "unlink",
+	[BTRFS_SEND_C_RMDIR]		= "rmdir",
+	[BTRFS_SEND_C_SET_XATTR]	= "set_xattr",
+	[BTRFS_SEND_C_REMOVE_XATTR]	= "remove_xattr",
+	[BTRFS_SEND_C_WRITE]		= "write",
+	[BTRFS_SEND_C_CLONE]		= "clone",
+	[BTRFS_SEND_C_TRUNCATE]		= "truncate",
+	[BTRFS_SEND_C_CHMOD]		= "chmod",
+	[BTRFS_SEND_C_CHOWN]		= "chown",
+	[BTRFS_SEND_C_UTIMES]		= "utimes",
+	[BTRFS_SEND_C_END]		= "end",
+	[BTRFS_SEND_C_UPDATE_EXTENT]	= "update_extent",
+};
+
+struct index_reader {
+	int fd;
+	char *buf;
+	size_t pos;
+	size_t len;
+	/* Stream offset of the next byte returned */
+	u64 offset;
+};
+
+/*
+ * Read @len bytes of the stream to @dst.
+ * Return:
+ *   0 - success
+ * < 0 - negative errno in case of error
+ * > 0 - no data read, EOF
+ */
+static int reader_read(struct index_reader *r, void *dst, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		if (r->pos == r->len) {
+			ret = read(r->fd, r->buf, SEND_INDEX_READ_SIZE);
+			if (ret < 0) {
+				ret = -errno;
+				error("read from stream failed: %m");
+				return ret;
+			}
+			if (ret == 0) {
+				if (!done)
+					return 1;
+				error("short read from stream: expected %zu read %zu",
+				      len, done);
+				return -EIO;
+			}
+			r->pos = 0;
+			r->len = ret;
+		}
+		ret = min_t(size_t, len - done, r->len - r->pos);
+		memcpy((char *)dst + done, r->buf + r->pos, ret);
+		r->pos += ret;
+		done += ret;
+	}
+	r->offset += len;
+
+	return 0;
+}
+
+struct index_path_node {
+	struct rb_node node;
+	u32 id;
+	char name[];
+};
+
+static int grow_array(void **array, u32 *alloc, u32 nr, size_t size)
+{
+	u32 new_alloc;
+	void *tmp;
+
+	if (nr < *alloc)
+		return 0;
+
+	new_alloc = max_t(u32, 64, *alloc * 2);
+	tmp = realloc(*array, (size_t)new_alloc * size);
+	if (!tmp)
+		return -ENOMEM;
+	*array = tmp;
+	*alloc = new_alloc;
+
+	return 0;
+}
+
+/* Find the path @name of length @len or add a new one, return its id */
+static int index_path(struct send_index *idx, const char *name, int len,
+		      u32 *id)
+{
+	struct rb_node **p = &idx->path_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct index_path_node *entry;
+	struct send_index_path *path;
+	int cmp;
+	int ret;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct index_path_node, node);
+		cmp = strncmp(name, entry->name, len);
+		if (!cmp && entry->name[len])
+			cmp = -1;
+		if (cmp < 0) {
+			p = &(*p)->rb_left;
+		} else if (cmp > 0) {
+			p = &(*p)->rb_right;
+		} else {
+			*id = entry->id;
+			return 0;
+		}
+	}
+
+	ret = grow_array((void **)&idx->paths, &idx->paths_alloc, idx->nr_paths,
+			 sizeof(*idx->paths));
+	if (ret < 0)
+		return ret;
+	while (idx->names_len + len + 1 > idx->names_alloc) {
+		ret = grow_array((void **)&idx->names, &idx->names_alloc,
+				 idx->names_alloc, 1);
+		if (ret < 0)
+			return ret;
+	}
+	entry = malloc(sizeof(*entry) + len + 1);
+	if (!entry)
+		return -ENOMEM;
+
+	entry->id = idx->nr_paths++;
+	memcpy(entry->name, name, len);
+	entry->name[len] = 0;
+	rb_link_node(&entry->node, parent, p);
+	rb_insert_color(&entry->node, &idx->path_tree);
+
+	path = &idx->paths[entry->id];
+	memset(path, 0, sizeof(*path));
+	path->name = cpu_to_le32(idx->names_len);
+	memcpy(idx->names + idx->names_len, entry->name, len + 1);
+	idx->names_len += len + 1;
+
+	*id = entry->id;
+	return 0;
+}
+
+static void free_path_tree(struct send_index *idx)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(&idx->path_tree))) {
+		rb_erase(n, &idx->path_tree);
+		free(rb_entry(n, struct index_path_node, node));
+	}
+}
+
+static void account_path(struct send_index *idx, u32 id, u32 cmd_nr)
+{
+	struct send_index_path *path = &idx->paths[id];
+
+	if (!path->nr_cmds)
+		path->first_cmd = cpu_to_le32(cmd_nr);
+	path->last_cmd = cpu_to_le32(cmd_nr);
+	path->nr_cmds = cpu_to_le32(le32_to_cpu(path->nr_cmds) + 1);
+}
+
+/*
+ * Add the command @hdr with attributes in @data to the index. Only the
+ * attributes needed for the index are looked at, the full validation is
+ * left to the stream parser.
+ */
+static int index_cmd(struct send_index *idx, u64 offset,
+		     struct btrfs_cmd_header *hdr, char *data)
+{
+	struct send_index_cmd *cmd;
+	u32 len = le32_to_cpu(hdr->len);
+	u32 path = SEND_INDEX_NO_PATH;
+	u32 path2 = SEND_INDEX_NO_PATH;
+	u16 type = le16_to_cpu(hdr->cmd);
+	u64 size = 0;
+	u32 pos = 0;
+	int ret;
+
+	while (pos + sizeof(struct btrfs_tlv_header) <= len) {
+		struct btrfs_tlv_header *tlv;
+		u16 tlv_type;
+		u16 tlv_len;
+		char *value;
+
+		tlv = (struct btrfs_tlv_header *)(data + pos);
+		tlv_type = le16_to_cpu(tlv->tlv_type);
+		tlv_len = le16_to_cpu(tlv->tlv_len);
+		value = (char *)(tlv + 1);
+		pos += sizeof(*tlv) + tlv_len;
+		if (pos > len) {
+			error("invalid tlv in cmd at offset %llu",
+			      (unsigned long long)offset);
+			return -EINVAL;
+		}
+
+		switch (tlv_type) {
+		case BTRFS_SEND_A_PATH:
+			ret = index_path(idx, value, tlv_len, &path);
+			break;
+		case BTRFS_SEND_A_PATH_TO:
+		case BTRFS_SEND_A_CLONE_PATH:
+			ret = index_path(idx, value, tlv_len, &path2);
+			break;
+		case BTRFS_SEND_A_PATH_LINK:
+			/* Target of symlink is not a path in the subvolume */
+			ret = 0;
+			if (type == BTRFS_SEND_C_LINK)
+				ret = index_path(idx, value, tlv_len, &path2);
+			break;
+		case BTRFS_SEND_A_DATA:
+			size = tlv_len;
+			ret = 0;
+			break;
+		case BTRFS_SEND_A_CLONE_LEN:
+		case BTRFS_SEND_A_SIZE:
+			if (tlv_len == sizeof(__le64))
+				size = get_unaligned_le64(value);
+			ret = 0;
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = grow_array((void **)&idx->cmds, &idx->cmds_alloc, idx->nr_cmds,
+			 sizeof(*idx->cmds));
+	if (ret < 0)
+		return ret;
+
+	cmd = &idx->cmds[idx->nr_cmds];
+	cmd->offset = cpu_to_le64(offset);
+	cmd->size = cpu_to_le64(size);
+	cmd->len = cpu_to_le32(sizeof(*hdr) + len);
+	cmd->path = cpu_to_le32(path);
+	cmd->path2 = cpu_to_le32(path2);
+	cmd->cmd = cpu_to_le16(type);
+	cmd->stream = cpu_to_le16(idx->nr_streams - 1);
+
+	if (path != SEND_INDEX_NO_PATH) {
+		struct send_index_path *p = &idx->paths[path];
+
+		account_path(idx, path, idx->nr_cmds);
+		if (type == BTRFS_SEND_C_WRITE)
+			p->write_bytes = cpu_to_le64(
+					le64_to_cpu(p->write_bytes) + size);
+		else if (type == BTRFS_SEND_C_CLONE)
+			p->clone_bytes = cpu_to_le64(
+					le64_to_cpu(p->clone_bytes) + size);
+	}
+	if (path2 != SEND_INDEX_NO_PATH && path2 != path)
+		account_path(idx, path2, idx->nr_cmds);
+	idx->nr_cmds++;
+
+	return 0;
+}
+
+/* Read the stream(s) from @fd to the end and build the index */
+int send_index_build(struct send_index *idx, int fd)
+{
+	struct index_reader reader = { .fd = fd };
+	struct btrfs_stream_header hdr;
+	struct btrfs_cmd_header cmd_hdr;
+	struct stat st;
+	char *data = NULL;
+	u64 offset;
+	u32 len;
+	int ret;
+
+	memset(idx, 0, sizeof(*idx));
+	reader.buf = malloc(SEND_INDEX_READ_SIZE);
+	data = malloc(BTRFS_SEND_BUF_SIZE);
+	if (!reader.buf || !data) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (1) {
+		offset = reader.offset;
+		ret = reader_read(&reader, &hdr, sizeof(hdr));
+		if (ret < 0)
+			goto out;
+		if (ret > 0)
+			break;
+		if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
+			error("unexpected header at offset %llu",
+			      (unsigned long long)offset);
+			ret = -EINVAL;
+			goto out;
+		}
+		if (idx->nr_streams == (u16)-1) {
+			error("too many streams");
+			ret = -E2BIG;
+			goto out;
+		}
+		ret = grow_array((void **)&idx->streams, &idx->streams_alloc,
+				 idx->nr_streams, sizeof(*idx->streams));
+		if (ret < 0)
+			goto out;
+		idx->streams[idx->nr_streams++] = cpu_to_le64(offset);
+
+		while (1) {
+			offset = reader.offset;
+			ret = reader_read(&reader, &cmd_hdr, sizeof(cmd_hdr));
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				goto done;
+
+			len = le32_to_cpu(cmd_hdr.len);
+			if (len + sizeof(cmd_hdr) >= BTRFS_SEND_BUF_SIZE) {
+				error("command length %u too big at offset %llu",
+				      len, (unsigned long long)offset);
+				ret = -EINVAL;
+				goto out;
+			}
+			ret = reader_read(&reader, data, len);
+			if (ret > 0) {
+				error("unexpected EOF in stream");
+				ret = -EINVAL;
+			}
+			if (ret < 0)
+				goto out;
+
+			ret = index_cmd(idx, offset, &cmd_hdr, data);
+			if (ret < 0)
+				goto out;
+			if (le16_to_cpu(cmd_hdr.cmd) == BTRFS_SEND_C_END)
+				break;
+		}
+	}
+
+done:
+	if (!idx->nr_streams) {
+		ret = -ENODATA;
+		goto out;
+	}
+	idx->stream_size = reader.offset;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		idx->stream_mtime = st.st_mtime;
+	ret = 0;
+
+out:
+	free_path_tree(idx);
+	free(reader.buf);
+	free(data);
+	if (ret < 0)
+		send_index_free(idx);
+	return ret;
+}
+
+int send_index_write(struct send_index *idx, const char *path)
+{
+	struct send_index_header hdr;
+	FILE *f;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SEND_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(SEND_INDEX_VERSION);
+	hdr.stream_size = cpu_to_le64(idx->stream_size);
+	hdr.stream_mtime = cpu_to_le64(idx->stream_mtime);
+	hdr.nr_streams = cpu_to_le32(idx->nr_streams);
+	hdr.nr_cmds = cpu_to_le32(idx->nr_cmds);
+	hdr.nr_paths = cpu_to_le32(idx->nr_paths);
+	hdr.names_len = cpu_to_le32(idx->names_len);
+
+	f = fopen(path, "w");
+	if (!f) {
+		ret = -errno;
+		error("cannot create index %s: %m", path);
+		return ret;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(idx->streams, sizeof(*idx->streams), idx->nr_streams, f) !=
+	    idx->nr_streams ||
+	    fwrite(idx->cmds, sizeof(*idx->cmds), idx->nr_cmds, f) !=
+	    idx->nr_cmds ||
+	    fwrite(idx->paths, sizeof(*idx->paths), idx->nr_paths, f) !=
+	    idx->nr_paths ||
+	    fwrite(idx->names, 1, idx->names_len, f) != idx->names_len)
+		ret = -errno;
+	if (fclose(f) && !ret)
+		ret = -errno;
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot write index %s: %m", path);
+	}
+
+	return ret;
+}
+
+static int read_array(FILE *f, void **array, size_t size, u32 nr)
+{
+	*array = malloc(size * nr + 1);
+	if (!*array)
+		return -ENOMEM;
+	if (fread(*array, size, nr, f) != nr)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int valid_path_id(struct send_index *idx, u32 id)
+{
+	return id == SEND_INDEX_NO_PATH || id < idx->nr_paths;
+}
+
+/*
+ * The entries are used as offsets and lengths of reads from the stream and
+ * as array indexes, reject the index if any of them is out of range
+ */
+static int send_index_validate(struct send_index *idx)
+{
+	u64 offset;
+	u32 len;
+	u32 i;
+
+	if (idx->names_len && idx->names[idx->names_len - 1])
+		return -EINVAL;
+
+	for (i = 0; i < idx->nr_streams; i++) {
+		offset = le64_to_cpu(idx->streams[i]);
+		if (offset > idx->stream_size ||
+		    idx->stream_size - offset <
+		    sizeof(struct btrfs_stream_header))
+			return -EINVAL;
+	}
+
+	for (i = 0; i < idx->nr_cmds; i++) {
+		struct send_index_cmd *cmd = &idx->cmds[i];
+
+		offset = le64_to_cpu(cmd->offset);
+		len = le32_to_cpu(cmd->len);
+		if (len < sizeof(struct btrfs_cmd_header) ||
+		    len > BTRFS_SEND_BUF_SIZE ||
+		    le16_to_cpu(cmd->stream) >= idx->nr_streams ||
+		    offset > idx->stream_size ||
+		    idx->stream_size - offset < len ||
+		    !valid_path_id(idx, le32_to_cpu(cmd->path)) ||
+		    !valid_path_id(idx, le32_to_cpu(cmd->path2)))
+			return -EINVAL;
+	}
+
+	for (i = 0; i < idx->nr_paths; i++) {
+		struct send_index_path *path = &idx->paths[i];
+
+		if (le32_to_cpu(path->name) >= idx->names_len ||
+		    le32_to_cpu(path->first_cmd) >= idx->nr_cmds ||
+		    le32_to_cpu(path->last_cmd) >= idx->nr_cmds)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int send_index_read(struct send_index *idx, const char *path)
+{
+	struct send_index_header hdr;
+	FILE *f;
+	int ret;
+
+	memset(idx, 0, sizeof(*idx));
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, SEND_INDEX_MAGIC, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != SEND_INDEX_VERSION) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	idx->stream_size = le64_to_cpu(hdr.stream_size);
+	idx->stream_mtime = le64_to_cpu(hdr.stream_mtime);
+	idx->nr_streams = le32_to_cpu(hdr.nr_streams);
+	idx->nr_cmds = le32_to_cpu(hdr.nr_cmds);
+	idx->nr_paths = le32_to_cpu(hdr.nr_paths);
+	idx->names_len = le32_to_cpu(hdr.names_len);
+
+	ret = read_array(f, (void **)&idx->streams, sizeof(*idx->streams),
+			 idx->nr_streams);
+	if (!ret)
+		ret = read_array(f, (void **)&idx->cmds, sizeof(*idx->cmds),
+				 idx->nr_cmds);
+	if (!ret)
+		ret = read_array(f, (void **)&idx->paths, sizeof(*idx->paths),
+				 idx->nr_paths);
+	if (!ret)
+		ret = read_array(f, (void **)&idx->names, 1, idx->names_len);
+	if (!ret)
+		ret = send_index_validate(idx);
+
+out:
+	fclose(f);
+	if (ret < 0)
+		send_index_free(idx);
+	return ret;
+}
+
+/*
+ * Return 1 if the index has been built from the stream file @fd, a stream
+ * that is not a regular file never matches
+ */
+int send_index_match(struct send_index *idx, int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	return st.st_size == idx->stream_size &&
+	       st.st_mtime == idx->stream_mtime;
+}
+
+void send_index_free(struct send_index *idx)
+{
+	free(idx->streams);
+	free(idx->cmds);
+	free(idx->paths);
+	free(idx->names);
+	memset(idx, 0, sizeof(*idx));
+}
+
+static const char *path_name(struct send_index *idx, u32 id)
+{
+	u32 name;
+
+	if (id >= idx->nr_paths)
+		return "";
+	name = le32_to_cpu(idx->paths[id].name);
+	if (name >= idx->names_len)
+		return "";
+	return idx->names + name;
+}
+
+static u64 path_bytes(struct send_index_path *path)
+{
+	return le64_to_cpu(path->write_bytes) + le64_to_cpu(path->clone_bytes);
+}
+
+static int cmp_path_bytes(const void *a, const void *b)
+{
+	u64 bytes_a = path_bytes(*(struct send_index_path **)a);
+	u64 bytes_b = path_bytes(*(struct send_index_path **)b);
+
+	if (bytes_a > bytes_b)
+		return -1;
+	if (bytes_a < bytes_b)
+		return 1;
+	return 0;
+}
+
+void send_index_print_stats(struct send_index *idx)
+{
+	u64 count[BTRFS_SEND_C_MAX + 1] = { 0 };
+	u64 bytes[BTRFS_SEND_C_MAX + 1] = { 0 };
+	struct send_index_path **sorted;
+	u64 written = 0;
+	u64 cloned = 0;
+	u32 nr = 0;
+	u32 i;
+
+	for (i = 0; i < idx->nr_cmds; i++) {
+		u16 cmd = le16_to_cpu(idx->cmds[i].cmd);
+
+		if (cmd > BTRFS_SEND_C_MAX)
+			cmd = BTRFS_SEND_C_UNSPEC;
+		count[cmd]++;
+		bytes[cmd] += le32_to_cpu(idx->cmds[i].len);
+		if (cmd == BTRFS_SEND_C_WRITE)
+			written += le64_to_cpu(idx->cmds[i].size);
+		else if (cmd == BTRFS_SEND_C_CLONE)
+			cloned += le64_to_cpu(idx->cmds[i].size);
+	}
+
+	printf("Stream size:  %s\n", pretty_size(idx->stream_size));
+	printf("Streams:      %u\n", idx->nr_streams);
+	printf("Commands:     %u\n", idx->nr_cmds);
+	printf("Paths:        %u\n", idx->nr_paths);
+	printf("Data written: %s\n", pretty_size(written));
+	printf("Data cloned:  %s\n", pretty_size(cloned));
+	printf("Clone ratio:  %llu%%\n", written + cloned ?
+	       cloned * 100 / (written + cloned) : 0);
+
+	printf("\n%-16s %12s %12s\n", "Command", "Count", "Size");
+	for (i = 0; i <= BTRFS_SEND_C_MAX; i++) {
+		if (!count[i])
+			continue;
+		printf("%-16s %12llu %12s\n",
+		       cmd_names[i] ? cmd_names[i] : "unknown",
+		       count[i], pretty_size(bytes[i]));
+	}
+
+	sorted = malloc(sizeof(*sorted) * (idx->nr_paths + 1));
+	if (!sorted)
+		return;
+	for (i = 0; i < idx->nr_paths; i++)
+		if (path_bytes(&idx->paths[i]))
+			sorted[nr++] = &idx->paths[i];
+	qsort(sorted, nr, sizeof(*sorted), cmp_path_bytes);
+
+	if (nr)
+		printf("\n%12s %12s %8s  %s\n", "Written", "Cloned", "Commands",
+		       "Path");
+	for (i = 0; i < nr; i++) {
+		printf("%12s ", pretty_size(le64_to_cpu(sorted[i]->write_bytes)));
+		printf("%12s %8u  %s\n",
+		       pretty_size(le64_to_cpu(sorted[i]->clone_bytes)),
+		       le32_to_cpu(sorted[i]->nr_cmds),
+		       path_name(idx, sorted[i] - idx->paths));
+	}
+	free(sorted);
+}
+
+/*
+ * Select the commands of the file named @id at the end of each stream, going
+ * backwards to follow renames and links to its earlier names up to the
+ * command that created it
+ */
+static int select_cmds(struct send_index *idx, u32 id, u8 *selected)
+{
+	u8 *active;
+	int stream = -1;
+	u32 i;
+
+	active = calloc(idx->nr_paths, 1);
+	if (!active)
+		return -ENOMEM;
+
+	for (i = idx->nr_cmds; i-- > 0;) {
+		struct send_index_cmd *cmd = &idx->cmds[i];
+		u32 path = le32_to_cpu(cmd->path);
+		u32 path2 = le32_to_cpu(cmd->path2);
+		int in1;
+		int in2;
+
+		if (le16_to_cpu(cmd->stream) != stream) {
+			stream = le16_to_cpu(cmd->stream);
+			memset(active, 0, idx->nr_paths);
+			active[id] = 1;
+		}
+		in1 = path < idx->nr_paths && active[path];
+		in2 = path2 < idx->nr_paths && active[path2];
+
+		switch (le16_to_cpu(cmd->cmd)) {
+		case BTRFS_SEND_C_RENAME:
+			if (in2) {
+				active[path2] = 0;
+				active[path] = 1;
+			}
+			break;
+		case BTRFS_SEND_C_LINK:
+			if (in1) {
+				active[path] = 0;
+				active[path2] = 1;
+			}
+			break;
+		case BTRFS_SEND_C_MKFILE:
+		case BTRFS_SEND_C_MKDIR:
+		case BTRFS_SEND_C_MKNOD:
+		case BTRFS_SEND_C_MKFIFO:
+		case BTRFS_SEND_C_MKSOCK:
+		case BTRFS_SEND_C_SYMLINK:
+			if (in1)
+				active[path] = 0;
+			break;
+		}
+		if (in1 || in2)
+			selected[i] = 1;
+	}
+
+	free(active);
+	return 0;
+}
+
+struct index_feed {
+	struct send_index *idx;
+	int in_fd;
+	int out_fd;
+	u8 *selected;
+	int ret;
+};
+
+static int feed_range(struct index_feed *feed, char *buf, u64 offset,
+		      size_t len)
+{
+	ssize_t ret;
+	size_t done;
+
+	ret = pread(feed->in_fd, buf, len, offset);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+
+	for (done = 0; done < len; done += ret) {
+		ret = write(feed->out_fd, buf + done, len - done);
+		if (ret < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the stream header, the subvolume, the end and the selected commands
+ * of each stream with any selected command to the pipe
+ */
+static void *feed_worker(void *arg)
+{
+	struct index_feed *feed = arg;
+	struct send_index *idx = feed->idx;
+	sigset_t sigs;
+	char *buf;
+	int stream = -1;
+	int first = 0;
+	u32 i;
+	int ret = 0;
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	buf = malloc(BTRFS_SEND_BUF_SIZE);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < idx->nr_cmds && !ret; i++) {
+		struct send_index_cmd *cmd = &idx->cmds[i];
+		u16 type = le16_to_cpu(cmd->cmd);
+		u32 j;
+
+		if (le16_to_cpu(cmd->stream) != stream) {
+			stream = le16_to_cpu(cmd->stream);
+			first = 1;
+			for (j = i; j < idx->nr_cmds &&
+			     le16_to_cpu(idx->cmds[j].stream) == stream; j++)
+				if (feed->selected[j])
+					break;
+			if (j == idx->nr_cmds ||
+			    le16_to_cpu(idx->cmds[j].stream) != stream) {
+				i = j - 1;
+				continue;
+			}
+			ret = feed_range(feed, buf,
+					 le64_to_cpu(idx->streams[stream]),
+					 sizeof(struct btrfs_stream_header));
+			if (ret < 0)
+				break;
+		}
+
+		if (feed->selected[i] || first || type == BTRFS_SEND_C_END)
+			ret = feed_range(feed, buf, le64_to_cpu(cmd->offset),
+					 le32_to_cpu(cmd->len));
+		first = 0;
+	}
+
+out:
+	free(buf);
+	close(feed->out_fd);
+	feed->ret = ret;
+	return NULL;
+}
+
+/*
+ * Print the commands of @path from the stream file @fd, including those on
+ * the names it had before being renamed to @path
+ */
+int send_index_dump_path(struct send_index *idx, int fd, const char *path)
+{
+	struct btrfs_dump_send_args dump_args;
+	struct index_feed feed = { .idx = idx, .in_fd = fd };
+	pthread_t thread;
+	int pipefd[2];
+	u32 id;
+	int ret;
+
+	for (id = 0; id < idx->nr_paths; id++)
+		if (strcmp(path_name(idx, id), path) == 0)
+			break;
+	if (id == idx->nr_paths) {
+		error("path not found in the stream: %s", path);
+		return -ENOENT;
+	}
+
+	feed.selected = calloc(idx->nr_cmds, 1);
+	if (!feed.selected)
+		return -ENOMEM;
+	ret = select_cmds(idx, id, feed.selected);
+	if (ret < 0)
+		goto out;
+
+	ret = pipe(pipefd);
+	if (ret < 0) {
+		ret = -errno;
+		error("pipe failed: %m");
+		goto out;
+	}
+	feed.out_fd = pipefd[1];
+	ret = pthread_create(&thread, NULL, feed_worker, &feed);
+	if (ret) {
+		errno = ret;
+		error("thread setup failed: %m");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		ret = -ret;
+		goto out;
+	}
+
+	dump_args.root_path[0] = '.';
+	dump_args.root_path[1] = '\0';
+	dump_args.full_subvol_path[0] = '.';
+	dump_args.full_subvol_path[1] = '\0';
+	do {
+		ret = btrfs_read_and_process_send_stream(pipefd[0],
+				&btrfs_print_send_ops, &dump_args, 0, 0);
+	} while (ret == 0);
+	if (ret == -ENODATA)
+		ret = 0;
+
+	close(pipefd[0]);
+	pthread_join(thread, NULL);
+	if (!ret && feed.ret && feed.ret != -EPIPE) {
+		ret = feed.ret;
+		errno = -ret;
+		error("cannot read the stream: %m");
+	}
+
+out:
+	free(feed.selected);
+	return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#ifndef __BTRFS_SEND_INDEX_H__
+#define __BTRFS_SEND_INDEX_H__
+
+#include "kerncompat.h"
+#include "kernel-lib/rbtree.h"
+
+/*
+ * Index of a send stream as written by 'btrfs receive --dump --index':
+ *
+ *   struct send_index_header
+ *   __le64 offset of each stream header in the stream
+ *   struct send_index_cmd for each command
+ *   struct send_index_path for each distinct path
+ *   path names, NUL terminated
+ *
+ * Paths are relative to the subvolume of their stream, the same path in
+ * different streams is one entry.
+ */
+#define SEND_INDEX_MAGIC		"btrfs-send-index"
+#define SEND_INDEX_VERSION		1
+
+/* No path in send_index_cmd */
+#define SEND_INDEX_NO_PATH		((u32)-1)
+
+struct send_index_header {
+	char magic[sizeof(SEND_INDEX_MAGIC)];
+	__le32 version;
+	/* Size and modification time of the indexed stream file */
+	__le64 stream_size;
+	__le64 stream_mtime;
+	__le32 nr_streams;
+	__le32 nr_cmds;
+	__le32 nr_paths;
+	__le32 names_len;
+} __attribute__ ((__packed__));
+
+struct send_index_cmd {
+	/* Offset of the command header in the stream */
+	__le64 offset;
+	/* Data length of write, length of clone, size of truncate */
+	__le64 size;
+	/* Length including the command header */
+	__le32 len;
+	__le32 path;
+	/* Target of rename and link, source of clone */
+	__le32 path2;
+	__le16 cmd;
+	__le16 stream;
+} __attribute__ ((__packed__));
+
+struct send_index_path {
+	/* Offset of the name in the names */
+	__le32 name;
+	__le32 nr_cmds;
+	__le32 first_cmd;
+	__le32 last_cmd;
+	__le64 write_bytes;
+	__le64 clone_bytes;
+} __attribute__ ((__packed__));
+
+struct send_index {
+	u64 stream_size;
+	u64 stream_mtime;
+	u32 nr_streams;
+	u32 nr_cmds;
+	u32 nr_paths;
+	u32 names_len;
+	__le64 *streams;
+	struct send_index_cmd *cmds;
+	struct send_index_path *paths;
+	char *names;
+
+	/* Used while building the index */
+	struct rb_root path_tree;
+	u32 streams_alloc;
+	u32 cmds_alloc;
+	u32 paths_alloc;
+	u32 names_alloc;
+};
+
+int send_index_build(struct send_index *idx, int fd);
+int send_index_write(struct send_index *idx, const char *path);
+int send_index_read(struct send_index *idx, const char *path);
+int send_index_match(struct send_index *idx, int fd);
+void send_index_free(struct send_index *idx);
+void send_index_print_stats(struct send_index *idx);
+int send_index_dump_path(struct send_index *idx, int fd, const char *path);
+
+#endif
@@ -18,16 +18,32 @@
 
 #include <uuid/uuid.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "send.h"
 #include "send-stream.h"
 #include "crc32c.h"
 #include "utils.h"
 
+/*
+ * Streams in regular files are mapped in windows of this size and the
+ * commands are parsed in place, without copying them to read_buf
+ */
+#define SEND_STREAM_MAP_SIZE	(64 * 1024 * 1024)
+
 struct btrfs_send_stream {
 	int fd;
 	char read_buf[BTRFS_SEND_BUF_SIZE];
 
+	/* Current mmap window, map is NULL when reading with read() */
+	char *map;
+	size_t map_len;
+	off_t map_offset;
+	/* File offset of the next byte to parse and size of the file */
+	off_t file_pos;
+	off_t file_size;
+
 	int cmd;
 	struct btrfs_cmd_header *cmd_hdr;
 	struct btrfs_tlv_header *cmd_attrs[BTRFS_SEND_A_MAX + 1];
@@ -84,6 +100,105 @@ out:
 	return ret;
 }
 
+/*
+ * Return in @buf a pointer to the next @len bytes of a mapped stream, moving
+ * the window if they are not inside it.
+ * Return:
+ *   0 - success
+ * < 0 - negative errno in case of error
+ * > 0 - no data left, EOF
+ */
+static int map_buf(struct btrfs_send_stream *sctx, size_t len, char **buf)
+{
+	off_t pos = sctx->file_pos;
+	off_t start;
+	size_t size;
+	char *map;
+
+	if (pos == sctx->file_size)
+		return 1;
+	if (len > sctx->file_size - pos) {
+		error("short read from stream: expected %zu read %zu", len,
+		      (size_t)(sctx->file_size - pos));
+		return -EIO;
+	}
+
+	if (!sctx->map || pos < sctx->map_offset ||
+	    pos + len > sctx->map_offset + sctx->map_len) {
+		start = pos & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+		size = max_t(size_t, SEND_STREAM_MAP_SIZE, pos + len - start);
+		size = min_t(size_t, size, sctx->file_size - start);
+
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, sctx->fd, start);
+		if (map == MAP_FAILED) {
+			int ret = -errno;
+
+			/* The first window is mapped by map_stream(), quietly */
+			if (sctx->map)
+				error("cannot map stream at offset %llu: %m",
+				      (unsigned long long)start);
+			return ret;
+		}
+		if (sctx->map)
+			munmap(sctx->map, sctx->map_len);
+		madvise(map, size, MADV_SEQUENTIAL);
+		sctx->map = map;
+		sctx->map_len = size;
+		sctx->map_offset = start;
+	}
+
+	*buf = sctx->map + (pos - sctx->map_offset);
+	sctx->file_pos += len;
+	sctx->stream_pos += len;
+	return 0;
+}
+
+/*
+ * Set up mapped reading if the stream is a regular file, otherwise it's read
+ * with read().  Parsing starts at the current file offset.
+ */
+static void map_stream(struct btrfs_send_stream *sctx)
+{
+	struct stat st;
+	char *buf;
+
+	sctx->map = NULL;
+	sctx->map_len = 0;
+	sctx->map_offset = 0;
+	if (fstat(sctx->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+	sctx->file_pos = lseek(sctx->fd, 0, SEEK_CUR);
+	if (sctx->file_pos < 0 || sctx->file_pos >= st.st_size)
+		return;
+	sctx->file_size = st.st_size;
+
+	/* Map the first window, fall back to read() if that's not possible */
+	if (map_buf(sctx, 0, &buf) < 0)
+		sctx->map = NULL;
+}
+
+/* Undo map_stream() and leave the file offset after the parsed data */
+static void unmap_stream(struct btrfs_send_stream *sctx)
+{
+	if (!sctx->map)
+		return;
+	munmap(sctx->map, sctx->map_len);
+	sctx->map = NULL;
+	lseek(sctx->fd, sctx->file_pos, SEEK_SET);
+}
+
+/*
+ * Read @len bytes of the stream, the returned pointer is valid until the
+ * next call.  Same return values as read_buf().
+ */
+static int get_buf(struct btrfs_send_stream *sctx, size_t len, char **buf)
+{
+	if (sctx->map)
+		return map_buf(sctx, len, buf);
+	*buf = sctx->read_buf;
+	return read_buf(sctx, sctx->read_buf, len);
+}
+
 /*
  * Reads a single command from kernel space and decodes the TLV's into
  * sctx->cmd_attrs
@@ -94,9 +209,12 @@ out:
  */
 static int read_cmd(struct btrfs_send_stream *sctx)
 {
+	static const u8 zero_crc[sizeof(sctx->cmd_hdr->crc)];
+	struct btrfs_cmd_header *hdr;
 	int ret;
 	u16 cmd;
 	u32 cmd_len;
+	char *buf;
 	char *data;
 	u32 pos;
 	u32 crc;
@@ -105,7 +223,7 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 	memset(sctx->cmd_attrs, 0, sizeof(sctx->cmd_attrs));
 
 	ASSERT(sizeof(*sctx->cmd_hdr) <= sizeof(sctx->read_buf));
-	ret = read_buf(sctx, sctx->read_buf, sizeof(*sctx->cmd_hdr));
+	ret = get_buf(sctx, sizeof(*sctx->cmd_hdr), &buf);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -114,9 +232,9 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		goto out;
 	}
 
-	sctx->cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	cmd = le16_to_cpu(sctx->cmd_hdr->cmd);
-	cmd_len = le32_to_cpu(sctx->cmd_hdr->len);
+	hdr = (struct btrfs_cmd_header *)buf;
+	cmd = le16_to_cpu(hdr->cmd);
+	cmd_len = le32_to_cpu(hdr->len);
 
 	if (cmd_len + sizeof(*sctx->cmd_hdr) >= sizeof(sctx->read_buf)) {
 		ret = -EINVAL;
@@ -125,8 +243,16 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		goto out;
 	}
 
-	data = sctx->read_buf + sizeof(*sctx->cmd_hdr);
-	ret = read_buf(sctx, data, cmd_len);
+	if (sctx->map) {
+		/* Get the header again together with the data */
+		sctx->file_pos -= sizeof(*hdr);
+		sctx->stream_pos -= sizeof(*hdr);
+		ret = map_buf(sctx, sizeof(*hdr) + cmd_len, &buf);
+		data = buf + sizeof(*hdr);
+	} else {
+		data = sctx->read_buf + sizeof(*hdr);
+		ret = read_buf(sctx, data, cmd_len);
+	}
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -134,12 +260,14 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		error("unexpected EOF in stream");
 		goto out;
 	}
+	sctx->cmd_hdr = (struct btrfs_cmd_header *)buf;
 
+	/* The crc is calculated with a zero crc field in the header */
 	crc = le32_to_cpu(sctx->cmd_hdr->crc);
-	sctx->cmd_hdr->crc = 0;
-
-	crc2 = crc32c(0, (unsigned char*)sctx->read_buf,
-			sizeof(*sctx->cmd_hdr) + cmd_len);
+	crc2 = crc32c(0, (unsigned char *)buf,
+		      offsetof(struct btrfs_cmd_header, crc));
+	crc2 = crc32c(crc2, zero_crc, sizeof(zero_crc));
+	crc2 = crc32c(crc2, (unsigned char *)data, cmd_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -153,12 +281,18 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		u16 tlv_type;
 		u16 tlv_len;
 
+		if (cmd_len - pos < sizeof(*tlv_hdr)) {
+			error("truncated tlv in cmd");
+			ret = -EINVAL;
+			goto out;
+		}
 		tlv_hdr = (struct btrfs_tlv_header *)data;
 		tlv_type = le16_to_cpu(tlv_hdr->tlv_type);
 		tlv_len = le16_to_cpu(tlv_hdr->tlv_len);
 
 		if (tlv_type == 0 || tlv_type > BTRFS_SEND_A_MAX
-		    || tlv_len > BTRFS_SEND_BUF_SIZE) {
+		    || tlv_len > BTRFS_SEND_BUF_SIZE
+		    || tlv_len > cmd_len - pos - sizeof(*tlv_hdr)) {
 			error("invalid tlv in cmd tlv_type = %hu, tlv_len = %hu",
 					tlv_type, tlv_len);
 			ret = -EINVAL;
@@ -475,25 +609,43 @@ int btrfs_read_and_process_send_stream(int fd,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
 				       u64 max_errors)
+{
+	u64 errors = 0;
+
+	return btrfs_read_and_process_send_stream_errors(fd, ops, user,
+				honor_end_cmd, max_errors, &errors);
+}
+
+/*
+ * Same as btrfs_read_and_process_send_stream, the errors are counted in
+ * @errors so the caller can count its own errors at the end of the stream
+ * against max_errors
+ */
+int btrfs_read_and_process_send_stream_errors(int fd,
+				       struct btrfs_send_ops *ops, void *user,
+				       int honor_end_cmd,
+				       u64 max_errors, u64 *errors)
 {
 	int ret;
 	struct btrfs_send_stream sctx;
 	struct btrfs_stream_header hdr;
-	u64 errors = 0;
 	int last_err = 0;
+	char *buf;
 
 	sctx.fd = fd;
 	sctx.ops = ops;
 	sctx.user = user;
 	sctx.stream_pos = 0;
+	map_stream(&sctx);
 
-	ret = read_buf(&sctx, (char*)&hdr, sizeof(hdr));
+	ret = get_buf(&sctx, sizeof(hdr), &buf);
 	if (ret < 0)
 		goto out;
 	if (ret) {
 		ret = -ENODATA;
 		goto out;
 	}
+	memcpy(&hdr, buf, sizeof(hdr));
 
 	if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
 		ret = -EINVAL;
@@ -513,8 +665,8 @@ int btrfs_read_and_process_send_stream(int fd,
 		ret = read_and_process_cmd(&sctx);
 		if (ret < 0) {
 			last_err = ret;
-			errors++;
-			if (max_errors > 0 && errors >= max_errors)
+			(*errors)++;
+			if (max_errors > 0 && *errors >= max_errors)
 				goto out;
 		} else if (ret > 0) {
 			if (!honor_end_cmd)
@@ -524,6 +676,7 @@ int btrfs_read_and_process_send_stream(int fd,
 	}
 
 out:
+	unmap_stream(&sctx);
 	if (last_err && !ret)
 		ret = last_err;
 
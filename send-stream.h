@@ -72,6 +72,10 @@ int btrfs_read_and_process_send_stream(int fd,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
 				       u64 max_errors);
+int btrfs_read_and_process_send_stream_errors(int fd,
+				       struct btrfs_send_ops *ops, void *user,
+				       int honor_end_cmd,
+				       u64 max_errors, u64 *errors);
 
 #ifdef __cplusplus
 }
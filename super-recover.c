@@ -34,6 +34,7 @@
 #include "crc32c.h"
 #include "volumes.h"
 #include "commands.h"
+#include "tree-scan.h"
 
 struct btrfs_recover_superblock {
 	struct btrfs_fs_devices *fs_devices;
@@ -109,63 +110,120 @@ static int add_superblock_record(struct btrfs_super_block *sb, char *fname,
 	return 0;
 }
 
-static int
-read_dev_supers(char *filename, struct btrfs_recover_superblock *recover)
+/* Superblock copies of a device, read by the tree scanner */
+struct dev_supers {
+	char *device_name;
+	struct tree_scan_range ranges[BTRFS_SUPER_MIRROR_MAX];
+	int found[BTRFS_SUPER_MIRROR_MAX];
+	u8 buf[BTRFS_SUPER_MIRROR_MAX][BTRFS_SUPER_INFO_SIZE];
+};
+
+/* Called from the scan threads, each copy is stored by only one of them */
+static int scan_dev_super(struct tree_scan *scan, void *data,
+			  struct tree_scan_device *dev, u64 physical,
+			  struct btrfs_super_block *sb)
 {
-	int i, ret, fd;
-	u8 buf[BTRFS_SUPER_INFO_SIZE];
-	u64 max_gen, bytenr;
-	struct btrfs_super_block *sb = (struct btrfs_super_block *)buf;
+	struct dev_supers *supers = dev->priv;
+	int i;
 
-	/* just ignore errno that were set in btrfs_scan_fs_devices() */
-	errno = 0;
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		if (physical != btrfs_sb_offset(i))
+			continue;
+		memcpy(supers->buf[i], sb, BTRFS_SUPER_INFO_SIZE);
+		supers->found[i] = 1;
+	}
+	return 0;
+}
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		return -errno;
+static const struct tree_scan_ops super_scan_ops = {
+	.super = scan_dev_super,
+};
+
+static int
+read_dev_supers(struct dev_supers *supers,
+		struct btrfs_recover_superblock *recover)
+{
+	int i, ret;
+	u64 max_gen, bytenr;
+	struct btrfs_super_block *sb;
 
 	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		/* Skip superblock which doesn't exist */
+		if (!supers->found[i])
+			continue;
 		bytenr = btrfs_sb_offset(i);
+		sb = (struct btrfs_super_block *)supers->buf[i];
 
-		ret = btrfs_read_dev_super(fd, sb, bytenr, SBREAD_DEFAULT);
-		if (!ret) {
-			ret = add_superblock_record(sb, filename, bytenr,
-							&recover->good_supers);
+		if (btrfs_super_bytenr(sb) == bytenr &&
+		    !btrfs_check_super(sb, SBREAD_DEFAULT)) {
+			ret = add_superblock_record(sb, supers->device_name,
+					bytenr, &recover->good_supers);
 			if (ret)
-				goto out;
+				return ret;
 			max_gen = btrfs_super_generation(sb);
 			if (max_gen > recover->max_generation)
 				recover->max_generation = max_gen;
-		} else if (ret != -ENOENT){
-			/*
-			 * Skip superblock which doesn't exist, only adds
-			 * really corrupted superblock
-			 */
-			ret = add_superblock_record(sb, filename, bytenr,
-						&recover->bad_supers);
+		} else {
+			ret = add_superblock_record(sb, supers->device_name,
+					bytenr, &recover->bad_supers);
 			if (ret)
-				goto out;
+				return ret;
 		}
 	}
-	ret = 0;
-out:
-	close(fd);
-	return ret;
+	return 0;
 }
 
+/* Read the superblock copies of all devices in parallel */
 static int read_fs_supers(struct btrfs_recover_superblock *recover)
 {
+	struct tree_scan scan = {
+		.ops = &super_scan_ops,
+	};
 	struct super_block_record *record;
 	struct super_block_record *next_record;
 	struct btrfs_device *dev;
-	int ret;
+	struct tree_scan_device *devs;
+	struct dev_supers *supers;
+	int devnr = 0;
+	int ret = 0;
+	int i;
+	int j;
 	u64 gen;
 
+	list_for_each_entry(dev, &recover->fs_devices->devices, dev_list)
+		devnr++;
+	devs = calloc(devnr, sizeof(*devs));
+	supers = calloc(devnr, sizeof(*supers));
+	if (!devs || !supers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	i = 0;
 	list_for_each_entry(dev, &recover->fs_devices->devices,
 				dev_list) {
-		ret = read_dev_supers(dev->name, recover);
+		supers[i].device_name = dev->name;
+		for (j = 0; j < BTRFS_SUPER_MIRROR_MAX; j++) {
+			supers[i].ranges[j].start = btrfs_sb_offset(j);
+			supers[i].ranges[j].end = btrfs_sb_offset(j) +
+						  BTRFS_SUPER_INFO_SIZE;
+		}
+		devs[i].name = dev->name;
+		devs[i].fsid = recover->fs_devices->fsid;
+		devs[i].ranges = supers[i].ranges;
+		devs[i].nr_ranges = BTRFS_SUPER_MIRROR_MAX;
+		devs[i].priv = &supers[i];
+		i++;
+	}
+
+	ret = tree_scan_devices(&scan, devs, devnr);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < devnr; i++) {
+		ret = read_dev_supers(&supers[i], recover);
 		if (ret)
-			return ret;
+			goto out;
 	}
 	list_for_each_entry_safe(record, next_record,
 			&recover->good_supers, list) {
@@ -173,8 +231,10 @@ static int read_fs_supers(struct btrfs_recover_superblock *recover)
 		if (gen < recover->max_generation)
 			list_move_tail(&record->list, &recover->bad_supers);
 	}
-
-	return 0;
+out:
+	free(supers);
+	free(devs);
+	return ret;
 }
 
 static void print_super_info(struct super_block_record *record)
@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# test that receive --dump --index rejects a truncated or corrupted index
+# and rebuilds it instead of using its entries
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f "$TEST_DEV"
+run_check_mount_test_dev
+
+here=`pwd`
+stream="$here/send-stream.img"
+index="$here/send-stream.idx"
+expected="$here/send-stream.expected"
+output="$here/send-stream.out"
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+for i in 1 2 3; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/file$i" \
+		bs=64K count=4
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" \
+	"$TEST_MNT/snap"
+
+truncate -s0 "$stream"
+chmod a+w "$stream"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$stream" "$TEST_MNT/snap"
+run_check_umount_test_dev
+
+# build the index and take the output as reference
+rm -f -- "$index"
+run_check_stdout "$TOP/btrfs" receive --dump --index "$index" \
+	--path file2 -f "$stream" | grep -v WARNING > "$expected"
+[ -s "$expected" ] || _fail "no commands of file2 printed"
+
+check_index_rebuilt()
+{
+	run_check_stdout "$TOP/btrfs" receive --dump --index "$index" \
+		--path file2 -f "$stream" > "$output"
+	grep -q "WARNING: invalid index $index, rebuilding" "$output" ||
+		_fail "$1 index not rejected"
+	grep -v WARNING "$output" | cmp -s - "$expected" ||
+		_fail "wrong output with $1 index"
+}
+
+# truncated index
+run_check truncate -s 100 "$index"
+check_index_rebuilt "truncated"
+
+# length of the first command past the end of the stream, the commands follow
+# the 53 bytes of the header and the offsets of the streams, the number of
+# streams is at 37 in the header and the length at 16 in the command
+nr_streams=$(od -An -tu4 --endian=little -j37 -N4 "$index" | tr -d ' ')
+[ "$nr_streams" -ge 1 ] 2>/dev/null || _fail "no streams in the index"
+printf '\xff\xff\xff\x7f' |
+	dd of="$index" bs=1 seek=$((53 + 8 * $nr_streams + 16)) conv=notrunc \
+	2>/dev/null
+check_index_rebuilt "corrupted"
+
+# the rebuilt index is used again
+run_check_stdout "$TOP/btrfs" receive --dump --index "$index" \
+	--path file2 -f "$stream" > "$output"
+grep -q WARNING "$output" && _fail "rebuilt index not used"
+cmp -s "$output" "$expected" || _fail "wrong output with rebuilt index"
+
+# a stream from a pipe never matches the index
+cat "$stream" | run_check_stdout "$TOP/btrfs" receive --dump \
+	--index "$index" --stats | grep -q "does not match" ||
+	_fail "index used for a stream from a pipe"
+
+# the index alone doesn't select anything to print
+run_mustfail "--index without --path or --stats" \
+	"$TOP/btrfs" receive --dump --index "$index" -f "$stream"
+
+run_check rm -f -- "$stream" "$index" "$expected" "$output"
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# test that a stream from send --compress is received from a file and from a
+# pipe, and that an uncompressed stream from a pipe still works
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f "$TEST_DEV"
+run_check_mount_test_dev
+
+here=`pwd`
+stream="$here/send-stream.img"
+stream_z="$here/send-stream.zlib"
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+for i in 1 2 3; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/file$i" \
+		bs=1M count=2
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" \
+	"$TEST_MNT/snap"
+
+truncate -s0 "$stream" "$stream_z"
+chmod a+w "$stream" "$stream_z"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$stream" "$TEST_MNT/snap"
+run_check $SUDO_HELPER "$TOP/btrfs" send --compress zlib -f "$stream_z" \
+	"$TEST_MNT/snap"
+
+check_received()
+{
+	local i
+
+	for i in 1 2 3; do
+		run_check $SUDO_HELPER cmp "$TEST_MNT/subv/file$i" \
+			"$TEST_MNT/$1/snap/file$i"
+	done
+}
+
+# compressed stream from a file
+run_check $SUDO_HELPER mkdir "$TEST_MNT/file"
+run_check $SUDO_HELPER "$TOP/btrfs" receive -f "$stream_z" "$TEST_MNT/file"
+check_received file
+
+# compressed stream from a pipe
+run_check $SUDO_HELPER mkdir "$TEST_MNT/pipe"
+cat "$stream_z" | run_check $SUDO_HELPER "$TOP/btrfs" receive "$TEST_MNT/pipe"
+check_received pipe
+
+# uncompressed stream from a pipe
+run_check $SUDO_HELPER mkdir "$TEST_MNT/raw"
+cat "$stream" | run_check $SUDO_HELPER "$TOP/btrfs" receive "$TEST_MNT/raw"
+check_received raw
+
+# the dump is the same from a file and from a pipe, compressed or not
+run_check_stdout "$TOP/btrfs" receive --dump -f "$stream" > "$here/dump.raw"
+cat "$stream_z" | run_check_stdout "$TOP/btrfs" receive --dump \
+	> "$here/dump.pipe"
+cmp -s "$here/dump.raw" "$here/dump.pipe" ||
+	_fail "dump of the compressed stream from a pipe differs"
+
+run_check_umount_test_dev
+run_check rm -f -- "$stream" "$stream_z" "$here/dump.raw" "$here/dump.pipe"
@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# receive full and incremental streams with the writer threads, then let the
+# writes fail with ENOSPC and check that receive fails and does not set the
+# subvolume read-only, with the default and an unlimited error count
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f "$TEST_DEV"
+run_check_mount_test_dev
+
+here=`pwd`
+stream_full="$here/send-stream-full.img"
+stream_incr="$here/send-stream-incr.img"
+stream_big="$here/send-stream-big.img"
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+run_check $SUDO_HELPER mkdir "$TEST_MNT/subv/dir"
+for i in 1 2 3 4 5 6 7 8; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/file$i" \
+		bs=256K count=4
+	run_check $SUDO_HELPER dd if=/dev/urandom \
+		of="$TEST_MNT/subv/dir/file$i" bs=64K count=1
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" \
+	"$TEST_MNT/snap1"
+
+# renames, removals and writes to the same paths in the incremental stream
+run_check $SUDO_HELPER mv "$TEST_MNT/subv/dir" "$TEST_MNT/subv/dir2"
+run_check $SUDO_HELPER mv "$TEST_MNT/subv/file1" "$TEST_MNT/subv/dir2/file1"
+run_check $SUDO_HELPER rm -f -- "$TEST_MNT/subv/file2"
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/file3" \
+	bs=64K count=4 seek=2 conv=notrunc
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/file2" \
+	bs=64K count=2
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" \
+	"$TEST_MNT/snap2"
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/big"
+for i in 1 2 3; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/big/file$i" \
+		bs=1M count=64
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/big" \
+	"$TEST_MNT/bigsnap"
+
+truncate -s0 "$stream_full" "$stream_incr" "$stream_big"
+chmod a+w "$stream_full" "$stream_incr" "$stream_big"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$stream_full" "$TEST_MNT/snap1"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$stream_incr" \
+	-p "$TEST_MNT/snap1" "$TEST_MNT/snap2"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$stream_big" "$TEST_MNT/bigsnap"
+
+check_received()
+{
+	run_check $SUDO_HELPER diff -r "$TEST_MNT/$1" "$TEST_MNT/recv/$1"
+}
+
+run_check $SUDO_HELPER mkdir "$TEST_MNT/recv"
+run_check $SUDO_HELPER "$TOP/btrfs" receive --threads 4 -f "$stream_full" \
+	"$TEST_MNT/recv"
+check_received snap1
+run_check $SUDO_HELPER "$TOP/btrfs" receive --threads 4 -f "$stream_incr" \
+	"$TEST_MNT/recv"
+check_received snap2
+
+run_check_umount_test_dev
+
+# a filesystem too small for the stream, the writer threads fail with ENOSPC
+check_enospc()
+{
+	local ro
+
+	run_check "$TOP/mkfs.btrfs" -f "$TEST_DEV"
+	run_check_mount_test_dev
+	run_mustfail "receive did not fail on a full filesystem" \
+		$SUDO_HELPER "$TOP/btrfs" receive --threads 4 "$@" \
+		-f "$stream_big" "$TEST_MNT"
+	ro=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" property get -t s \
+		"$TEST_MNT/bigsnap" ro)
+	if [ "$ro" != "ro=false" ]; then
+		_fail "subvolume finished after failed writes: $ro"
+	fi
+	run_check_umount_test_dev
+}
+
+prepare_test_dev 128M
+check_enospc
+check_enospc -E 0
+
+run_check rm -f -- "$stream_full" "$stream_incr" "$stream_big"
@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# interrupt a receive with a checkpoint by cutting the stream in the middle,
+# then resume it with the whole stream and compare the result
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f "$TEST_DEV"
+run_check_mount_test_dev
+
+here=`pwd`
+stream="$here/send-stream.img"
+stream_cut="$here/send-stream-cut.img"
+checkpoint="$here/receive.checkpoint"
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+for i in 1 2 3 4; do
+	run_check $SUDO_HELPER mkdir "$TEST_MNT/subv/dir$i"
+	for j in 1 2 3 4; do
+		run_check $SUDO_HELPER dd if=/dev/urandom \
+			of="$TEST_MNT/subv/dir$i/file$j" bs=256K count=4
+	done
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" \
+	"$TEST_MNT/snap"
+
+truncate -s0 "$stream" "$stream_cut"
+chmod a+w "$stream" "$stream_cut"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$stream" "$TEST_MNT/snap"
+size=$(stat -c %s "$stream")
+head -c $(($size / 2)) "$stream" > "$stream_cut" ||
+	_fail "cannot cut the stream"
+
+check_resume()
+{
+	local dir="$TEST_MNT/$1"
+	shift
+
+	run_check $SUDO_HELPER rm -f -- "$checkpoint"
+	run_check $SUDO_HELPER mkdir "$dir"
+	run_mustfail "receive of a cut stream did not fail" \
+		$SUDO_HELPER "$TOP/btrfs" receive "$@" \
+		--checkpoint "$checkpoint" -f "$stream_cut" "$dir"
+	[ -f "$checkpoint" ] || _fail "no checkpoint after interrupted receive"
+
+	run_check $SUDO_HELPER "$TOP/btrfs" receive "$@" \
+		--checkpoint "$checkpoint" --resume -f "$stream" "$dir"
+	if [ -f "$checkpoint" ]; then
+		_fail "checkpoint not removed after receive"
+	fi
+	run_check $SUDO_HELPER diff -r "$TEST_MNT/snap" "$dir/snap"
+}
+
+check_resume recv1
+check_resume recv4 --threads 4
+
+run_check_umount_test_dev
+run_check rm -f -- "$stream" "$stream_cut"
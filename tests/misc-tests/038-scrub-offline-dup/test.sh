@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# corrupt the second copy of a DUP tree block on an unmounted filesystem, let
+# the offline scrub rewrite it from the good copy and check the result
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq btrfs-map-logical
+
+setup_root_helper
+
+prepare_test_dev
+run_check "$TOP/mkfs.btrfs" -f -m dup -d single -n 16k "$TEST_DEV"
+run_check_mount_test_dev
+for i in 1 2 3 4; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/file$i" \
+		bs=64K count=4
+done
+run_check_umount_test_dev
+
+# the root tree block, its copies are on the same device
+logical=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" inspect-internal \
+	dump-super "$TEST_DEV" | awk '/^root\t/ { print $2 }')
+[ -z "$logical" ] && _fail "cannot find the root tree block"
+
+mirror_physical()
+{
+	run_check_stdout $SUDO_HELPER "$TOP/btrfs-map-logical" -l "$logical" \
+		-b 16384 -c "$1" "$TEST_DEV" |
+		awk -v m="$1" '$1 == "mirror" && $2 == m { print $6; exit }'
+}
+
+physical1=$(mirror_physical 1)
+physical2=$(mirror_physical 2)
+if [ -z "$physical1" -o -z "$physical2" -o "$physical1" = "$physical2" ]; then
+	_fail "cannot map the copies of block $logical"
+fi
+
+read_copy()
+{
+	$SUDO_HELPER dd if="$TEST_DEV" bs=16384 count=1 iflag=skip_bytes \
+		skip="$1" 2>/dev/null | md5sum
+}
+
+good=$(read_copy "$physical1")
+
+# overwrite the checksum and part of the header of the second copy
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_DEV" bs=64 count=1 \
+	oflag=seek_bytes seek="$physical2" conv=notrunc
+[ "$(read_copy "$physical2")" = "$good" ] && _fail "copy not corrupted"
+
+# read-only scrub reports the error and leaves it
+out=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" scrub start --offline -r \
+	"$TEST_DEV")
+echo "$out" | grep -q "error at logical $logical " ||
+	_fail "read-only scrub did not report the corrupted copy"
+[ "$(read_copy "$physical2")" = "$good" ] && _fail "read-only scrub wrote"
+
+# repaired from the first copy, exit code 0 for corrected errors
+run_check $SUDO_HELPER "$TOP/btrfs" scrub start --offline "$TEST_DEV"
+[ "$(read_copy "$physical2")" = "$good" ] || _fail "copy not repaired"
+
+run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+out=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" scrub start --offline -r \
+	"$TEST_DEV")
+if echo "$out" | grep -q "error at logical"; then
+	_fail "errors left after the repair"
+fi
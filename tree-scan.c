@@ -0,0 +1,484 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#include "kerncompat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "internal.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "crc32c.h"
+#include "messages.h"
+#include "tree-scan.h"
+
+/* Alignment of the buffers and offsets of O_DIRECT reads */
+#define SCAN_ALIGN	SZ_4K
+
+struct device_scan;
+
+/* State shared by the threads of all devices, protected by lock */
+struct scan_ctl {
+	struct tree_scan *scan;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	long ret;
+};
+
+struct scan_thread {
+	struct device_scan *dev_scan;
+	pthread_t thread;
+	int started;
+	void *data;
+};
+
+/*
+ * The threads of a device take the next window of the ranges in turn, so
+ * the device is still read about sequentially
+ */
+struct device_scan {
+	struct scan_ctl *ctl;
+	struct tree_scan_device *dev;
+	struct tree_scan_range whole;
+	struct tree_scan_range *ranges;
+	int nr_ranges;
+	int fd;
+	int direct_fd;
+	pthread_mutex_t lock;
+	int range;
+	u64 bytenr;
+	u64 eof;
+	int stop;
+	int nr_threads;
+	int running;
+	struct scan_thread *threads;
+};
+
+static inline int is_super_block_address(u64 offset)
+{
+	int i;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		if (offset == btrfs_sb_offset(i))
+			return 1;
+	}
+	return 0;
+}
+
+/* Take the next window of the ranges, returns 1 at the end */
+static int scan_next_window(struct device_scan *dev_scan,
+			    struct tree_scan_range **range, u64 *start,
+			    u64 *len)
+{
+	struct tree_scan_range *r;
+	int ret = 1;
+
+	pthread_mutex_lock(&dev_scan->lock);
+	while (!dev_scan->stop && dev_scan->range < dev_scan->nr_ranges) {
+		r = &dev_scan->ranges[dev_scan->range];
+		if (dev_scan->bytenr < r->start)
+			dev_scan->bytenr = r->start;
+		if (dev_scan->bytenr >= r->end ||
+		    dev_scan->bytenr >= dev_scan->eof) {
+			dev_scan->range++;
+			continue;
+		}
+		*range = r;
+		*start = dev_scan->bytenr;
+		*len = min_t(u64, TREE_SCAN_WINDOW, r->end - *start);
+		dev_scan->bytenr += *len;
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&dev_scan->lock);
+	return ret;
+}
+
+/* Read with O_DIRECT if the device and the offset allow it */
+static ssize_t scan_read(struct device_scan *dev_scan, char *buf, u64 len,
+			 u64 start)
+{
+	ssize_t ret;
+
+	if (dev_scan->direct_fd >= 0 && IS_ALIGNED(start, SCAN_ALIGN)) {
+		ret = pread64(dev_scan->direct_fd, buf, len, start);
+		if (ret >= 0 || errno != EINVAL)
+			return ret;
+	}
+	return pread64(dev_scan->fd, buf, len, start);
+}
+
+static int tree_block_csum_ok(const char *data, u32 nodesize, u16 csum_size)
+{
+	u8 result[BTRFS_CSUM_SIZE];
+	u32 crc = ~(u32)0;
+
+	crc = crc32c(crc, data + BTRFS_CSUM_SIZE, nodesize - BTRFS_CSUM_SIZE);
+	btrfs_csum_final(crc, result);
+	return !memcmp(data, result, csum_size);
+}
+
+static int scan_supers(struct scan_thread *st, char *buf, u64 start, u64 len,
+		       u64 read)
+{
+	struct device_scan *dev_scan = st->dev_scan;
+	struct tree_scan *scan = dev_scan->ctl->scan;
+	u64 bytenr;
+	int ret;
+	int i;
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		bytenr = btrfs_sb_offset(i);
+		if (bytenr < start || bytenr >= start + len ||
+		    bytenr + BTRFS_SUPER_INFO_SIZE > start + read)
+			continue;
+		ret = scan->ops->super(scan, st->data, dev_scan->dev, bytenr,
+				(struct btrfs_super_block *)(buf + bytenr - start));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Look for tree blocks at each sector of the window. The window is read
+ * with one nodesize more so that a block starting at its end is complete.
+ * The sectors with the fsid are collected first and checksummed together,
+ * the candidates inside a valid block are skipped.
+ */
+static int scan_blocks(struct scan_thread *st, struct tree_scan_range *range,
+		       char *buf, u64 start, u64 len, u64 read,
+		       struct extent_buffer *eb, u32 *offsets)
+{
+	struct device_scan *dev_scan = st->dev_scan;
+	struct tree_scan *scan = dev_scan->ctl->scan;
+	struct tree_scan_block block = {
+		.dev = dev_scan->dev,
+		.range = dev_scan->dev->nr_ranges ? range : NULL,
+		.eb = eb,
+	};
+	u32 nr = 0;
+	u32 next = 0;
+	u32 off;
+	u32 i;
+	int ret;
+
+	for (off = 0; off < len && off + scan->nodesize <= read;
+	     off += scan->sectorsize) {
+		if (is_super_block_address(start + off))
+			continue;
+		if (memcmp(buf + off + btrfs_header_fsid(), dev_scan->dev->fsid,
+			   BTRFS_FSID_SIZE))
+			continue;
+		offsets[nr++] = off;
+	}
+
+	for (i = 0; i < nr; i++) {
+		off = offsets[i];
+		if (off < next)
+			continue;
+		if (!tree_block_csum_ok(buf + off, scan->nodesize,
+					scan->csum_size))
+			continue;
+
+		memcpy(eb->data, buf + off, scan->nodesize);
+		eb->start = btrfs_header_bytenr(eb);
+		block.physical = start + off;
+		block.bytenr = eb->start;
+		block.owner = btrfs_header_owner(eb);
+		block.generation = btrfs_header_generation(eb);
+		block.level = btrfs_header_level(eb);
+		ret = scan->ops->block(scan, st->data, &block);
+		if (ret)
+			return ret;
+		next = off + scan->nodesize;
+	}
+	return 0;
+}
+
+static void *scan_one_device(void *arg)
+{
+	struct scan_thread *st = arg;
+	struct device_scan *dev_scan = st->dev_scan;
+	struct scan_ctl *ctl = dev_scan->ctl;
+	struct tree_scan *scan = ctl->scan;
+	struct tree_scan_range *range;
+	struct extent_buffer *eb = NULL;
+	u32 *offsets = NULL;
+	void *buf = NULL;
+	u64 margin = 0;
+	u64 size;
+	u64 start;
+	u64 len;
+	ssize_t bytes;
+	long ret = 0;
+
+	if (scan->ops->block)
+		margin = scan->nodesize;
+	if (scan->ops->super)
+		margin = max_t(u64, margin, BTRFS_SUPER_INFO_SIZE);
+	size = round_up(TREE_SCAN_WINDOW + margin, SCAN_ALIGN);
+
+	if (posix_memalign(&buf, SCAN_ALIGN, size)) {
+		buf = NULL;
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (scan->ops->block) {
+		eb = calloc(1, sizeof(*eb) + scan->nodesize);
+		offsets = malloc(TREE_SCAN_WINDOW / scan->sectorsize *
+				 sizeof(*offsets));
+		if (!eb || !offsets) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		eb->len = scan->nodesize;
+	}
+
+	while (!scan_next_window(dev_scan, &range, &start, &len)) {
+		size = round_up(len + margin, SCAN_ALIGN);
+		bytes = scan_read(dev_scan, buf, size, start);
+		if (bytes < (ssize_t)size) {
+			pthread_mutex_lock(&dev_scan->lock);
+			dev_scan->eof = min_t(u64, dev_scan->eof,
+					      start + max_t(ssize_t, bytes, 0));
+			pthread_mutex_unlock(&dev_scan->lock);
+		}
+		if (bytes <= 0)
+			continue;
+
+		if (scan->ops->super) {
+			ret = scan_supers(st, buf, start, len, bytes);
+			if (ret)
+				break;
+		}
+		if (scan->ops->block) {
+			ret = scan_blocks(st, range, buf, start, len, bytes, eb,
+					  offsets);
+			if (ret)
+				break;
+		}
+	}
+out:
+	free(offsets);
+	free(eb);
+	free(buf);
+
+	pthread_mutex_lock(&ctl->lock);
+	if (ret && !ctl->ret)
+		ctl->ret = ret;
+	dev_scan->running--;
+	ctl->running--;
+	pthread_cond_signal(&ctl->cond);
+	pthread_mutex_unlock(&ctl->lock);
+	return NULL;
+}
+
+static void stop_device_scans(struct device_scan *dev_scans, int nr_devs)
+{
+	int i;
+
+	for (i = 0; i < nr_devs; i++) {
+		pthread_mutex_lock(&dev_scans[i].lock);
+		dev_scans[i].stop = 1;
+		pthread_mutex_unlock(&dev_scans[i].lock);
+	}
+}
+
+/* Called with ctl->lock held */
+static void print_scan_progress(struct device_scan *dev_scans, int nr_devs)
+{
+	int i;
+
+	printf("\rScanning: ");
+	for (i = 0; i < nr_devs; i++) {
+		if (!dev_scans[i].running)
+			printf("%sDONE in dev%d", i ? ", " : "", i);
+		else
+			printf("%s%llu in dev%d", i ? ", " : "",
+			       dev_scans[i].bytenr, i);
+	}
+	/* clear chars if exist in tail */
+	printf("                ");
+	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+	fflush(stdout);
+}
+
+static int init_device_scan(struct device_scan *dev_scan,
+			    struct tree_scan_device *dev, int nr_threads)
+{
+	struct tree_scan *scan = dev_scan->ctl->scan;
+	struct scan_thread *st;
+	int i;
+
+	dev_scan->dev = dev;
+	dev_scan->eof = (u64)-1;
+	if (dev->nr_ranges) {
+		dev_scan->ranges = dev->ranges;
+		dev_scan->nr_ranges = dev->nr_ranges;
+	} else {
+		dev_scan->whole.end = (u64)-1;
+		dev_scan->ranges = &dev_scan->whole;
+		dev_scan->nr_ranges = 1;
+	}
+
+	dev_scan->fd = open(dev->name, O_RDONLY);
+	if (dev_scan->fd < 0) {
+		int ret = -errno;
+
+		error("cannot open device %s: %s", dev->name, strerror(-ret));
+		return ret;
+	}
+	/* Not supported by all filesystems an image can be stored on */
+	dev_scan->direct_fd = open(dev->name, O_RDONLY | O_DIRECT);
+	posix_fadvise(dev_scan->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	dev_scan->threads = calloc(nr_threads, sizeof(*st));
+	if (!dev_scan->threads)
+		return -ENOMEM;
+	dev_scan->nr_threads = nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		st = &dev_scan->threads[i];
+		st->dev_scan = dev_scan;
+		if (!scan->ops->thread_init)
+			continue;
+		st->data = scan->ops->thread_init(scan);
+		if (!st->data)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Scan the devices in parallel, see the top of tree-scan.h.
+ *
+ * Return 0 if all devices have been scanned, <0 on errors or the nonzero
+ * value of the callback that stopped the scan.
+ */
+int tree_scan_devices(struct tree_scan *scan, struct tree_scan_device *devs,
+		      int nr_devs)
+{
+	struct scan_ctl ctl = { .scan = scan };
+	struct device_scan *dev_scans;
+	struct device_scan *dev_scan;
+	struct scan_thread *st;
+	struct timespec ts;
+	int nr_threads = scan->nr_threads;
+	int i;
+	int j;
+	int ret = 0;
+
+	if (!nr_devs)
+		return 0;
+	dev_scans = calloc(nr_devs, sizeof(*dev_scans));
+	if (!dev_scans)
+		return -ENOMEM;
+	for (i = 0; i < nr_devs; i++) {
+		dev_scans[i].ctl = &ctl;
+		dev_scans[i].fd = -1;
+		dev_scans[i].direct_fd = -1;
+		pthread_mutex_init(&dev_scans[i].lock, NULL);
+	}
+	pthread_mutex_init(&ctl.lock, NULL);
+	pthread_cond_init(&ctl.cond, NULL);
+
+	if (!nr_threads) {
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN) / nr_devs;
+		nr_threads = min(max(nr_threads, 1), TREE_SCAN_THREADS_MAX);
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		ret = init_device_scan(&dev_scans[i], &devs[i], nr_threads);
+		if (ret)
+			goto out;
+	}
+
+	pthread_mutex_lock(&ctl.lock);
+	for (i = 0; i < nr_devs && !ret; i++) {
+		dev_scan = &dev_scans[i];
+		for (j = 0; j < dev_scan->nr_threads; j++) {
+			st = &dev_scan->threads[j];
+			ret = pthread_create(&st->thread, NULL,
+					     scan_one_device, st);
+			if (ret) {
+				ret = -ret;
+				break;
+			}
+			st->started = 1;
+			dev_scan->running++;
+			ctl.running++;
+		}
+	}
+
+	while (!ret && !ctl.ret && ctl.running) {
+		if (scan->progress)
+			print_scan_progress(dev_scans, nr_devs);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&ctl.cond, &ctl.lock, &ts);
+	}
+	if (!ret)
+		ret = ctl.ret;
+	pthread_mutex_unlock(&ctl.lock);
+
+	if (ret)
+		stop_device_scans(dev_scans, nr_devs);
+	for (i = 0; i < nr_devs; i++) {
+		for (j = 0; j < dev_scans[i].nr_threads; j++) {
+			st = &dev_scans[i].threads[j];
+			if (st->started)
+				pthread_join(st->thread, NULL);
+		}
+	}
+	if (ret)
+		goto out;
+
+	if (scan->progress) {
+		print_scan_progress(dev_scans, nr_devs);
+		printf("\n");
+	}
+
+	for (i = 0; i < nr_devs && !ret && scan->ops->thread_merge; i++) {
+		for (j = 0; j < dev_scans[i].nr_threads && !ret; j++)
+			ret = scan->ops->thread_merge(scan,
+					dev_scans[i].threads[j].data);
+	}
+
+out:
+	for (i = 0; i < nr_devs; i++) {
+		dev_scan = &dev_scans[i];
+		for (j = 0; j < dev_scan->nr_threads; j++) {
+			st = &dev_scan->threads[j];
+			if (st->data && scan->ops->thread_release)
+				scan->ops->thread_release(scan, st->data);
+		}
+		free(dev_scan->threads);
+		pthread_mutex_destroy(&dev_scan->lock);
+		if (dev_scan->direct_fd >= 0)
+			close(dev_scan->direct_fd);
+		if (dev_scan->fd >= 0)
+			close(dev_scan->fd);
+	}
+	pthread_cond_destroy(&ctl.cond);
+	pthread_mutex_destroy(&ctl.lock);
+	free(dev_scans);
+	return ret;
+}
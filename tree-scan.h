@@ -0,0 +1,110 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.
+ */
+
+#ifndef __BTRFS_TREE_SCAN_H__
+#define __BTRFS_TREE_SCAN_H__
+
+#include "kerncompat.h"
+#include "ctree.h"
+#include "extent_io.h"
+
+/*
+ * Raw device scanner for tree blocks and superblocks, used by the recovery
+ * tools.
+ *
+ * Each device is read by several threads in windows of TREE_SCAN_WINDOW
+ * bytes, with O_DIRECT if possible. Every sector of a window whose header
+ * carries the fsid of the device is a candidate, the candidates of a window
+ * are then checksummed in one pass and the valid tree blocks are passed to
+ * ops->block. The copies of the superblock in the scanned ranges are passed
+ * to ops->super, unverified.
+ *
+ * The callbacks run in the scan threads. Each thread has its own data from
+ * ops->thread_init that is merged by ops->thread_merge in the calling thread
+ * after all threads finished, so the callbacks don't need locking unless
+ * they share state through tree_scan::priv.
+ */
+
+/* Bytes read at once by a scan thread */
+#define TREE_SCAN_WINDOW	SZ_4M
+#define TREE_SCAN_THREADS_MAX	8
+
+/* Physical range [start, end) of a device to scan */
+struct tree_scan_range {
+	u64 start;
+	u64 end;
+	void *priv;
+};
+
+struct tree_scan_device {
+	const char *name;
+	/* Tree blocks of other filesystems are skipped */
+	const u8 *fsid;
+	/*
+	 * Ranges to scan sorted by start, they should be sector aligned for
+	 * O_DIRECT. The whole device is scanned if there are none.
+	 */
+	struct tree_scan_range *ranges;
+	int nr_ranges;
+	void *priv;
+};
+
+/* A valid tree block found, only valid during the callback */
+struct tree_scan_block {
+	struct tree_scan_device *dev;
+	/* NULL if the whole device is scanned */
+	struct tree_scan_range *range;
+	u64 physical;
+	u64 bytenr;
+	u64 owner;
+	u64 generation;
+	u8 level;
+	struct extent_buffer *eb;
+};
+
+struct tree_scan;
+
+/*
+ * All callbacks are optional. A nonzero return value of a callback stops the
+ * scan and is returned by tree_scan_devices().
+ */
+struct tree_scan_ops {
+	/* Return the private data of a new scan thread, or NULL */
+	void *(*thread_init)(struct tree_scan *scan);
+	int (*block)(struct tree_scan *scan, void *data,
+		     struct tree_scan_block *block);
+	int (*super)(struct tree_scan *scan, void *data,
+		     struct tree_scan_device *dev, u64 physical,
+		     struct btrfs_super_block *sb);
+	/* Called in device and thread order if the scan completed */
+	int (*thread_merge)(struct tree_scan *scan, void *data);
+	void (*thread_release)(struct tree_scan *scan, void *data);
+};
+
+struct tree_scan {
+	u32 nodesize;
+	u32 sectorsize;
+	u16 csum_size;
+	/* Threads per device, 0 to divide the CPUs among the devices */
+	int nr_threads;
+	/* Print the scanned offset of each device every second */
+	int progress;
+	const struct tree_scan_ops *ops;
+	void *priv;
+};
+
+int tree_scan_devices(struct tree_scan *scan, struct tree_scan_device *devs,
+		      int nr_devs);
+
+#endif
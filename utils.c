@@ -2579,6 +2579,24 @@ unsigned long total_memory(void)
         return si.totalram * si.mem_unit;       /* bytes */
 }
 
+/* Returns resident set size of the current process in bytes, 0 if error. */
+u64 process_rss(void)
+{
+	unsigned long long size;
+	unsigned long long resident;
+	FILE *f;
+	int ret;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	ret = fscanf(f, "%llu %llu", &size, &resident);
+	fclose(f);
+	if (ret != 2)
+		return 0;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
 void print_device_info(struct btrfs_device *device, char *prefix)
 {
 	if (prefix)
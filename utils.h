@@ -167,6 +167,7 @@ int string_is_numerical(const char *str);
 int prefixcmp(const char *str, const char *prefix);
 
 unsigned long total_memory(void);
+u64 process_rss(void);
 
 void print_device_info(struct btrfs_device *device, char *prefix);
 void print_all_devices(struct list_head *devices);